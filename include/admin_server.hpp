@@ -0,0 +1,132 @@
+//
+// admin_server.hpp
+// ~~~~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_ADMIN_SERVER_HPP
+#define CODECHALLENGE_ADMIN_SERVER_HPP
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <cstdio>
+#include <string>
+#include <unistd.h>
+#include "metrics.hpp"
+
+namespace codechallenge
+{
+
+/// Makes the process' metrics available outside it.
+/**
+ * Every connection to the admin unix socket is sent one metrics snapshot, a
+ * single line of JSON, and closed; e.g. `socat - UNIX-CONNECT:<path>`.
+ * Optionally, a snapshot is also printed to stderr on a fixed interval.
+ */
+class admin_server
+    : private boost::noncopyable
+{
+public:
+    explicit admin_server(boost::asio::io_service& io_service)
+        : io_service_(io_service), acceptor_(io_service), timer_(io_service) {
+    }
+
+    /// Listen on the given socket path, replacing any stale socket there.
+    void listen(const std::string& path) {
+        ::unlink(path.c_str());
+        boost::asio::local::stream_protocol::endpoint ep(path);
+        acceptor_.open(ep.protocol());
+        acceptor_.bind(ep);
+        acceptor_.listen();
+        path_ = path;
+        start_accept();
+    }
+
+    /// Print a snapshot to stderr every interval.
+    void report_every(boost::posix_time::time_duration interval) {
+        interval_ = interval;
+        timer_.expires_from_now(interval_);
+        timer_.async_wait(boost::bind(&admin_server::handle_timer, this,
+                                      boost::asio::placeholders::error));
+    }
+
+    /// Stop listening and reporting.
+    void stop() {
+        boost::system::error_code e;
+        timer_.cancel(e);
+        if (acceptor_.is_open()) {
+            acceptor_.close(e);
+            ::unlink(path_.c_str());
+        }
+    }
+
+private:
+    typedef boost::shared_ptr<boost::asio::local::stream_protocol::socket> socket_ptr;
+
+    /// Start an accept operation for the next admin connection.
+    void start_accept() {
+        socket_ptr socket(new boost::asio::local::stream_protocol::socket(io_service_));
+        acceptor_.async_accept(*socket, boost::bind(&admin_server::handle_accept, this,
+                               boost::asio::placeholders::error, socket));
+    }
+
+    /// Send the new connection a snapshot.
+    void handle_accept(const boost::system::error_code& e, socket_ptr socket) {
+        if (!e && socket->is_open()) {
+            boost::shared_ptr<std::string> text = boost::make_shared<std::string>(
+                    metrics::instance().snapshot());
+            boost::asio::async_write(*socket, boost::asio::buffer(*text),
+                                     boost::bind(&admin_server::handle_write,
+                                                 boost::asio::placeholders::error, socket, text));
+        }
+        if (acceptor_.is_open()) {
+            start_accept();
+        }
+    }
+
+    /// The snapshot has been sent, or failed to be; either way we're done.
+    static void handle_write(const boost::system::error_code& e, socket_ptr socket,
+                             boost::shared_ptr<std::string> text) {
+        boost::system::error_code ignored;
+        socket->close(ignored);
+    }
+
+    /// Print a snapshot and schedule the next one.
+    void handle_timer(const boost::system::error_code& e) {
+        if (e) {
+            return;
+        }
+        std::string text = metrics::instance().snapshot();
+        fwrite(text.data(), 1, text.size(), stderr);
+        timer_.expires_at(timer_.expires_at() + interval_);
+        timer_.async_wait(boost::bind(&admin_server::handle_timer, this,
+                                      boost::asio::placeholders::error));
+    }
+
+    /// The io_service admin connections are handled on.
+    boost::asio::io_service& io_service_;
+
+    /// Accepts admin connections.
+    boost::asio::local::stream_protocol::acceptor acceptor_;
+
+    /// Path of the admin socket.
+    std::string path_;
+
+    /// Drives periodic reports.
+    boost::asio::deadline_timer timer_;
+
+    /// Time between periodic reports.
+    boost::posix_time::time_duration interval_;
+};
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_ADMIN_SERVER_HPP
@@ -0,0 +1,461 @@
+//
+// async_logger.hpp
+// ~~~~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_ASYNC_LOGGER_HPP
+#define CODECHALLENGE_ASYNC_LOGGER_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include "csv_format.hpp"
+#include "eye_message.hpp"
+#include "io_service_pool.hpp"
+#include "metrics.hpp"
+#include "segment_file.hpp"
+#include "spsc_queue.hpp"
+
+namespace codechallenge
+{
+
+/// A destination for logged samples. Sinks are only ever called from the
+/// logger's writer thread.
+class log_sink
+{
+public:
+    virtual ~log_sink() {}
+
+    /// Consume a chunk of samples. first_count is the 1-based running count
+    /// of the first sample in the chunk.
+    virtual void write(const eye_message* samples, std::size_t n, uint64_t first_count) = 0;
+
+    /// Push anything buffered out to the underlying device.
+    virtual void flush() {}
+
+    /// Bytes the sink has written to its file, or buffered for it; 0 for
+    /// sinks without one.
+    virtual uint64_t size() const {
+        return 0;
+    }
+};
+
+typedef boost::shared_ptr<log_sink> log_sink_ptr;
+
+/// Writes samples as CSV, formatting into a buffer that is handed to a
+/// segment_file, which writes it in large aligned chunks.
+class csv_file_sink
+    : public log_sink
+{
+public:
+    explicit csv_file_sink(const std::string& filename,
+                           const segment_file_options& options = segment_file_options())
+        : file_(filename, options) {
+        buffer_.reserve(format_size + 256);
+        csv::append_header(buffer_);
+    }
+
+    ~csv_file_sink() {
+        append();
+    }
+
+    void write(const eye_message* samples, std::size_t n, uint64_t first_count) {
+        for (std::size_t i = 0; i < n; ++i) {
+            csv::append_row(buffer_, samples[i]);
+            if (buffer_.size() >= format_size) {
+                append();
+            }
+        }
+    }
+
+    void flush() {
+        append();
+        file_.flush();
+    }
+
+    uint64_t size() const {
+        return file_.size() + buffer_.size();
+    }
+
+private:
+    /// Hand the formatted text to the file.
+    void append() {
+        file_.append(buffer_.data(), buffer_.size());
+        buffer_.clear();
+    }
+
+    /// Formatted text that is handed to the file at once.
+    enum { format_size = 1 << 16 };
+
+    /// The CSV file.
+    segment_file file_;
+
+    /// Formatted text not yet handed to the file.
+    std::string buffer_;
+};
+
+/// Prints samples to stdout, at most max_lines_per_second of them; the rest
+/// are skipped.
+class console_sink
+    : public log_sink
+{
+public:
+    explicit console_sink(unsigned int max_lines_per_second)
+        : max_lines_(max_lines_per_second), lines_this_second_(0),
+          second_start_(std::chrono::steady_clock::now()) {
+    }
+
+    void write(const eye_message* samples, std::size_t n, uint64_t first_count) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (now - second_start_ >= std::chrono::seconds(1)) {
+            second_start_ = now;
+            lines_this_second_ = 0;
+        }
+        for (std::size_t i = 0; i < n && lines_this_second_ < max_lines_; ++i, ++lines_this_second_) {
+            csv::append_console_line(buffer_, first_count + i, samples[i]);
+        }
+    }
+
+    void flush() {
+        if (!buffer_.empty()) {
+            fwrite(buffer_.data(), 1, buffer_.size(), stdout);
+            fflush(stdout);
+            buffer_.clear();
+        }
+    }
+
+private:
+    /// Line budget per second.
+    unsigned int max_lines_;
+
+    /// Lines printed since second_start_.
+    unsigned int lines_this_second_;
+
+    /// Start of the current rate limiting window.
+    std::chrono::steady_clock::time_point second_start_;
+
+    /// Formatted lines not yet printed.
+    std::string buffer_;
+};
+
+/// What log() does when a writer thread has fallen a whole queue behind.
+enum overflow_policy {
+    /// Wait for the writer to make room.
+    overflow_block,
+
+    /// Discard the sample.
+    overflow_drop,
+
+    /// Discard the sample, and periodically report how many were discarded.
+    overflow_count
+};
+
+/// Settings for an async_logger.
+struct async_logger_options {
+    async_logger_options()
+        : queue_capacity(1 << 16), flush_interval_ms(100), overflow(overflow_block),
+          writer_threads(1) {
+    }
+
+    /// Number of samples the queue between receiver and each writer holds.
+    std::size_t queue_capacity;
+
+    /// Longest time formatted output may sit in a sink's buffer.
+    unsigned int flush_interval_ms;
+
+    /// What to do when a queue is full.
+    overflow_policy overflow;
+
+    /// Writer threads the sinks are spread over.
+    std::size_t writer_threads;
+
+    /// Cores the writers are pinned to, writer i to writer_cores[i] modulo
+    /// their number; empty for no pinning.
+    std::vector<unsigned int> writer_cores;
+};
+
+/// Moves logging off the receive path: log() only copies the sample into a
+/// lock-free queue, and a dedicated writer thread drains it in chunks into
+/// every sink.
+/**
+ * Sinks can be spread over several writer threads, each with its own queue
+ * and its own share of the sinks, so that one slow sink does not hold the
+ * others back. Each writer is given every sample.
+ *
+ * Every writer records how deep its queue is when it takes from it
+ * (sink_queue_depth), how long batches waited in it (sink_dwell_ns) and how
+ * long its sinks took over each chunk (sink_busy_ns).
+ */
+class async_logger
+    : private boost::noncopyable
+{
+public:
+    explicit async_logger(const async_logger_options& options = async_logger_options())
+        : options_(options), stopping_(false), dropped_(0), reported_dropped_(0) {
+        for (std::size_t i = 0; i < std::max<std::size_t>(options_.writer_threads, 1); ++i) {
+            writers_.push_back(boost::make_shared<writer>(options_.queue_capacity));
+        }
+        metrics& m = metrics::instance();
+        depth_ = m.add_histogram("sink_queue_depth");
+        dwell_ns_ = m.add_histogram("sink_dwell_ns");
+        busy_ns_ = m.add_histogram("sink_busy_ns");
+    }
+
+    ~async_logger() {
+        stop();
+    }
+
+    /// Add a sink to the writer with the fewest so far. Only valid before
+    /// start().
+    void add_sink(const log_sink_ptr& sink) {
+        std::size_t least = 0;
+        for (std::size_t i = 1; i < writers_.size(); ++i) {
+            if (writers_[i]->sinks.size() < writers_[least]->sinks.size()) {
+                least = i;
+            }
+        }
+        add_sink(sink, least);
+    }
+
+    /// Add a sink to a given writer, after the sinks it already has. Only
+    /// valid before start().
+    void add_sink(const log_sink_ptr& sink, std::size_t writer_index) {
+        writers_[writer_index % writers_.size()]->sinks.push_back(sink);
+    }
+
+    /// Number of writer threads.
+    std::size_t writer_count() const {
+        return writers_.size();
+    }
+
+    /// Start the writer threads.
+    void start() {
+        stopping_ = false;
+        for (std::size_t i = 0; i < writers_.size(); ++i) {
+            writer& w = *writers_[i];
+            w.thread.reset(new boost::thread(boost::bind(&async_logger::run, this, boost::ref(w))));
+            if (!options_.writer_cores.empty()) {
+                pin_thread(*w.thread, options_.writer_cores[i % options_.writer_cores.size()]);
+            }
+        }
+    }
+
+    /// Write out everything already queued, then stop the writer threads.
+    void stop() {
+        stopping_ = true;
+        for (std::size_t i = 0; i < writers_.size(); ++i) {
+            if (writers_[i]->thread) {
+                writers_[i]->thread->join();
+                writers_[i]->thread.reset();
+            }
+        }
+    }
+
+    /// Queue one sample. Called from one thread only.
+    void log(const eye_message& sample) {
+        uint64_t now = steady_clock_ns();
+        for (std::size_t i = 0; i < writers_.size(); ++i) {
+            push(*writers_[i], sample);
+            mark(*writers_[i], now);
+        }
+    }
+
+    /// Queue a batch of samples.
+    void log(const std::vector<eye_message>& samples) {
+        if (samples.empty()) {
+            return;
+        }
+        uint64_t now = steady_clock_ns();
+        for (std::size_t i = 0; i < writers_.size(); ++i) {
+            writer& w = *writers_[i];
+            for (std::size_t j = 0; j < samples.size(); ++j) {
+                push(w, samples[j]);
+            }
+            mark(w, now);
+        }
+    }
+
+    /// Samples discarded because a queue was full, once for each writer
+    /// that discarded them.
+    uint64_t dropped() const {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+    /// Samples handed to every writer's sinks so far.
+    uint64_t written() const {
+        uint64_t least = writers_[0]->count.load(std::memory_order_relaxed);
+        for (std::size_t i = 1; i < writers_.size(); ++i) {
+            least = std::min<uint64_t>(least, writers_[i]->count.load(std::memory_order_relaxed));
+        }
+        return least;
+    }
+
+private:
+    /// When a batch was queued: the writer's queued total once it was in,
+    /// and the time.
+    struct batch_mark {
+        uint64_t end;
+        uint64_t queued_ns;
+    };
+
+    /// A writer thread, its queue and its sinks.
+    struct writer
+        : private boost::noncopyable
+    {
+        explicit writer(std::size_t capacity)
+            : queue(capacity), marks(max_marks), pushed(0), count(0) {
+        }
+
+        /// Queue from the logging thread to this writer.
+        spsc_queue<eye_message> queue;
+
+        /// Batches queued, oldest first; at most max_marks, the rest go
+        /// unmeasured.
+        spsc_queue<batch_mark> marks;
+
+        /// Where this writer's samples end up.
+        std::vector<log_sink_ptr> sinks;
+
+        /// The thread.
+        boost::scoped_ptr<boost::thread> thread;
+
+        /// Samples queued, counted by the logging thread.
+        uint64_t pushed;
+
+        /// Samples handed to the sinks so far.
+        std::atomic<uint64_t> count;
+    };
+
+    /// Queue one sample for one writer, applying the overflow policy.
+    void push(writer& w, const eye_message& sample) {
+        if (!w.queue.try_push(sample)) {
+            if (options_.overflow != overflow_block) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            while (!w.queue.try_push(sample) && !stopping_) {
+                std::this_thread::yield();
+            }
+        }
+        ++w.pushed;
+    }
+
+    /// Note that what the writer has queued so far was in by now.
+    void mark(writer& w, uint64_t now) {
+        batch_mark m = { w.pushed, now };
+        w.marks.try_push(m);
+    }
+
+    /// Writer thread: drain the queue in chunks and flush the sinks on the
+    /// configured interval.
+    void run(writer& w) {
+        metrics& m = metrics::instance();
+        std::vector<eye_message> chunk(chunk_size);
+        std::chrono::steady_clock::time_point last_flush = std::chrono::steady_clock::now();
+        std::chrono::milliseconds interval(options_.flush_interval_ms);
+        batch_mark next = { 0, 0 };
+        bool marked = false;
+        for (;;) {
+            std::size_t depth = w.queue.size();
+            std::size_t n = w.queue.pop_bulk(&chunk[0], chunk.size());
+            if (n > 0) {
+                uint64_t first = w.count.load(std::memory_order_relaxed) + 1;
+                uint64_t start = steady_clock_ns();
+                m.record(depth_, depth);
+                for (std::size_t i = 0; i < w.sinks.size(); ++i) {
+                    w.sinks[i]->write(&chunk[0], n, first);
+                }
+                uint64_t end = steady_clock_ns();
+                m.record(busy_ns_, end - start);
+                w.count.fetch_add(n, std::memory_order_relaxed);
+
+                // Batches taken whole by now waited from being queued until
+                // this chunk was taken.
+                uint64_t taken = first - 1 + n;
+                while ((marked || (marked = w.marks.try_pop(next))) && next.end <= taken) {
+                    m.record(dwell_ns_, start - next.queued_ns);
+                    marked = false;
+                }
+            }
+
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            bool done = n == 0 && stopping_ && w.queue.size() == 0;
+            if (done || now - last_flush >= interval) {
+                flush_sinks(w);
+                last_flush = now;
+            }
+            if (done) {
+                return;
+            }
+            if (n == 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(idle_sleep_ms));
+            }
+        }
+    }
+
+    /// Flush a writer's sinks, and report new drops if asked to.
+    void flush_sinks(writer& w) {
+        for (std::size_t i = 0; i < w.sinks.size(); ++i) {
+            w.sinks[i]->flush();
+        }
+        if (&w != writers_[0].get()) {
+            return;
+        }
+        uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+        if (options_.overflow == overflow_count && dropped != reported_dropped_) {
+            std::cerr << "Logger dropped " << dropped - reported_dropped_
+                      << " samples (" << dropped << " total)" << std::endl;
+            reported_dropped_ = dropped;
+        }
+    }
+
+    /// Most samples taken from a queue at once.
+    enum { chunk_size = 4096 };
+
+    /// Most batches a writer keeps the queueing time of.
+    enum { max_marks = 1024 };
+
+    /// How long a writer sleeps when its queue is empty.
+    enum { idle_sleep_ms = 1 };
+
+    /// Logger settings.
+    async_logger_options options_;
+
+    /// The writers.
+    std::vector<boost::shared_ptr<writer> > writers_;
+
+    /// Set to make the writers drain their queues and exit.
+    std::atomic_bool stopping_;
+
+    /// Samples discarded because a queue was full.
+    std::atomic<uint64_t> dropped_;
+
+    /// Value of dropped_ at the last report, kept by the first writer.
+    uint64_t reported_dropped_;
+
+    /// Queue depth, queueing time and sink time.
+    histogram_id depth_;
+    histogram_id dwell_ns_;
+    histogram_id busy_ns_;
+};
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_ASYNC_LOGGER_HPP
@@ -0,0 +1,327 @@
+//
+// client_pipeline.hpp
+// ~~~~~~~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_CLIENT_PIPELINE_HPP
+#define CODECHALLENGE_CLIENT_PIPELINE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include "codec.hpp"
+#include "eye_message.hpp"
+#include "io_service_pool.hpp"
+#include "metrics.hpp"
+#include "spsc_queue.hpp"
+
+namespace codechallenge
+{
+
+/// A frame as received, its payload not yet decoded, so that it can be
+/// decoded on another thread.
+struct encoded_frame {
+    /// The frame's header.
+    frame_header header;
+
+    /// The payload, header.payload_length bytes.
+    std::vector<char> payload;
+};
+
+/// Take a frame's payload as it is rather than decoding it. The payload
+/// keeps its capacity, so frames read into a reused encoded_frame do not
+/// allocate once it has grown to the largest.
+inline bool decode_payload(const frame_header& header, const char* data, encoded_frame& frame)
+{
+    frame.header = header;
+    frame.payload.assign(data, data + header.payload_length);
+    return true;
+}
+
+/// A frame on its way through the pipeline, and the samples decoded from it.
+struct pipeline_batch {
+    pipeline_batch()
+        : decoded(false), received_at(0), frame_size(0), queued_ns(0) {
+    }
+
+    /// The frame, as received.
+    encoded_frame frame;
+
+    /// Its samples, and whether they could be decoded.
+    std::vector<eye_message> samples;
+    bool decoded;
+
+    /// Wall clock time the frame was received, and its size, header included.
+    uint64_t received_at;
+    std::size_t frame_size;
+
+    /// When the batch was put on the queue it is in.
+    uint64_t queued_ns;
+};
+
+/// Settings for a client_pipeline.
+struct pipeline_options {
+    pipeline_options()
+        : decode_threads(0), batches(1024) {
+    }
+
+    /// Threads decoding frames, 0 to decode on the receiving thread and
+    /// process there too, without a pipeline.
+    std::size_t decode_threads;
+
+    /// Frames in flight between receiving and processing. When all are in
+    /// use, receiving waits, and the socket fills up behind it.
+    std::size_t batches;
+
+    /// Cores the receiving thread, the decoders and the processing thread
+    /// are pinned to; empty for no pinning. Decoder i takes decode_cores[i]
+    /// modulo their number.
+    std::vector<unsigned int> receive_cores;
+    std::vector<unsigned int> decode_cores;
+    std::vector<unsigned int> process_cores;
+};
+
+/// Moves decoding and processing of received frames off the receiving thread.
+/**
+ * Frames are handed, undecoded, to decoder threads in turn, and taken from
+ * them in the same turn by a single processing thread, so they are
+ * processed in the order they were received however many decoders there
+ * are. Each decoder has a lock-free queue in and one out; batches come back
+ * to the receiving thread through a third, so once every batch has grown to
+ * the largest frame nothing allocates.
+ *
+ * Every stage records the depth of its queue when it takes from it
+ * (decode_queue_depth, process_queue_depth), how long batches waited in it
+ * (decode_dwell_ns, process_dwell_ns) and how long it spent on each batch
+ * (decode_busy_ns, process_busy_ns). receive_stalls counts the times
+ * receiving found every batch in flight and had to wait.
+ */
+class client_pipeline
+    : private boost::noncopyable
+{
+public:
+    /// Handles one decoded batch on the processing thread.
+    typedef boost::function<void(pipeline_batch&)> process_function;
+
+    client_pipeline(const pipeline_options& options, const process_function& process)
+        : options_(options), process_(process), batches_(std::max<std::size_t>(options.batches, 1)),
+          free_(batches_.size()), next_in_(0), next_out_(0), stopping_(false),
+          process_stopping_(false) {
+        for (std::size_t i = 0; i < batches_.size(); ++i) {
+            free_.try_push(&batches_[i]);
+        }
+        for (std::size_t i = 0; i < std::max<std::size_t>(options_.decode_threads, 1); ++i) {
+            workers_.push_back(boost::make_shared<worker>(batches_.size()));
+        }
+        metrics& m = metrics::instance();
+        decode_depth_ = m.add_histogram("decode_queue_depth");
+        decode_dwell_ns_ = m.add_histogram("decode_dwell_ns");
+        decode_busy_ns_ = m.add_histogram("decode_busy_ns");
+        process_depth_ = m.add_histogram("process_queue_depth");
+        process_dwell_ns_ = m.add_histogram("process_dwell_ns");
+        process_busy_ns_ = m.add_histogram("process_busy_ns");
+        stalls_ = m.add_counter("receive_stalls");
+    }
+
+    ~client_pipeline() {
+        stop();
+    }
+
+    /// Start the decoders and the processing thread.
+    void start() {
+        stopping_ = false;
+        process_stopping_ = false;
+        for (std::size_t i = 0; i < workers_.size(); ++i) {
+            worker& w = *workers_[i];
+            w.thread.reset(new boost::thread(boost::bind(&client_pipeline::decode, this, boost::ref(w))));
+            if (!options_.decode_cores.empty()) {
+                pin_thread(*w.thread, options_.decode_cores[i % options_.decode_cores.size()]);
+            }
+        }
+        processor_.reset(new boost::thread(boost::bind(&client_pipeline::process, this)));
+        if (!options_.process_cores.empty()) {
+            pin_thread(*processor_, options_.process_cores[0]);
+        }
+    }
+
+    /// Decode and process every frame already handed over, then stop. The
+    /// receiving thread must have stopped handing frames over.
+    void stop() {
+        stopping_ = true;
+        for (std::size_t i = 0; i < workers_.size(); ++i) {
+            if (workers_[i]->thread) {
+                workers_[i]->thread->join();
+                workers_[i]->thread.reset();
+            }
+        }
+        process_stopping_ = true;
+        if (processor_) {
+            processor_->join();
+            processor_.reset();
+        }
+    }
+
+    /// Receiving thread: a batch to receive a frame into, waiting for one if
+    /// all are in flight. Returns 0 if the pipeline is stopping instead.
+    pipeline_batch* acquire() {
+        pipeline_batch* batch = 0;
+        if (free_.try_pop(batch)) {
+            return batch;
+        }
+        metrics::instance().add(stalls_);
+        for (unsigned int idle = 0; !free_.try_pop(batch); ++idle) {
+            if (stopping_) {
+                return 0;
+            }
+            wait(idle);
+        }
+        return batch;
+    }
+
+    /// Receiving thread: hand a received frame to the next decoder.
+    void dispatch(pipeline_batch* batch) {
+        worker& w = *workers_[next_in_];
+        next_in_ = (next_in_ + 1) % workers_.size();
+        batch->queued_ns = steady_clock_ns();
+        w.in.try_push(batch);
+    }
+
+private:
+    /// A decoder thread and its queues. Each holds every batch, so neither
+    /// can fill up.
+    struct worker
+        : private boost::noncopyable
+    {
+        explicit worker(std::size_t capacity)
+            : in(capacity), out(capacity) {
+        }
+
+        /// Frames to decode, from the receiving thread.
+        spsc_queue<pipeline_batch*> in;
+
+        /// Batches decoded, to the processing thread.
+        spsc_queue<pipeline_batch*> out;
+
+        /// The thread.
+        boost::scoped_ptr<boost::thread> thread;
+    };
+
+    /// Decoder thread: decode frames until stopped with none left.
+    void decode(worker& w) {
+        metrics& m = metrics::instance();
+        unsigned int idle = 0;
+        for (;;) {
+            std::size_t depth = w.in.size();
+            pipeline_batch* batch = 0;
+            if (!w.in.try_pop(batch)) {
+                if (stopping_ && w.in.size() == 0) {
+                    return;
+                }
+                wait(idle++);
+                continue;
+            }
+            idle = 0;
+            uint64_t start = steady_clock_ns();
+            m.record(decode_depth_, depth);
+            m.record(decode_dwell_ns_, start - batch->queued_ns);
+            batch->decoded = decode_payload(batch->frame.header, batch->frame.payload.data(), batch->samples);
+            uint64_t end = steady_clock_ns();
+            m.record(decode_busy_ns_, end - start);
+            batch->queued_ns = end;
+            w.out.try_push(batch);
+        }
+    }
+
+    /// Processing thread: take decoded batches in the order they were handed
+    /// over, until stopped with none left.
+    void process() {
+        metrics& m = metrics::instance();
+        unsigned int idle = 0;
+        for (;;) {
+            worker& w = *workers_[next_out_];
+            std::size_t depth = w.out.size();
+            pipeline_batch* batch = 0;
+            if (!w.out.try_pop(batch)) {
+                if (process_stopping_ && w.out.size() == 0) {
+                    return;
+                }
+                wait(idle++);
+                continue;
+            }
+            idle = 0;
+            next_out_ = (next_out_ + 1) % workers_.size();
+            uint64_t start = steady_clock_ns();
+            m.record(process_depth_, depth);
+            m.record(process_dwell_ns_, start - batch->queued_ns);
+            process_(*batch);
+            m.record(process_busy_ns_, steady_clock_ns() - start);
+            free_.try_push(batch);
+        }
+    }
+
+    /// Wait for a queue to change after idle empty polls: yield at first,
+    /// then sleep briefly, so an idle pipeline does not hold cores.
+    static void wait(unsigned int idle) {
+        if (idle < idle_spins) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(idle_sleep_us));
+        }
+    }
+
+    /// Empty polls before an idle stage sleeps, and how long it sleeps.
+    enum { idle_spins = 256, idle_sleep_us = 50 };
+
+    /// Pipeline settings.
+    pipeline_options options_;
+
+    /// Handles decoded batches.
+    process_function process_;
+
+    /// Every batch, and those not in flight, returned by the processing
+    /// thread to the receiving thread.
+    std::vector<pipeline_batch> batches_;
+    spsc_queue<pipeline_batch*> free_;
+
+    /// The decoders, and the processing thread.
+    std::vector<boost::shared_ptr<worker> > workers_;
+    boost::scoped_ptr<boost::thread> processor_;
+
+    /// Decoder the next frame goes to, and the one the next batch comes from.
+    std::size_t next_in_;
+    std::size_t next_out_;
+
+    /// Set to make the decoders, then the processing thread, drain their
+    /// queues and exit.
+    std::atomic_bool stopping_;
+    std::atomic_bool process_stopping_;
+
+    /// Queue depth, queueing time and time spent, for each stage.
+    histogram_id decode_depth_;
+    histogram_id decode_dwell_ns_;
+    histogram_id decode_busy_ns_;
+    histogram_id process_depth_;
+    histogram_id process_dwell_ns_;
+    histogram_id process_busy_ns_;
+
+    /// Times receiving waited for a batch.
+    counter_id stalls_;
+};
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_CLIENT_PIPELINE_HPP
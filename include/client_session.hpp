@@ -0,0 +1,359 @@
+//
+// client_session.hpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_CLIENT_SESSION_HPP
+#define CODECHALLENGE_CLIENT_SESSION_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/thread/mutex.hpp>
+#include "connection.hpp"
+#include "handler_allocator.hpp"
+#include "metrics.hpp"
+#include "publisher.hpp"
+#include "send_queue.hpp"
+#include "subscription.hpp"
+
+namespace codechallenge
+{
+
+/// Metrics shared by every client session.
+struct session_metrics {
+    session_metrics() {
+        metrics& m = metrics::instance();
+        write_ns = m.add_histogram("publish_to_write_ns");
+        frames_written = m.add_counter("frames_written");
+        bytes_written = m.add_counter("bytes_written");
+        frames_dropped = m.add_counter("frames_dropped");
+        frames_recovered = m.add_counter("frames_recovered");
+    }
+
+    /// Sample timestamp to completed write, for the newest frame of each write.
+    histogram_id write_ns;
+
+    /// Totals over every client.
+    counter_id frames_written;
+    counter_id bytes_written;
+    counter_id frames_dropped;
+
+    /// Retained frames sent to clients resuming from a sequence number.
+    counter_id frames_recovered;
+};
+
+/// Forwards every published batch to one client connection, of any type
+/// providing the async_read(), async_write_frames(), reserve_frames() and
+/// close() of connection. All of the session's work runs on its strand, so it
+/// needs no locking of its own.
+/**
+ * Delivered batches collect in an inbox that the strand drains, so however
+ * fast batches arrive, at most one hand-off to the strand is outstanding.
+ * That hand-off and write completions allocate their handlers from the
+ * session's own handler_memory, so a session in steady state does not
+ * allocate.
+ *
+ * A subscription resuming from a sequence number brings retained frames with
+ * it. These are written ahead of everything queued, a queue's depth at a
+ * time, and while they are the queue keeps filling with live frames under
+ * the slow consumer policy.
+ */
+template <typename Connection>
+class basic_client_session
+    : public subscriber,
+      public metrics_source,
+      public boost::enable_shared_from_this<basic_client_session<Connection> >
+{
+public:
+    typedef boost::shared_ptr<Connection> connection_pointer;
+
+    basic_client_session(connection_pointer conn, publisher& pub, const send_queue_options& options,
+                         const session_metrics& ids, uint64_t number)
+        : conn_(conn), publisher_(pub), strand_(conn->get_io_service()), queue_(options),
+          closed_(false), ids_(ids), number_(number), newest_time_ns_(0), in_flight_time_ns_(0),
+          in_flight_bytes_(0), reported_dropped_(0), frames_(0), bytes_(0),
+          recovery_next_(0), writing_recovery_(false), drain_scheduled_(false) {
+        inbox_.reserve(options.max_depth);
+        draining_.reserve(options.max_depth);
+        recovery_write_.reserve(options.max_depth);
+        conn_->reserve_frames(options.max_depth);
+        metrics::instance().add_source(this);
+    }
+
+    ~basic_client_session() {
+        metrics::instance().remove_source(this);
+    }
+
+    /// Hand the batch over to the session's strand.
+    void deliver(const published_batch_ptr& batch) {
+        bool schedule = false;
+        {
+            boost::mutex::scoped_lock lock(inbox_mutex_);
+            inbox_.push_back(batch);
+            schedule = !drain_scheduled_;
+            drain_scheduled_ = true;
+        }
+        if (schedule) {
+            strand_.dispatch(make_custom_alloc_handler(deliver_memory_,
+                             boost::bind(&basic_client_session::drain, this->shared_from_this())));
+        }
+    }
+
+    /// Write every batch delivered since the last drain.
+    void drain() {
+        {
+            boost::mutex::scoped_lock lock(inbox_mutex_);
+            inbox_.swap(draining_);
+            drain_scheduled_ = false;
+        }
+        for (std::size_t i = 0; i < draining_.size(); ++i) {
+            write(draining_[i]);
+        }
+        draining_.clear();
+    }
+
+    /// Start listening for subscription requests from the client. Until one
+    /// arrives, the session gets every sample.
+    void start() {
+        conn_->async_read(request_, boost::bind(&basic_client_session::handle_request, this->shared_from_this(),
+                          boost::asio::placeholders::error));
+    }
+
+    /// Handle a completed read of a subscription request, on the strand.
+    void handle_request(const boost::system::error_code& e) {
+        strand_.dispatch(boost::bind(&basic_client_session::apply_request, this->shared_from_this(), e));
+    }
+
+    /// Move to the view matching the request, and wait for the next one.
+    void apply_request(const boost::system::error_code& e) {
+        if (closed_) {
+            return;
+        }
+        if (e) {
+            // The client has gone, or sent something that is not a
+            // subscription; either way it is done with us.
+            disconnect("Client Disconnected");
+            return;
+        }
+        publisher_.subscribe(this->shared_from_this(), request_, &recovery_);
+        start();
+        start_write();
+    }
+
+    /// Queue the batch's shared frame for the client, applying the slow
+    /// consumer policy if the client has fallen behind.
+    void write(const published_batch_ptr& batch) {
+        if (closed_) {
+            return;
+        }
+        if (!queue_.push(frame_of(batch))) {
+            disconnect("Slow Client Disconnected");
+            return;
+        }
+        if (!batch->samples.empty()) {
+            newest_time_ns_ = sample_time_ns(batch->samples.back());
+        }
+        start_write();
+    }
+
+    /// Send everything queued in one gather write, unless a write is already
+    /// in progress. Recovered frames go first.
+    void start_write() {
+        if (writing_recovery_ || queue_.writing()) {
+            return;
+        }
+        if (recovery_next_ < recovery_.size()) {
+            std::size_t count = std::min(recovery_.size() - recovery_next_,
+                                         std::max<std::size_t>(recovery_write_.capacity(), 1));
+            recovery_write_.assign(recovery_.begin() + recovery_next_,
+                                   recovery_.begin() + recovery_next_ + count);
+            recovery_next_ += count;
+            writing_recovery_ = true;
+            in_flight_bytes_ = 0;
+            for (std::size_t i = 0; i < recovery_write_.size(); ++i) {
+                in_flight_bytes_ += recovery_write_[i]->size();
+            }
+            conn_->async_write_frames(recovery_write_,
+                                      boost::bind(&basic_client_session::handle_write_done, this->shared_from_this(),
+                                                  boost::asio::placeholders::error));
+            return;
+        }
+        if (!queue_.ready()) {
+            return;
+        }
+        const std::vector<shared_frame>& frames = queue_.take();
+        in_flight_time_ns_ = newest_time_ns_;
+        in_flight_bytes_ = 0;
+        for (std::size_t i = 0; i < frames.size(); ++i) {
+            in_flight_bytes_ += frames[i]->size();
+        }
+        conn_->async_write_frames(frames,
+                                  boost::bind(&basic_client_session::handle_write_done, this->shared_from_this(),
+                                              boost::asio::placeholders::error));
+    }
+
+    /// Bring a completed write back onto the strand.
+    void handle_write_done(const boost::system::error_code& e) {
+        strand_.dispatch(make_custom_alloc_handler(write_memory_,
+                         boost::bind(&basic_client_session::handle_write, this->shared_from_this(), e)));
+    }
+
+    /// Handle completion of a write operation.
+    void handle_write(const boost::system::error_code& e) {
+        metrics& m = metrics::instance();
+        bool recovered = writing_recovery_;
+        std::size_t frames = 0;
+        if (recovered) {
+            frames = recovery_write_.size();
+            recovery_write_.clear();
+            writing_recovery_ = false;
+            if (recovery_next_ == recovery_.size()) {
+                recovery_.clear();
+                recovery_next_ = 0;
+            }
+        } else {
+            frames = queue_.in_flight();
+            queue_.complete();
+        }
+        if (!e) {
+            if (recovered) {
+                m.add(ids_.frames_recovered, frames);
+            } else {
+                m.record(ids_.write_ns, wall_clock_ns() - in_flight_time_ns_);
+            }
+            m.add(ids_.frames_written, frames);
+            m.add(ids_.bytes_written, in_flight_bytes_);
+            frames_.fetch_add(frames, std::memory_order_relaxed);
+            bytes_.fetch_add(in_flight_bytes_, std::memory_order_relaxed);
+            report_drops();
+        }
+        // Just assume that a write error is caused by the client socket closing
+        if (e == boost::asio::error::message_size) {
+            disconnect("Client Disconnected, frame too large for its transport");
+            return;
+        }
+        if (e) {
+            disconnect("Client Disconnected");
+            return;
+        }
+        start_write();
+    }
+
+    /// The session's outbound queue, for its depth and drop counters.
+    const send_queue& queue() const {
+        return queue_;
+    }
+
+    /// Report this client's traffic and queue.
+    void write_metrics(std::string& out) {
+        out += "{\"type\":\"client_session\"";
+        json::append_field(out, "client", number_);
+        json::append_field(out, "frames_written", frames_.load(std::memory_order_relaxed));
+        json::append_field(out, "bytes_written", bytes_.load(std::memory_order_relaxed));
+        json::append_field(out, "queue_depth", uint64_t(queue_.depth()));
+        json::append_field(out, "queue_high_water", uint64_t(queue_.high_water()));
+        json::append_field(out, "frames_dropped", queue_.dropped());
+        out.push_back('}');
+    }
+
+private:
+    /// Add drops since the last call to the process total.
+    void report_drops() {
+        uint64_t dropped = queue_.dropped();
+        if (dropped != reported_dropped_) {
+            metrics::instance().add(ids_.frames_dropped, dropped - reported_dropped_);
+            reported_dropped_ = dropped;
+        }
+    }
+
+    /// Stop serving the client.
+    void disconnect(const char* reason) {
+        if (closed_) {
+            return;
+        }
+        closed_ = true;
+        report_drops();
+        publisher_.unsubscribe(this->shared_from_this());
+        conn_->close();
+        std::cout << reason << " (" << queue_.dropped() << " frames dropped, queue high water "
+                  << queue_.high_water() << ")" << std::endl;
+    }
+
+    /// The connection to the client.
+    connection_pointer conn_;
+
+    /// The publisher this session is subscribed to.
+    publisher& publisher_;
+
+    /// Serialises the session's handlers across the worker pool.
+    boost::asio::io_service::strand strand_;
+
+    /// Frames waiting to be written to the client.
+    send_queue queue_;
+
+    /// Whether the session has stopped serving the client.
+    bool closed_;
+
+    /// The subscription request being read.
+    subscription request_;
+
+    /// Where to record metrics.
+    const session_metrics& ids_;
+
+    /// Identifies the client in metrics.
+    uint64_t number_;
+
+    /// Timestamp of the newest sample queued, and of the newest being written.
+    uint64_t newest_time_ns_;
+    uint64_t in_flight_time_ns_;
+
+    /// Size of the write in progress.
+    std::size_t in_flight_bytes_;
+
+    /// Queue drops already added to the process total.
+    uint64_t reported_dropped_;
+
+    /// Traffic to this client, readable from any thread.
+    std::atomic<uint64_t> frames_;
+    std::atomic<uint64_t> bytes_;
+
+    /// Retained frames to send ahead of the queue, the next of them to send,
+    /// and those being written.
+    std::vector<shared_frame> recovery_;
+    std::size_t recovery_next_;
+    std::vector<shared_frame> recovery_write_;
+    bool writing_recovery_;
+
+    /// Protects inbox_ and drain_scheduled_.
+    boost::mutex inbox_mutex_;
+
+    /// Batches delivered but not yet drained, and the batches being drained.
+    std::vector<published_batch_ptr> inbox_;
+    std::vector<published_batch_ptr> draining_;
+
+    /// Whether a drain has been handed to the strand and not yet started.
+    bool drain_scheduled_;
+
+    /// Handler memory for drains on their way to the strand, and for
+    /// completed writes on theirs.
+    handler_memory deliver_memory_;
+    handler_memory write_memory_;
+};
+
+typedef basic_client_session<connection> client_session;
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_CLIENT_SESSION_HPP
@@ -0,0 +1,609 @@
+//
+// codec.hpp
+// ~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_CODEC_HPP
+#define CODECHALLENGE_CODEC_HPP
+
+#include <boost/archive/text_iarchive.hpp>
+#include <boost/archive/text_oarchive.hpp>
+#include <boost/endian/conversion.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/stream.hpp>
+#include <boost/shared_ptr.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+#include "eye_message.hpp"
+
+namespace codechallenge
+{
+
+/// Identifies the encoding used for the payload of a frame.
+enum codec_type : uint8_t {
+    binary_codec_type = 1,
+    text_codec_type = 2,
+
+    /// Not a batch of samples: a subscription request sent by a client, see
+    /// subscription.hpp.
+    subscription_codec_type = 3,
+
+    compact_codec_type = 4,
+
+    /// Not batches either: a producer's handshake and the broker's reply to
+    /// it, see producer_handshake.hpp.
+    producer_hello_codec_type = 5,
+    producer_reply_codec_type = 6
+};
+
+/// Version of the frame header and binary payload layout.
+const uint8_t wire_version = 1;
+
+/// Little-endian load/store helpers for packing fixed width fields.
+namespace wire
+{
+
+template <typename T>
+inline void put(char* out, T value) {
+    boost::endian::native_to_little_inplace(value);
+    std::memcpy(out, &value, sizeof(T));
+}
+
+inline void put(char* out, float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    put(out, bits);
+}
+
+template <typename T>
+inline T get(const char* in) {
+    T value;
+    std::memcpy(&value, in, sizeof(T));
+    boost::endian::little_to_native_inplace(value);
+    return value;
+}
+
+template <>
+inline float get<float>(const char* in) {
+    uint32_t bits = get<uint32_t>(in);
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/// Map signed values to unsigned ones, small magnitudes to small values, so
+/// that they pack into short varints.
+inline uint64_t zigzag(int64_t value) {
+    return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+}
+
+inline int64_t unzigzag(uint64_t value) {
+    return int64_t((value >> 1) ^ (~(value & 1) + 1));
+}
+
+/// Longest varint, for a 64-bit value.
+const std::size_t max_varint_length = 10;
+
+/// Store value in 7-bit groups, least significant first, the top bit of each
+/// byte set if another follows. Returns the end of what was written.
+inline char* put_varint(char* out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = static_cast<char>(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = static_cast<char>(value);
+    return out;
+}
+
+/// Load a varint, advancing in. Returns false if it runs past end.
+inline bool get_varint(const char*& in, const char* end, uint64_t& value) {
+    value = 0;
+    for (unsigned int shift = 0; shift < 64 && in != end; shift += 7) {
+        uint8_t byte = static_cast<uint8_t>(*in++);
+        value |= uint64_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace wire
+
+/// Fixed length binary header that precedes every frame on the wire.
+/**
+ * @li 4 bytes: little-endian length of the payload that follows.
+ * @li 1 byte: codec_type of the payload.
+ * @li 1 byte: wire_version.
+ * @li 2 bytes: reserved, always zero.
+ */
+struct frame_header {
+    enum { length = 8 };
+
+    uint32_t payload_length;
+    uint8_t codec;
+    uint8_t version;
+
+    /// Write the header into the first length bytes of out.
+    void encode(char* out) const {
+        wire::put(out, payload_length);
+        out[4] = static_cast<char>(codec);
+        out[5] = static_cast<char>(version);
+        out[6] = 0;
+        out[7] = 0;
+    }
+
+    /// Read a header from the first length bytes of in. Returns false if the
+    /// header is not one we understand.
+    bool decode(const char* in) {
+        payload_length = wire::get<uint32_t>(in);
+        codec = static_cast<uint8_t>(in[4]);
+        version = static_cast<uint8_t>(in[5]);
+        return version == wire_version
+               && (codec == binary_codec_type || codec == text_codec_type
+                   || codec == subscription_codec_type || codec == compact_codec_type
+                   || codec == producer_hello_codec_type || codec == producer_reply_codec_type);
+    }
+};
+
+/// Whether any sample of a batch has a source. Batches without leave the
+/// source fields out of their encoding.
+inline bool has_source(const std::vector<eye_message>& batch)
+{
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+        if (batch[i].source_id != 0 || batch[i].source_seq != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Packed, little-endian encoding of eye_message batches.
+/**
+ * The payload is a 4-byte sample count followed by one fixed size record per
+ * sample, the fields of message_schema<eye_message> in order with no padding.
+ * Records of an older schema version, which lack the fields added since, are
+ * recognised by their size and decoded with those fields zeroed. Batches
+ * whose samples all have a source of 0 are encoded as version 1 records, as
+ * they were before sources were added.
+ */
+struct binary_codec {
+    static const codec_type type = binary_codec_type;
+
+    typedef message_schema<eye_message> schema;
+
+    /// Size of a single encoded eye_message.
+    enum { record_size = codechallenge::record_size(schema::fields(), schema::version) };
+
+    /// Append the encoded batch to out. Existing capacity is reused.
+    static bool encode(const std::vector<eye_message>& batch, std::vector<char>& out) {
+        if (has_source(batch)) {
+            write_records(batch, out, version_tag<schema::version>());
+        } else {
+            write_records(batch, out, version_tag<1>());
+        }
+        return true;
+    }
+
+    /// Decode a batch directly from the received bytes.
+    static bool decode(const char* data, std::size_t size, std::vector<eye_message>& batch) {
+        if (size < 4) {
+            return false;
+        }
+        uint32_t count = wire::get<uint32_t>(data);
+        uint32_t version = schema::version;
+        std::size_t size_of_record = record_size;
+        while (size != 4 + static_cast<std::size_t>(count) * size_of_record) {
+            if (--version == 0 || count == 0) {
+                return false;
+            }
+            size_of_record = codechallenge::record_size(schema::fields(), version);
+        }
+        batch.resize(count);
+        read_records(data + 4, version, batch, version_tag<schema::version>());
+        return true;
+    }
+
+private:
+    /// Selects the record layout of a schema version at compile time.
+    template <uint32_t Version>
+    struct version_tag
+        : std::integral_constant<uint32_t, Version>
+    {
+    };
+
+    /// Append the samples as records of schema version Version.
+    template <uint32_t Version>
+    static void write_records(const std::vector<eye_message>& batch, std::vector<char>& out,
+                              version_tag<Version>) {
+        const std::size_t size_of_record = codechallenge::record_size(schema::fields(), Version);
+        std::size_t offset = out.size();
+        out.resize(offset + 4 + batch.size() * size_of_record);
+        char* p = &out[offset];
+        wire::put(p, static_cast<uint32_t>(batch.size()));
+        p += 4;
+        for (std::size_t i = 0; i < batch.size(); ++i) {
+            record_writer<Version> write = { batch[i], p };
+            for_each_field(schema::fields(), write);
+            p += size_of_record;
+        }
+    }
+
+    /// Decode records of schema version version, Version or older, into
+    /// batch, which is already sized.
+    template <uint32_t Version>
+    static void read_records(const char* p, uint32_t version, std::vector<eye_message>& batch,
+                             version_tag<Version>) {
+        if (version != Version) {
+            read_records(p, version, batch, version_tag<Version - 1>());
+            return;
+        }
+        const std::size_t size_of_record = codechallenge::record_size(schema::fields(), Version);
+        for (std::size_t i = 0; i < batch.size(); ++i) {
+            record_reader<Version> read = { batch[i], p };
+            for_each_field(schema::fields(), read);
+            p += size_of_record;
+        }
+    }
+
+    static void read_records(const char*, uint32_t, std::vector<eye_message>&, version_tag<0>) {
+    }
+
+    /// Stores each field of schema version Version after the previous one.
+    template <uint32_t Version>
+    struct record_writer {
+        const eye_message& m;
+        char* p;
+
+        template <typename Field>
+        void operator()(Field) {
+            typedef typename Field::storage_type stored;
+            if (Field::since > Version) {
+                return;
+            }
+            wire::put(p, static_cast<stored>(Field::get(m)));
+            p += sizeof(stored);
+        }
+    };
+
+    /// Loads the fields of schema version Version, zeroing the rest.
+    template <uint32_t Version>
+    struct record_reader {
+        eye_message& m;
+        const char* p;
+
+        template <typename Field>
+        void operator()(Field) {
+            typedef typename Field::storage_type stored;
+            typedef typename Field::value_type value;
+            if (Field::since > Version) {
+                Field::get(m) = value();
+                return;
+            }
+            Field::get(m) = static_cast<value>(wire::get<stored>(p));
+            p += sizeof(stored);
+        }
+    };
+};
+
+/// Delta encoding of eye_message batches, several times smaller than
+/// binary_codec for streams of similar samples.
+/**
+ * Every batch is encoded on its own, so a consumer can start at, or skip to,
+ * any frame. The payload is a 1-byte precision, then varints holding the
+ * sample count, the first sample's sequence number and the first sample's
+ * timestamp in nanoseconds, then a record of varints per sample:
+ * @li The sequence number's difference from the previous one plus one,
+ *     zigzagged, shifted left with the eye id in the low bit.
+ * @li The timestamp's delta-of-delta, zigzagged; evenly spaced samples take
+ *     a single byte.
+ * @li Confidence, x and y position. With a precision of N bits, each is
+ *     rounded to a multiple of 1 / (2^N - 1) and its difference from the
+ *     previous sample's, in those steps, is zigzagged. With a precision of 0
+ *     (lossless) the float's bits are XORed with the previous sample's.
+ * @li The pupil diameter's difference from the previous one, zigzagged.
+ * @li Only if the precision byte has its sourced bit set: the source id's and
+ *     the source sequence number's differences from the previous sample's,
+ *     zigzagged. Batches whose samples all have a source of 0 leave the bit
+ *     clear and omit them, as payloads did before sources were added.
+ *
+ * Quantized values are clamped to +/-max_magnitude, far outside the
+ * normalized range.
+ */
+struct compact_codec {
+    static const codec_type type = compact_codec_type;
+
+    static_assert(message_schema<eye_message>::version == 2,
+                  "compact_codec encodes each field by hand; extend it for new fields");
+
+    enum {
+        /// Precision that keeps every float exactly.
+        lossless = 0,
+
+        /// Finest quantization, in bits per unit.
+        max_precision = 24,
+
+        /// Bit of the precision byte set when records carry their source.
+        sourced = 0x80,
+
+        /// Largest record: 10-byte sequence and time varints, 6 bytes for each
+        /// quantized value, 5 for the pupil and 5 and 10 for the source.
+        max_record_size = 3 * wire::max_varint_length + 3 * 6 + 5 + 5,
+
+        /// Smallest record, one byte per varint.
+        min_record_size = 6
+    };
+
+    /// Magnitude quantized values are clamped to.
+    static float max_magnitude() {
+        return 1024.0f;
+    }
+
+    /// Append the encoded batch to out. Existing capacity is reused. Fails for
+    /// timestamps whose nanoseconds are not within their second, or sequence
+    /// numbers jumping by more than 2^62.
+    static bool encode(const std::vector<eye_message>& batch, std::vector<char>& out,
+                       uint8_t precision = lossless) {
+        if (precision > max_precision) {
+            return false;
+        }
+        std::size_t offset = out.size();
+        out.resize(offset + 1 + 3 * wire::max_varint_length + batch.size() * max_record_size);
+        char* begin = &out[offset];
+        char* p = begin;
+        bool with_source = has_source(batch);
+        *p++ = static_cast<char>(precision | (with_source ? sourced : 0));
+        p = wire::put_varint(p, batch.size());
+        if (batch.empty()) {
+            out.resize(offset + (p - begin));
+            return true;
+        }
+
+        uint64_t prev_seq = uint64_t(batch[0].seq_number) - 1;
+        uint64_t prev_time = time_ns(batch[0]);
+        uint64_t prev_delta = 0;
+        p = wire::put_varint(p, prev_seq + 1);
+        p = wire::put_varint(p, prev_time);
+        double scale = double((uint32_t(1) << precision) - 1);
+        int64_t prev_q[3] = { 0, 0, 0 };
+        uint32_t prev_bits[3] = { 0, 0, 0 };
+        uint32_t prev_pupil = 0;
+        uint32_t prev_source = 0;
+        uint64_t prev_source_seq = 0;
+        for (std::size_t i = 0; i < batch.size(); ++i) {
+            const eye_message& m = batch[i];
+            if (m.time_nanos >= 1000000000u) {
+                return false;
+            }
+            int64_t seq_delta = int64_t(uint64_t(m.seq_number) - prev_seq - 1);
+            if (seq_delta >= (int64_t(1) << 62) || seq_delta < -(int64_t(1) << 62)) {
+                return false;
+            }
+            p = wire::put_varint(p, (wire::zigzag(seq_delta) << 1) | (m.id ? 1 : 0));
+            prev_seq = m.seq_number;
+
+            uint64_t time = time_ns(m);
+            uint64_t delta = time - prev_time;
+            p = wire::put_varint(p, wire::zigzag(int64_t(delta - prev_delta)));
+            prev_time = time;
+            prev_delta = delta;
+
+            const float values[3] = { m.confidence, m.normalized_pos_x, m.normalized_pos_y };
+            for (int v = 0; v < 3; ++v) {
+                if (precision == lossless) {
+                    uint32_t bits;
+                    std::memcpy(&bits, &values[v], sizeof(bits));
+                    p = wire::put_varint(p, bits ^ prev_bits[v]);
+                    prev_bits[v] = bits;
+                } else {
+                    int64_t q = quantize(values[v], scale);
+                    p = wire::put_varint(p, wire::zigzag(q - prev_q[v]));
+                    prev_q[v] = q;
+                }
+            }
+
+            p = wire::put_varint(p, wire::zigzag(int64_t(m.pupil_diameter) - int64_t(prev_pupil)));
+            prev_pupil = m.pupil_diameter;
+
+            if (with_source) {
+                p = wire::put_varint(p, wire::zigzag(int64_t(m.source_id) - int64_t(prev_source)));
+                p = wire::put_varint(p, wire::zigzag(int64_t(m.source_seq - prev_source_seq)));
+                prev_source = m.source_id;
+                prev_source_seq = m.source_seq;
+            }
+        }
+        out.resize(offset + (p - begin));
+        return true;
+    }
+
+    /// Decode a batch directly from the received bytes.
+    static bool decode(const char* data, std::size_t size, std::vector<eye_message>& batch) {
+        const char* end = data + size;
+        const char* p = data;
+        uint64_t count;
+        if (size < 1 || (static_cast<uint8_t>(*p) & ~sourced) > max_precision) {
+            return false;
+        }
+        bool with_source = (static_cast<uint8_t>(*p) & sourced) != 0;
+        uint8_t precision = static_cast<uint8_t>(*p++) & ~sourced;
+        if (!wire::get_varint(p, end, count) || count > size / min_record_size) {
+            return false;
+        }
+        batch.resize(count);
+        if (count == 0) {
+            return p == end;
+        }
+
+        uint64_t prev_seq;
+        uint64_t prev_time;
+        if (!wire::get_varint(p, end, prev_seq) || !wire::get_varint(p, end, prev_time)) {
+            return false;
+        }
+        prev_seq -= 1;
+        uint64_t prev_delta = 0;
+        double step = precision == lossless ? 0 : 1.0 / double((uint32_t(1) << precision) - 1);
+        uint64_t prev_q[3] = { 0, 0, 0 };
+        uint32_t prev_bits[3] = { 0, 0, 0 };
+        uint32_t prev_pupil = 0;
+        uint32_t prev_source = 0;
+        uint64_t prev_source_seq = 0;
+        for (uint64_t i = 0; i < count; ++i) {
+            eye_message& m = batch[i];
+            uint64_t fields[8];
+            for (int f = 0; f < 6; ++f) {
+                if (!wire::get_varint(p, end, fields[f])) {
+                    return false;
+                }
+            }
+
+            m.id = (fields[0] & 1) != 0;
+            prev_seq += uint64_t(wire::unzigzag(fields[0] >> 1)) + 1;
+            m.seq_number = prev_seq;
+
+            prev_delta += uint64_t(wire::unzigzag(fields[1]));
+            prev_time += prev_delta;
+            m.time_seconds = prev_time / 1000000000u;
+            m.time_nanos = static_cast<uint32_t>(prev_time % 1000000000u);
+
+            float values[3];
+            for (int v = 0; v < 3; ++v) {
+                if (precision == lossless) {
+                    prev_bits[v] ^= static_cast<uint32_t>(fields[2 + v]);
+                    std::memcpy(&values[v], &prev_bits[v], sizeof(values[v]));
+                } else {
+                    prev_q[v] += uint64_t(wire::unzigzag(fields[2 + v]));
+                    values[v] = static_cast<float>(double(int64_t(prev_q[v])) * step);
+                }
+            }
+            m.confidence = values[0];
+            m.normalized_pos_x = values[1];
+            m.normalized_pos_y = values[2];
+
+            prev_pupil += static_cast<uint32_t>(wire::unzigzag(fields[5]));
+            m.pupil_diameter = prev_pupil;
+
+            if (with_source) {
+                if (!wire::get_varint(p, end, fields[6]) || !wire::get_varint(p, end, fields[7])) {
+                    return false;
+                }
+                prev_source += static_cast<uint32_t>(wire::unzigzag(fields[6]));
+                prev_source_seq += uint64_t(wire::unzigzag(fields[7]));
+            }
+            m.source_id = prev_source;
+            m.source_seq = prev_source_seq;
+        }
+        return p == end;
+    }
+
+private:
+
+    /// A sample's timestamp in nanoseconds.
+    static uint64_t time_ns(const eye_message& m) {
+        return uint64_t(m.time_seconds) * 1000000000u + m.time_nanos;
+    }
+
+    /// Round a value to the nearest step of 1 / scale, halves away from zero.
+    static int64_t quantize(float value, double scale) {
+        if (!(value == value)) {
+            return 0;
+        }
+        double clamped = std::max(-double(max_magnitude()), std::min(double(max_magnitude()), double(value)));
+        double scaled = clamped * scale;
+        return int64_t(scaled < 0 ? scaled - 0.5 : scaled + 0.5);
+    }
+};
+
+/// Boost text archive encoding. Slow, but human readable; kept for debugging.
+struct text_codec {
+    static const codec_type type = text_codec_type;
+
+    template <typename T>
+    static bool encode(const T& t, std::vector<char>& out) {
+        boost::iostreams::stream<boost::iostreams::back_insert_device<std::vector<char> > > os(out);
+        {
+            boost::archive::text_oarchive archive(os);
+            archive << t;
+        }
+        os.flush();
+        return static_cast<bool>(os);
+    }
+
+    template <typename T>
+    static bool decode(const char* data, std::size_t size, T& t) {
+        try {
+            boost::iostreams::stream<boost::iostreams::array_source> is(data, size);
+            boost::archive::text_iarchive archive(is);
+            archive >> t;
+        } catch (std::exception&) {
+            return false;
+        }
+        return true;
+    }
+};
+
+/// An encoded frame shared, read-only, between several writers.
+typedef boost::shared_ptr<const std::vector<char> > shared_frame;
+
+/// Encode t as a complete frame (header and payload) into frame, replacing its
+/// contents but keeping its capacity. precision only applies to the compact
+/// codec, see compact_codec.
+template <typename T>
+bool encode_frame(codec_type codec, const T& t, std::vector<char>& frame,
+                  uint8_t precision = compact_codec::lossless) {
+    frame.resize(frame_header::length);
+    bool ok = false;
+    switch (codec) {
+    case binary_codec_type:
+        ok = binary_codec::encode(t, frame);
+        break;
+    case text_codec_type:
+        ok = text_codec::encode(t, frame);
+        break;
+    case compact_codec_type:
+        ok = compact_codec::encode(t, frame, precision);
+        break;
+    case subscription_codec_type:
+    case producer_hello_codec_type:
+    case producer_reply_codec_type:
+        // Subscriptions and handshakes are not batches; they have an
+        // encode_frame() of their own.
+        break;
+    }
+    if (!ok || frame.size() - frame_header::length > UINT32_MAX) {
+        return false;
+    }
+
+    frame_header header;
+    header.payload_length = static_cast<uint32_t>(frame.size() - frame_header::length);
+    header.codec = codec;
+    header.version = wire_version;
+    header.encode(&frame[0]);
+    return true;
+}
+
+/// Decode the payload of a frame whose header has already been read.
+template <typename T>
+bool decode_payload(const frame_header& header, const char* data, T& t) {
+    switch (header.codec) {
+    case binary_codec_type:
+        return binary_codec::decode(data, header.payload_length, t);
+    case text_codec_type:
+        return text_codec::decode(data, header.payload_length, t);
+    case compact_codec_type:
+        return compact_codec::decode(data, header.payload_length, t);
+    }
+    return false;
+}
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_CODEC_HPP
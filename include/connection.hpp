@@ -14,34 +14,124 @@
 #define SERIALIZATION_CONNECTION_HPP
 
 #include <boost/asio.hpp>
-#include <boost/archive/text_iarchive.hpp>
-#include <boost/archive/text_oarchive.hpp>
 #include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/tuple/tuple.hpp>
-#include <iomanip>
 #include <string>
-#include <sstream>
 #include <vector>
+#include <sys/socket.h>
+#include "codec.hpp"
+#include "frame_reader.hpp"
+#include "handler_allocator.hpp"
+#include "metrics.hpp"
 
 namespace codechallenge
 {
 
+/// A buffer sequence over a range of buffers owned by someone else. Asio
+/// copies buffer sequences into its operations, so passing this instead of
+/// the vector holding the buffers avoids copying the vector.
+class const_buffer_span
+{
+public:
+    typedef boost::asio::const_buffer value_type;
+    typedef const boost::asio::const_buffer* const_iterator;
+
+    const_buffer_span(const_iterator begin, const_iterator end)
+        : begin_(begin), end_(end) {
+    }
+
+    const_iterator begin() const {
+        return begin_;
+    }
+
+    const_iterator end() const {
+        return end_;
+    }
+
+private:
+    /// The range of buffers.
+    const_iterator begin_;
+    const_iterator end_;
+};
+
+/// Socket options for TCP connections. Unix sockets take none of them.
+struct socket_tuning {
+    socket_tuning()
+        : no_delay(true), send_buffer(0), receive_buffer(0), busy_poll_us(0) {
+    }
+
+    /// Send each frame at once instead of holding small writes back to
+    /// coalesce them (TCP_NODELAY).
+    bool no_delay;
+
+    /// Kernel send and receive buffer sizes in bytes, 0 for the system's
+    /// default and its autotuning.
+    int send_buffer;
+    int receive_buffer;
+
+    /// Microseconds to busy-poll the device queue for data before sleeping
+    /// (SO_BUSY_POLL), 0 to not poll.
+    int busy_poll_us;
+};
+
 /// The base_connection class provides serialization primitives on top of a socket.
+/**
+ * The socket is a generic stream socket, so the same connection runs over a
+ * unix socket or over TCP; only connecting and accepting differ.
+ */
 class base_connection
 {
 public:
+    typedef boost::asio::generic::stream_protocol protocol;
+
     /// Constructor.
     base_connection(boost::asio::io_service& io_service)
-        : socket_(io_service) {
+        : io_service_(io_service), socket_(io_service) {
+    }
+
+    /// Get the io_service the connection's operations are dispatched on.
+    boost::asio::io_service& get_io_service() {
+        return io_service_;
     }
 
     /// Get the underlying socket. Used for making a connection or for accepting
     /// an incoming connection.
-    boost::asio::local::stream_protocol::socket& socket() {
+    protocol::socket& socket() {
         return socket_;
     }
 
+    /// Shut down and close the socket. Outstanding operations complete with
+    /// operation_aborted.
+    void close() {
+        boost::system::error_code e;
+        socket_.shutdown(protocol::socket::shutdown_both, e);
+        socket_.close(e);
+    }
+
+    /// Apply TCP socket options to the open socket. Buffer sizes only take
+    /// full effect if set before connecting.
+    void tune(const socket_tuning& tuning, boost::system::error_code& e) {
+        socket_.set_option(boost::asio::ip::tcp::no_delay(tuning.no_delay), e);
+        if (!e && tuning.send_buffer > 0) {
+            socket_.set_option(boost::asio::socket_base::send_buffer_size(tuning.send_buffer), e);
+        }
+        if (!e && tuning.receive_buffer > 0) {
+            socket_.set_option(boost::asio::socket_base::receive_buffer_size(tuning.receive_buffer), e);
+        }
+        if (!e && tuning.busy_poll_us > 0) {
+#ifdef SO_BUSY_POLL
+            if (setsockopt(socket_.native_handle(), SOL_SOCKET, SO_BUSY_POLL,
+                           &tuning.busy_poll_us, sizeof(tuning.busy_poll_us)) != 0) {
+                e = boost::system::error_code(errno, boost::system::system_category());
+            }
+#else
+            e = boost::asio::error::operation_not_supported;
+#endif
+        }
+    }
+
     /// Asynchronously write a data structure to the socket.
     template <typename T, typename Handler>
     void async_write(const T& t, Handler handler);
@@ -52,143 +142,239 @@ public:
 
 
 protected:
+    /// The io_service the connection's operations are dispatched on.
+    boost::asio::io_service& io_service_;
+
     /// The underlying socket.
-    boost::asio::local::stream_protocol::socket socket_;
+    protocol::socket socket_;
 };
 
 
 /// The connection class provides serialization primitives on top of a socket.
 /**
  * Each message sent using this class consists of:
- * @li An 8-byte header containing the length of the serialized data in
- * hexadecimal.
- * @li The serialized data.
+ * @li An 8-byte binary frame_header holding the payload length, codec and
+ * wire version.
+ * @li The payload, encoded with the codec named in the header.
+ *
+ * Outgoing payloads use the connection's codec (binary by default). Incoming
+ * payloads are decoded with whichever codec the sender named in the header.
  */
 class connection : public base_connection
 {
 public:
 
     connection(boost::asio::io_service& io_service)
-        : base_connection(io_service) {
-        // Nothing to do here
+        : base_connection(io_service), codec_(binary_codec_type),
+          received_at_(0), last_frame_size_(0), reader_(new frame_reader()) {
+    }
+
+    /// Select the codec used for outgoing messages.
+    void set_codec(codec_type codec) {
+        codec_ = codec;
+    }
+
+    /// Wall clock time, in nanoseconds, at which the last frame read had been
+    /// fully received, before it was decoded.
+    uint64_t received_at() const {
+        return received_at_;
+    }
+
+    /// Size of the last frame read, header included.
+    std::size_t last_frame_size() const {
+        return last_frame_size_;
     }
 
     /// Asynchronously write a data structure to the socket.
     template <typename T, typename Handler>
     void async_write(const T& t, Handler handler) {
-        // Serialize the data first so we know how large it is.
-        std::ostringstream archive_stream;
-        boost::archive::text_oarchive archive(archive_stream);
-        archive << t;
-        outbound_data_ = archive_stream.str();
-
-        // Format the header.
-        std::ostringstream header_stream;
-        header_stream << std::setw(header_length)
-                      << std::hex << outbound_data_.size();
-        if (!header_stream || header_stream.str().size() != header_length) {
+        // Encode header and payload into the reusable outbound buffer.
+        if (!encode_frame(codec_, t, outbound_frame_)) {
             // Something went wrong, inform the caller.
             boost::system::error_code error(boost::asio::error::invalid_argument);
-            socket_.get_io_service().post(boost::bind(handler, error));
+            io_service_.post(boost::bind(handler, error));
             return;
         }
-        outbound_header_ = header_stream.str();
 
-        // Write the serialized data to the socket. We use "gather-write" to send
-        // both the header and the data in a single write operation.
-        std::vector<boost::asio::const_buffer> buffers;
-        buffers.push_back(boost::asio::buffer(outbound_header_));
-        buffers.push_back(boost::asio::buffer(outbound_data_));
-        boost::asio::async_write(socket_, buffers, handler);
+        // Header and payload are contiguous, so a single write sends both.
+        boost::asio::async_write(socket_, boost::asio::buffer(outbound_frame_),
+                                 make_custom_alloc_handler(write_memory_, handler));
+    }
+
+    /// Asynchronously write an already encoded frame to the socket. The frame
+    /// is shared, not copied, and is kept alive until the write completes.
+    template <typename Handler>
+    void async_write_frame(const shared_frame& frame, Handler handler) {
+        void (connection::*f)(const boost::system::error_code&, shared_frame, boost::tuple<Handler>)
+            = &connection::handle_write_frame<Handler>;
+        boost::asio::async_write(socket_, boost::asio::buffer(*frame),
+                                 make_custom_alloc_handler(write_memory_,
+                                         boost::bind(f, this, boost::asio::placeholders::error,
+                                                     frame, boost::make_tuple(handler))));
+    }
+
+    /// Make room for gather writes of up to count frames, so that they do not
+    /// allocate.
+    void reserve_frames(std::size_t count) {
+        outbound_buffers_.reserve(count);
+    }
+
+    /// Asynchronously write several encoded frames with a single gather write.
+    /// The caller keeps the frames alive until the handler is called.
+    template <typename Handler>
+    void async_write_frames(const std::vector<shared_frame>& frames, Handler handler) {
+        outbound_buffers_.clear();
+        for (std::size_t i = 0; i < frames.size(); ++i) {
+            outbound_buffers_.push_back(boost::asio::buffer(*frames[i]));
+        }
+        const boost::asio::const_buffer* begin = outbound_buffers_.empty() ? 0 : &outbound_buffers_[0];
+        boost::asio::async_write(socket_, const_buffer_span(begin, begin + outbound_buffers_.size()),
+                                 make_custom_alloc_handler(write_memory_, handler));
+    }
+
+    /// Handle a completed write of a shared frame, releasing our reference to it.
+    template <typename Handler>
+    void handle_write_frame(const boost::system::error_code& e,
+                            shared_frame frame, boost::tuple<Handler> handler) {
+        boost::get<0>(handler)(e);
+    }
+
+    /// Set the largest frame accepted, header included. Frames already
+    /// buffered are discarded, so call before the first read.
+    void set_max_frame(std::size_t bytes) {
+        reader_.reset(new frame_reader(bytes));
     }
 
     /// Asynchronously read a data structure from the socket.
+    /**
+     * Each read from the socket takes everything it has ready, up to the
+     * read buffer's free space, so one read usually brings in several frames.
+     * This reads from the socket only when no complete frame is buffered;
+     * read_buffered() takes the rest without waiting.
+     */
     template <typename T, typename Handler>
     void async_read(T& t, Handler handler) {
-        // Issue a read operation to read exactly the number of bytes in a header.
-        void (connection::*f)(const boost::system::error_code&,T&, boost::tuple<Handler>) = &connection::handle_read_header<T, Handler>;
-        boost::asio::async_read(
-            socket_,
-            boost::asio::buffer(inbound_header_),
-            boost::bind(f,this, boost::asio::placeholders::error, boost::ref(t),boost::make_tuple(handler)));
+        boost::system::error_code e;
+        if (read_buffered(t, e) || e) {
+            // Nothing to wait for; complete as if we had read it.
+            io_service_.post(make_custom_alloc_handler(read_memory_, boost::bind(handler, e)));
+            return;
+        }
+        start_read(t, handler);
     }
 
-    /// Handle a completed read of a message header. The handler is passed using
-    /// a tuple since boost::bind seems to have trouble binding a function object
-    /// created using boost::bind as a parameter.
-    template <typename T, typename Handler>
-    void handle_read_header(const boost::system::error_code& e,
-                            T& t, boost::tuple<Handler> handler) {
-        if (e) {
-            boost::get<0>(handler)(e);
-        } else {
-            // Determine the length of the serialized data.
-            std::istringstream is(std::string(inbound_header_, header_length));
-            std::size_t inbound_data_size = 0;
-            if (!(is >> std::hex >> inbound_data_size)) {
-                // Header doesn't seem to be valid. Inform the caller.
-                boost::system::error_code error(boost::asio::error::invalid_argument);
-                boost::get<0>(handler)(error);
-                return;
-            }
+    /// Decode the next complete frame already read, without reading from the
+    /// socket. Returns false if there is none, with e set if what is buffered
+    /// is not a valid frame, or the frame could not be decoded.
+    template <typename T>
+    bool read_buffered(T& t, boost::system::error_code& e) {
+        frame_view frame;
+        if (!reader_->peek(frame, e)) {
+            return false;
+        }
+        last_frame_size_ = frame.size();
 
-            // Start an asynchronous call to receive the data.
-            inbound_data_.resize(inbound_data_size);
-            void (connection::*f)(
-                const boost::system::error_code&,
-                T&, boost::tuple<Handler>)
-                = &connection::handle_read_data<T, Handler>;
-            boost::asio::async_read(socket_, boost::asio::buffer(inbound_data_),
-                                    boost::bind(f, this,
-                                                boost::asio::placeholders::error, boost::ref(t), handler));
+        // Extract the data structure in place from the read buffer.
+        bool decoded = decode_payload(frame.header, frame.payload, t);
+        reader_->consume(frame);
+        if (!decoded) {
+            e = boost::asio::error::invalid_argument;
+            return false;
         }
+        return true;
     }
 
-    /// Handle a completed read of message data.
+    /// Read whatever the socket has ready into the read buffer.
     template <typename T, typename Handler>
-    void handle_read_data(const boost::system::error_code& e,
-                          T& t, boost::tuple<Handler> handler) {
-        if (e) {
-            boost::get<0>(handler)(e);
-        } else {
-            // Extract the data structure from the data just received.
-            try {
-                std::string archive_data(&inbound_data_[0], inbound_data_.size());
-                std::istringstream archive_stream(archive_data);
-                boost::archive::text_iarchive archive(archive_stream);
-                archive >> t;
-            } catch (std::exception& e) {
-                // Unable to decode data.
-                boost::system::error_code error(boost::asio::error::invalid_argument);
-                boost::get<0>(handler)(error);
-                return;
-            }
+    void start_read(T& t, Handler handler) {
+        void (connection::*f)(const boost::system::error_code&, std::size_t, T&, boost::tuple<Handler>)
+            = &connection::handle_read<T, Handler>;
+        socket_.async_read_some(reader_->prepare(),
+                                make_custom_alloc_handler(read_memory_,
+                                        boost::bind(f, this, boost::asio::placeholders::error,
+                                                    boost::asio::placeholders::bytes_transferred,
+                                                    boost::ref(t), boost::make_tuple(handler))));
+    }
 
-            // Inform caller that data has been received ok.
+    /// Handle a completed read from the socket. The handler is passed using
+    /// a tuple since boost::bind seems to have trouble binding a function object
+    /// created using boost::bind as a parameter.
+    template <typename T, typename Handler>
+    void handle_read(const boost::system::error_code& e, std::size_t bytes,
+                     T& t, boost::tuple<Handler> handler) {
+        if (e) {
             boost::get<0>(handler)(e);
+            return;
         }
+        received_at_ = wall_clock_ns();
+        reader_->commit(bytes);
+        boost::system::error_code error;
+        if (read_buffered(t, error) || error) {
+            boost::get<0>(handler)(error);
+            return;
+        }
+
+        // Only part of a frame so far; wait for the rest.
+        start_read(t, boost::get<0>(handler));
     }
 
 private:
-    /// The size of a fixed length header.
-    enum { header_length = 8 };
+    /// Codec used for outgoing messages.
+    codec_type codec_;
 
-    /// Holds an outbound header.
-    std::string outbound_header_;
+    /// Holds an outbound frame, header followed by payload.
+    std::vector<char> outbound_frame_;
 
-    /// Holds the outbound data.
-    std::string outbound_data_;
+    /// When the last frame read was received, and its size.
+    uint64_t received_at_;
+    std::size_t last_frame_size_;
 
-    /// Holds an inbound header.
-    char inbound_header_[header_length];
+    /// Buffer sequence of the gather write in progress.
+    std::vector<boost::asio::const_buffer> outbound_buffers_;
 
-    /// Holds the inbound data.
-    std::vector<char> inbound_data_;
+    /// Frames read from the socket and not yet decoded.
+    boost::scoped_ptr<frame_reader> reader_;
+
+    /// Handler memory for the read and for the write in progress.
+    handler_memory read_memory_;
+    handler_memory write_memory_;
 };
 
 
 typedef boost::shared_ptr<connection> connection_ptr;
 
+/// Start connecting to the server listening on the unix socket at path.
+template <typename Handler>
+void async_connect(base_connection& conn, const std::string& path, Handler handler)
+{
+    boost::asio::local::stream_protocol::endpoint local(path);
+    conn.socket().async_connect(base_connection::protocol::endpoint(local), handler);
+}
+
+/// A server listening on TCP, and the options for connections to it.
+struct tcp_address {
+    boost::asio::ip::tcp::endpoint endpoint;
+    socket_tuning tuning;
+};
+
+/// Start connecting to the server listening on TCP at address. The socket is
+/// tuned before connecting, so its buffer sizes apply from the handshake on.
+template <typename Handler>
+void async_connect(base_connection& conn, const tcp_address& address, Handler handler)
+{
+    base_connection::protocol::endpoint ep(address.endpoint);
+    boost::system::error_code e;
+    conn.socket().open(ep.protocol(), e);
+    if (!e) {
+        conn.tune(address.tuning, e);
+    }
+    if (e) {
+        conn.get_io_service().post(boost::bind(handler, e));
+        return;
+    }
+    conn.socket().async_connect(ep, handler);
+}
+
 } // namespace codechallenge
 
 #endif // SERIALIZATION_CONNECTION_HPP
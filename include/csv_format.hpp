@@ -0,0 +1,247 @@
+//
+// csv_format.hpp
+// ~~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_CSV_FORMAT_HPP
+#define CODECHALLENGE_CSV_FORMAT_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include "eye_message.hpp"
+
+namespace codechallenge
+{
+
+/// Allocation-free text formatting of eye messages, appending to a string
+/// that is reused between calls, and parsing of the rows it writes.
+namespace csv
+{
+
+/// Append an unsigned integer in decimal.
+inline void append_uint(std::string& out, uint64_t value) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = static_cast<char>('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    while (n > 0) {
+        out.push_back(digits[--n]);
+    }
+}
+
+/// Append a float the way std::ostream prints it by default (%g).
+inline void append_float(std::string& out, float value) {
+    char text[32];
+    int n = snprintf(text, sizeof(text), "%g", value);
+    out.append(text, n);
+}
+
+/// Parse an unsigned decimal integer, advancing p. Returns false if there are
+/// no digits or the value overflows.
+inline bool parse_uint(const char*& p, const char* end, uint64_t& value) {
+    const char* start = p;
+    value = 0;
+    while (p != end && *p >= '0' && *p <= '9') {
+        uint64_t digit = uint64_t(*p - '0');
+        if (value > (UINT64_MAX - digit) / 10) {
+            return false;
+        }
+        value = value * 10 + digit;
+        ++p;
+    }
+    return p != start;
+}
+
+/// Parse a float, advancing p. Reads no further than end, which need not be
+/// followed by a terminator.
+inline bool parse_float(const char*& p, const char* end, float& value) {
+    char text[32];
+    std::size_t n = 0;
+    while (p + n != end && n + 1 < sizeof(text) && p[n] != ',' && p[n] != '\n' && p[n] != '\r') {
+        text[n] = p[n];
+        ++n;
+    }
+    text[n] = 0;
+    char* parsed;
+    value = strtof(text, &parsed);
+    if (parsed == text || parsed != text + n) {
+        return false;
+    }
+    p += n;
+    return true;
+}
+
+/// Skip the expected separator, advancing p.
+inline bool expect(const char*& p, const char* end, char c) {
+    if (p == end || *p != c) {
+        return false;
+    }
+    ++p;
+    return true;
+}
+
+/// Append a field's value: integers in decimal, bools as 1 or 0, floats as
+/// append_float does.
+inline void append_value(std::string& out, bool value) {
+    out.push_back(value ? '1' : '0');
+}
+
+inline void append_value(std::string& out, float value) {
+    append_float(out, value);
+}
+
+template <typename T>
+inline void append_value(std::string& out, T value) {
+    static_assert(std::is_unsigned<T>::value, "CSV fields are unsigned integers, bools or floats");
+    append_uint(out, value);
+}
+
+/// Parse a field's value as append_value writes it, advancing p.
+inline bool parse_value(const char*& p, const char* end, bool& value) {
+    uint64_t n;
+    if (!parse_uint(p, end, n) || n > 1) {
+        return false;
+    }
+    value = n != 0;
+    return true;
+}
+
+inline bool parse_value(const char*& p, const char* end, float& value) {
+    return parse_float(p, end, value);
+}
+
+template <typename T>
+inline bool parse_value(const char*& p, const char* end, T& value) {
+    uint64_t n;
+    if (!parse_uint(p, end, n) || n > std::numeric_limits<T>::max()) {
+        return false;
+    }
+    value = static_cast<T>(n);
+    return true;
+}
+
+/// Appends the headings, or values, of the fields that have a CSV heading,
+/// each followed by a comma.
+struct heading_writer {
+    std::string& out;
+
+    template <typename Field>
+    void operator()(Field) {
+        if (Field::heading()) {
+            out += Field::heading();
+            out.push_back(',');
+        }
+    }
+};
+
+struct row_writer {
+    std::string& out;
+    const eye_message& s;
+
+    template <typename Field>
+    void operator()(Field) {
+        if (Field::heading()) {
+            append_value(out, Field::get(s));
+            out.push_back(',');
+        }
+    }
+};
+
+/// Appends ", label: value" for the fields that have a console label.
+struct console_writer {
+    std::string& out;
+    const eye_message& s;
+
+    template <typename Field>
+    void operator()(Field) {
+        if (Field::label()) {
+            out += ", ";
+            out += Field::label();
+            out += ": ";
+            append_value(out, Field::get(s));
+        }
+    }
+};
+
+/// Parses the fields that have a CSV heading, in order, stopping at the
+/// first that is missing or not valid.
+struct row_parser {
+    const char*& p;
+    const char* end;
+    eye_message& s;
+    bool ok;
+    bool first;
+
+    template <typename Field>
+    void operator()(Field) {
+        if (Field::heading() && ok) {
+            ok = (first || expect(p, end, ','))
+                 && parse_value(p, end, Field::get(s)) && Field::valid(Field::get(s));
+            first = false;
+        }
+    }
+};
+
+/// Append the CSV column header line.
+inline void append_header(std::string& out) {
+    heading_writer write = { out };
+    for_each_field(message_schema<eye_message>::fields(), write);
+    out.back() = '\n';
+}
+
+/// Append one sample as a CSV line.
+inline void append_row(std::string& out, const eye_message& s) {
+    row_writer write = { out, s };
+    for_each_field(message_schema<eye_message>::fields(), write);
+    out.back() = '\n';
+}
+
+/// Append one sample as a human readable console line.
+inline void append_console_line(std::string& out, uint64_t count, const eye_message& s) {
+    out += "Count: ";
+    append_uint(out, count);
+    console_writer write = { out, s };
+    for_each_field(message_schema<eye_message>::fields(), write);
+    out += ",\n";
+}
+
+/// Parse one line written by append_row, advancing p past its end. On
+/// failure p is still moved to the next line and s is left alone. CSV rows
+/// carry no sequence number, so seq_number is left alone either way.
+inline bool parse_row(const char*& p, const char* end, eye_message& s) {
+    const char* line_end = static_cast<const char*>(memchr(p, '\n', end - p));
+    if (!line_end) {
+        line_end = end;
+    }
+    eye_message parsed = s;
+    row_parser parse = { p, line_end, parsed, true, true };
+    for_each_field(message_schema<eye_message>::fields(), parse);
+    bool ok = parse.ok;
+    if (ok && p != line_end && *p == '\r') {
+        ++p;
+    }
+    ok = ok && p == line_end;
+    p = line_end == end ? end : line_end + 1;
+    if (ok) {
+        s = parsed;
+    }
+    return ok;
+}
+
+} // namespace csv
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_CSV_FORMAT_HPP
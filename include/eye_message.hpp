@@ -13,7 +13,10 @@
 #ifndef SERIALIZATION_STOCK_HPP
 #define SERIALIZATION_STOCK_HPP
 
+#include <cstdint>
 #include <string>
+#include <boost/serialization/version.hpp>
+#include "message_schema.hpp"
 
 namespace codechallenge
 {
@@ -30,20 +33,119 @@ struct eye_message {
     float normalized_pos_y;
     uint32_t pupil_diameter;
 
+    /// Tracker the sample came from, and its number in that tracker's own
+    /// sequence; 0 for samples that did not pass through a broker.
+    uint32_t source_id;
+    uint64_t source_seq;
+
 
     template <typename Archive>
     void serialize(Archive& ar, const unsigned int version) {
-        ar &  seq_number;
-        ar &  time_seconds;
-        ar &  time_nanos;
-        ar &  id;
-        ar &  confidence;
-        ar &  normalized_pos_x;
-        ar &  normalized_pos_y;
-        ar &  pupil_diameter;
+        serialize_fields(ar, *this, version);
     }
 };
 
+/// Schema of eye_message, from which its binary records, CSV rows, console
+/// lines and recording columns are generated. Fields may only be appended,
+/// each with the version that added it, bumping version.
+template <>
+struct message_schema<eye_message> {
+    enum { version = 2 };
+
+    struct seq_number
+        : message_field<eye_message, ulong, &eye_message::seq_number>
+    {
+        static constexpr const char* name() { return "seq_number"; }
+        static constexpr const char* heading() { return 0; }
+        static constexpr const char* label() { return 0; }
+    };
+
+    struct time_seconds
+        : message_field<eye_message, uint64_t, &eye_message::time_seconds>
+    {
+        static constexpr const char* name() { return "time_seconds"; }
+        static constexpr const char* heading() { return "Timestamp(Seconds)"; }
+        static constexpr const char* label() { return "Time(Sec)"; }
+    };
+
+    struct time_nanos
+        : message_field<eye_message, uint32_t, &eye_message::time_nanos>
+    {
+        static constexpr const char* name() { return "time_nanos"; }
+        static constexpr const char* heading() { return "Timestamp(Nanoseconds)"; }
+        static constexpr const char* label() { return "Time(Nanos)"; }
+
+        /// Nanoseconds within the second.
+        static bool valid(uint32_t nanos) {
+            return nanos < 1000000000u;
+        }
+    };
+
+    struct id
+        : message_field<eye_message, bool, &eye_message::id>
+    {
+        static constexpr const char* name() { return "id"; }
+        static constexpr const char* heading() { return "ID"; }
+        static constexpr const char* label() { return "ID"; }
+    };
+
+    struct confidence
+        : message_field<eye_message, float, &eye_message::confidence>
+    {
+        static constexpr const char* name() { return "confidence"; }
+        static constexpr const char* heading() { return "Confidence"; }
+        static constexpr const char* label() { return "Confidence"; }
+    };
+
+    struct normalized_pos_x
+        : message_field<eye_message, float, &eye_message::normalized_pos_x>
+    {
+        static constexpr const char* name() { return "normalized_pos_x"; }
+        static constexpr const char* heading() { return "NormalizedPosX"; }
+        static constexpr const char* label() { return "NormalizedPosX"; }
+    };
+
+    struct normalized_pos_y
+        : message_field<eye_message, float, &eye_message::normalized_pos_y>
+    {
+        static constexpr const char* name() { return "normalized_pos_y"; }
+        static constexpr const char* heading() { return "NormalizedPosY"; }
+        static constexpr const char* label() { return "NormalizedPosY"; }
+    };
+
+    struct pupil_diameter
+        : message_field<eye_message, uint32_t, &eye_message::pupil_diameter>
+    {
+        static constexpr const char* name() { return "pupil_diameter"; }
+        static constexpr const char* heading() { return "PupilDiameter"; }
+        static constexpr const char* label() { return "PupilDiameter"; }
+    };
+
+    struct source_id
+        : message_field<eye_message, uint32_t, &eye_message::source_id, 2>
+    {
+        static constexpr const char* name() { return "source_id"; }
+        static constexpr const char* heading() { return 0; }
+        static constexpr const char* label() { return 0; }
+    };
+
+    struct source_seq
+        : message_field<eye_message, uint64_t, &eye_message::source_seq, 2>
+    {
+        static constexpr const char* name() { return "source_seq"; }
+        static constexpr const char* heading() { return 0; }
+        static constexpr const char* label() { return 0; }
+    };
+
+    typedef field_list<seq_number, time_seconds, time_nanos, id, confidence,
+                       normalized_pos_x, normalized_pos_y, pupil_diameter,
+                       source_id, source_seq> fields;
+};
+
 } // namespace codechallenge
 
+// Boost archives record the version they were written with; version 0, the
+// default, means schema version 1.
+BOOST_CLASS_VERSION(codechallenge::eye_message, codechallenge::message_schema<codechallenge::eye_message>::version)
+
 #endif // SERIALIZATION_STOCK_HPP
@@ -0,0 +1,171 @@
+//
+// frame_reader.hpp
+// ~~~~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_FRAME_READER_HPP
+#define CODECHALLENGE_FRAME_READER_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/system/error_code.hpp>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "codec.hpp"
+
+namespace codechallenge
+{
+
+/// A complete frame held in a frame_reader.
+struct frame_view {
+    /// The frame's decoded header.
+    frame_header header;
+
+    /// The payload, header.payload_length bytes.
+    const char* payload;
+
+    /// Size of the whole frame, header included.
+    std::size_t size() const {
+        return frame_header::length + header.payload_length;
+    }
+};
+
+/// Splits a byte stream into frames, in place, in a ring buffer read into as
+/// many frames at a time as the socket has ready.
+/**
+ * The ring is mapped twice, back to back, so that the bytes after its end
+ * are its start again. Free space and buffered frames are therefore always
+ * contiguous, even across the wrap: a read fills all the free space at once,
+ * and a frame left partial by one read is completed in place by the next,
+ * never copied. Frames are decoded straight out of the ring.
+ *
+ * No frame may be larger than max_frame, header included; a larger one is an
+ * error rather than a reason to grow. The ring holds at least one frame of
+ * that size, so a full ring always has a complete frame to take.
+ */
+class frame_reader
+    : private boost::noncopyable
+{
+public:
+    enum {
+        /// Largest frame accepted by default.
+        default_max_frame = 1 << 20,
+
+        /// Smallest ring, so that small frames are still read many at a time.
+        min_capacity = 64 * 1024
+    };
+
+    explicit frame_reader(std::size_t max_frame = default_max_frame)
+        : base_(0), capacity_(0), max_frame_(max_frame), head_(0), tail_(0) {
+        if (max_frame_ <= frame_header::length) {
+            throw std::invalid_argument("largest frame must be longer than a frame header");
+        }
+        std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        capacity_ = std::max<std::size_t>(max_frame_, min_capacity);
+        capacity_ = (capacity_ + page - 1) / page * page;
+
+        int fd = memfd_create("frame_reader", MFD_CLOEXEC);
+        if (fd < 0) {
+            throw std::runtime_error("memfd_create failed for the frame reader");
+        }
+        if (ftruncate(fd, capacity_) != 0) {
+            ::close(fd);
+            throw std::runtime_error("ftruncate failed for the frame reader");
+        }
+
+        // Reserve room for both mappings, then map the ring into each half.
+        void* base = mmap(0, 2 * capacity_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("mmap failed for the frame reader");
+        }
+        base_ = static_cast<char*>(base);
+        for (int half = 0; half < 2; ++half) {
+            if (mmap(base_ + half * capacity_, capacity_, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+                munmap(base_, 2 * capacity_);
+                ::close(fd);
+                throw std::runtime_error("mmap failed for the frame reader");
+            }
+        }
+        ::close(fd);
+    }
+
+    ~frame_reader() {
+        munmap(base_, 2 * capacity_);
+    }
+
+    /// The free space, to read into.
+    boost::asio::mutable_buffers_1 prepare() {
+        return boost::asio::buffer(base_ + tail_ % capacity_, capacity_ - buffered());
+    }
+
+    /// Add n bytes just read into the free space.
+    void commit(std::size_t n) {
+        tail_ += n;
+    }
+
+    /// Get the oldest frame, if it is complete, without taking it. Returns
+    /// false if it is not; e is set if it cannot be a valid frame.
+    bool peek(frame_view& frame, boost::system::error_code& e) const {
+        e = boost::system::error_code();
+        std::size_t available = buffered();
+        if (available < frame_header::length) {
+            return false;
+        }
+        const char* p = base_ + head_ % capacity_;
+        if (!frame.header.decode(p)) {
+            e = boost::asio::error::invalid_argument;
+            return false;
+        }
+        if (frame.header.payload_length > max_frame_ - frame_header::length) {
+            e = boost::asio::error::message_size;
+            return false;
+        }
+        if (available < frame.size()) {
+            return false;
+        }
+        frame.payload = p + frame_header::length;
+        return true;
+    }
+
+    /// Take the oldest frame, letting its space be read into again.
+    void consume(const frame_view& frame) {
+        head_ += frame.size();
+    }
+
+    /// Bytes read and not yet taken.
+    std::size_t buffered() const {
+        return static_cast<std::size_t>(tail_ - head_);
+    }
+
+    /// Largest frame accepted, header included.
+    std::size_t max_frame() const {
+        return max_frame_;
+    }
+
+private:
+    /// The ring, mapped twice in a row.
+    char* base_;
+    std::size_t capacity_;
+
+    /// Largest frame accepted.
+    std::size_t max_frame_;
+
+    /// Stream offsets of the oldest byte not taken and of the end of the data.
+    uint64_t head_;
+    uint64_t tail_;
+};
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_FRAME_READER_HPP
@@ -0,0 +1,658 @@
+//
+// gaze_analytics.hpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_GAZE_ANALYTICS_HPP
+#define CODECHALLENGE_GAZE_ANALYTICS_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "async_logger.hpp"
+#include "csv_format.hpp"
+#include "eye_message.hpp"
+#include "metrics.hpp"
+
+namespace codechallenge
+{
+
+/// Mean and variance of the last size values pushed, in O(1) per value.
+/**
+ * Running sums are kept in double precision, and recomputed from the window
+ * each time it wraps, so rounding error cannot build up over a long stream.
+ */
+class rolling_window
+{
+public:
+    explicit rolling_window(std::size_t size = 64)
+        : values_(std::max<std::size_t>(size, 1), 0.0f), next_(0), count_(0), sum_(0), sum_squares_(0) {
+    }
+
+    /// Add a value, dropping the oldest once the window is full.
+    void push(float value) {
+        if (count_ == values_.size()) {
+            double old = values_[next_];
+            sum_ -= old;
+            sum_squares_ -= old * old;
+        } else {
+            ++count_;
+        }
+        values_[next_] = value;
+        sum_ += value;
+        sum_squares_ += double(value) * value;
+        if (++next_ == values_.size()) {
+            next_ = 0;
+            resum();
+        }
+    }
+
+    /// Mean of the window, 0 when empty.
+    double mean() const {
+        return count_ ? sum_ / count_ : 0;
+    }
+
+    /// Population variance of the window.
+    double variance() const {
+        if (count_ < 2) {
+            return 0;
+        }
+        double m = mean();
+        return std::max(0.0, sum_squares_ / count_ - m * m);
+    }
+
+    /// Values in the window.
+    std::size_t count() const {
+        return count_;
+    }
+
+private:
+    /// Recompute the sums exactly.
+    void resum() {
+        sum_ = 0;
+        sum_squares_ = 0;
+        for (std::size_t i = 0; i < count_; ++i) {
+            sum_ += values_[i];
+            sum_squares_ += double(values_[i]) * values_[i];
+        }
+    }
+
+    /// The window, oldest value at next_ once full.
+    std::vector<float> values_;
+    std::size_t next_;
+    std::size_t count_;
+
+    /// Sums over the window.
+    double sum_;
+    double sum_squares_;
+};
+
+/// What an eye was doing.
+enum gaze_event_type {
+    fixation_event,
+    saccade_event,
+    blink_event
+};
+
+/// Name of an event type, as written to event logs.
+inline const char* event_name(gaze_event_type type) {
+    switch (type) {
+    case fixation_event:
+        return "fixation";
+    case saccade_event:
+        return "saccade";
+    case blink_event:
+        return "blink";
+    }
+    return "unknown";
+}
+
+/// A fixation, saccade or blink of one eye, reported once it has ended.
+struct gaze_event {
+    gaze_event_type type;
+
+    /// Eye, 0 or 1.
+    uint8_t eye;
+
+    /// Timestamps of the event's first and last samples, nanoseconds.
+    uint64_t start_ns;
+    uint64_t end_ns;
+
+    /// Samples the event spans.
+    uint32_t samples;
+
+    /// Fixations: the centroid. Saccades: where the eye landed. Blinks: the
+    /// last position seen before the blink.
+    float x;
+    float y;
+
+    /// Saccades: distance travelled, degrees. 0 for other events.
+    float amplitude;
+
+    /// Fastest gaze velocity over the event, degrees per second.
+    float peak_velocity;
+};
+
+/// Rolling statistics of one eye, over the last options.window samples.
+struct gaze_summary {
+    double mean_x;
+    double mean_y;
+    double mean_confidence;
+    double mean_pupil_diameter;
+    double mean_velocity;
+
+    /// Spread of gaze around its mean, normalized units.
+    double dispersion;
+
+    /// Latest gaze velocity, degrees per second.
+    double velocity;
+
+    /// What the eye is doing now.
+    gaze_event_type state;
+};
+
+/// Settings for a gaze_analyzer.
+struct gaze_analytics_options {
+    gaze_analytics_options()
+        : window(64), degrees_per_unit(40), saccade_velocity(100), velocity_lag(4),
+          blink_confidence(0.1f), min_fixation_ns(50000000), min_blink_ns(50000000) {
+    }
+
+    /// Samples per eye the rolling statistics cover.
+    std::size_t window;
+
+    /// Visual angle spanned by the normalized range [0, 1].
+    float degrees_per_unit;
+
+    /// Gaze velocity above which an eye is saccading, degrees per second.
+    float saccade_velocity;
+
+    /// Velocity is measured across this many of an eye's samples, which
+    /// averages out jitter at high sample rates.
+    std::size_t velocity_lag;
+
+    /// Samples below this confidence, or with no pupil, are part of a blink.
+    float blink_confidence;
+
+    /// Shorter fixations and blinks are not reported.
+    uint64_t min_fixation_ns;
+    uint64_t min_blink_ns;
+};
+
+/// Streaming per-eye gaze analytics: velocity, fixation, saccade and blink
+/// classification, and rolling means.
+/**
+ * Each batch is split into per-eye columns (structure-of-arrays), with the
+ * last velocity_lag samples of the previous batch carried in front. Velocity
+ * is computed for the whole batch in one branch-free SIMD pass over the
+ * columns, and compared against the saccade threshold squared so that the
+ * pass needs no square roots. A short sequential pass
+ * then runs each eye's state machine (velocity threshold classification,
+ * I-VT) and updates the rolling windows.
+ *
+ * Events are handed to every handler as soon as they end; within a batch,
+ * eye 0's events come before eye 1's. Once its columns have grown to the
+ * largest batch, the analyzer does not allocate.
+ */
+class gaze_analyzer
+    : private boost::noncopyable
+{
+public:
+    /// Called with every completed event.
+    typedef boost::function<void(const gaze_event&)> event_handler;
+
+    explicit gaze_analyzer(const gaze_analytics_options& options = gaze_analytics_options())
+        : options_(options) {
+        if (options.velocity_lag < 1 || options.degrees_per_unit <= 0) {
+            throw std::invalid_argument("velocity lag and degrees per unit must be positive");
+        }
+        float threshold = options.saccade_velocity / options.degrees_per_unit;
+        threshold_squared_ = threshold * threshold;
+        for (int e = 0; e < eyes; ++e) {
+            eyes_[e].reset(options);
+        }
+        metrics& m = metrics::instance();
+        analyze_ns_ = m.add_histogram("analyze_ns");
+        fixations_ = m.add_counter("fixations");
+        saccades_ = m.add_counter("saccades");
+        blinks_ = m.add_counter("blinks");
+    }
+
+    /// Add a handler for completed events.
+    void on_event(const event_handler& handler) {
+        handlers_.push_back(handler);
+    }
+
+    /// Analyze the next n samples of the stream.
+    void process(const eye_message* samples, std::size_t n) {
+        uint64_t start = steady_clock_ns();
+        for (int e = 0; e < eyes; ++e) {
+            split(samples, n, e);
+        }
+        for (int e = 0; e < eyes; ++e) {
+            if (eyes_[e].size > 0) {
+                velocity_squared(eyes_[e]);
+                classify(eyes_[e], uint8_t(e));
+                carry(eyes_[e]);
+            }
+        }
+        metrics::instance().record(analyze_ns_, steady_clock_ns() - start);
+    }
+
+    /// Rolling statistics of an eye.
+    gaze_summary summary(int eye) const {
+        const eye_state& s = eyes_[eye];
+        gaze_summary out;
+        out.mean_x = s.x_window.mean();
+        out.mean_y = s.y_window.mean();
+        out.mean_confidence = s.confidence_window.mean();
+        out.mean_pupil_diameter = s.pupil_window.mean();
+        out.mean_velocity = s.velocity_window.mean();
+        out.dispersion = std::sqrt(s.x_window.variance() + s.y_window.variance());
+        out.velocity = s.velocity;
+        out.state = s.state;
+        return out;
+    }
+
+    /// Report what is still in progress as if the stream ended here.
+    void finish() {
+        for (int e = 0; e < eyes; ++e) {
+            end_event(eyes_[e], uint8_t(e));
+            eyes_[e].reset(options_);
+        }
+    }
+
+private:
+    enum { eyes = 2 };
+
+    /// One eye's columns and state.
+    struct eye_state {
+        eye_state()
+            : size(0), primed(false), velocity(0), state(fixation_event), in_event(false) {
+        }
+
+        void reset(const gaze_analytics_options& options) {
+            x_window = rolling_window(options.window);
+            y_window = rolling_window(options.window);
+            confidence_window = rolling_window(options.window);
+            pupil_window = rolling_window(options.window);
+            velocity_window = rolling_window(options.window);
+            primed = false;
+            size = 0;
+            velocity = 0;
+            state = fixation_event;
+            in_event = false;
+        }
+
+        /// Columns: lag carried samples, then this batch's size samples.
+        std::vector<uint64_t> time_ns;
+        std::vector<float> time;
+        std::vector<float> x;
+        std::vector<float> y;
+        std::vector<float> confidence;
+        std::vector<uint32_t> pupil;
+
+        /// Squared velocity of each of this batch's samples, units^2/s^2.
+        std::vector<float> speed_squared;
+
+        /// Samples of this batch, and whether earlier samples are carried.
+        std::size_t size;
+        bool primed;
+
+        /// Rolling statistics.
+        rolling_window x_window;
+        rolling_window y_window;
+        rolling_window confidence_window;
+        rolling_window pupil_window;
+        rolling_window velocity_window;
+
+        /// Latest velocity, degrees per second.
+        double velocity;
+
+        /// The event in progress.
+        gaze_event_type state;
+        bool in_event;
+        gaze_event event;
+        double sum_x;
+        double sum_y;
+        float start_x;
+        float start_y;
+        float last_x;
+        float last_y;
+        float peak_squared;
+    };
+
+    /// Copy eye e's samples into its columns, after the carried ones.
+    void split(const eye_message* samples, std::size_t n, int e) {
+        eye_state& s = eyes_[e];
+        std::size_t lag = options_.velocity_lag;
+        std::size_t total = lag + n;
+        if (s.x.size() < total) {
+            s.time_ns.resize(total);
+            s.time.resize(total);
+            s.x.resize(total);
+            s.y.resize(total);
+            s.confidence.resize(total);
+            s.pupil.resize(total);
+            s.speed_squared.resize(n);
+        }
+        std::size_t k = lag;
+        for (std::size_t i = 0; i < n; ++i) {
+            const eye_message& m = samples[i];
+            if ((m.id ? 1 : 0) != e) {
+                continue;
+            }
+            s.time_ns[k] = uint64_t(m.time_seconds) * 1000000000u + m.time_nanos;
+            s.x[k] = m.normalized_pos_x;
+            s.y[k] = m.normalized_pos_y;
+            s.confidence[k] = m.confidence;
+            s.pupil[k] = m.pupil_diameter;
+            ++k;
+        }
+        s.size = k - lag;
+        if (s.size == 0) {
+            return;
+        }
+
+        // Nothing to carry at the start of the stream: pad with the first
+        // sample, which reads as standing still.
+        if (!s.primed) {
+            for (std::size_t i = 0; i < lag; ++i) {
+                s.time_ns[i] = s.time_ns[lag];
+                s.x[i] = s.x[lag];
+                s.y[i] = s.y[lag];
+            }
+        }
+
+        // Times relative to the first column entry, in seconds, for the kernel.
+        uint64_t base = s.time_ns[0];
+        for (std::size_t i = 0; i < total; ++i) {
+            s.time[i] = float(int64_t(s.time_ns[i] - base)) * 1e-9f;
+        }
+    }
+
+    /// The SIMD kernel: squared velocity of every sample over the lag, four
+    /// samples at a time where SSE is available.
+    void velocity_squared(eye_state& s) {
+        std::size_t lag = options_.velocity_lag;
+        std::size_t n = s.size;
+        const float* t = &s.time[0];
+        const float* x = &s.x[0];
+        const float* y = &s.y[0];
+        float* out = &s.speed_squared[0];
+        std::size_t i = 0;
+#ifdef __SSE2__
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 tiny = _mm_set1_ps(1e-30f);
+        for (; i + 4 <= n; i += 4) {
+            __m128 dx = _mm_sub_ps(_mm_loadu_ps(x + i + lag), _mm_loadu_ps(x + i));
+            __m128 dy = _mm_sub_ps(_mm_loadu_ps(y + i + lag), _mm_loadu_ps(y + i));
+            __m128 dt = _mm_sub_ps(_mm_loadu_ps(t + i + lag), _mm_loadu_ps(t + i));
+            __m128 distance = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+            __m128 speed = _mm_div_ps(distance, _mm_max_ps(_mm_mul_ps(dt, dt), tiny));
+            _mm_storeu_ps(out + i, _mm_and_ps(speed, _mm_cmpgt_ps(dt, zero)));
+        }
+#endif
+        for (; i < n; ++i) {
+            float dx = x[i + lag] - x[i];
+            float dy = y[i + lag] - y[i];
+            float dt = t[i + lag] - t[i];
+            out[i] = dt > 0 ? (dx * dx + dy * dy) / (dt * dt) : 0.0f;
+        }
+    }
+
+    /// Run the eye's state machine over the batch.
+    void classify(eye_state& s, uint8_t eye) {
+        std::size_t lag = options_.velocity_lag;
+        for (std::size_t i = 0; i < s.size; ++i) {
+            std::size_t k = lag + i;
+            float speed_squared = s.speed_squared[i];
+            gaze_event_type type;
+            if (s.confidence[k] < options_.blink_confidence || s.pupil[k] == 0) {
+                type = blink_event;
+            } else {
+                type = speed_squared > threshold_squared_ ? saccade_event : fixation_event;
+                s.velocity = std::sqrt(speed_squared) * options_.degrees_per_unit;
+                s.x_window.push(s.x[k]);
+                s.y_window.push(s.y[k]);
+                s.confidence_window.push(s.confidence[k]);
+                s.pupil_window.push(float(s.pupil[k]));
+                s.velocity_window.push(float(s.velocity));
+            }
+
+            if (!s.in_event || type != s.state) {
+                end_event(s, eye);
+                s.in_event = true;
+                s.state = type;
+                s.event.type = type;
+                s.event.eye = eye;
+                s.event.start_ns = s.time_ns[k];
+                s.event.samples = 0;
+                s.sum_x = 0;
+                s.sum_y = 0;
+                s.start_x = s.x[k];
+                s.start_y = s.y[k];
+                s.peak_squared = 0;
+            }
+            s.event.end_ns = s.time_ns[k];
+            ++s.event.samples;
+            if (type != blink_event) {
+                s.sum_x += s.x[k];
+                s.sum_y += s.y[k];
+                s.last_x = s.x[k];
+                s.last_y = s.y[k];
+                s.peak_squared = std::max(s.peak_squared, speed_squared);
+            }
+        }
+    }
+
+    /// Report the event in progress, if it qualifies.
+    void end_event(eye_state& s, uint8_t eye) {
+        if (!s.in_event) {
+            return;
+        }
+        s.in_event = false;
+        gaze_event& e = s.event;
+        uint64_t duration = e.end_ns - e.start_ns;
+        e.amplitude = 0;
+        e.peak_velocity = std::sqrt(s.peak_squared) * options_.degrees_per_unit;
+        counter_id counter;
+        switch (e.type) {
+        case fixation_event:
+            if (duration < options_.min_fixation_ns) {
+                return;
+            }
+            e.x = float(s.sum_x / e.samples);
+            e.y = float(s.sum_y / e.samples);
+            counter = fixations_;
+            break;
+        case saccade_event: {
+            e.x = s.last_x;
+            e.y = s.last_y;
+            float dx = s.last_x - s.start_x;
+            float dy = s.last_y - s.start_y;
+            e.amplitude = std::sqrt(dx * dx + dy * dy) * options_.degrees_per_unit;
+            counter = saccades_;
+            break;
+        }
+        case blink_event:
+        default:
+            if (duration < options_.min_blink_ns) {
+                return;
+            }
+            e.x = s.last_x;
+            e.y = s.last_y;
+            counter = blinks_;
+            break;
+        }
+        metrics::instance().add(counter);
+        for (std::size_t h = 0; h < handlers_.size(); ++h) {
+            handlers_[h](e);
+        }
+    }
+
+    /// Keep the last lag samples in front of the next batch.
+    void carry(eye_state& s) {
+        std::size_t lag = options_.velocity_lag;
+        std::size_t total = lag + s.size;
+        for (std::size_t i = 0; i < lag; ++i) {
+            s.time_ns[i] = s.time_ns[total - lag + i];
+            s.x[i] = s.x[total - lag + i];
+            s.y[i] = s.y[total - lag + i];
+        }
+        s.primed = true;
+    }
+
+    /// Settings.
+    gaze_analytics_options options_;
+
+    /// Saccade threshold, squared, in normalized units per second.
+    float threshold_squared_;
+
+    /// Per-eye state.
+    eye_state eyes_[eyes];
+
+    /// Told about every completed event.
+    std::vector<event_handler> handlers_;
+
+    /// Metric ids.
+    histogram_id analyze_ns_;
+    counter_id fixations_;
+    counter_id saccades_;
+    counter_id blinks_;
+};
+
+/// Writes events as CSV, one line each, in large writes.
+class gaze_event_writer
+    : private boost::noncopyable
+{
+public:
+    explicit gaze_event_writer(const std::string& filename, std::size_t write_size = 1 << 16)
+        : write_size_(write_size) {
+        fd_ = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd_ < 0) {
+            throw std::runtime_error("unable to open " + filename);
+        }
+        buffer_.reserve(write_size_ + 256);
+        buffer_ += "Event,Eye,Start(Nanoseconds),End(Nanoseconds),Samples,X,Y,Amplitude(Degrees),"
+                   "PeakVelocity(DegreesPerSecond)\n";
+    }
+
+    ~gaze_event_writer() {
+        flush();
+        ::close(fd_);
+    }
+
+    /// Format an event, writing out once enough has built up.
+    void write(const gaze_event& e) {
+        buffer_ += event_name(e.type);
+        buffer_.push_back(',');
+        buffer_.push_back(e.eye ? '1' : '0');
+        buffer_.push_back(',');
+        csv::append_uint(buffer_, e.start_ns);
+        buffer_.push_back(',');
+        csv::append_uint(buffer_, e.end_ns);
+        buffer_.push_back(',');
+        csv::append_uint(buffer_, e.samples);
+        buffer_.push_back(',');
+        csv::append_float(buffer_, e.x);
+        buffer_.push_back(',');
+        csv::append_float(buffer_, e.y);
+        buffer_.push_back(',');
+        csv::append_float(buffer_, e.amplitude);
+        buffer_.push_back(',');
+        csv::append_float(buffer_, e.peak_velocity);
+        buffer_.push_back('\n');
+        if (buffer_.size() >= write_size_) {
+            flush();
+        }
+    }
+
+    void flush() {
+        const char* p = buffer_.data();
+        std::size_t left = buffer_.size();
+        while (left > 0) {
+            ssize_t written = ::write(fd_, p, left);
+            if (written <= 0) {
+                break;
+            }
+            p += written;
+            left -= written;
+        }
+        buffer_.clear();
+    }
+
+private:
+    /// Buffer size that triggers a write.
+    std::size_t write_size_;
+
+    /// The event log.
+    int fd_;
+
+    /// Formatted events not yet written.
+    std::string buffer_;
+};
+
+/// Runs a gaze_analyzer on the logger's writer thread, off the receive path,
+/// optionally writing its events to a file.
+class analytics_sink
+    : public log_sink
+{
+public:
+    /// Events are written to events_filename, unless it is empty.
+    analytics_sink(const gaze_analytics_options& options, const std::string& events_filename)
+        : analyzer_(options) {
+        if (!events_filename.empty()) {
+            writer_.reset(new gaze_event_writer(events_filename));
+            analyzer_.on_event(boost::bind(&gaze_event_writer::write, writer_.get(), _1));
+        }
+    }
+
+    ~analytics_sink() {
+        analyzer_.finish();
+    }
+
+    /// The analyzer, to add event handlers before logging starts.
+    gaze_analyzer& analyzer() {
+        return analyzer_;
+    }
+
+    void write(const eye_message* samples, std::size_t n, uint64_t first_count) {
+        analyzer_.process(samples, n);
+    }
+
+    void flush() {
+        if (writer_) {
+            writer_->flush();
+        }
+    }
+
+private:
+    /// Declared first, so that it is destroyed after the analyzer's last
+    /// events have been written to it.
+    boost::scoped_ptr<gaze_event_writer> writer_;
+
+    /// The analytics.
+    gaze_analyzer analyzer_;
+};
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_GAZE_ANALYTICS_HPP
@@ -0,0 +1,154 @@
+//
+// handler_allocator.hpp
+// ~~~~~~~~~~~~~~~~~~~~~
+//
+// Original Work Copyright (c) 2003-2012 Christopher M. Kohlhoff (chris at kohlhoff dot com)
+// Modified Work Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_HANDLER_ALLOCATOR_HPP
+#define CODECHALLENGE_HANDLER_ALLOCATOR_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <boost/noncopyable.hpp>
+
+namespace codechallenge
+{
+
+/// Memory for the handlers of one chain of asynchronous operations, so that
+/// steady state operation never reaches the global allocator. Modelled on the
+/// asio allocation example.
+/**
+ * Holds a few fixed size slots. A chain of operations only ever has one or
+ * two handlers outstanding, so it cycles through the same slots forever;
+ * anything that does not fit falls back to the heap. Slots may be taken on
+ * one thread and released on another.
+ */
+class handler_memory
+    : private boost::noncopyable
+{
+public:
+    handler_memory() {
+        for (std::size_t i = 0; i < slot_count; ++i) {
+            in_use_[i].clear();
+        }
+    }
+
+    void* allocate(std::size_t size) {
+        if (size <= slot_size) {
+            for (std::size_t i = 0; i < slot_count; ++i) {
+                if (!in_use_[i].test_and_set(std::memory_order_acquire)) {
+                    return &storage_[i];
+                }
+            }
+        }
+        return ::operator new(size);
+    }
+
+    void deallocate(void* pointer) {
+        for (std::size_t i = 0; i < slot_count; ++i) {
+            if (pointer == &storage_[i]) {
+                in_use_[i].clear(std::memory_order_release);
+                return;
+            }
+        }
+        ::operator delete(pointer);
+    }
+
+private:
+    /// Number and size of the slots.
+    enum { slot_count = 4, slot_size = 512 };
+
+    /// Storage for the slots.
+    typename std::aligned_storage<slot_size>::type storage_[slot_count];
+
+    /// Whether each slot is handed out.
+    std::atomic_flag in_use_[slot_count];
+};
+
+/// Minimal standard allocator handing out a handler_memory's slots. Asio uses
+/// it for any handler whose associated allocator it is.
+template <typename T>
+class handler_allocator
+{
+public:
+    typedef T value_type;
+
+    explicit handler_allocator(handler_memory& memory)
+        : memory_(memory) {
+    }
+
+    template <typename U>
+    handler_allocator(const handler_allocator<U>& other)
+        : memory_(other.memory_) {
+    }
+
+    bool operator==(const handler_allocator& other) const {
+        return &memory_ == &other.memory_;
+    }
+
+    bool operator!=(const handler_allocator& other) const {
+        return &memory_ != &other.memory_;
+    }
+
+    T* allocate(std::size_t n) const {
+        return static_cast<T*>(memory_.allocate(sizeof(T) * n));
+    }
+
+    void deallocate(T* p, std::size_t) const {
+        return memory_.deallocate(p);
+    }
+
+private:
+    template <typename> friend class handler_allocator;
+
+    /// Where the memory comes from.
+    handler_memory& memory_;
+};
+
+/// Wraps a handler so that asio allocates its operations from a
+/// handler_memory.
+template <typename Handler>
+class custom_alloc_handler
+{
+public:
+    typedef handler_allocator<Handler> allocator_type;
+
+    custom_alloc_handler(handler_memory& memory, Handler handler)
+        : memory_(memory), handler_(handler) {
+    }
+
+    allocator_type get_allocator() const {
+        return allocator_type(memory_);
+    }
+
+    template <typename... Args>
+    void operator()(Args&&... args) {
+        handler_(std::forward<Args>(args)...);
+    }
+
+private:
+    /// Where the handler's operations are allocated.
+    handler_memory& memory_;
+
+    /// The wrapped handler.
+    Handler handler_;
+};
+
+/// Helper function to wrap a handler object to add custom allocation.
+template <typename Handler>
+inline custom_alloc_handler<Handler> make_custom_alloc_handler(handler_memory& memory, Handler handler)
+{
+    return custom_alloc_handler<Handler>(memory, handler);
+}
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_HANDLER_ALLOCATOR_HPP
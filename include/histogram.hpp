@@ -0,0 +1,186 @@
+//
+// histogram.hpp
+// ~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_HISTOGRAM_HPP
+#define CODECHALLENGE_HISTOGRAM_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+namespace codechallenge
+{
+
+/// Log-linear bucketing of 64-bit values, in the style of HdrHistogram: each
+/// power of two is split into sub_buckets linear buckets, so any recorded value
+/// is reported to within 1/sub_buckets (about 3%) of its true value.
+namespace histogram_buckets
+{
+
+/// log2 of the number of linear buckets per power of two.
+const int sub_bucket_bits = 5;
+
+/// Linear buckets per power of two.
+const uint64_t sub_buckets = 1 << sub_bucket_bits;
+
+/// Buckets needed to cover every uint64_t value.
+const std::size_t count = (64 - sub_bucket_bits + 1) * sub_buckets;
+
+/// Bucket holding value.
+inline std::size_t index(uint64_t value) {
+    if (value < sub_buckets) {
+        return value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    int shift = exponent - sub_bucket_bits;
+    return (shift + 1) * sub_buckets + ((value >> shift) & (sub_buckets - 1));
+}
+
+/// Smallest value held by bucket i.
+inline uint64_t lower_bound(std::size_t i) {
+    if (i < sub_buckets) {
+        return i;
+    }
+    int shift = int(i / sub_buckets) - 1;
+    return (sub_buckets + i % sub_buckets) << shift;
+}
+
+/// Largest value held by bucket i.
+inline uint64_t upper_bound(std::size_t i) {
+    if (i < sub_buckets) {
+        return i;
+    }
+    int shift = int(i / sub_buckets) - 1;
+    return lower_bound(i) + ((uint64_t(1) << shift) - 1);
+}
+
+} // namespace histogram_buckets
+
+/// A histogram written by one thread and read, approximately, by any other.
+/**
+ * Recording is a relaxed load and store of one bucket, with no locked
+ * instructions, so each writing thread should own its own recorder; readers
+ * merge the recorders into a histogram_snapshot.
+ */
+class histogram_recorder
+    : private boost::noncopyable
+{
+public:
+    histogram_recorder()
+        : buckets_(histogram_buckets::count), count_(0), sum_(0), max_(0) {
+        for (std::size_t i = 0; i < buckets_.size(); ++i) {
+            buckets_[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    /// Record one value. Only the owning thread may call this.
+    void record(uint64_t value) {
+        std::atomic<uint64_t>& bucket = buckets_[histogram_buckets::index(value)];
+        bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        count_.store(count_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        sum_.store(sum_.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+        if (value > max_.load(std::memory_order_relaxed)) {
+            max_.store(value, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    friend class histogram_snapshot;
+
+    /// Count of values per bucket.
+    std::vector<std::atomic<uint64_t> > buckets_;
+
+    /// Number, total and largest of the recorded values.
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> max_;
+};
+
+/// Merged, point in time copy of one or more recorders, for reporting.
+class histogram_snapshot
+{
+public:
+    histogram_snapshot()
+        : buckets_(histogram_buckets::count), count_(0), sum_(0), max_(0) {
+    }
+
+    /// Add a recorder's current contents.
+    void merge(const histogram_recorder& r) {
+        for (std::size_t i = 0; i < buckets_.size(); ++i) {
+            buckets_[i] += r.buckets_[i].load(std::memory_order_relaxed);
+        }
+        count_ += r.count_.load(std::memory_order_relaxed);
+        sum_ += r.sum_.load(std::memory_order_relaxed);
+        uint64_t max = r.max_.load(std::memory_order_relaxed);
+        if (max > max_) {
+            max_ = max;
+        }
+    }
+
+    /// Number of recorded values.
+    uint64_t count() const {
+        return count_;
+    }
+
+    /// Mean of the recorded values.
+    double mean() const {
+        return count_ ? double(sum_) / count_ : 0;
+    }
+
+    /// Largest recorded value.
+    uint64_t max() const {
+        return max_;
+    }
+
+    /// Smallest recorded value, to bucket precision.
+    uint64_t min() const {
+        for (std::size_t i = 0; i < buckets_.size(); ++i) {
+            if (buckets_[i]) {
+                return histogram_buckets::lower_bound(i);
+            }
+        }
+        return 0;
+    }
+
+    /// Value at or below which the given fraction (0 to 1) of the recorded
+    /// values lie, to bucket precision.
+    uint64_t percentile(double fraction) const {
+        if (count_ == 0) {
+            return 0;
+        }
+        uint64_t rank = uint64_t(fraction * count_ + 0.5);
+        if (rank < 1) {
+            rank = 1;
+        }
+        uint64_t seen = 0;
+        for (std::size_t i = 0; i < buckets_.size(); ++i) {
+            seen += buckets_[i];
+            if (seen >= rank) {
+                uint64_t value = histogram_buckets::upper_bound(i);
+                return value < max_ ? value : max_;
+            }
+        }
+        return max_;
+    }
+
+private:
+    /// Count of values per bucket.
+    std::vector<uint64_t> buckets_;
+
+    /// Number, total and largest of the recorded values.
+    uint64_t count_;
+    uint64_t sum_;
+    uint64_t max_;
+};
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_HISTOGRAM_HPP
@@ -0,0 +1,227 @@
+//
+// ingest_broker.hpp
+// ~~~~~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_INGEST_BROKER_HPP
+#define CODECHALLENGE_INGEST_BROKER_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <set>
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include "eye_message.hpp"
+#include "metrics.hpp"
+#include "mpsc_queue.hpp"
+#include "producer_handshake.hpp"
+
+namespace codechallenge
+{
+
+/// Settings for taking samples from producers.
+struct ingest_options {
+    ingest_options()
+        : enabled(false), path("/tmp/code_challenge/producers"), tcp_port(0), queue_capacity(1 << 16),
+          max_batch(8192) {
+    }
+
+    /// Whether producers are accepted, and their samples published instead
+    /// of generated ones.
+    bool enabled;
+
+    /// Unix socket producers connect to.
+    std::string path;
+
+    /// TCP port producers may also connect to, 0 for none.
+    unsigned short tcp_port;
+
+    /// Source ids accepted; empty to accept any.
+    std::vector<uint32_t> sources;
+
+    /// Secret every producer must present, empty for none.
+    std::string token;
+
+    /// Samples the merge queue holds between ticks.
+    std::size_t queue_capacity;
+
+    /// Most samples published per tick. The rest wait in the queue, so a
+    /// backlog cannot make a frame larger than clients accept.
+    std::size_t max_batch;
+};
+
+/// Metrics of the broker and its producer sessions.
+struct ingest_metrics {
+    ingest_metrics() {
+        metrics& m = metrics::instance();
+        producers_accepted = m.add_counter("producers_accepted");
+        producers_rejected = m.add_counter("producers_rejected");
+        samples_ingested = m.add_counter("samples_ingested");
+        samples_dropped = m.add_counter("samples_ingest_dropped");
+        samples_discarded = m.add_counter("samples_ingest_discarded");
+        source_gaps = m.add_counter("source_gaps");
+        queue_depth = m.add_histogram("ingest_queue_depth");
+    }
+
+    /// Handshakes accepted and rejected.
+    counter_id producers_accepted;
+    counter_id producers_rejected;
+
+    /// Samples queued for publishing, dropped because the queue was full,
+    /// and let go unpublished because nobody was subscribed.
+    counter_id samples_ingested;
+    counter_id samples_dropped;
+    counter_id samples_discarded;
+
+    /// Samples missing from producers' own sequences.
+    counter_id source_gaps;
+
+    /// Samples waiting when the publisher takes them.
+    histogram_id queue_depth;
+};
+
+/// Decides which producers may publish, and merges their samples into one
+/// stream for the publisher.
+/**
+ * Producer sessions push samples, already stamped with their source, from
+ * whichever io threads they run on into one lock-free multi-producer queue.
+ * The publisher takes everything queued on each tick, on its own thread, so
+ * merging costs producers a slot claim per sample and never a lock. When the
+ * queue is full, producers drop the samples that do not fit rather than wait.
+ *
+ * A source id can only be held by one connected producer at a time.
+ */
+class ingest_broker
+    : private boost::noncopyable
+{
+public:
+    explicit ingest_broker(const ingest_options& options)
+        : options_(options), queue_(std::max<std::size_t>(options.queue_capacity, 1)) {
+    }
+
+    /// Settings.
+    const ingest_options& options() const {
+        return options_;
+    }
+
+    /// Metric ids.
+    const ingest_metrics& ids() const {
+        return ids_;
+    }
+
+    /// Check a producer's hello, and claim its source id if it passes. The
+    /// producer's operating system identity is for the caller to check.
+    producer_status admit(const producer_hello& hello) {
+        producer_status status = check(hello);
+        metrics::instance().add(status == producer_accepted ? ids_.producers_accepted : ids_.producers_rejected);
+        return status;
+    }
+
+    /// Count a producer rejected before its hello got as far as admit().
+    void reject() {
+        metrics::instance().add(ids_.producers_rejected);
+    }
+
+    /// Let go of a source id claimed by admit().
+    void release(uint32_t source_id) {
+        boost::mutex::scoped_lock lock(mutex_);
+        connected_.erase(source_id);
+    }
+
+    /// Producer: queue samples for publishing. Returns the number queued;
+    /// the rest did not fit and are dropped.
+    std::size_t push(const eye_message* samples, std::size_t n) {
+        std::size_t queued = 0;
+        while (queued < n && queue_.try_push(samples[queued])) {
+            ++queued;
+        }
+        metrics& m = metrics::instance();
+        m.add(ids_.samples_ingested, queued);
+        if (queued < n) {
+            m.add(ids_.samples_dropped, n - queued);
+        }
+        return queued;
+    }
+
+    /// Publisher: replace samples with the oldest samples queued, at most
+    /// max_batch of them. The vector keeps its capacity, so once it has grown
+    /// to the largest tick this does not allocate.
+    void fill(std::vector<eye_message>& samples) {
+        std::size_t depth = queue_.size();
+        metrics::instance().record(ids_.queue_depth, depth);
+        samples.resize(std::min(depth, std::max<std::size_t>(options_.max_batch, 1)));
+        if (!samples.empty()) {
+            samples.resize(queue_.pop_bulk(&samples[0], samples.size()));
+        }
+    }
+
+    /// Publisher: let go of every sample queued.
+    void discard() {
+        eye_message scratch[discard_chunk];
+        uint64_t discarded = 0;
+        std::size_t n = 0;
+        do {
+            n = queue_.pop_bulk(scratch, discard_chunk);
+            discarded += n;
+        } while (n == discard_chunk);
+        if (discarded > 0) {
+            metrics::instance().add(ids_.samples_discarded, discarded);
+        }
+    }
+
+private:
+    /// Whether a hello may publish; claims its source id if so.
+    producer_status check(const producer_hello& hello) {
+        if (!options_.sources.empty()
+                && std::find(options_.sources.begin(), options_.sources.end(), hello.source_id)
+                   == options_.sources.end()) {
+            return producer_unknown_source;
+        }
+        if (!options_.token.empty() && !same_token(hello.token, options_.token)) {
+            return producer_bad_token;
+        }
+        boost::mutex::scoped_lock lock(mutex_);
+        if (!connected_.insert(hello.source_id).second) {
+            return producer_duplicate_source;
+        }
+        return producer_accepted;
+    }
+
+    /// Whether a presented token matches the expected one, taking the same
+    /// time wherever they differ, so that timing does not give the token
+    /// away a byte at a time.
+    static bool same_token(const std::string& given, const std::string& expected) {
+        unsigned char difference = given.size() != expected.size();
+        for (std::size_t i = 0; i < expected.size(); ++i) {
+            difference |= expected[i] ^ (i < given.size() ? given[i] : 0);
+        }
+        return difference == 0;
+    }
+
+    /// Samples discarded at a time.
+    enum { discard_chunk = 64 };
+
+    /// Settings.
+    ingest_options options_;
+
+    /// Metric ids.
+    ingest_metrics ids_;
+
+    /// Source ids of connected producers.
+    boost::mutex mutex_;
+    std::set<uint32_t> connected_;
+
+    /// Samples on their way from producers to the publisher.
+    mpsc_queue<eye_message> queue_;
+};
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_INGEST_BROKER_HPP
@@ -0,0 +1,114 @@
+//
+// io_service_pool.hpp
+// ~~~~~~~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_IO_SERVICE_POOL_HPP
+#define CODECHALLENGE_IO_SERVICE_POOL_HPP
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <vector>
+
+namespace codechallenge
+{
+
+/// Bind a thread to a single core. Failure only costs locality, so it is
+/// ignored.
+inline void pin_thread(boost::thread& thread, unsigned int core)
+{
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core, &cpus);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus);
+}
+
+/// A fixed pool of worker threads all running one shared io_service.
+/**
+ * Handlers may run on any worker, so anything with per-object ordering
+ * requirements (e.g. a connection) should dispatch through its own strand.
+ */
+class io_service_pool
+    : private boost::noncopyable
+{
+public:
+    /// Construct the pool. A thread_count of 0 uses one thread per core. When
+    /// pin_threads is set, worker i is bound to core i modulo the core count.
+    explicit io_service_pool(std::size_t thread_count = 0, bool pin_threads = false)
+        : thread_count_(thread_count), pin_threads_(pin_threads) {
+        if (thread_count_ == 0) {
+            thread_count_ = std::max(1u, boost::thread::hardware_concurrency());
+        }
+    }
+
+    /// Stops and joins the workers if still running.
+    ~io_service_pool() {
+        stop();
+    }
+
+    /// The io_service shared by every worker.
+    boost::asio::io_service& get_io_service() {
+        return io_service_;
+    }
+
+    /// Number of worker threads.
+    std::size_t size() const {
+        return thread_count_;
+    }
+
+    /// Start the worker threads. Returns immediately.
+    void run() {
+        work_.reset(new boost::asio::io_service::work(io_service_));
+        unsigned int cores = std::max(1u, boost::thread::hardware_concurrency());
+        for (std::size_t i = 0; i < thread_count_; ++i) {
+            boost::shared_ptr<boost::thread> thread(new boost::thread(
+                    boost::bind(&boost::asio::io_service::run, &io_service_)));
+            if (pin_threads_) {
+                pin_thread(*thread, i % cores);
+            }
+            threads_.push_back(thread);
+        }
+    }
+
+    /// Stop the io_service and wait for every worker to exit.
+    void stop() {
+        work_.reset();
+        io_service_.stop();
+        for (std::size_t i = 0; i < threads_.size(); ++i) {
+            threads_[i]->join();
+        }
+        threads_.clear();
+    }
+
+private:
+    /// The io_service shared by every worker.
+    boost::asio::io_service io_service_;
+
+    /// Keeps the workers running while there is nothing to do.
+    boost::scoped_ptr<boost::asio::io_service::work> work_;
+
+    /// The worker threads.
+    std::vector<boost::shared_ptr<boost::thread> > threads_;
+
+    /// Number of worker threads.
+    std::size_t thread_count_;
+
+    /// Whether workers are pinned to cores.
+    bool pin_threads_;
+};
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_IO_SERVICE_POOL_HPP
@@ -0,0 +1,267 @@
+//
+// message_schema.hpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_MESSAGE_SCHEMA_HPP
+#define CODECHALLENGE_MESSAGE_SCHEMA_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace codechallenge
+{
+
+/// Compile-time description of message types.
+/**
+ * A message type's schema is a specialization of message_schema listing its
+ * fields, in order, as a field_list of field types. Each field type derives
+ * from message_field, naming the member it describes, and adds:
+ *
+ * @li name(): the field's name, as used for recording columns and queries.
+ * @li heading(): its CSV column heading, or 0 if it is not saved as CSV.
+ * @li label(): its label on the console, or 0 if it is not printed.
+ *
+ * The codecs, CSV writer and reader, recording columns and soa_batch are
+ * all generated from the schema by visiting its fields with for_each_field,
+ * which expands to straight-line code for each field; nothing is looked up
+ * at run time.
+ *
+ * Schemas evolve compatibly by appending fields only. A field is part of
+ * every schema version from its since version on; data written with an
+ * older version lacks the newer fields, which are read as zero.
+ */
+template <typename Message>
+struct message_schema;
+
+/// How a field of type T is stored in records and columns: bools as one
+/// byte, everything else as itself.
+template <typename T>
+struct field_storage {
+    typedef T type;
+};
+
+template <>
+struct field_storage<bool> {
+    typedef uint8_t type;
+};
+
+/// Base of a field description: member of Message, of type T, added in
+/// schema version Since.
+template <typename Message, typename T, T Message::*Member, uint32_t Since = 1>
+struct message_field {
+    typedef Message message_type;
+    typedef T value_type;
+    typedef typename field_storage<T>::type storage_type;
+
+    enum { since = Since };
+
+    static const T& get(const Message& m) {
+        return m.*Member;
+    }
+
+    static T& get(Message& m) {
+        return m.*Member;
+    }
+
+    /// Whether a value read from outside is acceptable for the field.
+    static bool valid(const T&) {
+        return true;
+    }
+};
+
+/// The fields of a schema, in order.
+template <typename... Fields>
+struct field_list {
+    enum { size = sizeof...(Fields) };
+};
+
+/// Call visit(Field()) for every field of the list, in order.
+template <typename... Fields, typename Visitor>
+inline void for_each_field(field_list<Fields...>, Visitor& visit)
+{
+    int expand[] = { 0, (visit(Fields()), 0)... };
+    (void)expand;
+}
+
+/// Size of one record holding the fields of schema version version, each
+/// stored packed.
+template <typename... Fields>
+constexpr std::size_t record_size(field_list<Fields...>, uint32_t version)
+{
+    const std::size_t sizes[] = {
+        0, (Fields::since <= version ? sizeof(typename Fields::storage_type) : 0)...
+    };
+    std::size_t total = 0;
+    for (std::size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        total += sizes[i];
+    }
+    return total;
+}
+
+/// Number of fields in schema version version.
+template <typename... Fields>
+constexpr std::size_t field_count(field_list<Fields...>, uint32_t version)
+{
+    const bool present[] = { false, (Fields::since <= version)... };
+    std::size_t total = 0;
+    for (std::size_t i = 1; i < sizeof(present) / sizeof(present[0]); ++i) {
+        total += present[i] ? 1 : 0;
+    }
+    return total;
+}
+
+/// Hands each field of a message present in a schema version to a boost
+/// serialization archive, zeroing the rest.
+template <typename Archive, typename Message>
+struct field_serializer {
+    Archive& ar;
+    Message& m;
+    uint32_t version;
+
+    template <typename Field>
+    void operator()(Field) {
+        if (Field::since <= version) {
+            ar & Field::get(m);
+        } else {
+            Field::get(m) = typename Field::value_type();
+        }
+    }
+};
+
+/// Hand every field of m, in order, to a boost serialization archive. version
+/// is the archive's class version, which is the schema version it was written
+/// with, or 0 for archives written before versions were recorded.
+template <typename Archive, typename Message>
+void serialize_fields(Archive& ar, Message& m, unsigned int version = message_schema<Message>::version)
+{
+    field_serializer<Archive, Message> visit = { ar, m, version > 1 ? uint32_t(version) : 1 };
+    for_each_field(typename message_schema<Message>::fields(), visit);
+}
+
+/// One vector per field of a field_list.
+template <typename Fields>
+struct field_columns;
+
+template <typename... Fields>
+struct field_columns<field_list<Fields...> > {
+    typedef std::tuple<std::vector<typename Fields::storage_type>...> type;
+};
+
+/// A batch of messages stored field by field (structure of arrays), one
+/// contiguous column per field, so that passes over a few fields only touch
+/// those fields' memory.
+template <typename Message>
+class soa_batch {
+public:
+    typedef typename message_schema<Message>::fields fields;
+
+    /// Number of messages.
+    std::size_t size() const {
+        return std::get<0>(columns_).size();
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    /// Remove every message, keeping the columns' capacity.
+    void clear() {
+        resize_columns(0, std::make_index_sequence<fields::size>());
+    }
+
+    /// Make room for n messages in every column.
+    void reserve(std::size_t n) {
+        reserve_columns(n, std::make_index_sequence<fields::size>());
+    }
+
+    /// Append a message, splitting it into its fields.
+    void push_back(const Message& m) {
+        push_columns(m, fields(), std::make_index_sequence<fields::size>());
+    }
+
+    /// Append messages.
+    void append(const Message* messages, std::size_t n) {
+        for (std::size_t i = 0; i < n; ++i) {
+            push_back(messages[i]);
+        }
+    }
+
+    /// Reassemble message i.
+    Message get(std::size_t i) const {
+        Message m;
+        get_columns(m, i, fields(), std::make_index_sequence<fields::size>());
+        return m;
+    }
+
+    /// The column of a field.
+    template <typename Field>
+    const std::vector<typename Field::storage_type>& column() const {
+        return std::get<index_of<Field>(fields())>(columns_);
+    }
+
+    template <typename Field>
+    std::vector<typename Field::storage_type>& column() {
+        return std::get<index_of<Field>(fields())>(columns_);
+    }
+
+private:
+    /// Position of Field in the schema.
+    template <typename Field, typename... Fields>
+    static constexpr std::size_t index_of(field_list<Fields...>) {
+        const bool same[] = { std::is_same<Field, Fields>::value... };
+        for (std::size_t i = 0; i < sizeof...(Fields); ++i) {
+            if (same[i]) {
+                return i;
+            }
+        }
+        return sizeof...(Fields);
+    }
+
+    template <std::size_t... I>
+    void resize_columns(std::size_t n, std::index_sequence<I...>) {
+        int expand[] = { 0, (std::get<I>(columns_).resize(n), 0)... };
+        (void)expand;
+    }
+
+    template <std::size_t... I>
+    void reserve_columns(std::size_t n, std::index_sequence<I...>) {
+        int expand[] = { 0, (std::get<I>(columns_).reserve(n), 0)... };
+        (void)expand;
+    }
+
+    template <typename... Fields, std::size_t... I>
+    void push_columns(const Message& m, field_list<Fields...>, std::index_sequence<I...>) {
+        int expand[] = {
+            0, (std::get<I>(columns_).push_back(
+                    static_cast<typename Fields::storage_type>(Fields::get(m))), 0)...
+        };
+        (void)expand;
+    }
+
+    template <typename... Fields, std::size_t... I>
+    void get_columns(Message& m, std::size_t i, field_list<Fields...>,
+                     std::index_sequence<I...>) const {
+        int expand[] = {
+            0, (Fields::get(m) = static_cast<typename Fields::value_type>(std::get<I>(columns_)[i]),
+                0)...
+        };
+        (void)expand;
+    }
+
+    /// One vector per field.
+    typename field_columns<fields>::type columns_;
+};
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_MESSAGE_SCHEMA_HPP
@@ -0,0 +1,280 @@
+//
+// metrics.hpp
+// ~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_METRICS_HPP
+#define CODECHALLENGE_METRICS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include "csv_format.hpp"
+#include "eye_message.hpp"
+#include "histogram.hpp"
+
+namespace codechallenge
+{
+
+/// Wall clock time in nanoseconds since the epoch, comparable with sample
+/// timestamps.
+inline uint64_t wall_clock_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+/// Monotonic time in nanoseconds, for measuring durations.
+inline uint64_t steady_clock_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// Timestamp of a sample in nanoseconds since the epoch.
+inline uint64_t sample_time_ns(const eye_message& m)
+{
+    return m.time_seconds * 1000000000ULL + m.time_nanos;
+}
+
+/// Append-only JSON text helpers, in the style of csv_format.hpp.
+namespace json
+{
+
+/// Append "name": as an object key, preceded by a comma unless first.
+inline void append_key(std::string& out, const char* name, bool first = false) {
+    if (!first) {
+        out.push_back(',');
+    }
+    out.push_back('"');
+    out += name;
+    out += "\":";
+}
+
+/// Append "name":value.
+inline void append_field(std::string& out, const char* name, uint64_t value, bool first = false) {
+    append_key(out, name, first);
+    csv::append_uint(out, value);
+}
+
+/// Append "name":value for a fractional value.
+inline void append_field(std::string& out, const char* name, double value, bool first = false) {
+    append_key(out, name, first);
+    char text[32];
+    int n = snprintf(text, sizeof(text), "%.1f", value);
+    out.append(text, n);
+}
+
+} // namespace json
+
+/// Something that reports its own state (a connection, a queue) in every
+/// metrics snapshot.
+class metrics_source
+{
+public:
+    virtual ~metrics_source() {}
+
+    /// Append the source's state as a JSON object.
+    virtual void write_metrics(std::string& out) = 0;
+};
+
+/// Identifies a registered counter.
+typedef std::size_t counter_id;
+
+/// Identifies a registered histogram.
+typedef std::size_t histogram_id;
+
+/// Process wide registry of counters, latency histograms and sources.
+/**
+ * Counters and histograms are registered by name once, at startup, and then
+ * updated by id from any thread. Every thread updates its own shard, so the
+ * hot path never contends or uses locked instructions; snapshot() merges the
+ * shards and renders everything as one JSON object.
+ */
+class metrics
+    : private boost::noncopyable
+{
+public:
+    /// The registry.
+    static metrics& instance() {
+        static metrics m;
+        return m;
+    }
+
+    /// Name this process in snapshots.
+    void set_process_name(const std::string& name) {
+        boost::mutex::scoped_lock lock(mutex_);
+        process_name_ = name;
+    }
+
+    /// Register a counter. Must happen before any thread updates metrics.
+    counter_id add_counter(const char* name) {
+        boost::mutex::scoped_lock lock(mutex_);
+        counter_names_.push_back(name);
+        return counter_names_.size() - 1;
+    }
+
+    /// Register a histogram of nanosecond values. Must happen before any
+    /// thread updates metrics.
+    histogram_id add_histogram(const char* name) {
+        boost::mutex::scoped_lock lock(mutex_);
+        histogram_names_.push_back(name);
+        return histogram_names_.size() - 1;
+    }
+
+    /// Add n to a counter.
+    void add(counter_id id, uint64_t n = 1) {
+        std::atomic<uint64_t>& c = local_shard().counters[id];
+        c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    /// Record a value in a histogram.
+    void record(histogram_id id, uint64_t value) {
+        local_shard().histograms[id].record(value);
+    }
+
+    /// Include a source in snapshots until it is removed.
+    void add_source(metrics_source* source) {
+        boost::mutex::scoped_lock lock(mutex_);
+        sources_.push_back(source);
+    }
+
+    /// Stop including a source. Once this returns, the source is no longer
+    /// being reported and may be destroyed.
+    void remove_source(metrics_source* source) {
+        boost::mutex::scoped_lock lock(mutex_);
+        sources_.erase(std::remove(sources_.begin(), sources_.end(), source), sources_.end());
+    }
+
+    /// Current total of a counter over every thread.
+    uint64_t total(counter_id id) {
+        boost::mutex::scoped_lock lock(mutex_);
+        return total_locked(id);
+    }
+
+    /// Current contents of a histogram over every thread.
+    histogram_snapshot merged(histogram_id id) {
+        boost::mutex::scoped_lock lock(mutex_);
+        return merged_locked(id);
+    }
+
+    /// Render every counter, histogram and source as one line of JSON.
+    std::string snapshot() {
+        boost::mutex::scoped_lock lock(mutex_);
+        std::string out;
+        out += "{\"process\":\"";
+        out += process_name_;
+        out += "\"";
+        json::append_field(out, "time_ns", wall_clock_ns());
+
+        out += ",\"counters\":{";
+        for (std::size_t i = 0; i < counter_names_.size(); ++i) {
+            json::append_field(out, counter_names_[i], total_locked(i), i == 0);
+        }
+
+        out += "},\"histograms\":{";
+        for (std::size_t i = 0; i < histogram_names_.size(); ++i) {
+            histogram_snapshot h = merged_locked(i);
+            json::append_key(out, histogram_names_[i], i == 0);
+            out.push_back('{');
+            json::append_field(out, "count", h.count(), true);
+            json::append_field(out, "min", h.min());
+            json::append_field(out, "mean", h.mean());
+            json::append_field(out, "p50", h.percentile(0.5));
+            json::append_field(out, "p90", h.percentile(0.9));
+            json::append_field(out, "p99", h.percentile(0.99));
+            json::append_field(out, "p999", h.percentile(0.999));
+            json::append_field(out, "max", h.max());
+            out.push_back('}');
+        }
+
+        out += "},\"sources\":[";
+        for (std::size_t i = 0; i < sources_.size(); ++i) {
+            if (i) {
+                out.push_back(',');
+            }
+            sources_[i]->write_metrics(out);
+        }
+        out += "]}\n";
+        return out;
+    }
+
+private:
+    /// One thread's counters and histograms.
+    struct shard {
+        shard(std::size_t counter_count, std::size_t histogram_count)
+            : counters(counter_count), histograms(histogram_count) {
+            for (std::size_t i = 0; i < counters.size(); ++i) {
+                counters[i].store(0, std::memory_order_relaxed);
+            }
+        }
+
+        std::vector<std::atomic<uint64_t> > counters;
+        std::vector<histogram_recorder> histograms;
+    };
+
+    metrics()
+        : process_name_("unknown") {
+    }
+
+    /// Sum a counter's shards. Called with mutex_ held.
+    uint64_t total_locked(counter_id id) const {
+        uint64_t total = 0;
+        for (std::size_t s = 0; s < shards_.size(); ++s) {
+            total += shards_[s]->counters[id].load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    /// Merge a histogram's shards. Called with mutex_ held.
+    histogram_snapshot merged_locked(histogram_id id) const {
+        histogram_snapshot h;
+        for (std::size_t s = 0; s < shards_.size(); ++s) {
+            h.merge(shards_[s]->histograms[id]);
+        }
+        return h;
+    }
+
+    /// The calling thread's shard, created on first use. Shards outlive their
+    /// threads so that their counts stay in the totals.
+    shard& local_shard() {
+        static thread_local shard* local = 0;
+        if (!local) {
+            boost::mutex::scoped_lock lock(mutex_);
+            local = new shard(counter_names_.size(), histogram_names_.size());
+            shards_.push_back(local);
+        }
+        return *local;
+    }
+
+    /// Protects everything but the contents of the shards.
+    boost::mutex mutex_;
+
+    /// Reported as "process".
+    std::string process_name_;
+
+    /// Names of the registered counters and histograms, indexed by id.
+    std::vector<const char*> counter_names_;
+    std::vector<const char*> histogram_names_;
+
+    /// Every thread's shard.
+    std::vector<shard*> shards_;
+
+    /// Sources included in snapshots.
+    std::vector<metrics_source*> sources_;
+};
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_METRICS_HPP
@@ -0,0 +1,130 @@
+//
+// mpsc_queue.hpp
+// ~~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_MPSC_QUEUE_HPP
+#define CODECHALLENGE_MPSC_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+namespace codechallenge
+{
+
+/// Bounded, lock-free queue for any number of producer threads and exactly
+/// one consumer thread.
+/**
+ * Capacity is rounded up to a power of two. Every slot carries a sequence
+ * number saying whose turn it is: producers claim the next slot by advancing
+ * the shared tail with a compare-and-swap, fill it, then publish it by
+ * bumping its sequence; the consumer takes slots in order as their sequence
+ * shows them published, and hands them back to the producers a lap later. A
+ * producer stalled between claiming and publishing holds up the consumer at
+ * that slot only, never the other producers.
+ */
+template <typename T>
+class mpsc_queue
+    : private boost::noncopyable
+{
+public:
+    explicit mpsc_queue(std::size_t capacity)
+        : head_(0), tail_(0) {
+        std::size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        std::vector<slot> slots(size);
+        slots_.swap(slots);
+        for (std::size_t i = 0; i < size; ++i) {
+            slots_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        mask_ = size - 1;
+    }
+
+    /// Number of elements the queue can hold.
+    std::size_t capacity() const {
+        return slots_.size();
+    }
+
+    /// Approximate number of queued elements, counting those still being
+    /// pushed.
+    std::size_t size() const {
+        return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+    }
+
+    /// Producer: append one element. Returns false if the queue is full.
+    bool try_push(const T& value) {
+        std::size_t tail = tail_.load(std::memory_order_relaxed);
+        for (;;) {
+            slot& s = slots_[tail & mask_];
+            std::size_t sequence = s.sequence.load(std::memory_order_acquire);
+            if (sequence == tail) {
+                if (tail_.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed)) {
+                    s.value = value;
+                    s.sequence.store(tail + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (sequence < tail) {
+                // Not yet taken by the consumer since the last lap.
+                return false;
+            } else {
+                tail = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /// Consumer: remove up to max elements into out, stopping early at one
+    /// not yet fully pushed. Returns the number taken.
+    std::size_t pop_bulk(T* out, std::size_t max) {
+        std::size_t head = head_.load(std::memory_order_relaxed);
+        std::size_t count = 0;
+        while (count < max) {
+            slot& s = slots_[head & mask_];
+            if (s.sequence.load(std::memory_order_acquire) != head + 1) {
+                break;
+            }
+            out[count++] = s.value;
+            s.sequence.store(head + slots_.size(), std::memory_order_release);
+            ++head;
+        }
+        head_.store(head, std::memory_order_release);
+        return count;
+    }
+
+    /// Consumer: remove one element. Returns false if the queue is empty.
+    bool try_pop(T& out) {
+        return pop_bulk(&out, 1) == 1;
+    }
+
+private:
+    /// An element and its turn: its index while free for the lap's producer,
+    /// one more once pushed, a lap on once taken.
+    struct slot {
+        std::atomic<std::size_t> sequence;
+        T value;
+    };
+
+    /// Element storage.
+    std::vector<slot> slots_;
+
+    /// capacity() - 1.
+    std::size_t mask_;
+
+    /// Consumer's index.
+    alignas(64) std::atomic<std::size_t> head_;
+
+    /// Next index to be claimed by a producer.
+    alignas(64) std::atomic<std::size_t> tail_;
+};
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_MPSC_QUEUE_HPP
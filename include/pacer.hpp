@@ -0,0 +1,362 @@
+//
+// pacer.hpp
+// ~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_PACER_HPP
+#define CODECHALLENGE_PACER_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "metrics.hpp"
+
+namespace codechallenge
+{
+
+/// How the pacer waits for the next tick.
+enum pacing_mode {
+    /// Block on a timerfd armed with the absolute deadline.
+    pacing_timerfd,
+
+    /// Sleep until shortly before the deadline, then spin until it passes.
+    /// Tightest jitter, at the cost of a busy core during the spin window.
+    pacing_hybrid,
+
+    /// Don't wait at all: callbacks run back to back, one tick each, as fast
+    /// as the callee allows, except while the callee has said it is idle.
+    /// The rate is ignored.
+    pacing_unpaced
+};
+
+/// What the pacer does with ticks it woke up too late for.
+enum catch_up_policy {
+    /// Run every missed tick, back to back.
+    catch_up_burst,
+
+    /// Forget missed ticks; only count them.
+    catch_up_skip,
+
+    /// Fold missed ticks into the next callback, which covers up to
+    /// max_batch of them; any more are covered by the callbacks after it.
+    catch_up_coalesce
+};
+
+/// Settings for a pacer.
+struct pacer_options {
+    pacer_options()
+        : rate(100), mode(pacing_timerfd), catch_up(catch_up_coalesce), spin_ns(50000),
+          adaptive(true), max_batch(64) {
+    }
+
+    /// Ticks per second.
+    double rate;
+
+    /// How to wait for each tick.
+    pacing_mode mode;
+
+    /// What to do about late wake ups.
+    catch_up_policy catch_up;
+
+    /// Spin window before each deadline, for pacing_hybrid.
+    uint64_t spin_ns;
+
+    /// Let the pacer cover several ticks per callback when callbacks take too
+    /// large a share of the tick period.
+    bool adaptive;
+
+    /// Most ticks a single callback covers through adaptive batching.
+    unsigned int max_batch;
+};
+
+/// Drives a callback at a precise, configurable rate from a dedicated thread.
+/**
+ * Deadlines are start + n * period, computed in absolute monotonic time, so
+ * error never accumulates from tick to tick. Each callback is told how many
+ * ticks it covers, more than one when ticks are coalesced or batched, so the
+ * callee can produce that many ticks' worth of output.
+ *
+ * Jitter (wake up time minus deadline) is recorded in the "tick_jitter_ns"
+ * histogram, and missed and coalesced ticks are counted.
+ */
+class pacer
+    : public metrics_source,
+      private boost::noncopyable
+{
+public:
+    /// Called with the number of ticks to cover.
+    typedef boost::function<void(unsigned int)> tick_handler;
+
+    explicit pacer(const pacer_options& options)
+        : options_(options), period_ns_(uint64_t(1e9 / options.rate)), stopping_(false),
+          timer_fd_(-1), idle_(false), batch_(1), cost_ns_(0) {
+        if (options.rate <= 0 || options.rate > 1e9 || period_ns_ == 0) {
+            throw std::invalid_argument("pacing rate must be positive and at most 1 GHz");
+        }
+        metrics& m = metrics::instance();
+        jitter_ns_ = m.add_histogram("tick_jitter_ns");
+        ticks_ = m.add_counter("ticks");
+        ticks_skipped_ = m.add_counter("ticks_skipped");
+        ticks_late_ = m.add_counter("ticks_late");
+        m.add_source(this);
+    }
+
+    ~pacer() {
+        stop();
+        metrics::instance().remove_source(this);
+    }
+
+    /// Start calling handler on the pacer's thread.
+    void start(tick_handler handler) {
+        if (options_.mode == pacing_timerfd) {
+            timer_fd_ = timerfd_create(CLOCK_MONOTONIC, 0);
+            if (timer_fd_ < 0) {
+                throw std::runtime_error("unable to create timerfd");
+            }
+        }
+        handler_ = handler;
+        stopping_ = false;
+        thread_.reset(new boost::thread(boost::bind(&pacer::run, this)));
+    }
+
+    /// Stop the pacer's thread. Returns once the last callback has finished.
+    void stop() {
+        if (!thread_) {
+            return;
+        }
+        stopping_ = true;
+        if (timer_fd_ >= 0) {
+            arm(steady_clock_ns());
+        }
+        {
+            boost::mutex::scoped_lock lock(idle_mutex_);
+            idle_ready_.notify_one();
+        }
+        thread_->join();
+        thread_.reset();
+        if (timer_fd_ >= 0) {
+            ::close(timer_fd_);
+            timer_fd_ = -1;
+        }
+    }
+
+    /// Stop calling the handler once the current callback returns. For use
+    /// from the handler itself; stop() must still be called to join the
+    /// thread.
+    void finish() {
+        stopping_ = true;
+    }
+
+    /// Don't call the handler again until wake(). For use from the handler
+    /// when there is nothing to do; only unpaced pacing waits, paced modes
+    /// sleep until their next tick anyway.
+    void idle() {
+        boost::mutex::scoped_lock lock(idle_mutex_);
+        idle_ = true;
+    }
+
+    /// Resume calling the handler after idle().
+    void wake() {
+        boost::mutex::scoped_lock lock(idle_mutex_);
+        idle_ = false;
+        idle_ready_.notify_one();
+    }
+
+    /// Ticks currently covered by each callback through adaptive batching.
+    unsigned int batch() const {
+        return batch_.load(std::memory_order_relaxed);
+    }
+
+    /// Report the pacer's settings and state.
+    void write_metrics(std::string& out) {
+        out += "{\"type\":\"pacer\"";
+        json::append_field(out, "rate", options_.rate);
+        json::append_field(out, "period_ns", period_ns_);
+        json::append_field(out, "batch", uint64_t(batch()));
+        json::append_field(out, "callback_ns", double(cost_ns_.load(std::memory_order_relaxed)));
+        out.push_back('}');
+    }
+
+private:
+    /// The pacer's thread: wait for each deadline, work out how many ticks are
+    /// owed, and call the handler.
+    void run() {
+        metrics& m = metrics::instance();
+        if (options_.mode == pacing_unpaced) {
+            while (!stopping_) {
+                m.add(ticks_);
+                handler_(1);
+                boost::mutex::scoped_lock lock(idle_mutex_);
+                while (idle_ && !stopping_) {
+                    idle_ready_.wait(lock);
+                }
+            }
+            return;
+        }
+        uint64_t deadline = steady_clock_ns() + period_ns_;
+        uint64_t owed = 0;
+        while (!stopping_) {
+            wait_until(deadline);
+            if (stopping_) {
+                break;
+            }
+            uint64_t now = steady_clock_ns();
+            m.record(jitter_ns_, now - deadline);
+
+            // Ticks whose deadlines have also passed while we were late.
+            uint64_t late = (now - deadline) / period_ns_;
+            deadline += (late + 1) * period_ns_;
+            m.add(ticks_, late + 1);
+            if (late > 0) {
+                m.add(options_.catch_up == catch_up_skip ? ticks_skipped_ : ticks_late_, late);
+            }
+            owed += options_.catch_up == catch_up_skip ? 1 : late + 1;
+
+            unsigned int batch = batch_.load(std::memory_order_relaxed);
+            if (owed < batch) {
+                continue;
+            }
+            if (options_.catch_up == catch_up_burst) {
+                while (owed >= batch && !stopping_) {
+                    call(batch);
+                    owed -= batch;
+                }
+            } else {
+                // Never more than max_batch ticks at once, however late, so
+                // a long stall is worked off over the following ticks rather
+                // than in one batch too large to send.
+                uint64_t ticks = std::min<uint64_t>(owed, options_.max_batch);
+                call(ticks);
+                owed -= ticks;
+            }
+        }
+    }
+
+    /// Call the handler, and adapt the batch size to how long it took.
+    void call(uint64_t ticks) {
+        uint64_t start = steady_clock_ns();
+        handler_(unsigned(ticks));
+        uint64_t cost = steady_clock_ns() - start;
+
+        // Exponentially weighted average cost of one callback.
+        uint64_t average = cost_ns_.load(std::memory_order_relaxed);
+        average = average ? (average * 7 + cost) / 8 : cost;
+        cost_ns_.store(average, std::memory_order_relaxed);
+        if (!options_.adaptive) {
+            return;
+        }
+
+        // Batch up when callbacks use over half the time they cover, and
+        // back off once half as many ticks per callback would use under a
+        // fifth of theirs.
+        unsigned int batch = batch_.load(std::memory_order_relaxed);
+        uint64_t budget = batch * period_ns_;
+        if (average > budget / 2 && batch < options_.max_batch) {
+            batch_.store(std::min(batch * 2, options_.max_batch), std::memory_order_relaxed);
+        } else if (batch > 1 && average < budget / 2 / 5) {
+            batch_.store(batch / 2, std::memory_order_relaxed);
+        }
+    }
+
+    /// Wait until the monotonic clock reaches deadline, or stop() is called.
+    void wait_until(uint64_t deadline) {
+        if (options_.mode == pacing_timerfd) {
+            arm(deadline);
+            if (stopping_) {
+                return;
+            }
+            uint64_t expirations;
+            ssize_t n = ::read(timer_fd_, &expirations, sizeof(expirations));
+            (void)n;
+            return;
+        }
+
+        // Sleep in bounded steps so that stop() is noticed, then spin.
+        for (;;) {
+            uint64_t now = steady_clock_ns();
+            if (now >= deadline || stopping_) {
+                return;
+            }
+            uint64_t left = deadline - now;
+            if (left <= options_.spin_ns) {
+                break;
+            }
+            uint64_t sleep = std::min<uint64_t>(left - options_.spin_ns, max_sleep_ns);
+            uint64_t until = now + sleep;
+            struct timespec ts;
+            ts.tv_sec = until / 1000000000;
+            ts.tv_nsec = until % 1000000000;
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0);
+        }
+        while (steady_clock_ns() < deadline && !stopping_) {
+        }
+    }
+
+    /// Arm the timerfd to expire at an absolute monotonic time.
+    void arm(uint64_t deadline) {
+        struct itimerspec spec;
+        spec.it_interval.tv_sec = 0;
+        spec.it_interval.tv_nsec = 0;
+        spec.it_value.tv_sec = deadline / 1000000000;
+        spec.it_value.tv_nsec = deadline % 1000000000;
+        timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, 0);
+    }
+
+    /// Longest single sleep in hybrid mode.
+    enum { max_sleep_ns = 100000000 };
+
+    /// Pacer settings.
+    pacer_options options_;
+
+    /// Time between ticks.
+    uint64_t period_ns_;
+
+    /// Called on every tick, or batch of ticks.
+    tick_handler handler_;
+
+    /// The pacer's thread.
+    boost::scoped_ptr<boost::thread> thread_;
+
+    /// Set to make the pacer's thread exit.
+    std::atomic_bool stopping_;
+
+    /// Timer used by pacing_timerfd.
+    int timer_fd_;
+
+    /// Set by idle() until wake(), for pacing_unpaced.
+    boost::mutex idle_mutex_;
+    boost::condition_variable idle_ready_;
+    bool idle_;
+
+    /// Ticks covered by each callback.
+    std::atomic<unsigned int> batch_;
+
+    /// Average callback duration.
+    std::atomic<uint64_t> cost_ns_;
+
+    /// Metric ids.
+    histogram_id jitter_ns_;
+    counter_id ticks_;
+    counter_id ticks_skipped_;
+    counter_id ticks_late_;
+};
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_PACER_HPP
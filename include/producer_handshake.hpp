@@ -0,0 +1,201 @@
+//
+// producer_handshake.hpp
+// ~~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_PRODUCER_HANDSHAKE_HPP
+#define CODECHALLENGE_PRODUCER_HANDSHAKE_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "codec.hpp"
+
+namespace codechallenge
+{
+
+/// A producer introducing itself to a broker. Sent as the first frame on a
+/// producer connection; the broker reads nothing else until it has accepted
+/// the producer, and the producer sends nothing else until it is told so.
+/**
+ * On the wire the payload is little-endian:
+ * @li 4 bytes: source id, never 0.
+ * @li 1 byte: length of the name, then the name, at most max_text bytes.
+ * @li 1 byte: length of the token, then the token, at most max_text bytes.
+ *
+ * The name is only for people reading logs. The token is a secret shared
+ * with the broker, for producers whose operating system identity the broker
+ * cannot check, over TCP for instance.
+ */
+struct producer_hello {
+    enum { max_text = 64 };
+
+    producer_hello()
+        : source_id(0) {
+    }
+
+    /// Size of the payload.
+    std::size_t payload_length() const {
+        return 4 + 1 + name.size() + 1 + token.size();
+    }
+
+    /// Write the payload into the first payload_length() bytes of out.
+    void encode(char* out) const {
+        wire::put(out, source_id);
+        out = put_text(out + 4, name);
+        put_text(out, token);
+    }
+
+    /// Read the payload. Returns false if it is malformed.
+    bool decode(const char* in, std::size_t size) {
+        const char* end = in + size;
+        if (size < 4) {
+            return false;
+        }
+        source_id = wire::get<uint32_t>(in);
+        in += 4;
+        return get_text(in, end, name) && get_text(in, end, token) && in == end && source_id != 0;
+    }
+
+    /// Who the producer says it is.
+    uint32_t source_id;
+    std::string name;
+
+    /// Shared secret, empty for none.
+    std::string token;
+
+private:
+    static char* put_text(char* out, const std::string& text) {
+        *out++ = static_cast<char>(text.size());
+        std::memcpy(out, text.data(), text.size());
+        return out + text.size();
+    }
+
+    static bool get_text(const char*& in, const char* end, std::string& text) {
+        if (in == end) {
+            return false;
+        }
+        std::size_t length = static_cast<uint8_t>(*in++);
+        if (length > max_text || std::size_t(end - in) < length) {
+            return false;
+        }
+        text.assign(in, length);
+        in += length;
+        return true;
+    }
+};
+
+/// How a broker answered a producer's hello.
+enum producer_status : uint8_t {
+    /// The producer may send batches.
+    producer_accepted = 0,
+
+    /// The hello could not be read.
+    producer_malformed = 1,
+
+    /// The source id is not one the broker takes.
+    producer_unknown_source = 2,
+
+    /// The token does not match the broker's.
+    producer_bad_token = 3,
+
+    /// A producer with the same source id is already connected.
+    producer_duplicate_source = 4,
+
+    /// The producer runs as a different user from the broker.
+    producer_foreign_user = 5
+};
+
+/// Describe a producer_status.
+inline const char* describe(producer_status status)
+{
+    switch (status) {
+    case producer_accepted:
+        return "accepted";
+    case producer_malformed:
+        return "malformed hello";
+    case producer_unknown_source:
+        return "unknown source";
+    case producer_bad_token:
+        return "bad token";
+    case producer_duplicate_source:
+        return "source already connected";
+    case producer_foreign_user:
+        return "different user";
+    }
+    return "unknown status";
+}
+
+/// The broker's reply to a producer_hello. A producer that is not accepted is
+/// disconnected once the reply has been sent.
+/**
+ * On the wire the payload is 1 byte, the producer_status.
+ */
+struct producer_reply {
+    enum { payload_length = 1 };
+
+    producer_reply()
+        : status(producer_accepted) {
+    }
+
+    producer_status status;
+};
+
+/// Encode a producer hello as a complete frame. Found by argument dependent
+/// lookup from connection::async_write(); the codec is ignored, as
+/// handshakes have an encoding of their own.
+inline bool encode_frame(codec_type, const producer_hello& hello, std::vector<char>& frame)
+{
+    if (hello.source_id == 0 || hello.name.size() > producer_hello::max_text
+            || hello.token.size() > producer_hello::max_text) {
+        return false;
+    }
+    frame.resize(frame_header::length + hello.payload_length());
+    frame_header header;
+    header.payload_length = static_cast<uint32_t>(hello.payload_length());
+    header.codec = producer_hello_codec_type;
+    header.version = wire_version;
+    header.encode(&frame[0]);
+    hello.encode(&frame[frame_header::length]);
+    return true;
+}
+
+/// Decode a producer hello whose header has already been read.
+inline bool decode_payload(const frame_header& header, const char* data, producer_hello& hello)
+{
+    return header.codec == producer_hello_codec_type && hello.decode(data, header.payload_length);
+}
+
+/// Encode a broker's reply as a complete frame.
+inline bool encode_frame(codec_type, const producer_reply& reply, std::vector<char>& frame)
+{
+    frame.resize(frame_header::length + producer_reply::payload_length);
+    frame_header header;
+    header.payload_length = producer_reply::payload_length;
+    header.codec = producer_reply_codec_type;
+    header.version = wire_version;
+    header.encode(&frame[0]);
+    frame[frame_header::length] = static_cast<char>(reply.status);
+    return true;
+}
+
+/// Decode a broker's reply whose header has already been read.
+inline bool decode_payload(const frame_header& header, const char* data, producer_reply& reply)
+{
+    if (header.codec != producer_reply_codec_type || header.payload_length != producer_reply::payload_length
+            || static_cast<uint8_t>(data[0]) > producer_foreign_user) {
+        return false;
+    }
+    reply.status = producer_status(static_cast<uint8_t>(data[0]));
+    return true;
+}
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_PRODUCER_HANDSHAKE_HPP
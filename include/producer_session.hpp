@@ -0,0 +1,287 @@
+//
+// producer_session.hpp
+// ~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_PRODUCER_SESSION_HPP
+#define CODECHALLENGE_PRODUCER_SESSION_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/lexical_cast.hpp>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "connection.hpp"
+#include "eye_message.hpp"
+#include "ingest_broker.hpp"
+#include "metrics.hpp"
+#include "producer_handshake.hpp"
+
+namespace codechallenge
+{
+
+/// Takes batches from one producer connection and hands them to the broker,
+/// every sample stamped with the source the producer identified itself as.
+/**
+ * The first frame must be a producer_hello, and the session answers it with
+ * a producer_reply. A producer on the unix socket must also run as the
+ * broker's user, which the kernel vouches for (SO_PEERCRED); over TCP there
+ * is nothing to check but the token. A rejected producer is disconnected
+ * once it has been told why, and nothing it sent is published.
+ *
+ * Once accepted, every frame is a batch in any codec. The source id comes
+ * from the handshake, whatever the samples carry; each sample's own sequence
+ * number is kept as its source_seq, and gaps in it are counted. The publisher
+ * numbers the merged stream afresh.
+ *
+ * Reads are chained one at a time, so the session needs no strand.
+ */
+class producer_session
+    : public metrics_source,
+      public boost::enable_shared_from_this<producer_session>
+{
+public:
+    producer_session(connection_ptr conn, ingest_broker& broker)
+        : conn_(conn), broker_(broker), closed_(false), accepted_(false), source_id_(0), last_seq_(0),
+          samples_(0), dropped_(0), gaps_(0) {
+        metrics::instance().add_source(this);
+    }
+
+    ~producer_session() {
+        metrics::instance().remove_source(this);
+    }
+
+    /// Wait for the producer's hello.
+    void start() {
+        peer_ = describe_peer();
+        conn_->async_read(hello_, boost::bind(&producer_session::handle_hello, shared_from_this(),
+                          boost::asio::placeholders::error));
+    }
+
+    /// Judge the hello and reply to it.
+    void handle_hello(const boost::system::error_code& e) {
+        if (e && e != boost::asio::error::invalid_argument && e != boost::asio::error::message_size) {
+            // Gone before saying anything.
+            broker_.reject();
+            disconnect(0);
+            return;
+        }
+        if (e) {
+            reply_.status = producer_malformed;
+            broker_.reject();
+        } else if (!same_user()) {
+            reply_.status = producer_foreign_user;
+            broker_.reject();
+        } else {
+            reply_.status = broker_.admit(hello_);
+        }
+        if (reply_.status == producer_accepted) {
+            accepted_ = true;
+            source_id_ = hello_.source_id;
+        }
+        conn_->async_write(reply_, boost::bind(&producer_session::handle_reply, shared_from_this(),
+                           boost::asio::placeholders::error));
+    }
+
+    /// Start taking batches from an accepted producer, or let a rejected one
+    /// go.
+    void handle_reply(const boost::system::error_code& e) {
+        if (!accepted_) {
+            std::cout << "Producer Rejected (source " << hello_.source_id << ", " << peer_ << ": "
+                      << describe(reply_.status) << ")" << std::endl;
+            disconnect(0);
+            return;
+        }
+        if (e) {
+            disconnect("Producer Disconnected");
+            return;
+        }
+        std::cout << "Producer Connected! (source " << source_id_ << " \"" << hello_.name << "\", "
+                  << peer_ << ")" << std::endl;
+        read();
+    }
+
+    /// Stamp a batch read with its source and queue it for publishing.
+    void handle_read(const boost::system::error_code& e) {
+        if (e) {
+            disconnect("Producer Disconnected");
+            return;
+        }
+        if (!batch_.empty()) {
+            stamp();
+            std::size_t queued = broker_.push(&batch_[0], batch_.size());
+            samples_.fetch_add(queued, std::memory_order_relaxed);
+            dropped_.fetch_add(batch_.size() - queued, std::memory_order_relaxed);
+        }
+        read();
+    }
+
+    /// Report this producer's traffic.
+    void write_metrics(std::string& out) {
+        out += "{\"type\":\"producer_session\"";
+        json::append_field(out, "source", uint64_t(source_id_));
+        json::append_field(out, "samples", samples_.load(std::memory_order_relaxed));
+        json::append_field(out, "dropped", dropped_.load(std::memory_order_relaxed));
+        json::append_field(out, "gaps", gaps_.load(std::memory_order_relaxed));
+        out.push_back('}');
+    }
+
+private:
+    /// Read the next batch.
+    void read() {
+        conn_->async_read(batch_, boost::bind(&producer_session::handle_read, shared_from_this(),
+                          boost::asio::placeholders::error));
+    }
+
+    /// Give every sample of the batch its source, keeping the producer's
+    /// sequence number as the source's.
+    void stamp() {
+        uint64_t gaps = 0;
+        for (std::size_t i = 0; i < batch_.size(); ++i) {
+            eye_message& m = batch_[i];
+            uint64_t seq = m.seq_number;
+            if (last_seq_ != 0 && seq > last_seq_ + 1) {
+                gaps += seq - last_seq_ - 1;
+            }
+            last_seq_ = seq;
+            m.source_id = source_id_;
+            m.source_seq = seq;
+        }
+        if (gaps > 0) {
+            gaps_.fetch_add(gaps, std::memory_order_relaxed);
+            metrics::instance().add(broker_.ids().source_gaps, gaps);
+        }
+    }
+
+    /// What the kernel can say about who a producer is.
+    enum peer_identity {
+        /// On a unix socket, with credentials read.
+        peer_local,
+
+        /// Over TCP, with no user to check.
+        peer_remote,
+
+        /// Anything else, a unix socket whose credentials could not be read
+        /// for instance. Never trusted.
+        peer_unknown
+    };
+
+    /// Whether the producer may be who it says: on a unix socket, whether it
+    /// runs as our user; over TCP there is no user to check. A producer
+    /// whose socket cannot be told apart is refused.
+    bool same_user() const {
+        struct ucred credentials;
+        switch (peer_credentials(credentials)) {
+        case peer_local:
+            return credentials.uid == geteuid();
+        case peer_remote:
+            return true;
+        case peer_unknown:
+            break;
+        }
+        return false;
+    }
+
+    /// Which kind of socket the producer is on, with its credentials filled
+    /// in for a unix socket.
+    peer_identity peer_credentials(struct ucred& credentials) const {
+        boost::system::error_code e;
+        connection::protocol::endpoint local = conn_->socket().local_endpoint(e);
+        if (e) {
+            return peer_unknown;
+        }
+        int family = local.protocol().family();
+        if (family == AF_INET || family == AF_INET6) {
+            return peer_remote;
+        }
+        socklen_t length = sizeof(credentials);
+        if (family != AF_UNIX || getsockopt(conn_->socket().native_handle(), SOL_SOCKET, SO_PEERCRED,
+                                            &credentials, &length) != 0) {
+            return peer_unknown;
+        }
+        return peer_local;
+    }
+
+    /// The producer's process or address, for logs.
+    std::string describe_peer() const {
+        struct ucred credentials;
+        peer_identity identity = peer_credentials(credentials);
+        if (identity == peer_local) {
+            return "pid " + boost::lexical_cast<std::string>(credentials.pid);
+        }
+        boost::system::error_code e;
+        connection::protocol::endpoint remote = conn_->socket().remote_endpoint(e);
+        if (identity != peer_remote || e) {
+            return "unknown peer";
+        }
+        boost::asio::ip::tcp::endpoint tcp;
+        tcp.resize(remote.size());
+        std::memcpy(tcp.data(), remote.data(), remote.size());
+        return boost::lexical_cast<std::string>(tcp);
+    }
+
+    /// Stop taking from the producer, giving up its source id. Prints reason,
+    /// if any.
+    void disconnect(const char* reason) {
+        if (closed_) {
+            return;
+        }
+        closed_ = true;
+        if (accepted_) {
+            broker_.release(source_id_);
+        }
+        conn_->close();
+        if (reason) {
+            std::cout << reason << " (source " << source_id_ << ", "
+                      << samples_.load(std::memory_order_relaxed) << " samples, "
+                      << dropped_.load(std::memory_order_relaxed) << " dropped, "
+                      << gaps_.load(std::memory_order_relaxed) << " missing)" << std::endl;
+        }
+    }
+
+    /// The connection to the producer.
+    connection_ptr conn_;
+
+    /// Where samples go.
+    ingest_broker& broker_;
+
+    /// Whether the session has stopped, and whether the producer was accepted.
+    bool closed_;
+    bool accepted_;
+
+    /// The handshake read and the reply to it, and the producer's process or
+    /// address.
+    producer_hello hello_;
+    producer_reply reply_;
+    std::string peer_;
+
+    /// The source the producer was accepted as, and the last of its sequence
+    /// numbers seen.
+    uint32_t source_id_;
+    uint64_t last_seq_;
+
+    /// The batch being read.
+    std::vector<eye_message> batch_;
+
+    /// Samples queued and dropped, and missing from the producer's sequence,
+    /// readable from any thread.
+    std::atomic<uint64_t> samples_;
+    std::atomic<uint64_t> dropped_;
+    std::atomic<uint64_t> gaps_;
+};
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_PRODUCER_SESSION_HPP
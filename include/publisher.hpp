@@ -0,0 +1,584 @@
+//
+// publisher.hpp
+// ~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_PUBLISHER_HPP
+#define CODECHALLENGE_PUBLISHER_HPP
+
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <set>
+#include <vector>
+#include "codec.hpp"
+#include "eye_message.hpp"
+#include "ingest_broker.hpp"
+#include "metrics.hpp"
+#include "pacer.hpp"
+#include "replay.hpp"
+#include "sample_generator.hpp"
+#include "subscription.hpp"
+
+namespace codechallenge
+{
+
+/// A batch of samples together with its encoded frame. Built once per tick and
+/// shared, read-only, by every subscriber it is delivered to.
+struct published_batch {
+    std::vector<eye_message> samples;
+    std::vector<char> frame;
+};
+
+typedef boost::shared_ptr<const published_batch> published_batch_ptr;
+
+/// Get the encoded frame of a batch without copying it. The returned pointer
+/// keeps the whole batch alive.
+inline shared_frame frame_of(const published_batch_ptr& batch) {
+    return shared_frame(batch, &batch->frame);
+}
+
+/// The most recent batches published, oldest first, kept for clients joining
+/// late or recovering from a gap. Holds up to a fixed number of batches, and
+/// none older than a fixed age.
+/**
+ * The ring is allocated once, at its full capacity. It holds references to
+ * the published batches themselves, encoded frames included, so retaining a
+ * batch copies nothing and recovery serves the very frames sent live.
+ */
+class retention_ring
+    : private boost::noncopyable
+{
+public:
+    retention_ring()
+        : max_age_ns_(0), head_(0), size_(0) {
+    }
+
+    /// Keep up to capacity batches, none older than max_age_ns. Drops
+    /// anything already retained.
+    void reset(std::size_t capacity, uint64_t max_age_ns) {
+        ring_.assign(capacity, published_batch_ptr());
+        max_age_ns_ = max_age_ns;
+        head_ = 0;
+        size_ = 0;
+    }
+
+    /// Most batches kept, 0 if retention is off.
+    std::size_t capacity() const {
+        return ring_.size();
+    }
+
+    /// Batches currently kept.
+    std::size_t size() const {
+        return size_;
+    }
+
+    /// Add the newest batch, letting go of the oldest once full and of any
+    /// that have grown too old. Sequence numbers must increase from batch to
+    /// batch, and no batch may be empty.
+    void push(const published_batch_ptr& batch) {
+        if (ring_.empty()) {
+            return;
+        }
+        uint64_t now = sample_time_ns(batch->samples.back());
+        while (size_ > 0 && (size_ == ring_.size()
+                             || sample_time_ns(front().samples.back()) + max_age_ns_ < now)) {
+            ring_[head_].reset();
+            head_ = (head_ + 1) % ring_.size();
+            --size_;
+        }
+        ring_[(head_ + size_) % ring_.size()] = batch;
+        ++size_;
+    }
+
+    /// Append the batches holding any sample numbered from first up to, but
+    /// not including, last (0 for no limit) to out, oldest first.
+    void collect(uint64_t first, uint64_t last, std::vector<published_batch_ptr>& out) const {
+        for (std::size_t i = 0; i < size_; ++i) {
+            const published_batch_ptr& batch = ring_[(head_ + i) % ring_.size()];
+            if (batch->samples.back().seq_number >= first
+                && (last == 0 || batch->samples.front().seq_number < last)) {
+                out.push_back(batch);
+            }
+        }
+    }
+
+    /// Sequence number of the oldest sample kept, 0 if there is none.
+    uint64_t first_seq() const {
+        return size_ > 0 ? uint64_t(front().samples.front().seq_number) : 0;
+    }
+
+private:
+    /// The oldest batch kept.
+    const published_batch& front() const {
+        return *ring_[head_];
+    }
+
+    /// Slots for the kept batches: size_ of them from head_ onwards.
+    std::vector<published_batch_ptr> ring_;
+
+    /// Age beyond which batches are let go.
+    uint64_t max_age_ns_;
+
+    std::size_t head_;
+    std::size_t size_;
+};
+
+/// Receives every batch produced by a publisher.
+class subscriber
+{
+public:
+    virtual ~subscriber() {}
+
+    /// Called once per published batch. Must not block.
+    virtual void deliver(const published_batch_ptr& batch) = 0;
+};
+
+typedef boost::shared_ptr<subscriber> subscriber_ptr;
+
+/// Periodically generates a batch of eye messages, encodes it once and hands
+/// the same immutable batch to every subscriber. Subscribers may be added and
+/// removed from any thread.
+/**
+ * Ticks come from a pacer running on its own thread. A callback covering
+ * several ticks (late ticks that were coalesced, or adaptive batching at high
+ * rates) publishes one batch holding every covered tick's samples.
+ *
+ * Subscribers with identical subscriptions are grouped into one view. Each
+ * view's filter is applied once per batch and its filtered batch encoded
+ * once, in the view's codec, then shared by every member; views that filter
+ * out a whole batch send nothing. Unfiltered views in the publisher's own
+ * encoding all share the generated batch.
+ *
+ * Samples are generated, replayed from a recording (see replayer), or taken
+ * from producers through an ingest_broker. A replay stops the pacer once the
+ * recording ends, unless it loops. A broker's samples are published on the
+ * tick after they arrive, all of them, so the rate sets how long they wait.
+ * Either way, every sample published is given the next sequence number,
+ * starting from 1, so clients can tell when they have missed some.
+ *
+ * With retention on, the publisher also keeps the last few seconds of
+ * batches, encoded, in a retention_ring. A subscription asking to resume from
+ * a sequence number gets the retained samples from there on, ahead of the
+ * live stream and without a gap or overlap between the two.
+ *
+ * Batches are recycled: once every subscriber has let go of one, its sample
+ * and frame buffers are reused, capacity and all, for a later tick.
+ */
+class publisher
+{
+public:
+    publisher(codec_type codec, int sample_chunk_length, const pacer_options& pacing,
+              const generator_options& generation = generator_options())
+        : codec_(codec), precision_(compact_codec::lossless), sample_chunk_length_(sample_chunk_length),
+          pacer_(pacing), generator_(generation), sample_interval_ns_(uint64_t(1e9 / pacing.rate / sample_chunk_length)),
+          next_seq_(1), next_batch_(0) {
+        metrics& m = metrics::instance();
+        generate_ns_ = m.add_histogram("generate_ns");
+        encode_ns_ = m.add_histogram("encode_ns");
+        batches_published_ = m.add_counter("batches_published");
+        samples_published_ = m.add_counter("samples_published");
+        bytes_encoded_ = m.add_counter("bytes_encoded");
+        views_published_ = m.add_counter("views_published");
+        batches_recovered_ = m.add_counter("batches_recovered");
+    }
+
+    /// Add a subscriber, or change its subscription. It receives the samples
+    /// passing the subscription from every batch published from now on.
+    /**
+     * If the subscription resumes from a sequence number and recovery is
+     * given, the frames of the retained samples it asks for are added to
+     * recovery. They come before the first batch delivered live, and must be
+     * sent ahead of it. Retained batches are served as they are when the
+     * subscription takes them unfiltered in the publisher's encoding; for
+     * others, the retained samples are filtered and encoded here, on the
+     * caller's thread, rather than holding up publishing.
+     */
+    void subscribe(const subscriber_ptr& s, const subscription& filter = subscription(),
+                   std::vector<shared_frame>* recovery = 0) {
+        subscription key = filter;
+        key.resume_from = 0;
+        key.resume_to = 0;
+        std::vector<published_batch_ptr> retained;
+        codec_type codec = codec_;
+        uint8_t precision = precision_;
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            leave_view(s);
+            view_ptr& view = views_[key];
+            if (!view) {
+                view.reset(new view_state(key));
+                if (!key.is_server_codec()) {
+                    view->codec = codec_type(key.codec);
+                    view->precision = key.precision;
+                } else {
+                    view->codec = codec_;
+                    view->precision = precision_;
+                }
+            }
+            view->members.insert(s);
+            membership_[s] = view;
+            pacer_.wake();
+            codec = view->codec;
+            precision = view->precision;
+
+            // Batches are retained under the same lock as subscribers are
+            // snapshotted, so each is either retained already or delivered.
+            if (recovery && filter.is_resume()) {
+                retention_.collect(filter.resume_from, filter.resume_to, retained);
+            }
+        }
+        if (retained.empty()) {
+            return;
+        }
+        metrics::instance().add(batches_recovered_, retained.size());
+        bool native = key.is_all() && codec == codec_ && precision == precision_;
+        uint64_t seen = 0;
+        for (std::size_t i = 0; i < retained.size(); ++i) {
+            if (native) {
+                recovery->push_back(frame_of(retained[i]));
+                continue;
+            }
+            boost::shared_ptr<published_batch> batch = boost::make_shared<published_batch>();
+            const std::vector<eye_message>& samples = retained[i]->samples;
+            for (std::size_t j = 0; j < samples.size(); ++j) {
+                if (filter.resumes(samples[j].seq_number) && key.matches(samples[j])
+                    && seen++ % key.decimation == 0) {
+                    batch->samples.push_back(samples[j]);
+                }
+            }
+            if (!batch->samples.empty() && encode_frame(codec, batch->samples, batch->frame, precision)) {
+                recovery->push_back(frame_of(batch));
+            }
+        }
+    }
+
+    /// Remove a subscriber. Safe to call from within deliver().
+    void unsubscribe(const subscriber_ptr& s) {
+        boost::mutex::scoped_lock lock(mutex_);
+        leave_view(s);
+    }
+
+    /// Number of currently attached subscribers.
+    std::size_t subscriber_count() const {
+        boost::mutex::scoped_lock lock(mutex_);
+        return membership_.size();
+    }
+
+    /// Number of distinct subscriptions among the subscribers.
+    std::size_t view_count() const {
+        boost::mutex::scoped_lock lock(mutex_);
+        return views_.size();
+    }
+
+    /// Set the precision of the compact codec, for subscribers taking the
+    /// publisher's encoding. Call before start().
+    void set_precision(uint8_t precision) {
+        precision_ = precision;
+    }
+
+    /// Keep about the last seconds of batches for recovery, at up to rate
+    /// batches a second; 0 turns retention off. The batches retained are
+    /// built here, up front. Call before start().
+    void set_retention(double seconds, double rate) {
+        std::size_t capacity = seconds > 0 ? std::size_t(std::ceil(seconds * rate)) + 1 : 0;
+        retention_.reset(capacity, uint64_t(seconds * 1e9));
+        reserve_batches(batches_.size() + capacity);
+    }
+
+    /// Publish samples from a recording instead of generating them. Call
+    /// before start().
+    void replay(const boost::shared_ptr<replayer>& replay) {
+        replay_ = replay;
+    }
+
+    /// Publish the samples producers send to a broker instead of generating
+    /// them. Call before start().
+    void ingest(const boost::shared_ptr<ingest_broker>& broker) {
+        ingest_ = broker;
+    }
+
+    /// Build batches up front, so that up to count of them can be in flight
+    /// at once before the publisher has to allocate another. Call before
+    /// start().
+    void reserve_batches(std::size_t count) {
+        while (batches_.size() < count) {
+            add_batch();
+        }
+    }
+
+    /// Start publishing from the pacer's thread.
+    void start() {
+        pacer_.start(boost::bind(&publisher::handle_tick, this, _1));
+    }
+
+    /// Stop publishing. Returns once the last batch has been delivered.
+    void stop() {
+        pacer_.stop();
+    }
+
+private:
+    /// Subscribers sharing a subscription, and the state of their view.
+    struct view_state {
+        explicit view_state(const subscription& f)
+            : filter(f), codec(binary_codec_type), precision(compact_codec::lossless), seen(0) {
+        }
+
+        /// What the members subscribed to.
+        subscription filter;
+
+        /// How the view's batches are encoded.
+        codec_type codec;
+        uint8_t precision;
+
+        /// Current members. Protected by the publisher's mutex.
+        std::set<subscriber_ptr> members;
+
+        /// Snapshot of members for the tick in progress, and matching samples
+        /// seen so far, for decimation. Used by the pacer's thread only.
+        std::vector<subscriber_ptr> targets;
+        uint64_t seen;
+    };
+
+    typedef boost::shared_ptr<view_state> view_ptr;
+
+    /// Take a subscriber out of its view, dropping the view once empty.
+    /// Called with mutex_ held.
+    void leave_view(const subscriber_ptr& s) {
+        std::map<subscriber_ptr, view_ptr>::iterator it = membership_.find(s);
+        if (it == membership_.end()) {
+            return;
+        }
+        view_ptr view = it->second;
+        membership_.erase(it);
+        view->members.erase(s);
+        if (view->members.empty()) {
+            views_.erase(view->filter);
+        }
+    }
+
+    /// Generate one batch covering the given number of ticks, then filter,
+    /// encode and fan it out to every view.
+    void handle_tick(unsigned int ticks) {
+        // Nobody is listening, don't bother generating anything. A replay
+        // waits for its first listener, then keeps time whoever listens.
+        bool listening = false;
+        bool waiting = !(replay_ && replay_->started());
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            listening = !views_.empty();
+            if (!listening && waiting) {
+                // Under the lock, so that a subscriber arriving now wakes
+                // the pacer rather than being missed.
+                pacer_.idle();
+            }
+        }
+        if (!listening && waiting) {
+            // Producers send regardless; publishing what they sent to
+            // whoever subscribes next would only be late.
+            if (ingest_) {
+                ingest_->discard();
+            }
+            return;
+        }
+        metrics& m = metrics::instance();
+        uint64_t start = steady_clock_ns();
+        boost::shared_ptr<published_batch> batch = acquire_batch();
+        generate(batch->samples, ticks);
+        for (std::size_t i = 0; i < batch->samples.size(); ++i) {
+            batch->samples[i].seq_number = next_seq_++;
+        }
+        m.record(generate_ns_, steady_clock_ns() - start);
+        if (replay_ && replay_->finished()) {
+            pacer_.finish();
+            std::cout << "Replay Finished (" << replay_->replayed() << " samples)" << std::endl;
+        }
+        if (batch->samples.empty()) {
+            return;
+        }
+
+        // Retained batches are served to subscribers as they are, so encode
+        // before letting anyone see this one.
+        bool encoded = false;
+        bool retain = retention_.capacity() > 0;
+        if (retain) {
+            encoded = encode(*batch, codec_, precision_);
+        }
+
+        // Deliver from a snapshot, subscribers may come and go while we iterate.
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            if (retain && encoded) {
+                retention_.push(batch);
+            }
+            for (std::map<subscription, view_ptr>::iterator it = views_.begin(); it != views_.end(); ++it) {
+                it->second->targets.assign(it->second->members.begin(), it->second->members.end());
+                active_views_.push_back(it->second);
+            }
+        }
+        if (active_views_.empty()) {
+            return;
+        }
+        m.add(batches_published_);
+        m.add(samples_published_, batch->samples.size());
+
+        for (std::size_t v = 0; v < active_views_.size(); ++v) {
+            view_state& view = *active_views_[v];
+            bool native = view.codec == codec_ && view.precision == precision_;
+            if (view.filter.is_all() && native) {
+                // Unfiltered views in our encoding share the generated batch.
+                if (!encoded && !encode(*batch, codec_, precision_)) {
+                    break;
+                }
+                encoded = true;
+                deliver(view, batch);
+            } else {
+                boost::shared_ptr<published_batch> filtered = acquire_batch();
+                if (view.filter.is_all()) {
+                    filtered->samples.assign(batch->samples.begin(), batch->samples.end());
+                } else {
+                    view.filter.apply(batch->samples, filtered->samples, view.seen);
+                }
+                if (!filtered->samples.empty() && encode(*filtered, view.codec, view.precision)) {
+                    m.add(views_published_);
+                    deliver(view, filtered);
+                }
+            }
+            view.targets.clear();
+        }
+        active_views_.clear();
+    }
+
+    /// Encode a batch's frame.
+    bool encode(published_batch& batch, codec_type codec, uint8_t precision) {
+        metrics& m = metrics::instance();
+        uint64_t start = steady_clock_ns();
+        if (!encode_frame(codec, batch.samples, batch.frame, precision)) {
+            return false;
+        }
+        m.record(encode_ns_, steady_clock_ns() - start);
+        m.add(bytes_encoded_, batch.frame.size());
+        return true;
+    }
+
+    /// Hand a batch to every member of a view.
+    void deliver(view_state& view, const boost::shared_ptr<published_batch>& batch) {
+        published_batch_ptr shared(batch);
+        for (std::size_t i = 0; i < view.targets.size(); ++i) {
+            view.targets[i]->deliver(shared);
+        }
+    }
+
+    /// A batch nobody else holds any more, or a new one if all are in use.
+    /// Called on the pacer's thread only, which is the only thread that hands
+    /// out references; others can only drop theirs, so a batch found unshared
+    /// stays unshared.
+    const boost::shared_ptr<published_batch>& acquire_batch() {
+        for (std::size_t i = 0; i < batches_.size(); ++i) {
+            next_batch_ = (next_batch_ + 1) % batches_.size();
+            if (batches_[next_batch_].use_count() == 1) {
+                return batches_[next_batch_];
+            }
+        }
+        next_batch_ = batches_.size();
+        add_batch();
+        return batches_.back();
+    }
+
+    /// Add a batch to the pool, sized for one tick. The rare batch covering
+    /// several ticks grows, and keeps its capacity when it is reused.
+    void add_batch() {
+        boost::shared_ptr<published_batch> batch = boost::make_shared<published_batch>();
+        batch->samples.resize(std::size_t(sample_chunk_length_));
+        encode_frame(codec_, batch->samples, batch->frame);
+        batches_.push_back(batch);
+    }
+
+    /// Fill a batch with eye messages for the given number of ticks. The
+    /// clock is read once; generated samples are spread evenly over the ticks
+    /// the batch covers, the last one stamped now.
+    void generate(std::vector<eye_message>& samples, unsigned int ticks) {
+        if (replay_) {
+            replay_->fill(samples, std::size_t(sample_chunk_length_) * ticks, wall_clock_ns());
+            return;
+        }
+        if (ingest_) {
+            ingest_->fill(samples);
+            return;
+        }
+        generator_.generate(samples, std::size_t(sample_chunk_length_) * ticks,
+                            wall_clock_ns(), sample_interval_ns_);
+    }
+
+    /// Codec used to encode batches for subscribers that do not choose one,
+    /// and the compact codec's precision.
+    codec_type codec_;
+    uint8_t precision_;
+
+    /// Num samples to send in each chunk.
+    int sample_chunk_length_;
+
+    /// Drives ticks at the configured rate.
+    pacer pacer_;
+
+    /// Makes up the samples, and the time between consecutive samples.
+    sample_generator generator_;
+    uint64_t sample_interval_ns_;
+
+    /// Replays a recording instead, if set.
+    boost::shared_ptr<replayer> replay_;
+
+    /// Or takes samples from producers, if set.
+    boost::shared_ptr<ingest_broker> ingest_;
+
+    /// Time to generate and to encode each batch.
+    histogram_id generate_ns_;
+    histogram_id encode_ns_;
+
+    /// Publishing totals.
+    counter_id batches_published_;
+    counter_id samples_published_;
+    counter_id bytes_encoded_;
+
+    /// Filtered views encoded.
+    counter_id views_published_;
+
+    /// Retained batches sent to subscribers resuming from a sequence number.
+    counter_id batches_recovered_;
+
+    /// Sequence number of the next sample published. Used by the pacer's
+    /// thread only.
+    uint64_t next_seq_;
+
+    /// Protects views_, membership_ and retention_.
+    mutable boost::mutex mutex_;
+
+    /// A view for every distinct subscription, and the view of each subscriber.
+    std::map<subscription, view_ptr> views_;
+    std::map<subscriber_ptr, view_ptr> membership_;
+
+    /// The latest batches, for subscribers resuming from a sequence number.
+    retention_ring retention_;
+
+    /// Views with members, taken for the tick in progress.
+    std::vector<view_ptr> active_views_;
+
+    /// Every batch ever built, for reuse, and where the last search stopped.
+    std::vector<boost::shared_ptr<published_batch> > batches_;
+    std::size_t next_batch_;
+};
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_PUBLISHER_HPP
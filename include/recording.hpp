@@ -0,0 +1,568 @@
+//
+// recording.hpp
+// ~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_RECORDING_HPP
+#define CODECHALLENGE_RECORDING_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/predef/other/endian.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "async_logger.hpp"
+#include "eye_message.hpp"
+
+namespace codechallenge
+{
+
+/// Native columnar recording format (.rec files).
+/**
+ * A recording is a fixed 64-byte file header, then a run of fixed size blocks,
+ * then a footer index and trailer:
+ *
+ * @li Each block holds up to block_capacity samples, stored column by column
+ * (one contiguous array per field of message_schema<eye_message>, each
+ * 64-byte aligned). The header records the schema version and its column
+ * count; recordings of an older version, whose blocks lack the columns added
+ * since, are read with those fields zeroed.
+ * @li The index has one entry per block giving its sample count and the
+ * earliest and latest sample timestamps, so time ranges map to blocks without
+ * touching sample data.
+ * @li The trailer, the last 32 bytes, locates the index.
+ *
+ * Blocks are only written once full, and the index and trailer only when the
+ * recording is closed. A recording that was never closed is read from its
+ * whole blocks, indexed afresh when it is opened.
+ *
+ * Everything is stored in host (little-endian) layout so that readers can mmap
+ * the file and use the columns in place.
+ */
+namespace recording
+{
+
+#if !BOOST_ENDIAN_LITTLE_BYTE
+#error "recording files are stored little-endian and read in place"
+#endif
+
+/// Identifies a recording file, at the start and in the trailer.
+const uint64_t file_magic = 0x3130434552455945ULL; // "EYEREC01"
+
+/// Version of the layout described above.
+const uint32_t format_version = 1;
+
+/// Samples per block written by default.
+const uint32_t default_block_capacity = 4096;
+
+/// Element type of a column.
+enum column_type { u8_column, u32_column, u64_column, f32_column };
+
+/// Columns of a block, in storage order: the schema's fields.
+enum column_id {
+    seq_number_column,
+    time_seconds_column,
+    time_nanos_column,
+    id_column,
+    confidence_column,
+    normalized_pos_x_column,
+    normalized_pos_y_column,
+    pupil_diameter_column,
+    source_id_column,
+    source_seq_column,
+    column_count
+};
+
+/// Static description of a column.
+struct column_info {
+    const char* name;
+    column_type type;
+    uint32_t element_size;
+};
+
+typedef message_schema<eye_message> schema;
+
+static_assert(int(column_count) == int(schema::fields::size), "a column_id for every schema field");
+
+/// Column type storing a field.
+template <typename T>
+struct column_type_of;
+
+template <>
+struct column_type_of<uint8_t> {
+    static const column_type value = u8_column;
+};
+
+template <>
+struct column_type_of<uint32_t> {
+    static const column_type value = u32_column;
+};
+
+template <>
+struct column_type_of<uint64_t> {
+    static const column_type value = u64_column;
+};
+
+template <>
+struct column_type_of<float> {
+    static const column_type value = f32_column;
+};
+
+/// Descriptions of the columns of a field list.
+template <typename... Fields>
+inline const column_info* columns(field_list<Fields...>) {
+    static const column_info table[] = {
+        { Fields::name(), column_type_of<typename Fields::storage_type>::value,
+          uint32_t(sizeof(typename Fields::storage_type)) }...
+    };
+    return table;
+}
+
+/// Column descriptions, indexed by column_id. Names match eye_message fields.
+inline const column_info& column(column_id id) {
+    return columns(schema::fields())[id];
+}
+
+/// Find a column by name. Returns column_count if there is none.
+inline column_id find_column(const std::string& name) {
+    for (int i = 0; i < column_count; ++i) {
+        if (name == column(column_id(i)).name) {
+            return column_id(i);
+        }
+    }
+    return column_count;
+}
+
+/// Round n up to a multiple of 64.
+inline uint64_t align64(uint64_t n) {
+    return (n + 63) & ~uint64_t(63);
+}
+
+/// Byte offset of a column within a block.
+inline uint64_t column_offset(uint32_t block_capacity, column_id id) {
+    uint64_t offset = 0;
+    for (int i = 0; i < id; ++i) {
+        offset += align64(uint64_t(block_capacity) * column(column_id(i)).element_size);
+    }
+    return offset;
+}
+
+/// Size of a block of the first columns columns, in bytes.
+inline uint64_t block_size(uint32_t block_capacity, uint32_t columns = column_count) {
+    return column_offset(block_capacity, column_id(columns));
+}
+
+/// Timestamp of a sample in nanoseconds since the epoch.
+inline uint64_t timestamp_ns(uint64_t seconds, uint32_t nanos) {
+    return seconds * 1000000000ULL + nanos;
+}
+
+/// The file header. A schema_version of 0, written before it was recorded,
+/// means version 1.
+struct file_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t block_capacity;
+    uint32_t column_count;
+    uint32_t schema_version;
+    uint64_t block_size;
+    char padding[32];
+};
+
+/// One footer index entry, describing one block. first_ns and last_ns are
+/// the earliest and latest timestamps in the block.
+struct index_entry {
+    uint64_t first_ns;
+    uint64_t last_ns;
+    uint32_t count;
+    uint32_t reserved;
+};
+
+/// The last bytes of the file.
+struct trailer {
+    uint64_t index_offset;
+    uint64_t block_count;
+    uint64_t sample_count;
+    uint64_t magic;
+};
+
+static_assert(sizeof(file_header) == 64, "file_header must stay 64 bytes");
+static_assert(sizeof(index_entry) == 24, "index_entry must stay 24 bytes");
+static_assert(sizeof(trailer) == 32, "trailer must stay 32 bytes");
+
+} // namespace recording
+
+/// Records samples into a .rec file, through a segment_file. Used as a
+/// log_sink, so all writing is done on the logger's writer thread.
+class recording_sink
+    : public log_sink
+{
+public:
+    explicit recording_sink(const std::string& filename,
+                            const segment_file_options& options = segment_file_options(),
+                            uint32_t block_capacity = recording::default_block_capacity)
+        : block_capacity_(block_capacity),
+          block_(recording::block_size(block_capacity)),
+          count_(0), sample_count_(0), file_(filename, options) {
+        recording::file_header header;
+        std::memset(&header, 0, sizeof(header));
+        header.magic = recording::file_magic;
+        header.version = recording::format_version;
+        header.block_capacity = block_capacity_;
+        header.column_count = recording::column_count;
+        header.schema_version = recording::schema::version;
+        header.block_size = block_.size();
+        write_all(&header, sizeof(header));
+
+        for (int i = 0; i < recording::column_count; ++i) {
+            columns_[i] = &block_[recording::column_offset(block_capacity_, recording::column_id(i))];
+        }
+    }
+
+    /// Write the last, partial, block and the footer.
+    ~recording_sink() {
+        if (count_ > 0) {
+            write_block();
+        }
+        write_all(index_.empty() ? 0 : &index_[0], index_.size() * sizeof(recording::index_entry));
+        recording::trailer t;
+        t.index_offset = sizeof(recording::file_header) + index_.size() * block_.size();
+        t.block_count = index_.size();
+        t.sample_count = sample_count_;
+        t.magic = recording::file_magic;
+        write_all(&t, sizeof(t));
+    }
+
+    void write(const eye_message* samples, std::size_t n, uint64_t first_count) {
+        for (std::size_t i = 0; i < n; ++i) {
+            const eye_message& s = samples[i];
+            column_writer write = { s, columns_, count_ };
+            for_each_field(recording::schema::fields(), write);
+
+            uint64_t ts = recording::timestamp_ns(s.time_seconds, s.time_nanos);
+            if (count_ == 0 || ts < first_ns_) {
+                first_ns_ = ts;
+            }
+            if (count_ == 0 || ts > last_ns_) {
+                last_ns_ = ts;
+            }
+            if (++count_ == block_capacity_) {
+                write_block();
+            }
+        }
+    }
+
+    /// Hand the blocks written so far to the kernel. The block being filled
+    /// is only written once full, or when the recording is closed.
+    void flush() {
+        file_.flush();
+    }
+
+    /// Bytes written so far; the block being filled is not counted until it
+    /// is written.
+    uint64_t size() const {
+        return file_.size();
+    }
+
+private:
+    /// Stores each field of a sample at row count of its column.
+    struct column_writer {
+        const eye_message& s;
+        char* const* column;
+        uint32_t count;
+
+        template <typename Field>
+        void operator()(Field) {
+            typedef typename Field::storage_type stored;
+            stored value = static_cast<stored>(Field::get(s));
+            std::memcpy(*column++ + count * sizeof(stored), &value, sizeof(stored));
+        }
+    };
+
+    /// Write the current block (always at full size) and index it.
+    void write_block() {
+        write_all(&block_[0], block_.size());
+        recording::index_entry entry;
+        entry.first_ns = first_ns_;
+        entry.last_ns = last_ns_;
+        entry.count = count_;
+        entry.reserved = 0;
+        index_.push_back(entry);
+        sample_count_ += count_;
+        count_ = 0;
+        std::fill(block_.begin(), block_.end(), 0);
+    }
+
+    /// Append to the file.
+    void write_all(const void* data, std::size_t size) {
+        file_.append(data, size);
+    }
+
+    /// Samples per block.
+    uint32_t block_capacity_;
+
+    /// The block being filled.
+    std::vector<char> block_;
+
+    /// Start of each column within block_.
+    char* columns_[recording::column_count];
+
+    /// Samples in the current block.
+    uint32_t count_;
+
+    /// Earliest and latest timestamps in the current block.
+    uint64_t first_ns_;
+    uint64_t last_ns_;
+
+    /// Index entries of the blocks written so far.
+    std::vector<recording::index_entry> index_;
+
+    /// Samples in the blocks written so far.
+    uint64_t sample_count_;
+
+    /// The recording file.
+    segment_file file_;
+};
+
+/// Read-only, memory mapped view of a .rec file. Opening costs one mmap and
+/// a look at the trailer, regardless of the file's size, unless the file has
+/// no trailer and its blocks have to be indexed.
+class recording_reader
+    : private boost::noncopyable
+{
+public:
+    explicit recording_reader(const std::string& filename) {
+        fd_ = ::open(filename.c_str(), O_RDONLY);
+        if (fd_ < 0) {
+            throw std::runtime_error("unable to open " + filename);
+        }
+        struct stat st;
+        if (fstat(fd_, &st) != 0 || st.st_size < off_t(sizeof(recording::file_header))) {
+            ::close(fd_);
+            throw std::runtime_error(filename + " is not a complete recording");
+        }
+        size_ = st.st_size;
+        void* base = mmap(0, size_, PROT_READ, MAP_SHARED, fd_, 0);
+        if (base == MAP_FAILED) {
+            ::close(fd_);
+            throw std::runtime_error("unable to map " + filename);
+        }
+        base_ = static_cast<const char*>(base);
+
+        header_ = reinterpret_cast<const recording::file_header*>(base_);
+        schema_version_ = std::max<uint32_t>(header_->schema_version, 1);
+        if (header_->magic != recording::file_magic
+                || header_->version != recording::format_version
+                || schema_version_ > uint32_t(recording::schema::version)
+                || header_->column_count != field_count(recording::schema::fields(), schema_version_)
+                || header_->block_capacity == 0
+                || header_->block_size != recording::block_size(header_->block_capacity, header_->column_count)) {
+            munmap(const_cast<char*>(base_), size_);
+            ::close(fd_);
+            throw std::runtime_error(filename + " is not a recording");
+        }
+
+        const recording::trailer* t = 0;
+        if (size_ >= sizeof(recording::file_header) + sizeof(recording::trailer)) {
+            t = reinterpret_cast<const recording::trailer*>(base_ + size_ - sizeof(recording::trailer));
+        }
+        if (t && t->magic == recording::file_magic
+                && t->index_offset + t->block_count * sizeof(recording::index_entry)
+                == size_ - sizeof(recording::trailer)) {
+            index_ = reinterpret_cast<const recording::index_entry*>(base_ + t->index_offset);
+            block_count_ = t->block_count;
+            sample_count_ = t->sample_count;
+            recovered_ = false;
+        } else {
+            rebuild_index();
+        }
+    }
+
+    ~recording_reader() {
+        munmap(const_cast<char*>(base_), size_);
+        ::close(fd_);
+    }
+
+    /// Number of blocks.
+    std::size_t block_count() const {
+        return block_count_;
+    }
+
+    /// Number of samples in the whole recording.
+    uint64_t sample_count() const {
+        return sample_count_;
+    }
+
+    /// Whether the recording was never closed, and its whole blocks were
+    /// indexed when it was opened. Samples after the last whole block are
+    /// lost.
+    bool recovered() const {
+        return recovered_;
+    }
+
+    /// Samples per (full) block.
+    uint32_t block_capacity() const {
+        return header_->block_capacity;
+    }
+
+    /// Schema version the recording was written with.
+    uint32_t schema_version() const {
+        return schema_version_;
+    }
+
+    /// Whether the recording has a column; those added to the schema after
+    /// it was written are missing.
+    bool has_column(recording::column_id id) const {
+        return uint32_t(id) < header_->column_count;
+    }
+
+    /// Index entry of block i.
+    const recording::index_entry& block_index(std::size_t i) const {
+        return index_[i];
+    }
+
+    /// Column data of block i, in place. Only the first block_index(i).count
+    /// elements are meaningful. The column must be one the recording has.
+    template <typename T>
+    const T* column(std::size_t i, recording::column_id id) const {
+        return reinterpret_cast<const T*>(base_ + sizeof(recording::file_header)
+                                          + i * header_->block_size
+                                          + recording::column_offset(header_->block_capacity, id));
+    }
+
+    /// Read column id of sample j in block i as a double, whatever its type.
+    double value(std::size_t i, recording::column_id id, uint32_t j) const {
+        if (!has_column(id)) {
+            return 0;
+        }
+        switch (recording::column(id).type) {
+        case recording::u8_column:
+            return column<uint8_t>(i, id)[j];
+        case recording::u32_column:
+            return column<uint32_t>(i, id)[j];
+        case recording::u64_column:
+            return double(column<uint64_t>(i, id)[j]);
+        case recording::f32_column:
+            return column<float>(i, id)[j];
+        }
+        return 0;
+    }
+
+    /// Timestamp of sample j in block i.
+    uint64_t timestamp_ns(std::size_t i, uint32_t j) const {
+        return recording::timestamp_ns(column<uint64_t>(i, recording::time_seconds_column)[j],
+                                       column<uint32_t>(i, recording::time_nanos_column)[j]);
+    }
+
+    /// Reassemble sample j of block i, with fields the recording lacks zeroed.
+    eye_message sample(std::size_t i, uint32_t j) const {
+        eye_message m;
+        column_reader read = { *this, m, i, j, 0 };
+        for_each_field(recording::schema::fields(), read);
+        return m;
+    }
+
+    /// First block that may hold samples at or after from_ns. Blocks are in
+    /// arrival order, so this is a binary search over the index.
+    std::size_t lower_block(uint64_t from_ns) const {
+        std::size_t lo = 0;
+        std::size_t hi = block_count();
+        while (lo < hi) {
+            std::size_t mid = (lo + hi) / 2;
+            if (index_[mid].last_ns < from_ns) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+private:
+    /// Index the blocks of a recording that has no trailer. Each block written
+    /// is full; space preallocated past the last of them reads as zeros, and
+    /// ends the scan.
+    void rebuild_index() {
+        uint32_t capacity = header_->block_capacity;
+        std::size_t blocks = (size_ - sizeof(recording::file_header)) / header_->block_size;
+        rebuilt_.reserve(blocks);
+        for (std::size_t i = 0; i < blocks; ++i) {
+            if (column<uint64_t>(i, recording::time_seconds_column)[0] == 0) {
+                break;
+            }
+            recording::index_entry entry;
+            entry.first_ns = timestamp_ns(i, 0);
+            entry.last_ns = entry.first_ns;
+            entry.count = capacity;
+            entry.reserved = 0;
+            for (uint32_t j = 1; j < capacity; ++j) {
+                uint64_t ts = timestamp_ns(i, j);
+                entry.first_ns = std::min(entry.first_ns, ts);
+                entry.last_ns = std::max(entry.last_ns, ts);
+            }
+            rebuilt_.push_back(entry);
+        }
+        index_ = rebuilt_.empty() ? 0 : &rebuilt_[0];
+        block_count_ = rebuilt_.size();
+        sample_count_ = uint64_t(block_count_) * capacity;
+        recovered_ = true;
+    }
+
+    /// Loads each field of a sample from its column.
+    struct column_reader {
+        const recording_reader& reader;
+        eye_message& m;
+        std::size_t block;
+        uint32_t row;
+        int id;
+
+        template <typename Field>
+        void operator()(Field) {
+            typedef typename Field::storage_type stored;
+            recording::column_id column = recording::column_id(id++);
+            typedef typename Field::value_type value;
+            Field::get(m) = reader.has_column(column)
+                            ? static_cast<value>(reader.column<stored>(block, column)[row]) : value();
+        }
+    };
+
+    /// The recording file.
+    int fd_;
+
+    /// Size of the file and its mapping.
+    std::size_t size_;
+
+    /// Start of the mapping.
+    const char* base_;
+
+    /// Parts of the mapping.
+    const recording::file_header* header_;
+    const recording::index_entry* index_;
+
+    /// Blocks and samples, from the trailer or counted.
+    std::size_t block_count_;
+    uint64_t sample_count_;
+
+    /// Whether the index was rebuilt, and the rebuilt index if so.
+    bool recovered_;
+    std::vector<recording::index_entry> rebuilt_;
+
+    /// Schema version of the recording.
+    uint32_t schema_version_;
+};
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_RECORDING_HPP
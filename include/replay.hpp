@@ -0,0 +1,331 @@
+//
+// replay.hpp
+// ~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_REPLAY_HPP
+#define CODECHALLENGE_REPLAY_HPP
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "csv_format.hpp"
+#include "eye_message.hpp"
+#include "recording.hpp"
+
+namespace codechallenge
+{
+
+/// A recorded session, read one sample at a time from start to end.
+class replay_source
+{
+public:
+    virtual ~replay_source() {}
+
+    /// Read the next sample. Returns false at the end of the recording.
+    virtual bool next(eye_message& sample) = 0;
+
+    /// Go back to the first sample.
+    virtual void rewind() = 0;
+};
+
+/// Replays a native recording (.rec) in place through its memory mapping.
+class rec_replay_source
+    : public replay_source,
+      private boost::noncopyable
+{
+public:
+    explicit rec_replay_source(const std::string& filename)
+        : reader_(filename), block_(0), index_(0) {
+    }
+
+    bool next(eye_message& sample) {
+        while (block_ < reader_.block_count() && index_ >= reader_.block_index(block_).count) {
+            ++block_;
+            index_ = 0;
+        }
+        if (block_ == reader_.block_count()) {
+            return false;
+        }
+        sample = reader_.sample(block_, index_++);
+        return true;
+    }
+
+    void rewind() {
+        block_ = 0;
+        index_ = 0;
+    }
+
+private:
+    /// The recording.
+    recording_reader reader_;
+
+    /// Block and sample within it to read next.
+    std::size_t block_;
+    uint32_t index_;
+};
+
+/// Replays a CSV log written by the client. The file is memory mapped and
+/// parsed as it is read, so it is never loaded whole. Lines that do not parse
+/// are skipped and counted.
+class csv_replay_source
+    : public replay_source,
+      private boost::noncopyable
+{
+public:
+    explicit csv_replay_source(const std::string& filename)
+        : base_(0), size_(0), skipped_(0), count_(0) {
+        fd_ = ::open(filename.c_str(), O_RDONLY);
+        if (fd_ < 0) {
+            throw std::runtime_error("unable to open " + filename);
+        }
+        struct stat st;
+        if (fstat(fd_, &st) != 0) {
+            ::close(fd_);
+            throw std::runtime_error("unable to read " + filename);
+        }
+        size_ = st.st_size;
+        if (size_ > 0) {
+            void* base = mmap(0, size_, PROT_READ, MAP_SHARED, fd_, 0);
+            if (base == MAP_FAILED) {
+                ::close(fd_);
+                throw std::runtime_error("unable to map " + filename);
+            }
+            madvise(base, size_, MADV_SEQUENTIAL);
+            base_ = static_cast<const char*>(base);
+        }
+        rewind();
+    }
+
+    ~csv_replay_source() {
+        if (base_) {
+            munmap(const_cast<char*>(base_), size_);
+        }
+        ::close(fd_);
+    }
+
+    bool next(eye_message& sample) {
+        const char* end = base_ + size_;
+        while (p_ != end) {
+            if (csv::parse_row(p_, end, sample)) {
+                // CSV logs carry no sequence numbers; number samples in order.
+                sample.seq_number = count_++;
+                return true;
+            }
+            ++skipped_;
+        }
+        return false;
+    }
+
+    void rewind() {
+        p_ = base_;
+        count_ = 0;
+
+        // Skip the column header line.
+        const char* end = base_ + size_;
+        if (p_ != end && (*p_ < '0' || *p_ > '9')) {
+            const char* line_end = static_cast<const char*>(memchr(p_, '\n', end - p_));
+            p_ = line_end ? line_end + 1 : end;
+        }
+    }
+
+    /// Lines skipped because they did not parse.
+    uint64_t skipped() const {
+        return skipped_;
+    }
+
+private:
+    /// The CSV file and its mapping.
+    int fd_;
+    const char* base_;
+    std::size_t size_;
+
+    /// Start of the next line to parse.
+    const char* p_;
+
+    /// Lines skipped, and samples read in this pass.
+    uint64_t skipped_;
+    uint64_t count_;
+};
+
+/// Open a recording for replay, choosing the reader by file extension.
+inline boost::shared_ptr<replay_source> open_replay_source(const std::string& filename) {
+    std::string::size_type dot = filename.rfind('.');
+    std::string extension = dot == std::string::npos ? "" : filename.substr(dot);
+    if (extension == ".rec") {
+        return boost::shared_ptr<replay_source>(new rec_replay_source(filename));
+    }
+    if (extension == ".csv") {
+        return boost::shared_ptr<replay_source>(new csv_replay_source(filename));
+    }
+    throw std::invalid_argument("unknown recording type, expected .rec or .csv: " + filename);
+}
+
+/// Settings for replaying a recording.
+struct replay_options {
+    replay_options()
+        : speed(1), loop(false) {
+    }
+
+    /// Recording to replay, .rec or .csv; empty to generate samples instead.
+    std::string path;
+
+    /// Playback speed relative to the recording, 2 for twice as fast; 0 for
+    /// as fast as samples can be published.
+    double speed;
+
+    /// Start again from the beginning at the end of the recording.
+    bool loop;
+};
+
+/// Turns a recording into batches of samples due for publishing.
+/**
+ * The replay clock starts with the first batch asked for. At a speed of s,
+ * a sample recorded d nanoseconds after the first is due d / s nanoseconds
+ * after the start, and is stamped with that time, so inter-sample timing is
+ * kept at 1x and compressed above it. At speed 0 each batch holds as many
+ * samples as asked for, stamped with the time they are published.
+ *
+ * Looping continues the timeline: the first sample of the next pass is due
+ * one average sample interval after the last sample of the previous one.
+ */
+class replayer
+    : private boost::noncopyable
+{
+public:
+    replayer(boost::shared_ptr<replay_source> source, const replay_options& options)
+        : source_(source), options_(options), started_(false), have_next_(false),
+          first_ns_(0), start_ns_(0), last_ns_(0), last_offset_(0), pass_samples_(0),
+          passes_(0), replayed_(0) {
+    }
+
+    /// Replace samples with those due at now (wall clock, nanoseconds). At
+    /// speed 0, take up to max samples instead.
+    void fill(std::vector<eye_message>& samples, std::size_t max, uint64_t now) {
+        samples.clear();
+        if (!started_) {
+            started_ = true;
+            start_ns_ = now;
+            last_ns_ = now;
+            have_next_ = source_->next(next_);
+            if (have_next_) {
+                first_ns_ = recording::timestamp_ns(next_.time_seconds, next_.time_nanos);
+                passes_ = 1;
+            }
+        }
+        double due = this->due(now);
+        while (have_next_) {
+            uint64_t stamp = now;
+            if (options_.speed > 0) {
+                uint64_t recorded = recording::timestamp_ns(next_.time_seconds, next_.time_nanos);
+                double offset = recorded > first_ns_ ? double(recorded - first_ns_) : 0;
+                if (offset > due) {
+                    break;
+                }
+                stamp = start_ns_ + uint64_t(offset / options_.speed);
+                last_offset_ = offset;
+            } else if (samples.size() >= max) {
+                break;
+            }
+            samples.push_back(next_);
+            samples.back().time_seconds = stamp / 1000000000u;
+            samples.back().time_nanos = static_cast<uint32_t>(stamp % 1000000000u);
+            last_ns_ = stamp;
+            ++pass_samples_;
+            ++replayed_;
+            advance(now);
+            due = this->due(now);
+        }
+    }
+
+    /// Whether the first batch has been asked for.
+    bool started() const {
+        return started_;
+    }
+
+    /// Whether every sample has been replayed, and the replay does not loop.
+    bool finished() const {
+        return started_ && !have_next_;
+    }
+
+    /// Passes started through the recording, and samples replayed.
+    uint64_t passes() const {
+        return passes_;
+    }
+
+    uint64_t replayed() const {
+        return replayed_;
+    }
+
+private:
+    /// How far into the pass, in recorded nanoseconds, samples are due at now;
+    /// negative before the pass starts.
+    double due(uint64_t now) const {
+        return now >= start_ns_ ? double(now - start_ns_) * options_.speed : -1;
+    }
+
+    /// Read the sample after next_, going round again when looping.
+    void advance(uint64_t now) {
+        have_next_ = source_->next(next_);
+        if (have_next_ || !options_.loop) {
+            return;
+        }
+        source_->rewind();
+        have_next_ = source_->next(next_);
+        if (have_next_) {
+            first_ns_ = recording::timestamp_ns(next_.time_seconds, next_.time_nanos);
+            start_ns_ = now;
+            if (options_.speed > 0) {
+                // A recording with no duration still takes a millisecond a pass.
+                double span = last_offset_ / options_.speed;
+                start_ns_ = last_ns_ + (pass_samples_ > 1 && span >= 1
+                                        ? uint64_t(span / (pass_samples_ - 1)) : 1000000);
+            }
+            last_offset_ = 0;
+            pass_samples_ = 0;
+            ++passes_;
+        }
+    }
+
+    /// Where samples come from.
+    boost::shared_ptr<replay_source> source_;
+
+    /// Speed and looping.
+    replay_options options_;
+
+    /// Whether replay has started, and the sample to replay next, if any.
+    bool started_;
+    bool have_next_;
+    eye_message next_;
+
+    /// Recorded time of the pass's first sample, and the wall clock time it
+    /// was due.
+    uint64_t first_ns_;
+    uint64_t start_ns_;
+
+    /// Stamp given to the latest sample replayed, its recorded time relative
+    /// to the pass's first sample, and samples replayed in this pass.
+    uint64_t last_ns_;
+    double last_offset_;
+    uint64_t pass_samples_;
+
+    /// Progress.
+    uint64_t passes_;
+    uint64_t replayed_;
+};
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_REPLAY_HPP
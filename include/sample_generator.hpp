@@ -0,0 +1,433 @@
+//
+// sample_generator.hpp
+// ~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_SAMPLE_GENERATOR_HPP
+#define CODECHALLENGE_SAMPLE_GENERATOR_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include "eye_message.hpp"
+
+namespace codechallenge
+{
+
+/// xoshiro256** pseudo random generator, run as several independent lanes.
+/**
+ * Each call to step() advances every lane once. The lanes are stored
+ * structure-of-arrays and share no state, so the compiler can vectorise the
+ * step, and filling a buffer costs a fraction of a call to rand() per value.
+ * Lanes are seeded from one 64-bit seed through splitmix64, so a seed always
+ * reproduces the same sequence.
+ */
+class sample_rng
+{
+public:
+    /// Number of independent lanes, and values produced per step.
+    enum { lanes = 4 };
+
+    explicit sample_rng(uint64_t seed = 1) {
+        reseed(seed);
+    }
+
+    /// Restart the sequence from a seed.
+    void reseed(uint64_t seed) {
+        for (int l = 0; l < lanes; ++l) {
+            for (int w = 0; w < 4; ++w) {
+                state_[w][l] = splitmix64(seed);
+            }
+        }
+        left_ = 0;
+    }
+
+    /// Advance every lane, writing one value per lane to out.
+    void step(uint64_t* out) {
+        for (int l = 0; l < lanes; ++l) {
+            out[l] = rotl(state_[1][l] * 5, 7) * 9;
+            uint64_t t = state_[1][l] << 17;
+            state_[2][l] ^= state_[0][l];
+            state_[3][l] ^= state_[1][l];
+            state_[1][l] ^= state_[2][l];
+            state_[0][l] ^= state_[3][l];
+            state_[2][l] ^= t;
+            state_[3][l] = rotl(state_[3][l], 45);
+        }
+    }
+
+    /// One value.
+    uint64_t next() {
+        if (left_ == 0) {
+            step(cache_);
+            left_ = lanes;
+        }
+        return cache_[--left_];
+    }
+
+    /// Fill out with count values uniform in [0, 1).
+    void uniform(float* out, std::size_t count) {
+        uint64_t r[lanes];
+        std::size_t i = 0;
+        for (; i + lanes <= count; i += lanes) {
+            step(r);
+            for (int l = 0; l < lanes; ++l) {
+                out[i + l] = to_unit(r[l]);
+            }
+        }
+        for (; i < count; ++i) {
+            out[i] = to_unit(next());
+        }
+    }
+
+    /// A value uniform in [0, 1).
+    float uniform() {
+        return to_unit(next());
+    }
+
+    /// A value uniform in [0, n).
+    uint32_t below(uint32_t n) {
+        return uint32_t(((next() >> 32) * n) >> 32);
+    }
+
+private:
+    static uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+
+    static uint64_t splitmix64(uint64_t& x) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    /// The top 24 bits as a float in [0, 1).
+    static float to_unit(uint64_t r) {
+        return float(r >> 40) * (1.0f / 16777216.0f);
+    }
+
+    /// The four state words of each lane.
+    uint64_t state_[4][lanes];
+
+    /// Values of the last step not yet handed out by next().
+    uint64_t cache_[lanes];
+    int left_;
+};
+
+/// A batch of samples stored structure-of-arrays, one vector per field, for
+/// generators to fill in tight loops.
+struct sample_columns {
+    /// Resize every column. Capacity is kept, so reuse does not allocate.
+    void resize(std::size_t count) {
+        time_ns.resize(count);
+        id.resize(count);
+        confidence.resize(count);
+        pos_x.resize(count);
+        pos_y.resize(count);
+        pupil_diameter.resize(count);
+    }
+
+    std::size_t size() const {
+        return time_ns.size();
+    }
+
+    std::vector<uint64_t> time_ns;
+    std::vector<uint8_t> id;
+    std::vector<float> confidence;
+    std::vector<float> pos_x;
+    std::vector<float> pos_y;
+    std::vector<uint32_t> pupil_diameter;
+};
+
+/// Produces the gaze fields of generated samples: eye, confidence, position
+/// and pupil diameter. Models keep their state from batch to batch, so motion
+/// continues smoothly across batches.
+class gaze_model
+{
+public:
+    virtual ~gaze_model() {}
+
+    /// Fill every field but time_ns for all samples in columns, which are
+    /// interval_ns apart.
+    virtual void fill(sample_columns& columns, sample_rng& rng, uint64_t interval_ns) = 0;
+};
+
+/// Independent uniform noise for every field, as the server has always sent.
+class uniform_gaze
+    : public gaze_model
+{
+public:
+    void fill(sample_columns& c, sample_rng& rng, uint64_t) {
+        std::size_t n = c.size();
+        rng.uniform(&c.pos_x[0], n);
+        rng.uniform(&c.pos_y[0], n);
+        rng.uniform(&c.confidence[0], n);
+        for (std::size_t i = 0; i < n; ++i) {
+            uint64_t r = rng.next();
+            c.id[i] = uint8_t(r & 1);
+            c.confidence[i] = c.confidence[i] < 0.5f ? 0.0f : 1.0f;
+            c.pupil_diameter[i] = uint32_t(((r >> 32) * 100) >> 32);
+        }
+    }
+};
+
+/// Gaze that behaves like an eye: fixations with small jitter and drift,
+/// joined by fast saccades, with an occasional blink.
+/**
+ * Fixations last 150-450 ms and saccades 20 ms plus 2.2 ms per degree of
+ * amplitude, taking the screen to span 40 degrees. Positions follow a smooth
+ * velocity profile through each saccade. Blinks come every few seconds and
+ * last around 150 ms, during which confidence and pupil diameter read zero.
+ * Pupil diameter wanders slowly around its baseline. Samples alternate
+ * between the left (0) and right (1) eye.
+ */
+class saccade_gaze
+    : public gaze_model
+{
+public:
+    saccade_gaze()
+        : phase_(fixating), phase_left_ns_(0), phase_length_ns_(1), x_(0.5f), y_(0.5f),
+          from_x_(0.5f), from_y_(0.5f), to_x_(0.5f), to_y_(0.5f), pupil_(50.0f),
+          next_blink_ns_(0), eye_(0), started_(false) {
+    }
+
+    void fill(sample_columns& c, sample_rng& rng, uint64_t interval_ns) {
+        std::size_t n = c.size();
+        if (!started_) {
+            started_ = true;
+            start_fixation(rng);
+            next_blink_ns_ = blink_gap(rng);
+        }
+
+        // Noise for every sample in one pass each, then the state machine.
+        rng.uniform(&c.pos_x[0], n);
+        rng.uniform(&c.pos_y[0], n);
+        rng.uniform(&c.confidence[0], n);
+        for (std::size_t i = 0; i < n; ++i) {
+            advance(rng, interval_ns);
+
+            float jitter = phase_ == saccading ? 0.0f : 0.004f;
+            c.pos_x[i] = clamp(x_ + (c.pos_x[i] - 0.5f) * jitter);
+            c.pos_y[i] = clamp(y_ + (c.pos_y[i] - 0.5f) * jitter);
+            c.id[i] = eye_;
+            eye_ ^= 1;
+
+            pupil_ += (c.confidence[i] - 0.5f) * 0.5f + (50.0f - pupil_) * 0.001f;
+            if (phase_ == blinking) {
+                c.confidence[i] = 0.0f;
+                c.pupil_diameter[i] = 0;
+            } else {
+                c.confidence[i] = 0.9f + c.confidence[i] * 0.1f;
+                c.pupil_diameter[i] = uint32_t(std::max(20.0f, std::min(80.0f, pupil_)));
+            }
+        }
+    }
+
+private:
+    enum phase { fixating, saccading, blinking };
+
+    /// Move the state machine on by one sample.
+    void advance(sample_rng& rng, uint64_t interval_ns) {
+        if (next_blink_ns_ <= interval_ns && phase_ != blinking) {
+            phase_ = blinking;
+            phase_left_ns_ = 100000000 + rng.below(100000000);
+            next_blink_ns_ = blink_gap(rng);
+        } else if (phase_ != blinking) {
+            next_blink_ns_ -= interval_ns;
+        }
+
+        if (phase_left_ns_ <= interval_ns) {
+            if (phase_ == fixating) {
+                start_saccade(rng);
+            } else {
+                if (phase_ == saccading) {
+                    x_ = to_x_;
+                    y_ = to_y_;
+                }
+                start_fixation(rng);
+            }
+            return;
+        }
+        phase_left_ns_ -= interval_ns;
+
+        if (phase_ == fixating) {
+            // Slow drift away from the fixation point.
+            x_ += (rng.uniform() - 0.5f) * 0.0005f;
+            y_ += (rng.uniform() - 0.5f) * 0.0005f;
+        } else if (phase_ == saccading) {
+            float t = 1.0f - float(phase_left_ns_) / float(phase_length_ns_);
+            float s = t * t * (3.0f - 2.0f * t);
+            x_ = from_x_ + (to_x_ - from_x_) * s;
+            y_ = from_y_ + (to_y_ - from_y_) * s;
+        }
+    }
+
+    void start_fixation(sample_rng& rng) {
+        phase_ = fixating;
+        phase_left_ns_ = phase_length_ns_ = 150000000 + rng.below(300000000);
+    }
+
+    void start_saccade(sample_rng& rng) {
+        phase_ = saccading;
+        from_x_ = x_;
+        from_y_ = y_;
+        to_x_ = 0.05f + rng.uniform() * 0.9f;
+        to_y_ = 0.05f + rng.uniform() * 0.9f;
+        float dx = to_x_ - from_x_;
+        float dy = to_y_ - from_y_;
+        float degrees = std::sqrt(dx * dx + dy * dy) * 40.0f;
+        phase_left_ns_ = phase_length_ns_ = 20000000 + uint64_t(degrees * 2200000.0f);
+    }
+
+    static uint64_t blink_gap(sample_rng& rng) {
+        return 2000000000ULL + rng.below(4000000000U);
+    }
+
+    static float clamp(float v) {
+        return std::max(0.0f, std::min(1.0f, v));
+    }
+
+    /// What the eye is doing, and for how much longer.
+    phase phase_;
+    uint64_t phase_left_ns_;
+    uint64_t phase_length_ns_;
+
+    /// Current gaze point, and where the saccade in progress runs between.
+    float x_;
+    float y_;
+    float from_x_;
+    float from_y_;
+    float to_x_;
+    float to_y_;
+
+    /// Current pupil diameter.
+    float pupil_;
+
+    /// Time left until the next blink.
+    uint64_t next_blink_ns_;
+
+    /// Eye of the next sample.
+    uint8_t eye_;
+
+    /// Whether the first fixation has been set up.
+    bool started_;
+};
+
+/// Create a gaze model by name: "uniform" or "saccade".
+inline boost::shared_ptr<gaze_model> make_gaze_model(const std::string& name)
+{
+    if (name == "uniform") {
+        return boost::make_shared<uniform_gaze>();
+    }
+    if (name == "saccade") {
+        return boost::make_shared<saccade_gaze>();
+    }
+    throw std::invalid_argument("unknown gaze model: " + name);
+}
+
+/// Settings for a sample_generator.
+struct generator_options {
+    generator_options()
+        : gaze("saccade"), seed(0) {
+    }
+
+    /// Name of the gaze model, see make_gaze_model().
+    std::string gaze;
+
+    /// Seed of the random sequence, 0 to pick one from the clock.
+    uint64_t seed;
+};
+
+/// Generates batches of eye messages, a batch at a time.
+/**
+ * Samples are built structure-of-arrays. The clock is read once per batch by
+ * the caller; sample timestamps are spaced evenly back from it. The gaze
+ * model fills in the rest, and the columns are then written out as messages.
+ * Once the columns have grown to the largest batch, generating does not
+ * allocate.
+ */
+class sample_generator
+    : private boost::noncopyable
+{
+public:
+    explicit sample_generator(const generator_options& options = generator_options())
+        : rng_(options.seed ? options.seed : seed_from_clock()), model_(make_gaze_model(options.gaze)) {
+    }
+
+    /// Fill samples with count messages, interval_ns apart, the last one
+    /// stamped end_ns (nanoseconds since the epoch).
+    void generate(std::vector<eye_message>& samples, std::size_t count,
+                  uint64_t end_ns, uint64_t interval_ns) {
+        columns_.resize(count);
+        samples.resize(count);
+        if (count == 0) {
+            return;
+        }
+        uint64_t first_ns = end_ns - (count - 1) * interval_ns;
+        for (std::size_t i = 0; i < count; ++i) {
+            columns_.time_ns[i] = first_ns + i * interval_ns;
+        }
+        model_->fill(columns_, rng_, interval_ns);
+
+        // Split timestamps into seconds and nanoseconds by carrying, rather
+        // than dividing every one.
+        uint64_t seconds = first_ns / 1000000000;
+        uint64_t nanos = first_ns % 1000000000;
+        for (std::size_t i = 0; i < count; ++i) {
+            eye_message& msg = samples[i];
+            msg.seq_number = 0;
+            msg.time_seconds = seconds;
+            msg.time_nanos = uint32_t(nanos);
+            nanos += interval_ns;
+            while (nanos >= 1000000000) {
+                nanos -= 1000000000;
+                ++seconds;
+            }
+            msg.id = columns_.id[i] != 0;
+            msg.confidence = columns_.confidence[i];
+            msg.normalized_pos_x = columns_.pos_x[i];
+            msg.normalized_pos_y = columns_.pos_y[i];
+            msg.pupil_diameter = columns_.pupil_diameter[i];
+            msg.source_id = 0;
+            msg.source_seq = 0;
+        }
+    }
+
+    /// The columns of the last batch generated.
+    const sample_columns& columns() const {
+        return columns_;
+    }
+
+private:
+    static uint64_t seed_from_clock() {
+        return uint64_t(std::chrono::steady_clock::now().time_since_epoch().count())
+               ^ uint64_t(std::chrono::system_clock::now().time_since_epoch().count());
+    }
+
+    /// Source of randomness.
+    sample_rng rng_;
+
+    /// Fills in the gaze fields.
+    boost::shared_ptr<gaze_model> model_;
+
+    /// The batch being generated.
+    sample_columns columns_;
+};
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_SAMPLE_GENERATOR_HPP
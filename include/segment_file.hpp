@@ -0,0 +1,233 @@
+//
+// segment_file.hpp
+// ~~~~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_SEGMENT_FILE_HPP
+#define CODECHALLENGE_SEGMENT_FILE_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <boost/noncopyable.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace codechallenge
+{
+
+/// When a segment file's data is forced to disk.
+enum sync_policy {
+    /// Never; the kernel writes it back in its own time.
+    sync_none,
+
+    /// When the segment is closed, so every completed segment is durable.
+    sync_segment,
+
+    /// After every flush too, so at most the data handed over since the last
+    /// flush is lost. For a recording that is the block being filled, which
+    /// may span many flush intervals; for CSV it is a flush interval.
+    sync_flush
+};
+
+/// Settings for a segment_file.
+struct segment_file_options {
+    segment_file_options()
+        : write_size(1 << 20), direct_io(false), preallocate(0), sync(sync_segment) {
+    }
+
+    /// Bytes gathered before they are written, rounded up to a multiple of
+    /// segment_file::alignment.
+    std::size_t write_size;
+
+    /// Write with O_DIRECT, bypassing the page cache.
+    bool direct_io;
+
+    /// Bytes of disk to reserve when the file is created, 0 for none.
+    uint64_t preallocate;
+
+    /// When to force data to disk.
+    sync_policy sync;
+};
+
+/// An append-only file written in large, aligned chunks.
+/**
+ * Appended bytes are gathered in an aligned buffer and written write_size at
+ * a time, always starting at an aligned offset; a flush writes the partial
+ * chunk at the end too, but keeps it buffered and writes it again, completed,
+ * next time. So the file can be opened with O_DIRECT, where a flushed tail is
+ * padded to the alignment and the padding cut off when the file is closed.
+ *
+ * Without O_DIRECT, every full chunk's writeback is started as soon as it is
+ * written and waited for, then dropped from the page cache, one chunk later.
+ * Dirty pages never pile up, so the kernel never stalls the process to write
+ * back a large backlog, however long the file grows.
+ */
+class segment_file
+    : private boost::noncopyable
+{
+public:
+    enum { alignment = 4096 };
+
+    segment_file(const std::string& path, const segment_file_options& options = segment_file_options())
+        : path_(path), options_(options), buffer_(0),
+          capacity_(align_up(std::max<std::size_t>(options.write_size, 1))), used_(0), offset_(0),
+          written_back_(0) {
+        int flags = O_WRONLY | O_CREAT | O_TRUNC | (options_.direct_io ? O_DIRECT : 0);
+        fd_ = ::open(path.c_str(), flags, 0644);
+        if (fd_ < 0) {
+            throw std::runtime_error("unable to open " + path
+                                     + (options_.direct_io ? " for direct I/O" : ""));
+        }
+        if (posix_memalign(reinterpret_cast<void**>(&buffer_), alignment, capacity_) != 0) {
+            ::close(fd_);
+            throw std::runtime_error("unable to allocate a write buffer for " + path);
+        }
+        if (options_.preallocate > 0) {
+            // Best effort: not every file system, or device, supports it.
+            fallocate(fd_, FALLOC_FL_KEEP_SIZE, 0, off_t(options_.preallocate));
+        }
+    }
+
+    ~segment_file() {
+        close();
+        free(buffer_);
+    }
+
+    /// Append bytes, writing out every chunk they fill.
+    void append(const void* data, std::size_t size) {
+        const char* p = static_cast<const char*>(data);
+        while (size > 0) {
+            std::size_t n = std::min(size, capacity_ - used_);
+            std::memcpy(buffer_ + used_, p, n);
+            used_ += n;
+            p += n;
+            size -= n;
+            if (used_ == capacity_) {
+                write_out(false);
+            }
+        }
+    }
+
+    /// Write out everything appended so far, and force it to disk if the
+    /// sync policy says so.
+    void flush() {
+        write_out(true);
+        if (options_.sync == sync_flush) {
+            fdatasync(fd_);
+        }
+    }
+
+    /// Write out everything, trim the file to what was appended, force it to
+    /// disk unless the sync policy is sync_none, and close it. Errors are
+    /// reported rather than thrown, as this runs from destructors.
+    void close() {
+        if (fd_ < 0) {
+            return;
+        }
+        try {
+            write_out(true);
+        } catch (std::exception& e) {
+            std::cerr << e.what() << std::endl;
+        }
+        // Cuts off O_DIRECT padding and any preallocated space left over.
+        if (ftruncate(fd_, off_t(size())) != 0 && errno != EINVAL) {
+            std::cerr << "unable to trim " << path_ << std::endl;
+        }
+        if (options_.sync != sync_none) {
+            fdatasync(fd_);
+        }
+        ::close(fd_);
+        fd_ = -1;
+    }
+
+    /// Bytes appended so far.
+    uint64_t size() const {
+        return offset_ + used_;
+    }
+
+    /// The file's path.
+    const std::string& path() const {
+        return path_;
+    }
+
+private:
+    static std::size_t align_up(std::size_t n) {
+        return (n + alignment - 1) & ~std::size_t(alignment - 1);
+    }
+
+    /// Write the whole chunks in the buffer and move past them. With partial,
+    /// write the incomplete chunk after them too, without moving past it.
+    void write_out(bool partial) {
+        std::size_t full = used_ & ~std::size_t(alignment - 1);
+        std::size_t length = full;
+        if (partial && used_ > full) {
+            length = options_.direct_io ? align_up(used_) : used_;
+            std::memset(buffer_ + used_, 0, length - used_);
+        }
+        std::size_t done = 0;
+        while (done < length) {
+            ssize_t written = pwrite(fd_, buffer_ + done, length - done, off_t(offset_ + done));
+            if (written <= 0) {
+                throw std::runtime_error("write to " + path_ + " failed");
+            }
+            done += written;
+        }
+        if (full == 0) {
+            return;
+        }
+        if (!options_.direct_io) {
+            write_back(offset_, full);
+        }
+        std::memmove(buffer_, buffer_ + full, used_ - full);
+        offset_ += full;
+        used_ -= full;
+    }
+
+    /// Start writing back the chunk just written, then wait for everything
+    /// before it and drop it from the page cache. Advisory: files that do not
+    /// support it, like /dev/null, are left to the kernel.
+    void write_back(uint64_t offset, std::size_t length) {
+        sync_file_range(fd_, off_t(offset), off_t(length), SYNC_FILE_RANGE_WRITE);
+        if (written_back_ < offset) {
+            sync_file_range(fd_, off_t(written_back_), off_t(offset - written_back_),
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+                            | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(fd_, off_t(written_back_), off_t(offset - written_back_), POSIX_FADV_DONTNEED);
+            written_back_ = offset;
+        }
+    }
+
+    /// The file's path.
+    std::string path_;
+
+    /// File settings.
+    segment_file_options options_;
+
+    /// The file.
+    int fd_;
+
+    /// Bytes not yet written past, starting at file offset offset_.
+    char* buffer_;
+    std::size_t capacity_;
+    std::size_t used_;
+    uint64_t offset_;
+
+    /// Offset up to which the file has been written back and dropped from
+    /// the page cache.
+    uint64_t written_back_;
+};
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_SEGMENT_FILE_HPP
@@ -0,0 +1,331 @@
+//
+// segment_recorder.hpp
+// ~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_SEGMENT_RECORDER_HPP
+#define CODECHALLENGE_SEGMENT_RECORDER_HPP
+
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "async_logger.hpp"
+#include "metrics.hpp"
+#include "segment_file.hpp"
+
+namespace codechallenge
+{
+
+/// Settings for segmented recording.
+struct recorder_options {
+    recorder_options()
+        : segment_bytes(0), segment_seconds(0), compress(false) {
+    }
+
+    /// Start a new segment once the current one holds this many bytes, 0 for
+    /// no limit.
+    uint64_t segment_bytes;
+
+    /// Start a new segment once the current one is this many seconds old, 0
+    /// for no limit.
+    unsigned int segment_seconds;
+
+    /// gzip each segment once it is closed, on a background thread.
+    bool compress;
+
+    /// How each segment's file is written.
+    segment_file_options file;
+};
+
+/// Metrics of the segmented sinks, registered once, by the first sink.
+struct segment_metrics {
+    static const segment_metrics& instance() {
+        static const segment_metrics m;
+        return m;
+    }
+
+    /// Segments closed, and how long closing each took, syncing included.
+    counter_id closed;
+    histogram_id close_ns;
+
+    /// Segments compressed, and how long each took.
+    counter_id compressed;
+    histogram_id compress_ns;
+
+private:
+    segment_metrics() {
+        metrics& m = metrics::instance();
+        closed = m.add_counter("segments_closed");
+        close_ns = m.add_histogram("segment_close_ns");
+        compressed = m.add_counter("segments_compressed");
+        compress_ns = m.add_histogram("segment_compress_ns");
+    }
+};
+
+/// Compresses closed segments on a background thread of its own, at a lower
+/// priority than the rest of the process.
+/**
+ * Each file is gzipped at the fastest level, a block at a time, to
+ * <file>.gz, and removed once that is complete; if compression fails the
+ * file is kept as it is. Stopping compresses every file already handed over
+ * first.
+ */
+class segment_compressor
+    : private boost::noncopyable
+{
+public:
+    segment_compressor()
+        : metrics_(segment_metrics::instance()), stopping_(false) {
+        thread_.reset(new boost::thread(boost::bind(&segment_compressor::run, this)));
+    }
+
+    ~segment_compressor() {
+        stop();
+    }
+
+    /// Queue a closed file.
+    void compress(const std::string& path) {
+        boost::mutex::scoped_lock lock(mutex_);
+        pending_.push_back(path);
+        ready_.notify_one();
+    }
+
+    /// Compress everything queued, then stop.
+    void stop() {
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            stopping_ = true;
+            ready_.notify_one();
+        }
+        if (thread_) {
+            thread_->join();
+            thread_.reset();
+        }
+    }
+
+private:
+    /// Compressor thread: take files until stopped with none left.
+    void run() {
+        setpriority(PRIO_PROCESS, pid_t(syscall(SYS_gettid)), background_nice);
+        std::vector<char> block(block_size);
+        for (;;) {
+            std::string path;
+            {
+                boost::mutex::scoped_lock lock(mutex_);
+                while (pending_.empty() && !stopping_) {
+                    ready_.wait(lock);
+                }
+                if (pending_.empty()) {
+                    return;
+                }
+                path = pending_.front();
+                pending_.pop_front();
+            }
+            uint64_t start = steady_clock_ns();
+            if (compress_file(path, block)) {
+                metrics::instance().add(metrics_.compressed);
+                metrics::instance().record(metrics_.compress_ns, steady_clock_ns() - start);
+            } else {
+                std::cerr << "Unable to compress " << path << std::endl;
+            }
+        }
+    }
+
+    /// gzip path to path.gz and remove it.
+    static bool compress_file(const std::string& path, std::vector<char>& block) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        std::string compressed = path + ".gz";
+        gzFile out = gzopen(compressed.c_str(), "wb1");
+        bool ok = out != 0;
+        while (ok) {
+            ssize_t n = ::read(fd, &block[0], block.size());
+            if (n <= 0) {
+                ok = n == 0;
+                break;
+            }
+            ok = gzwrite(out, &block[0], unsigned(n)) == int(n);
+        }
+        ::close(fd);
+        if (out && gzclose(out) != Z_OK) {
+            ok = false;
+        }
+        if (!ok) {
+            ::unlink(compressed.c_str());
+            return false;
+        }
+        return ::unlink(path.c_str()) == 0;
+    }
+
+    /// Bytes read and compressed at a time.
+    enum { block_size = 1 << 20 };
+
+    /// Niceness of the compressor thread.
+    enum { background_nice = 10 };
+
+    /// Metrics.
+    const segment_metrics& metrics_;
+
+    /// Files waiting to be compressed, and whether to stop once there are
+    /// none.
+    boost::mutex mutex_;
+    boost::condition_variable ready_;
+    std::deque<std::string> pending_;
+    bool stopping_;
+
+    /// The thread.
+    boost::scoped_ptr<boost::thread> thread_;
+};
+
+/// Makes the sink writing one segment.
+typedef boost::function<log_sink_ptr(const std::string& path)> segment_sink_factory;
+
+/// Make a sink of type Sink, constructed with a path and the file options.
+template <typename Sink>
+log_sink_ptr make_segment_sink(const std::string& path, const segment_file_options& options)
+{
+    return boost::make_shared<Sink>(path, options);
+}
+
+/// Spreads a recording over a sequence of segment files, each complete in
+/// itself, starting a new one when the current one is big enough or old
+/// enough.
+/**
+ * Without a size or age limit there is a single segment, named
+ * <base><extension>. Otherwise segments are numbered: <base>.0000<extension>,
+ * <base>.0001<extension> and so on. Closed segments are handed to the
+ * compressor, if there is one.
+ *
+ * Rotation happens on the writer thread, between chunks, and is judged by
+ * the bytes a segment's sink has written, so a segment may run over its size
+ * limit by what the sink still buffers, a recording block for instance.
+ */
+class segmented_sink
+    : public log_sink
+{
+public:
+    segmented_sink(const std::string& base, const std::string& extension,
+                   const segment_sink_factory& factory, const recorder_options& options,
+                   const boost::shared_ptr<segment_compressor>& compressor)
+        : base_(base), extension_(extension), factory_(factory), options_(options),
+          compressor_(compressor), metrics_(segment_metrics::instance()), index_(0),
+          closed_bytes_(0) {
+        open();
+    }
+
+    ~segmented_sink() {
+        close();
+    }
+
+    void write(const eye_message* samples, std::size_t n, uint64_t first_count) {
+        if (due()) {
+            close();
+            open();
+        }
+        current_->write(samples, n, first_count);
+    }
+
+    void flush() {
+        current_->flush();
+    }
+
+    uint64_t size() const {
+        return closed_bytes_ + current_->size();
+    }
+
+    /// Path of the segment being written.
+    const std::string& path() const {
+        return path_;
+    }
+
+private:
+    /// Whether the current segment has reached a limit.
+    bool due() const {
+        if (options_.segment_bytes > 0 && current_->size() >= options_.segment_bytes) {
+            return true;
+        }
+        std::chrono::seconds max_age(options_.segment_seconds);
+        return max_age.count() > 0 && std::chrono::steady_clock::now() - opened_ >= max_age;
+    }
+
+    /// Start the next segment.
+    void open() {
+        if (options_.segment_bytes == 0 && options_.segment_seconds == 0) {
+            path_ = base_ + extension_;
+        } else {
+            char suffix[16];
+            snprintf(suffix, sizeof(suffix), ".%04u", index_);
+            path_ = base_ + suffix + extension_;
+        }
+        ++index_;
+        current_ = factory_(path_);
+        opened_ = std::chrono::steady_clock::now();
+    }
+
+    /// Finish the current segment, and hand it to the compressor.
+    void close() {
+        if (!current_) {
+            return;
+        }
+        uint64_t start = steady_clock_ns();
+        closed_bytes_ += current_->size();
+        current_.reset();
+        metrics& m = metrics::instance();
+        m.add(metrics_.closed);
+        m.record(metrics_.close_ns, steady_clock_ns() - start);
+        if (compressor_) {
+            compressor_->compress(path_);
+        }
+    }
+
+    /// Segment names are base_, a number if rotating, and extension_.
+    std::string base_;
+    std::string extension_;
+
+    /// Makes the sink for each segment.
+    segment_sink_factory factory_;
+
+    /// Recorder settings.
+    recorder_options options_;
+
+    /// Compresses closed segments; null for none.
+    boost::shared_ptr<segment_compressor> compressor_;
+
+    /// Metrics.
+    const segment_metrics& metrics_;
+
+    /// The segment being written, its path, number and when it was opened.
+    log_sink_ptr current_;
+    std::string path_;
+    unsigned int index_;
+    std::chrono::steady_clock::time_point opened_;
+
+    /// Bytes in the segments already closed.
+    uint64_t closed_bytes_;
+};
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_SEGMENT_RECORDER_HPP
@@ -0,0 +1,191 @@
+//
+// send_queue.hpp
+// ~~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_SEND_QUEUE_HPP
+#define CODECHALLENGE_SEND_QUEUE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include "codec.hpp"
+
+namespace codechallenge
+{
+
+/// What a send queue does with a client that cannot keep up.
+enum slow_consumer_policy {
+    /// When the queue is full, discard its oldest frame.
+    drop_oldest,
+
+    /// Only ever keep the newest frame waiting behind the write in progress.
+    conflate_latest,
+
+    /// When the queue is full, drop the client.
+    disconnect_slow
+};
+
+/// Settings for a send_queue.
+struct send_queue_options {
+    send_queue_options()
+        : max_depth(256), policy(drop_oldest) {
+    }
+
+    /// Most frames waiting behind the write in progress.
+    std::size_t max_depth;
+
+    /// What to do when a frame arrives and the queue is full.
+    slow_consumer_policy policy;
+};
+
+/// Bounded queue of encoded frames waiting to be written to one connection.
+/**
+ * Frames queue up while a write is in progress; when it completes, everything
+ * pending is taken in one go and sent as a single gather write. The queue is
+ * meant to be used from one strand; only the counters may be read from other
+ * threads.
+ *
+ * Pending frames live in a ring allocated once, at its full depth, so queueing
+ * and dropping frames never allocates.
+ */
+class send_queue
+    : private boost::noncopyable
+{
+public:
+    explicit send_queue(const send_queue_options& options = send_queue_options())
+        : options_(options), ring_(std::max<std::size_t>(options.max_depth, 1)), head_(0),
+          size_(0), writing_(false), depth_(0), dropped_(0), high_water_(0) {
+        in_flight_.reserve(ring_.size());
+    }
+
+    /// Queue a frame. Returns false if the policy says the client must be
+    /// dropped instead.
+    bool push(const shared_frame& frame) {
+        if (writing_ && size_ > 0) {
+            if (options_.policy == conflate_latest) {
+                dropped_.fetch_add(size_, std::memory_order_relaxed);
+                clear();
+            } else if (size_ >= ring_.size()) {
+                if (options_.policy == disconnect_slow) {
+                    return false;
+                }
+                pop_front();
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        if (size_ >= ring_.size()) {
+            // Only reachable with no write in progress, which take() prevents
+            // unless the connection is busy writing something else.
+            pop_front();
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
+        ring_[(head_ + size_) % ring_.size()] = frame;
+        ++size_;
+        update_depth();
+        return true;
+    }
+
+    /// Whether a write should be started: frames are pending and no write is
+    /// in progress.
+    bool ready() const {
+        return !writing_ && size_ > 0;
+    }
+
+    /// Take every pending frame for one gather write. They are kept alive
+    /// until complete() is called.
+    const std::vector<shared_frame>& take() {
+        in_flight_.clear();
+        while (size_ > 0) {
+            in_flight_.push_back(ring_[head_]);
+            pop_front();
+        }
+        writing_ = true;
+        update_depth();
+        return in_flight_;
+    }
+
+    /// The write of the frames returned by take() has finished.
+    void complete() {
+        in_flight_.clear();
+        writing_ = false;
+    }
+
+    /// Whether the frames returned by take() are being written.
+    bool writing() const {
+        return writing_;
+    }
+
+    /// Number of frames being written.
+    std::size_t in_flight() const {
+        return in_flight_.size();
+    }
+
+    /// Frames waiting behind the write in progress.
+    std::size_t depth() const {
+        return depth_.load(std::memory_order_relaxed);
+    }
+
+    /// Frames discarded by the policy.
+    uint64_t dropped() const {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+    /// Largest depth seen.
+    std::size_t high_water() const {
+        return high_water_.load(std::memory_order_relaxed);
+    }
+
+private:
+    /// Release the oldest pending frame.
+    void pop_front() {
+        ring_[head_].reset();
+        head_ = (head_ + 1) % ring_.size();
+        --size_;
+    }
+
+    /// Release every pending frame.
+    void clear() {
+        while (size_ > 0) {
+            pop_front();
+        }
+    }
+
+    /// Publish the current depth to the counters.
+    void update_depth() {
+        depth_.store(size_, std::memory_order_relaxed);
+        if (size_ > high_water_.load(std::memory_order_relaxed)) {
+            high_water_.store(size_, std::memory_order_relaxed);
+        }
+    }
+
+    /// Queue settings.
+    send_queue_options options_;
+
+    /// Frames waiting for the next write: size_ frames from head_ onwards.
+    std::vector<shared_frame> ring_;
+    std::size_t head_;
+    std::size_t size_;
+
+    /// Frames being written.
+    std::vector<shared_frame> in_flight_;
+
+    /// Whether a write is in progress.
+    bool writing_;
+
+    /// Counters, readable from any thread.
+    std::atomic<std::size_t> depth_;
+    std::atomic<uint64_t> dropped_;
+    std::atomic<std::size_t> high_water_;
+};
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_SEND_QUEUE_HPP
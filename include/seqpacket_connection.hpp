@@ -0,0 +1,413 @@
+//
+// seqpacket_connection.hpp
+// ~~~~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_SEQPACKET_CONNECTION_HPP
+#define CODECHALLENGE_SEQPACKET_CONNECTION_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/tuple/tuple.hpp>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include "codec.hpp"
+#include "handler_allocator.hpp"
+#include "metrics.hpp"
+
+namespace codechallenge
+{
+
+/// Unix socket carrying one frame per message (SOCK_SEQPACKET), with the
+/// same interface as connection.
+/**
+ * The socket keeps message boundaries, so a frame is sent and received whole
+ * in one go, never split or merged with its neighbours, and nothing has to
+ * be read twice to find where a frame ends. Each message still starts with
+ * the frame header, for its codec, so that the very frames published for
+ * stream connections are sent unchanged; the header's length is checked
+ * against the message's.
+ *
+ * Reads take up to read_batch messages per system call with recvmmsg(); the
+ * rest are handed out by read_buffered() without waiting. Gather writes send
+ * every frame queued in one sendmmsg(). Received messages land in fixed
+ * slots of max_frame bytes; a longer message is an error.
+ *
+ * A message must fit in the sender's socket buffer whole, which is only
+ * about 200 KiB by default; set_max_send() raises it.
+ */
+class seqpacket_connection
+    : private boost::noncopyable
+{
+public:
+    typedef boost::asio::generic::seq_packet_protocol protocol;
+
+    enum {
+        /// Largest frame accepted by default, header included.
+        default_max_frame = 64 * 1024,
+
+        /// Messages taken per read by default.
+        default_read_batch = 32
+    };
+
+    explicit seqpacket_connection(boost::asio::io_service& io_service)
+        : io_service_(io_service), socket_(io_service), codec_(binary_codec_type),
+          received_at_(0), last_frame_size_(0), inbound_(0), inbound_size_(0),
+          max_frame_(0), received_(0), next_(0), max_send_(SIZE_MAX), write_next_(0) {
+        set_max_frame(default_max_frame);
+    }
+
+    ~seqpacket_connection() {
+        release_inbound();
+    }
+
+    /// Get the io_service the connection's operations are dispatched on.
+    boost::asio::io_service& get_io_service() {
+        return io_service_;
+    }
+
+    /// Get the underlying socket. Used for making a connection or for accepting
+    /// an incoming connection.
+    protocol::socket& socket() {
+        return socket_;
+    }
+
+    /// Shut down and close the socket. Outstanding operations complete with
+    /// operation_aborted.
+    void close() {
+        boost::system::error_code e;
+        socket_.shutdown(protocol::socket::shutdown_both, e);
+        socket_.close(e);
+    }
+
+    /// Select the codec used for outgoing messages.
+    void set_codec(codec_type codec) {
+        codec_ = codec;
+    }
+
+    /// Set the largest frame accepted, header included, and how many
+    /// messages each read may take. Messages already read are discarded, so
+    /// call before the first read.
+    void set_max_frame(std::size_t bytes, std::size_t read_batch = default_read_batch) {
+        release_inbound();
+        max_frame_ = bytes;
+        inbound_size_ = bytes * read_batch;
+
+        // Slots are only backed by memory once a message lands in them, so a
+        // connection reading small messages costs a page, not the whole batch.
+        void* base = mmap(0, inbound_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            throw std::runtime_error("mmap failed for the seqpacket read slots");
+        }
+        inbound_ = static_cast<char*>(base);
+        inbound_iovecs_.resize(read_batch);
+        inbound_messages_.resize(read_batch);
+        for (std::size_t i = 0; i < read_batch; ++i) {
+            inbound_iovecs_[i].iov_base = inbound_ + i * max_frame_;
+            inbound_iovecs_[i].iov_len = max_frame_;
+            std::memset(&inbound_messages_[i], 0, sizeof(mmsghdr));
+            inbound_messages_[i].msg_hdr.msg_iov = &inbound_iovecs_[i];
+            inbound_messages_[i].msg_hdr.msg_iovlen = 1;
+        }
+        received_ = 0;
+        next_ = 0;
+    }
+
+    /// Raise the socket's send buffer so that frames of up to bytes fit in a
+    /// message, past the system limit (net.core.wmem_max) if the process is
+    /// allowed to. Returns the largest frame the socket now sends;
+    /// async_write_frames() refuses longer ones with message_size.
+    std::size_t set_max_send(std::size_t bytes) {
+        int fd = socket_.native_handle();
+        int wanted = int(std::min<std::size_t>(bytes + send_overhead, INT_MAX / 2));
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &wanted, sizeof(wanted));
+        if (send_buffer() < std::size_t(wanted) + send_overhead) {
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &wanted, sizeof(wanted));
+        }
+        std::size_t buffer = send_buffer();
+        max_send_ = std::min(bytes, buffer > send_overhead ? buffer - send_overhead : 0);
+        return max_send_;
+    }
+
+    /// Wall clock time, in nanoseconds, at which the last batch of messages
+    /// was received, before any was decoded.
+    uint64_t received_at() const {
+        return received_at_;
+    }
+
+    /// Size of the last frame read, header included.
+    std::size_t last_frame_size() const {
+        return last_frame_size_;
+    }
+
+    /// Asynchronously write a data structure to the socket, as one message.
+    template <typename T, typename Handler>
+    void async_write(const T& t, Handler handler) {
+        if (!encode_frame(codec_, t, outbound_frame_)) {
+            boost::system::error_code error(boost::asio::error::invalid_argument);
+            io_service_.post(boost::bind(handler, error));
+            return;
+        }
+        socket_.async_send(boost::asio::buffer(outbound_frame_), 0,
+                           make_custom_alloc_handler(write_memory_, handler));
+    }
+
+    /// Make room for writes of up to count frames, so that they do not
+    /// allocate.
+    void reserve_frames(std::size_t count) {
+        outbound_iovecs_.reserve(count);
+        outbound_messages_.reserve(count);
+    }
+
+    /// Asynchronously write several encoded frames, a message each, with as
+    /// few sendmmsg() calls as the socket allows. The caller keeps the frames
+    /// alive until the handler is called.
+    template <typename Handler>
+    void async_write_frames(const std::vector<shared_frame>& frames, Handler handler) {
+        for (std::size_t i = 0; i < frames.size(); ++i) {
+            if (frames[i]->size() > max_send_) {
+                boost::system::error_code error(boost::asio::error::message_size);
+                io_service_.post(make_custom_alloc_handler(write_memory_, boost::bind(handler, error)));
+                return;
+            }
+        }
+        outbound_iovecs_.resize(frames.size());
+        outbound_messages_.resize(frames.size());
+        for (std::size_t i = 0; i < frames.size(); ++i) {
+            const std::vector<char>& frame = *frames[i];
+            outbound_iovecs_[i].iov_base = const_cast<char*>(frame.empty() ? 0 : &frame[0]);
+            outbound_iovecs_[i].iov_len = frame.size();
+            std::memset(&outbound_messages_[i], 0, sizeof(mmsghdr));
+            outbound_messages_[i].msg_hdr.msg_iov = &outbound_iovecs_[i];
+            outbound_messages_[i].msg_hdr.msg_iovlen = 1;
+        }
+        write_next_ = 0;
+
+        // The socket usually has room, so try before waiting for it.
+        boost::system::error_code e;
+        if (send_pending(e)) {
+            io_service_.post(make_custom_alloc_handler(write_memory_, boost::bind(handler, e)));
+            return;
+        }
+        wait_writable(handler);
+    }
+
+    /// Asynchronously read a data structure from the socket. Reads from the
+    /// socket only when no message is left from the last read.
+    template <typename T, typename Handler>
+    void async_read(T& t, Handler handler) {
+        boost::system::error_code e;
+        if (read_buffered(t, e) || e) {
+            // Nothing to wait for; complete as if we had read it.
+            io_service_.post(make_custom_alloc_handler(read_memory_, boost::bind(handler, e)));
+            return;
+        }
+        wait_readable(t, handler);
+    }
+
+    /// Decode the next message already read, without reading from the
+    /// socket. Returns false if there is none, with e set if it is not a
+    /// valid frame, or could not be decoded.
+    template <typename T>
+    bool read_buffered(T& t, boost::system::error_code& e) {
+        e = boost::system::error_code();
+        if (next_ == received_) {
+            return false;
+        }
+        const mmsghdr& message = inbound_messages_[next_];
+        const char* data = inbound_ + next_ * max_frame_;
+        std::size_t size = message.msg_len;
+        ++next_;
+        if (size == 0) {
+            e = boost::asio::error::eof;
+            return false;
+        }
+        if (message.msg_hdr.msg_flags & MSG_TRUNC) {
+            e = boost::asio::error::message_size;
+            return false;
+        }
+        frame_header header;
+        if (size < frame_header::length || !header.decode(data)
+                || header.payload_length != size - frame_header::length
+                || !decode_payload(header, data + frame_header::length, t)) {
+            e = boost::asio::error::invalid_argument;
+            return false;
+        }
+        last_frame_size_ = size;
+        return true;
+    }
+
+private:
+    /// Wait until the socket has messages to read.
+    template <typename T, typename Handler>
+    void wait_readable(T& t, Handler handler) {
+        void (seqpacket_connection::*f)(const boost::system::error_code&, T&, boost::tuple<Handler>)
+            = &seqpacket_connection::handle_readable<T, Handler>;
+        socket_.async_wait(protocol::socket::wait_read,
+                           make_custom_alloc_handler(read_memory_,
+                                   boost::bind(f, this, boost::asio::placeholders::error,
+                                               boost::ref(t), boost::make_tuple(handler))));
+    }
+
+    /// Take every message ready, up to a batch, and decode the first.
+    template <typename T, typename Handler>
+    void handle_readable(const boost::system::error_code& e, T& t, boost::tuple<Handler> handler) {
+        if (e) {
+            boost::get<0>(handler)(e);
+            return;
+        }
+        int n = recvmmsg(socket_.native_handle(), &inbound_messages_[0], inbound_messages_.size(),
+                         MSG_DONTWAIT, 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                wait_readable(t, boost::get<0>(handler));
+                return;
+            }
+            boost::get<0>(handler)(boost::system::error_code(errno, boost::system::system_category()));
+            return;
+        }
+        received_at_ = wall_clock_ns();
+        received_ = std::size_t(n);
+        next_ = 0;
+        if (n == 0) {
+            boost::get<0>(handler)(boost::asio::error::eof);
+            return;
+        }
+        boost::system::error_code error;
+        read_buffered(t, error);
+        boost::get<0>(handler)(error);
+    }
+
+    /// Wait until the socket has room for the frames not yet sent.
+    template <typename Handler>
+    void wait_writable(Handler handler) {
+        void (seqpacket_connection::*f)(const boost::system::error_code&, boost::tuple<Handler>)
+            = &seqpacket_connection::handle_writable<Handler>;
+        socket_.async_wait(protocol::socket::wait_write,
+                           make_custom_alloc_handler(write_memory_,
+                                   boost::bind(f, this, boost::asio::placeholders::error,
+                                               boost::make_tuple(handler))));
+    }
+
+    /// Send what the socket has room for, and wait again if that is not all.
+    template <typename Handler>
+    void handle_writable(const boost::system::error_code& e, boost::tuple<Handler> handler) {
+        boost::system::error_code error = e;
+        if (error || send_pending(error)) {
+            boost::get<0>(handler)(error);
+            return;
+        }
+        wait_writable(boost::get<0>(handler));
+    }
+
+    /// Send as many of the frames not yet sent as the socket takes. Returns
+    /// true once all are sent or sending failed, setting e.
+    bool send_pending(boost::system::error_code& e) {
+        while (write_next_ < outbound_messages_.size()) {
+            int n = sendmmsg(socket_.native_handle(), &outbound_messages_[write_next_],
+                             outbound_messages_.size() - write_next_, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return false;
+                }
+                if (errno != EINTR) {
+                    e = boost::system::error_code(errno, boost::system::system_category());
+                    return true;
+                }
+                continue;
+            }
+            write_next_ += n;
+        }
+        return true;
+    }
+
+    /// Size of the socket's send buffer, as the kernel accounts it.
+    std::size_t send_buffer() {
+        int size = 0;
+        socklen_t length = sizeof(size);
+        getsockopt(socket_.native_handle(), SOL_SOCKET, SO_SNDBUF, &size, &length);
+        return std::size_t(std::max(size, 0));
+    }
+
+    /// Bytes of the send buffer the kernel keeps back from every message.
+    enum { send_overhead = 32 };
+
+    /// Unmap the read slots.
+    void release_inbound() {
+        if (inbound_) {
+            munmap(inbound_, inbound_size_);
+            inbound_ = 0;
+        }
+    }
+
+    /// The io_service the connection's operations are dispatched on.
+    boost::asio::io_service& io_service_;
+
+    /// The underlying socket.
+    protocol::socket socket_;
+
+    /// Codec used for outgoing messages.
+    codec_type codec_;
+
+    /// Holds an outbound frame, header followed by payload.
+    std::vector<char> outbound_frame_;
+
+    /// When the last batch of messages was received, and the size of the last
+    /// frame decoded.
+    uint64_t received_at_;
+    std::size_t last_frame_size_;
+
+    /// Slots that read messages land in, max_frame_ bytes each.
+    char* inbound_;
+    std::size_t inbound_size_;
+    std::size_t max_frame_;
+
+    /// recvmmsg() arguments, a message per slot.
+    std::vector<iovec> inbound_iovecs_;
+    std::vector<mmsghdr> inbound_messages_;
+
+    /// Messages taken by the last read, and the next of them to decode.
+    std::size_t received_;
+    std::size_t next_;
+
+    /// Largest frame sent.
+    std::size_t max_send_;
+
+    /// sendmmsg() arguments for the frames being written, and the first of
+    /// them not yet sent.
+    std::vector<iovec> outbound_iovecs_;
+    std::vector<mmsghdr> outbound_messages_;
+    std::size_t write_next_;
+
+    /// Handler memory for the read and for the write in progress.
+    handler_memory read_memory_;
+    handler_memory write_memory_;
+};
+
+typedef boost::shared_ptr<seqpacket_connection> seqpacket_connection_ptr;
+
+/// Start connecting to the server listening on the seqpacket unix socket at
+/// path.
+template <typename Handler>
+void async_connect(seqpacket_connection& conn, const std::string& path, Handler handler)
+{
+    boost::asio::local::stream_protocol::endpoint local(path);
+    conn.socket().async_connect(seqpacket_connection::protocol::endpoint(local), handler);
+}
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_SEQPACKET_CONNECTION_HPP
@@ -0,0 +1,188 @@
+//
+// sequence_tracker.hpp
+// ~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_SEQUENCE_TRACKER_HPP
+#define CODECHALLENGE_SEQUENCE_TRACKER_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "eye_message.hpp"
+
+namespace codechallenge
+{
+
+/// Follows the sequence numbers of received samples, dropping any received
+/// twice and, for a stream that should have every number, noticing gaps.
+/**
+ * Samples numbered past the newest so far are new. A jump past the next
+ * number expected leaves a gap of missing numbers, which is remembered until
+ * it is filled by recovered samples arriving later, out of order. Samples
+ * numbered before the newest that fill no gap are duplicates.
+ *
+ * Gaps found since the last call to take_gap() are merged into one range,
+ * for asking the server to resend. At most max_gaps gaps are remembered; the
+ * oldest is given up on to make room for a new one.
+ */
+class sequence_tracker
+{
+public:
+    enum { max_gaps = 64 };
+
+    /// Start with no samples seen. Gaps are only looked for if detect_gaps,
+    /// as a filtered stream skips numbers by design.
+    explicit sequence_tracker(bool detect_gaps = true)
+        : detect_gaps_(detect_gaps), next_(0), pending_first_(0), pending_last_(0),
+          gap_samples_(0), recovered_(0), duplicates_(0), lost_(0) {
+        missing_.reserve(max_gaps);
+    }
+
+    /// Treat every sample numbered before seq as already seen.
+    void resume_from(uint64_t seq) {
+        next_ = seq;
+    }
+
+    /// Append the samples of in that have not been seen before to out.
+    void accept(const std::vector<eye_message>& in, std::vector<eye_message>& out) {
+        out.clear();
+        for (std::size_t i = 0; i < in.size(); ++i) {
+            uint64_t seq = in[i].seq_number;
+            if (seq >= next_) {
+                if (detect_gaps_ && seq > next_ && next_ != 0) {
+                    add_gap(next_, seq);
+                }
+                next_ = seq + 1;
+                out.push_back(in[i]);
+            } else if (fill(seq)) {
+                ++recovered_;
+                out.push_back(in[i]);
+            } else {
+                ++duplicates_;
+            }
+        }
+    }
+
+    /// Take the range of gaps found since the last call: from first up to,
+    /// but not including, last. Returns false if none were found.
+    bool take_gap(uint64_t& first, uint64_t& last) {
+        if (pending_last_ == 0) {
+            return false;
+        }
+        first = pending_first_;
+        last = pending_last_;
+        pending_first_ = 0;
+        pending_last_ = 0;
+        return true;
+    }
+
+    /// Sequence number expected next.
+    uint64_t next() const {
+        return next_;
+    }
+
+    /// Samples found missing, samples later received to fill a gap,
+    /// duplicates dropped, and samples given up on.
+    uint64_t gap_samples() const {
+        return gap_samples_;
+    }
+
+    uint64_t recovered() const {
+        return recovered_;
+    }
+
+    uint64_t duplicates() const {
+        return duplicates_;
+    }
+
+    uint64_t lost() const {
+        return lost_;
+    }
+
+    /// Samples still missing.
+    uint64_t missing() const {
+        uint64_t total = 0;
+        for (std::size_t i = 0; i < missing_.size(); ++i) {
+            total += missing_[i].last - missing_[i].first;
+        }
+        return total;
+    }
+
+private:
+    /// Missing sequence numbers, from first up to, but not including, last.
+    struct gap {
+        uint64_t first;
+        uint64_t last;
+    };
+
+    /// Remember a new gap, and add it to the range to ask for.
+    void add_gap(uint64_t first, uint64_t last) {
+        if (missing_.size() == max_gaps) {
+            lost_ += missing_.front().last - missing_.front().first;
+            missing_.erase(missing_.begin());
+        }
+        gap g = { first, last };
+        missing_.push_back(g);
+        gap_samples_ += last - first;
+        pending_first_ = pending_last_ == 0 ? first : std::min(pending_first_, first);
+        pending_last_ = std::max(pending_last_, last);
+    }
+
+    /// Take seq out of the gap holding it. Returns false if no gap does.
+    bool fill(uint64_t seq) {
+        for (std::size_t i = 0; i < missing_.size(); ++i) {
+            gap& g = missing_[i];
+            if (seq < g.first || seq >= g.last) {
+                continue;
+            }
+            if (seq == g.first) {
+                ++g.first;
+            } else if (seq + 1 == g.last) {
+                --g.last;
+            } else if (missing_.size() < max_gaps) {
+                gap rest = { seq + 1, g.last };
+                g.last = seq;
+                missing_.insert(missing_.begin() + i + 1, rest);
+            } else {
+                // No room to split the gap; give up on the rest of it.
+                lost_ += g.last - seq - 1;
+                g.last = seq;
+            }
+            if (missing_[i].first == missing_[i].last) {
+                missing_.erase(missing_.begin() + i);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    /// Whether a jump in sequence numbers is a gap.
+    bool detect_gaps_;
+
+    /// One past the newest sequence number seen, 0 before the first sample.
+    uint64_t next_;
+
+    /// Gaps not yet filled, oldest first.
+    std::vector<gap> missing_;
+
+    /// Range of gaps found since the last take_gap(); pending_last_ is 0 if
+    /// there are none.
+    uint64_t pending_first_;
+    uint64_t pending_last_;
+
+    /// Counters.
+    uint64_t gap_samples_;
+    uint64_t recovered_;
+    uint64_t duplicates_;
+    uint64_t lost_;
+};
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_SEQUENCE_TRACKER_HPP
@@ -0,0 +1,232 @@
+//
+// shm_connection.hpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_SHM_CONNECTION_HPP
+#define CODECHALLENGE_SHM_CONNECTION_HPP
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/tuple/tuple.hpp>
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "eye_message.hpp"
+#include "metrics.hpp"
+#include "shm_ring.hpp"
+
+namespace codechallenge
+{
+
+/// How a shared memory reader waits for the producer.
+enum shm_wait_mode {
+    /// Poll the ring from the io_service thread. Lowest latency, burns a core.
+    shm_spin_wait,
+
+    /// Block a helper thread on the ring's futex between samples.
+    shm_futex_wait
+};
+
+/// Same-host transport over a shared memory ring, exposing the same
+/// async_write/async_read interface as connection.
+/**
+ * The producer side create()s the segment and async_write()s batches into it.
+ * Each reader open()s the segment, starts at the producer's current position,
+ * and each async_read() completes with every sample published since the
+ * previous one. Readers that fall a whole ring behind skip ahead; the skipped
+ * samples are counted by lost().
+ */
+class shm_connection
+    : private boost::noncopyable
+{
+public:
+    shm_connection(boost::asio::io_service& io_service, shm_wait_mode mode = shm_futex_wait)
+        : io_service_(io_service), mode_(mode), cursor_(0), lost_(0), closed_(false),
+          received_at_(0), last_frame_size_(0) {
+    }
+
+    ~shm_connection() {
+        close();
+    }
+
+    /// Get the io_service the connection's handlers are dispatched on.
+    boost::asio::io_service& get_io_service() {
+        return io_service_;
+    }
+
+    /// Create the named segment as its only producer.
+    void create(const std::string& name, uint32_t capacity) {
+        ring_.reset(shm_ring::create(name, capacity));
+    }
+
+    /// Attach to the named segment as a reader.
+    void open(const std::string& name) {
+        ring_.reset(shm_ring::open(name));
+        cursor_ = ring_->write_seq();
+        if (mode_ == shm_futex_wait) {
+            wait_work_.reset(new boost::asio::io_service::work(wait_service_));
+            wait_thread_.reset(new boost::thread(
+                                   boost::bind(&boost::asio::io_service::run, &wait_service_)));
+        }
+    }
+
+    /// Stop reading. A pending async_read completes with operation_aborted.
+    void close() {
+        closed_ = true;
+        if (wait_thread_) {
+            ring_->wake_all();
+            wait_work_.reset();
+            wait_service_.stop();
+            wait_thread_->join();
+            wait_thread_.reset();
+        }
+    }
+
+    /// Number of samples a reader missed because it was lapped.
+    uint64_t lost() const {
+        return lost_;
+    }
+
+    /// Wall clock time, in nanoseconds, at which the last read took its
+    /// samples out of the ring.
+    uint64_t received_at() const {
+        return received_at_;
+    }
+
+    /// Bytes copied out of the ring by the last read.
+    std::size_t last_frame_size() const {
+        return last_frame_size_;
+    }
+
+    /// Publish a batch into the ring. Never blocks; the handler is posted.
+    template <typename Handler>
+    void async_write(const std::vector<eye_message>& samples, Handler handler) {
+        ring_->write(samples);
+        io_service_.post(boost::bind(handler, boost::system::error_code()));
+    }
+
+    /// Asynchronously read every sample published since the last read.
+    template <typename Handler>
+    void async_read(std::vector<eye_message>& samples, Handler handler) {
+        if (mode_ == shm_spin_wait) {
+            void (shm_connection::*f)(std::vector<eye_message>&, boost::tuple<Handler>)
+                = &shm_connection::poll<Handler>;
+            io_service_.post(boost::bind(f, this, boost::ref(samples), boost::make_tuple(handler)));
+        } else {
+            // Like a socket read, the pending wait keeps io_service running.
+            void (shm_connection::*f)(std::vector<eye_message>&, boost::tuple<Handler>,
+                                      boost::asio::io_service::work)
+                = &shm_connection::wait<Handler>;
+            wait_service_.post(boost::bind(f, this, boost::ref(samples), boost::make_tuple(handler),
+                                           boost::asio::io_service::work(io_service_)));
+        }
+    }
+
+private:
+    /// Spin mode: check the ring once, then requeue behind other io_service
+    /// work until data shows up.
+    template <typename Handler>
+    void poll(std::vector<eye_message>& samples, boost::tuple<Handler> handler) {
+        if (closed_) {
+            boost::get<0>(handler)(boost::asio::error::operation_aborted);
+        } else if (ring_->read(cursor_, samples, max_batch, lost_)) {
+            mark_received(samples);
+            boost::get<0>(handler)(boost::system::error_code());
+        } else {
+            void (shm_connection::*f)(std::vector<eye_message>&, boost::tuple<Handler>)
+                = &shm_connection::poll<Handler>;
+            io_service_.post(boost::bind(f, this, boost::ref(samples), handler));
+        }
+    }
+
+    /// Futex mode: block the helper thread until data shows up, then hand the
+    /// completion back to the io_service.
+    template <typename Handler>
+    void wait(std::vector<eye_message>& samples, boost::tuple<Handler> handler,
+              boost::asio::io_service::work) {
+        while (!closed_) {
+            uint32_t token = ring_->wait_token();
+            if (ring_->read(cursor_, samples, max_batch, lost_)) {
+                mark_received(samples);
+                io_service_.post(boost::bind(boost::get<0>(handler), boost::system::error_code()));
+                return;
+            }
+            ring_->wait(token, wait_timeout_ns);
+        }
+        boost::system::error_code error(boost::asio::error::operation_aborted);
+        io_service_.post(boost::bind(boost::get<0>(handler), error));
+    }
+
+    /// Note the time and size of a completed read.
+    void mark_received(const std::vector<eye_message>& samples) {
+        received_at_ = wall_clock_ns();
+        last_frame_size_ = samples.size() * sizeof(eye_message);
+    }
+
+    /// Largest number of samples returned by a single read.
+    enum { max_batch = 1024 };
+
+    /// Upper bound on a single futex wait, so close() is never missed.
+    enum { wait_timeout_ns = 100000000 };
+
+    /// The io_service handlers are dispatched on.
+    boost::asio::io_service& io_service_;
+
+    /// How readers wait for data.
+    shm_wait_mode mode_;
+
+    /// The mapped ring.
+    boost::scoped_ptr<shm_ring> ring_;
+
+    /// Sequence number of the next sample this reader will read.
+    uint64_t cursor_;
+
+    /// Samples skipped because the reader was lapped.
+    uint64_t lost_;
+
+    /// Set once the connection is closed.
+    std::atomic_bool closed_;
+
+    /// When the last read completed, and how much it copied. Written before
+    /// the read's handler is posted, so the handler sees them.
+    uint64_t received_at_;
+    std::size_t last_frame_size_;
+
+    /// Runs blocking futex waits off the io_service thread.
+    boost::asio::io_service wait_service_;
+
+    /// Keeps wait_service_ running between reads.
+    boost::scoped_ptr<boost::asio::io_service::work> wait_work_;
+
+    /// Thread running wait_service_.
+    boost::scoped_ptr<boost::thread> wait_thread_;
+};
+
+/// Attach to the shared memory segment published under name. The handler is
+/// posted with not_found if there is no usable segment.
+template <typename Handler>
+void async_connect(shm_connection& conn, const std::string& name, Handler handler)
+{
+    boost::system::error_code error;
+    try {
+        conn.open(name);
+    } catch (std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        error = boost::asio::error::not_found;
+    }
+    conn.get_io_service().post(boost::bind(handler, error));
+}
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_SHM_CONNECTION_HPP
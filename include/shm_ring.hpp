@@ -0,0 +1,309 @@
+//
+// shm_ring.hpp
+// ~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_SHM_RING_HPP
+#define CODECHALLENGE_SHM_RING_HPP
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "eye_message.hpp"
+
+namespace codechallenge
+{
+
+/// Header at the start of a shared memory ring segment.
+struct shm_ring_header {
+    enum { magic_value = 0x45594552 }; // "EYER"
+    enum { layout_version = 1 };
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;
+    uint32_t slot_size;
+
+    /// Sequence number the producer will write next.
+    alignas(64) std::atomic<uint64_t> write_seq;
+
+    /// Bumped after every publish; blocked readers futex-wait on it.
+    alignas(64) std::atomic<uint32_t> futex_word;
+
+    /// Number of readers currently blocked on futex_word.
+    std::atomic<uint32_t> waiters;
+};
+
+/// One fixed size slot of the ring.
+struct shm_ring_slot {
+    /// Marks a slot the producer is currently overwriting.
+    static const uint64_t writing = UINT64_MAX;
+
+    /// Sequence number of the sample held, or writing.
+    std::atomic<uint64_t> seq;
+
+    eye_message msg;
+};
+
+/// A named shared memory segment (under /dev/shm) holding a single-producer,
+/// multi-consumer broadcast ring of eye_message slots.
+/**
+ * The producer never waits for readers: it overwrites the oldest slot. Each
+ * slot carries the sequence number of the sample it holds, which readers use
+ * both to find new samples and to detect that they have been lapped.
+ *
+ * The producer holds an exclusive flock on the segment for as long as it
+ * runs, so another producer can tell a live segment from one left behind by
+ * a producer that died.
+ */
+class shm_ring
+    : private boost::noncopyable
+{
+public:
+    /// Create the segment as its producer, replacing one left behind by a
+    /// producer that has gone, but never one whose producer is still
+    /// running. Capacity is rounded up to a power of two.
+    static shm_ring* create(const std::string& name, uint32_t capacity) {
+        uint32_t slots = 1;
+        while (slots < capacity) {
+            slots <<= 1;
+        }
+        int fd = shm_open(segment_name(name).c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        bool live = false;
+        if (fd < 0 && errno == EEXIST) {
+            live = !remove_stale(name);
+            if (!live) {
+                fd = shm_open(segment_name(name).c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+                live = fd < 0 && errno == EEXIST;
+            }
+        }
+        if (fd < 0) {
+            if (live) {
+                throw std::runtime_error("shared memory segment " + name + " is in use by another producer");
+            }
+            throw std::runtime_error("shm_open failed for " + name);
+        }
+        std::size_t size = sizeof(shm_ring_header) + slots * sizeof(shm_ring_slot);
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0 || ftruncate(fd, size) != 0) {
+            close(fd);
+            shm_unlink(segment_name(name).c_str());
+            throw std::runtime_error("unable to set up shared memory segment " + name);
+        }
+        shm_ring* ring = 0;
+        try {
+            ring = new shm_ring(name, fd, size, true);
+        } catch (...) {
+            shm_unlink(segment_name(name).c_str());
+            throw;
+        }
+
+        shm_ring_header* h = ring->header_;
+        h->capacity = slots;
+        h->slot_size = sizeof(shm_ring_slot);
+        h->write_seq.store(0);
+        h->futex_word.store(0);
+        h->waiters.store(0);
+        for (uint32_t i = 0; i < slots; ++i) {
+            ring->slots_[i].seq.store(shm_ring_slot::writing);
+        }
+        h->version = shm_ring_header::layout_version;
+        std::atomic_thread_fence(std::memory_order_release);
+        h->magic = shm_ring_header::magic_value;
+        return ring;
+    }
+
+    /// Attach to an existing segment as a reader.
+    static shm_ring* open(const std::string& name) {
+        int fd = shm_open(segment_name(name).c_str(), O_RDWR, 0600);
+        if (fd < 0) {
+            throw std::runtime_error("no shared memory segment named " + name);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(shm_ring_header)) {
+            close(fd);
+            throw std::runtime_error("shared memory segment " + name + " is not initialised");
+        }
+        shm_ring* ring = new shm_ring(name, fd, st.st_size, false);
+        const shm_ring_header* h = ring->header_;
+        if (h->magic != shm_ring_header::magic_value
+                || h->version != shm_ring_header::layout_version
+                || h->slot_size != sizeof(shm_ring_slot)
+                || sizeof(shm_ring_header) + std::size_t(h->capacity) * h->slot_size > ring->size_) {
+            delete ring;
+            throw std::runtime_error("shared memory segment " + name + " has an incompatible layout");
+        }
+        return ring;
+    }
+
+    ~shm_ring() {
+        munmap(header_, size_);
+        close(fd_);
+        if (owner_) {
+            shm_unlink(segment_name(name_).c_str());
+        }
+    }
+
+    /// Number of slots in the ring.
+    uint32_t capacity() const {
+        return header_->capacity;
+    }
+
+    /// Sequence number the producer will write next.
+    uint64_t write_seq() const {
+        return header_->write_seq.load(std::memory_order_acquire);
+    }
+
+    /// Publish a batch of samples. Producer only; never blocks.
+    void write(const std::vector<eye_message>& samples) {
+        uint64_t seq = header_->write_seq.load(std::memory_order_relaxed);
+        uint32_t mask = header_->capacity - 1;
+        for (std::size_t i = 0; i < samples.size(); ++i, ++seq) {
+            shm_ring_slot& slot = slots_[seq & mask];
+            slot.seq.store(shm_ring_slot::writing, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            std::memcpy(&slot.msg, &samples[i], sizeof(eye_message));
+            slot.seq.store(seq, std::memory_order_release);
+        }
+        header_->write_seq.store(seq, std::memory_order_release);
+
+        // Wake blocked readers, if any.
+        header_->futex_word.fetch_add(1, std::memory_order_release);
+        if (header_->waiters.load(std::memory_order_acquire) != 0) {
+            futex(FUTEX_WAKE, INT32_MAX, 0);
+        }
+    }
+
+    /// Copy every sample from cursor up to the producer's position (at most
+    /// max_samples) into out, and advance cursor. If the reader has been
+    /// lapped, the overwritten samples are skipped and counted in lost.
+    std::size_t read(uint64_t& cursor, std::vector<eye_message>& out,
+                     std::size_t max_samples, uint64_t& lost) const {
+        out.clear();
+        uint32_t mask = header_->capacity - 1;
+        while (out.size() < max_samples) {
+            uint64_t end = write_seq();
+            if (cursor >= end) {
+                break;
+            }
+            if (end - cursor > header_->capacity) {
+                lost += end - header_->capacity - cursor;
+                cursor = end - header_->capacity;
+            }
+
+            const shm_ring_slot& slot = slots_[cursor & mask];
+            if (slot.seq.load(std::memory_order_acquire) != cursor) {
+                // Overwritten (or being overwritten) since we loaded end.
+                continue;
+            }
+            eye_message msg;
+            std::memcpy(&msg, &slot.msg, sizeof(eye_message));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.seq.load(std::memory_order_relaxed) != cursor) {
+                continue;
+            }
+            out.push_back(msg);
+            ++cursor;
+        }
+        return out.size();
+    }
+
+    /// Value to pass to wait(). Load it before checking for data, so that a
+    /// publish between the check and the wait is not missed.
+    uint32_t wait_token() const {
+        return header_->futex_word.load(std::memory_order_acquire);
+    }
+
+    /// Block until the producer publishes after token was taken, or until the
+    /// timeout expires.
+    void wait(uint32_t token, long timeout_ns) const {
+        struct timespec timeout;
+        timeout.tv_sec = timeout_ns / 1000000000L;
+        timeout.tv_nsec = timeout_ns % 1000000000L;
+        header_->waiters.fetch_add(1, std::memory_order_acq_rel);
+        futex(FUTEX_WAIT, token, &timeout);
+        header_->waiters.fetch_sub(1, std::memory_order_acq_rel);
+    }
+
+    /// Wake every reader blocked in wait().
+    void wake_all() const {
+        futex(FUTEX_WAKE, INT32_MAX, 0);
+    }
+
+private:
+    shm_ring(const std::string& name, int fd, std::size_t size, bool owner)
+        : name_(name), fd_(fd), size_(size), owner_(owner) {
+        void* base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("mmap failed for " + name);
+        }
+        header_ = static_cast<shm_ring_header*>(base);
+        slots_ = reinterpret_cast<shm_ring_slot*>(header_ + 1);
+    }
+
+    /// Unlink the named segment if no producer holds it. Returns whether the
+    /// name is free to create again.
+    static bool remove_stale(const std::string& name) {
+        int fd = shm_open(segment_name(name).c_str(), O_RDWR, 0600);
+        if (fd < 0) {
+            return errno == ENOENT;
+        }
+        bool stale = flock(fd, LOCK_EX | LOCK_NB) == 0;
+        if (stale) {
+            shm_unlink(segment_name(name).c_str());
+        }
+        close(fd);
+        return stale;
+    }
+
+    /// The POSIX name of the segment, i.e. /dev/shm/<name>.
+    static std::string segment_name(const std::string& name) {
+        return "/" + name;
+    }
+
+    /// Shared (not process private) futex operation on the header's futex word.
+    long futex(int op, uint32_t val, const struct timespec* timeout) const {
+        return syscall(SYS_futex, reinterpret_cast<uint32_t*>(&header_->futex_word),
+                       op, val, timeout, 0, 0);
+    }
+
+    /// Name of the segment, without the leading slash.
+    std::string name_;
+
+    /// Descriptor of the open segment.
+    int fd_;
+
+    /// Size of the mapping in bytes.
+    std::size_t size_;
+
+    /// Whether this is the producer, which unlinks the segment when done.
+    bool owner_;
+
+    /// Start of the mapping.
+    shm_ring_header* header_;
+
+    /// The slots, directly after the header.
+    shm_ring_slot* slots_;
+};
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_SHM_RING_HPP
@@ -0,0 +1,108 @@
+//
+// spsc_queue.hpp
+// ~~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_SPSC_QUEUE_HPP
+#define CODECHALLENGE_SPSC_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+namespace codechallenge
+{
+
+/// Bounded, lock-free queue for exactly one producer thread and one consumer
+/// thread.
+/**
+ * Capacity is rounded up to a power of two. The producer and consumer each
+ * cache the other side's index so that the shared indices are only touched
+ * when the cached value says the queue looks full (or empty).
+ */
+template <typename T>
+class spsc_queue
+    : private boost::noncopyable
+{
+public:
+    explicit spsc_queue(std::size_t capacity)
+        : head_(0), cached_tail_(0), tail_(0), cached_head_(0) {
+        std::size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        buffer_.resize(size);
+        mask_ = size - 1;
+    }
+
+    /// Number of elements the queue can hold.
+    std::size_t capacity() const {
+        return buffer_.size();
+    }
+
+    /// Approximate number of queued elements. Exact from either end's thread.
+    std::size_t size() const {
+        return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+    }
+
+    /// Producer: append one element. Returns false if the queue is full.
+    bool try_push(const T& value) {
+        std::size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - cached_head_ == buffer_.size()) {
+            cached_head_ = head_.load(std::memory_order_acquire);
+            if (tail - cached_head_ == buffer_.size()) {
+                return false;
+            }
+        }
+        buffer_[tail & mask_] = value;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// Consumer: remove up to max elements into out. Returns the number taken.
+    std::size_t pop_bulk(T* out, std::size_t max) {
+        std::size_t head = head_.load(std::memory_order_relaxed);
+        if (cached_tail_ - head < max) {
+            cached_tail_ = tail_.load(std::memory_order_acquire);
+        }
+        std::size_t count = cached_tail_ - head;
+        if (count > max) {
+            count = max;
+        }
+        for (std::size_t i = 0; i < count; ++i) {
+            out[i] = buffer_[(head + i) & mask_];
+        }
+        head_.store(head + count, std::memory_order_release);
+        return count;
+    }
+
+    /// Consumer: remove one element. Returns false if the queue is empty.
+    bool try_pop(T& out) {
+        return pop_bulk(&out, 1) == 1;
+    }
+
+private:
+    /// Element storage.
+    std::vector<T> buffer_;
+
+    /// capacity() - 1.
+    std::size_t mask_;
+
+    /// Consumer's index, and its copy of the producer's.
+    alignas(64) std::atomic<std::size_t> head_;
+    std::size_t cached_tail_;
+
+    /// Producer's index, and its copy of the consumer's.
+    alignas(64) std::atomic<std::size_t> tail_;
+    std::size_t cached_head_;
+};
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_SPSC_QUEUE_HPP
@@ -0,0 +1,205 @@
+//
+// subscription.hpp
+// ~~~~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_SUBSCRIPTION_HPP
+#define CODECHALLENGE_SUBSCRIPTION_HPP
+
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <boost/tuple/tuple.hpp>
+#include <boost/tuple/tuple_comparison.hpp>
+#include "codec.hpp"
+#include "eye_message.hpp"
+
+namespace codechallenge
+{
+
+/// Which samples a client wants, and how they should be encoded. Sent by the
+/// client after connecting; until then, and for clients that never send one,
+/// every sample is delivered in the server's encoding.
+/**
+ * A sample is delivered if it is from the chosen eye, has at least the minimum
+ * confidence and lies within the region of interest. Of the samples that pass,
+ * every decimation-th one is delivered.
+ *
+ * A subscription may also ask for retained samples from before it was made:
+ * every sample with a sequence number from resume_from up to, but not
+ * including, resume_to (0 for the newest retained) is sent ahead of the live
+ * stream. Clients use this to join late without losing data, or to fill a
+ * gap in the sequence numbers they received. Resume ranges are not part of
+ * what is subscribed to, so they do not split views.
+ *
+ * On the wire the payload of a subscription frame is 43 bytes, little-endian:
+ * @li 1 byte: eye, 0 or 1, or 255 for either.
+ * @li 4 bytes: minimum confidence, float.
+ * @li 4 bytes: decimation factor, at least 1.
+ * @li 16 bytes: region of interest as min x, min y, max x, max y, floats.
+ * @li 1 byte: codec_type for batches, or 0 for the server's.
+ * @li 1 byte: precision, for the compact codec.
+ * @li 8 bytes: first sequence number to resume from, 0 for none.
+ * @li 8 bytes: sequence number to resume up to, 0 for the newest.
+ */
+struct subscription {
+    enum { payload_length = 1 + 4 + 4 + 16 + 1 + 1 + 8 + 8, any_eye = 255, server_codec = 0 };
+
+    /// The default subscription passes everything in the server's encoding.
+    subscription()
+        : eye(any_eye), min_confidence(0), decimation(1),
+          min_x(0), min_y(0), max_x(1), max_y(1),
+          codec(server_codec), precision(compact_codec::lossless), resume_from(0), resume_to(0) {
+    }
+
+    /// Whether every sample passes.
+    bool is_all() const {
+        return eye == any_eye && min_confidence <= 0 && decimation <= 1
+               && min_x <= 0 && min_y <= 0 && max_x >= 1 && max_y >= 1;
+    }
+
+    /// Whether the thresholds are usable: finite, a confidence within [0, 1]
+    /// and a region no smaller than a point. Others, NaN in particular, could
+    /// not be ordered among views.
+    bool valid() const {
+        return std::isfinite(min_confidence) && std::isfinite(min_x) && std::isfinite(min_y)
+               && std::isfinite(max_x) && std::isfinite(max_y)
+               && min_confidence >= 0 && min_confidence <= 1 && min_x <= max_x && min_y <= max_y;
+    }
+
+    /// Whether the server's encoding is wanted.
+    bool is_server_codec() const {
+        return codec == server_codec;
+    }
+
+    /// Whether retained samples are asked for.
+    bool is_resume() const {
+        return resume_from != 0;
+    }
+
+    /// Whether a sequence number is within the resume range.
+    bool resumes(uint64_t seq) const {
+        return seq >= resume_from && (resume_to == 0 || seq < resume_to);
+    }
+
+    /// Whether a sample passes the predicates, decimation aside.
+    bool matches(const eye_message& m) const {
+        return (eye == any_eye || eye == (m.id ? 1 : 0))
+               && m.confidence >= min_confidence
+               && m.normalized_pos_x >= min_x && m.normalized_pos_x <= max_x
+               && m.normalized_pos_y >= min_y && m.normalized_pos_y <= max_y;
+    }
+
+    /// Append the samples of in that are delivered to out. seen counts the
+    /// matching samples so far, so that decimation carries across batches.
+    void apply(const std::vector<eye_message>& in, std::vector<eye_message>& out, uint64_t& seen) const {
+        out.clear();
+        uint32_t every = decimation ? decimation : 1;
+        for (std::size_t i = 0; i < in.size(); ++i) {
+            if (matches(in[i]) && seen++ % every == 0) {
+                out.push_back(in[i]);
+            }
+        }
+    }
+
+    /// Orders subscriptions, so that identical ones can be grouped.
+    bool operator<(const subscription& other) const {
+        return boost::make_tuple(eye, min_confidence, decimation, min_x, min_y, max_x, max_y, codec, precision)
+               < boost::make_tuple(other.eye, other.min_confidence, other.decimation,
+                                   other.min_x, other.min_y, other.max_x, other.max_y,
+                                   other.codec, other.precision);
+    }
+
+    /// Write the payload into the first payload_length bytes of out.
+    void encode(char* out) const {
+        out[0] = static_cast<char>(eye);
+        wire::put(out + 1, min_confidence);
+        wire::put(out + 5, decimation);
+        wire::put(out + 9, min_x);
+        wire::put(out + 13, min_y);
+        wire::put(out + 17, max_x);
+        wire::put(out + 21, max_y);
+        out[25] = static_cast<char>(codec);
+        out[26] = static_cast<char>(precision);
+        wire::put(out + 27, resume_from);
+        wire::put(out + 35, resume_to);
+    }
+
+    /// Read the payload. Returns false if it is malformed.
+    bool decode(const char* in, std::size_t size) {
+        if (size != payload_length) {
+            return false;
+        }
+        eye = static_cast<uint8_t>(in[0]);
+        min_confidence = wire::get<float>(in + 1);
+        decimation = wire::get<uint32_t>(in + 5);
+        min_x = wire::get<float>(in + 9);
+        min_y = wire::get<float>(in + 13);
+        max_x = wire::get<float>(in + 17);
+        max_y = wire::get<float>(in + 21);
+        codec = static_cast<uint8_t>(in[25]);
+        precision = static_cast<uint8_t>(in[26]);
+        resume_from = wire::get<uint64_t>(in + 27);
+        resume_to = wire::get<uint64_t>(in + 35);
+        return (eye == 0 || eye == 1 || eye == any_eye) && decimation >= 1 && valid()
+               && (codec == server_codec || codec == binary_codec_type || codec == text_codec_type
+                   || codec == compact_codec_type)
+               && precision <= compact_codec::max_precision
+               && (resume_to == 0 || resume_to > resume_from);
+    }
+
+    /// Eye to deliver, or any_eye.
+    uint8_t eye;
+
+    /// Lowest confidence delivered.
+    float min_confidence;
+
+    /// Deliver one in this many matching samples.
+    uint32_t decimation;
+
+    /// Region of interest, inclusive, in normalized coordinates.
+    float min_x;
+    float min_y;
+    float max_x;
+    float max_y;
+
+    /// Codec for delivered batches, or server_codec, and the compact codec's
+    /// precision.
+    uint8_t codec;
+    uint8_t precision;
+
+    /// Retained samples to send ahead of the live stream.
+    uint64_t resume_from;
+    uint64_t resume_to;
+};
+
+/// Encode a subscription request as a complete frame. Found by argument
+/// dependent lookup from connection::async_write(); the codec is ignored, as
+/// subscriptions have an encoding of their own.
+inline bool encode_frame(codec_type, const subscription& s, std::vector<char>& frame)
+{
+    frame.resize(frame_header::length + subscription::payload_length);
+    frame_header header;
+    header.payload_length = subscription::payload_length;
+    header.codec = subscription_codec_type;
+    header.version = wire_version;
+    header.encode(&frame[0]);
+    s.encode(&frame[frame_header::length]);
+    return true;
+}
+
+/// Decode a subscription request whose header has already been read.
+inline bool decode_payload(const frame_header& header, const char* data, subscription& s)
+{
+    return header.codec == subscription_codec_type && s.decode(data, header.payload_length);
+}
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_SUBSCRIPTION_HPP
@@ -0,0 +1,257 @@
+//
+// uring.hpp
+// ~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_URING_HPP
+#define CODECHALLENGE_URING_HPP
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// Multishot receive is the newest feature used; without it there is no
+// io_uring backend and uring_service::supported() is false.
+#ifdef IORING_RECV_MULTISHOT
+#define CODECHALLENGE_HAS_URING 1
+#endif
+
+#ifdef CODECHALLENGE_HAS_URING
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/system/error_code.hpp>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace codechallenge
+{
+
+/// An io_uring instance, set up and driven with the raw system calls.
+/**
+ * Only one thread may prepare and submit entries, and only one may take
+ * completions, at a time; uring_service serialises both.
+ */
+class uring
+    : private boost::noncopyable
+{
+public:
+    uring()
+        : fd_(-1), sq_ring_(0), sq_ring_size_(0), cq_ring_(0), cq_ring_size_(0), sqes_(0),
+          sq_entries_(0), sqe_tail_(0), submitted_(0) {
+        std::memset(&params_, 0, sizeof(params_));
+    }
+
+    ~uring() {
+        close();
+    }
+
+    /// Set up a ring with room for sq_entries submissions and cq_entries
+    /// completions, both powers of two. Returns false, with e set, if the
+    /// kernel has no io_uring or does not allow it.
+    bool open(unsigned int sq_entries, unsigned int cq_entries, boost::system::error_code& e) {
+        close();
+        std::memset(&params_, 0, sizeof(params_));
+        params_.flags = IORING_SETUP_CQSIZE;
+        params_.cq_entries = cq_entries;
+        int fd = static_cast<int>(syscall(__NR_io_uring_setup, sq_entries, &params_));
+        if (fd < 0) {
+            e = boost::system::error_code(errno, boost::system::system_category());
+            return false;
+        }
+        fd_ = fd;
+
+        // Map the submission and completion rings, in one mapping if the
+        // kernel shares them, and the submission entries.
+        sq_ring_size_ = params_.sq_off.array + params_.sq_entries * sizeof(uint32_t);
+        cq_ring_size_ = params_.cq_off.cqes + params_.cq_entries * sizeof(io_uring_cqe);
+        if (params_.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        }
+        sq_ring_ = map(sq_ring_size_, IORING_OFF_SQ_RING);
+        if (!sq_ring_) {
+            return fail(e);
+        }
+        if (params_.features & IORING_FEAT_SINGLE_MMAP) {
+            cq_ring_ = sq_ring_;
+        } else if (!(cq_ring_ = map(cq_ring_size_, IORING_OFF_CQ_RING))) {
+            return fail(e);
+        }
+        sqes_ = static_cast<io_uring_sqe*>(map(params_.sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES));
+        if (!sqes_) {
+            return fail(e);
+        }
+
+        sq_entries_ = params_.sq_entries;
+        sq_head_ = field<unsigned int>(sq_ring_, params_.sq_off.head);
+        sq_tail_ = field<unsigned int>(sq_ring_, params_.sq_off.tail);
+        sq_mask_ = *field<unsigned int>(sq_ring_, params_.sq_off.ring_mask);
+        cq_head_ = field<unsigned int>(cq_ring_, params_.cq_off.head);
+        cq_tail_ = field<unsigned int>(cq_ring_, params_.cq_off.tail);
+        cq_mask_ = *field<unsigned int>(cq_ring_, params_.cq_off.ring_mask);
+        cqes_ = field<io_uring_cqe>(cq_ring_, params_.cq_off.cqes);
+
+        // Entries are always submitted in ring order.
+        unsigned int* array = field<unsigned int>(sq_ring_, params_.sq_off.array);
+        for (unsigned int i = 0; i < sq_entries_; ++i) {
+            array[i] = i;
+        }
+        sqe_tail_ = submitted_ = *sq_tail_;
+        return true;
+    }
+
+    /// Tear the ring down. Operations still in flight are cancelled.
+    void close() {
+        if (sqes_) {
+            munmap(sqes_, params_.sq_entries * sizeof(io_uring_sqe));
+            sqes_ = 0;
+        }
+        if (cq_ring_ && cq_ring_ != sq_ring_) {
+            munmap(cq_ring_, cq_ring_size_);
+        }
+        cq_ring_ = 0;
+        if (sq_ring_) {
+            munmap(sq_ring_, sq_ring_size_);
+            sq_ring_ = 0;
+        }
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    /// The next free submission entry, cleared, or 0 if every entry is
+    /// prepared and not yet taken by the kernel.
+    io_uring_sqe* get_sqe() {
+        unsigned int head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        if (sqe_tail_ - head >= sq_entries_) {
+            return 0;
+        }
+        io_uring_sqe* sqe = &sqes_[sqe_tail_ & sq_mask_];
+        ++sqe_tail_;
+        std::memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    /// Entries prepared and not yet submitted.
+    unsigned int pending() const {
+        return sqe_tail_ - submitted_;
+    }
+
+    /// Hand every prepared entry to the kernel in one system call. Returns
+    /// the number submitted.
+    unsigned int submit(boost::system::error_code& e) {
+        unsigned int count = pending();
+        if (count == 0) {
+            return 0;
+        }
+        __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+        int ret = static_cast<int>(syscall(__NR_io_uring_enter, fd_, count, 0, 0, 0, 0));
+        if (ret < 0) {
+            e = boost::system::error_code(errno, boost::system::system_category());
+            return 0;
+        }
+        submitted_ += ret;
+        return static_cast<unsigned int>(ret);
+    }
+
+    /// Take the oldest completion. Returns false if there is none.
+    bool peek(io_uring_cqe& cqe) {
+        unsigned int head = *cq_head_;
+        if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+        cqe = cqes_[head & cq_mask_];
+        __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    /// Register resources with the ring: files, buffers, an eventfd.
+    bool register_resource(unsigned int opcode, const void* arg, unsigned int count,
+                           boost::system::error_code& e) {
+        if (syscall(__NR_io_uring_register, fd_, opcode, arg, count) < 0) {
+            e = boost::system::error_code(errno, boost::system::system_category());
+            return false;
+        }
+        return true;
+    }
+
+    /// Whether the kernel knows the operation.
+    bool supports(unsigned int opcode) {
+        std::vector<char> space(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+        io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(&space[0]);
+        boost::system::error_code e;
+        if (!register_resource(IORING_REGISTER_PROBE, probe, 256, e) || opcode > probe->last_op) {
+            return false;
+        }
+        return (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED) != 0;
+    }
+
+    /// Features the kernel reported.
+    uint32_t features() const {
+        return params_.features;
+    }
+
+private:
+    /// Map part of the ring, or return 0.
+    void* map(std::size_t size, off_t offset) {
+        void* p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+        return p == MAP_FAILED ? 0 : p;
+    }
+
+    /// Give up on setting up, with e set from errno.
+    bool fail(boost::system::error_code& e) {
+        e = boost::system::error_code(errno, boost::system::system_category());
+        close();
+        return false;
+    }
+
+    template <typename T>
+    static T* field(void* base, uint32_t offset) {
+        return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+    }
+
+    /// The ring's file descriptor and what the kernel told us about it.
+    int fd_;
+    io_uring_params params_;
+
+    /// The mapped rings and submission entries.
+    void* sq_ring_;
+    std::size_t sq_ring_size_;
+    void* cq_ring_;
+    std::size_t cq_ring_size_;
+    io_uring_sqe* sqes_;
+
+    /// Submission ring: shared head and tail, and our own tail of entries
+    /// prepared and of entries submitted.
+    unsigned int* sq_head_;
+    unsigned int* sq_tail_;
+    unsigned int sq_mask_;
+    unsigned int sq_entries_;
+    unsigned int sqe_tail_;
+    unsigned int submitted_;
+
+    /// Completion ring.
+    unsigned int* cq_head_;
+    unsigned int* cq_tail_;
+    unsigned int cq_mask_;
+    io_uring_cqe* cqes_;
+};
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_HAS_URING
+
+#endif // CODECHALLENGE_URING_HPP
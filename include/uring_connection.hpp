@@ -0,0 +1,1038 @@
+//
+// uring_connection.hpp
+// ~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef CODECHALLENGE_URING_CONNECTION_HPP
+#define CODECHALLENGE_URING_CONNECTION_HPP
+
+#include "connection.hpp"
+#include "uring.hpp"
+
+#ifdef CODECHALLENGE_HAS_URING
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread/mutex.hpp>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+namespace codechallenge
+{
+
+#ifdef CODECHALLENGE_HAS_URING
+
+class uring_connection;
+
+/// Holds one completion handler in place, so that storing it does not
+/// allocate.
+class uring_handler
+{
+public:
+    enum { capacity = 128 };
+
+    uring_handler()
+        : manage_(0) {
+    }
+
+    uring_handler(uring_handler&& other) noexcept
+        : manage_(0) {
+        other.move_to(*this);
+    }
+
+    ~uring_handler() {
+        reset();
+    }
+
+    /// Hold handler, replacing any held before.
+    template <typename Handler>
+    void set(Handler handler) {
+        static_assert(sizeof(Handler) <= capacity, "handler too large for a uring_handler");
+        reset();
+        new (&storage_) Handler(std::move(handler));
+        manage_ = &manage<Handler>;
+    }
+
+    /// Whether a handler is held.
+    bool empty() const {
+        return manage_ == 0;
+    }
+
+    /// Call the handler. It is no longer held once called, so it may hold
+    /// another.
+    void operator()(const boost::system::error_code& e) {
+        manage_function manage = manage_;
+        manage_ = 0;
+        manage(call_handler, &storage_, 0, &e);
+    }
+
+    /// Hand the handler over to other.
+    void move_to(uring_handler& other) {
+        other.reset();
+        if (manage_) {
+            manage_(move_handler, &storage_, &other.storage_, 0);
+            other.manage_ = manage_;
+            manage_ = 0;
+        }
+    }
+
+    /// Destroy the handler without calling it.
+    void reset() {
+        if (manage_) {
+            manage_(destroy_handler, &storage_, 0, 0);
+            manage_ = 0;
+        }
+    }
+
+private:
+    enum operation { call_handler, move_handler, destroy_handler };
+    typedef void (*manage_function)(operation, void*, void*, const boost::system::error_code*);
+
+    template <typename Handler>
+    static void manage(operation op, void* from, void* to, const boost::system::error_code* e) {
+        Handler* handler = static_cast<Handler*>(from);
+        if (op == call_handler) {
+            Handler local(std::move(*handler));
+            handler->~Handler();
+            local(*e);
+        } else if (op == move_handler) {
+            new (to) Handler(std::move(*handler));
+            handler->~Handler();
+        } else {
+            handler->~Handler();
+        }
+    }
+
+    /// Calls, moves or destroys the handler held, 0 if none is.
+    manage_function manage_;
+
+    /// The handler.
+    std::aligned_storage<capacity, alignof(std::max_align_t)>::type storage_;
+};
+
+/// A handler taken out of a connection, to be called with its result once
+/// the service's lock is released.
+struct uring_completion {
+    uring_completion() {
+    }
+
+    uring_completion(uring_completion&& other) noexcept
+        : error(other.error) {
+        other.handler.move_to(handler);
+    }
+
+    uring_handler handler;
+    boost::system::error_code error;
+
+};
+
+/// Runs the io_uring instance shared by every uring_connection on an
+/// io_service, as an asio service.
+/**
+ * Connections prepare submissions under the service's lock and ask for a
+ * submit, which is posted to the io_service. Every submission prepared
+ * before it runs goes to the kernel in that one system call, so the writes
+ * of all the sessions a published batch is delivered to share one
+ * io_uring_enter rather than making a sendmsg each.
+ *
+ * Connection sockets are registered as fixed files, so operations skip the
+ * file table lookup. Received data lands in provided buffers handed to the
+ * kernel once, in one group shared by every connection, and handed back
+ * one at a time, in the same batched submit, as they are emptied; each
+ * connection keeps one multishot receive armed, which completes once per
+ * arrival without being submitted again.
+ *
+ * Completions are signalled on an eventfd the io_service waits on. They are
+ * taken under the lock, and the handlers they complete are called after it
+ * is released.
+ */
+class uring_service
+    : public boost::asio::detail::service_base<uring_service>
+{
+public:
+    enum {
+        /// Ring sizes.
+        submission_entries = 1024,
+        completion_entries = 8192,
+
+        /// Connections that can be open at once, one fixed file each.
+        max_connections = 4096,
+
+        /// Provided receive buffers, a power of two, and their size.
+        buffer_count = 1024,
+        buffer_size = 16 * 1024,
+        buffer_group = 0
+    };
+
+    /// Kinds of operation, kept in the low bits of each submission's
+    /// user_data; the rest holds the connection's slot and generation.
+    enum operation_kind { receive_operation = 0, send_operation = 1, provide_operation = 2 };
+
+    /// Whether this kernel has everything the service needs: io_uring, and
+    /// the operations it uses.
+    static bool supported() {
+        static const bool result = probe();
+        return result;
+    }
+
+    explicit uring_service(boost::asio::io_service& io_service)
+        : boost::asio::detail::service_base<uring_service>(io_service),
+          io_service_(io_service), events_(io_service), event_fd_(-1), buffers_(0),
+          submit_scheduled_(false), open_(false) {
+        metrics& m = metrics::instance();
+        enters_ = m.add_counter("uring_enters");
+        submitted_ = m.add_counter("uring_submitted");
+        completed_ = m.add_counter("uring_completed");
+        open_ = setup(error_);
+        if (open_) {
+            ready_.reserve(1024);
+            wait();
+        }
+    }
+
+    ~uring_service() {
+        ring_.close();
+        if (buffers_) {
+            munmap(buffers_, std::size_t(buffer_count) * buffer_size);
+        }
+    }
+
+    /// Stop waiting for completions.
+    void shutdown() {
+        boost::system::error_code e;
+        events_.close(e);
+    }
+
+    /// Why the ring could not be set up, if it could not.
+    const boost::system::error_code& error() const {
+        return error_;
+    }
+
+private:
+    friend class uring_connection;
+
+    /// Which connection holds a fixed file slot. The generation changes
+    /// whenever the slot is let go, so late completions for the connection
+    /// that held it before are recognised.
+    struct slot_entry {
+        slot_entry()
+            : owner(0), generation(0) {
+        }
+
+        uring_connection* owner;
+        uint32_t generation;
+    };
+
+    enum { generation_mask = 0x3fffffff };
+
+    /// Set up a throwaway ring to see what the kernel offers.
+    static bool probe() {
+        uring ring;
+        boost::system::error_code e;
+        if (!ring.open(4, 8, e) || !(ring.features() & IORING_FEAT_CQE_SKIP) ||
+            !ring.supports(IORING_OP_RECV) || !ring.supports(IORING_OP_SENDMSG) ||
+            !ring.supports(IORING_OP_PROVIDE_BUFFERS)) {
+            return false;
+        }
+        std::vector<int> files(1, -1);
+        return ring.register_resource(IORING_REGISTER_FILES, &files[0], 1, e);
+    }
+
+    /// Create the ring and register the fixed file table, the provided
+    /// buffers and the eventfd with it.
+    bool setup(boost::system::error_code& e) {
+        if (!ring_.open(submission_entries, completion_entries, e)) {
+            return false;
+        }
+
+        std::vector<int> files(max_connections, -1);
+        if (!ring_.register_resource(IORING_REGISTER_FILES, &files[0], max_connections, e)) {
+            return false;
+        }
+        slots_.resize(max_connections);
+        free_slots_.reserve(max_connections);
+        for (uint32_t i = max_connections; i > 0; --i) {
+            free_slots_.push_back(i - 1);
+        }
+        starved_.reserve(max_connections);
+
+        void* buffers = mmap(0, std::size_t(buffer_count) * buffer_size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffers == MAP_FAILED) {
+            e = boost::system::error_code(errno, boost::system::system_category());
+            return false;
+        }
+        buffers_ = static_cast<char*>(buffers);
+        provide(0, buffer_count);
+        ring_.submit(e);
+        if (e) {
+            return false;
+        }
+
+        event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (event_fd_ < 0) {
+            e = boost::system::error_code(errno, boost::system::system_category());
+            return false;
+        }
+        events_.assign(event_fd_);
+        return ring_.register_resource(IORING_REGISTER_EVENTFD, &event_fd_, 1, e);
+    }
+
+    /// Give conn a fixed file slot for fd. Lock held.
+    bool attach(uring_connection* conn, int fd, uint32_t& slot, uint32_t& generation,
+                boost::system::error_code& e) {
+        if (!open_) {
+            e = error_ ? error_ : boost::asio::error::operation_not_supported;
+            return false;
+        }
+        if (free_slots_.empty()) {
+            e = boost::asio::error::no_descriptors;
+            return false;
+        }
+        if (!update_file(free_slots_.back(), fd, e)) {
+            return false;
+        }
+        slot = free_slots_.back();
+        free_slots_.pop_back();
+        slots_[slot].owner = conn;
+        generation = slots_[slot].generation;
+        return true;
+    }
+
+    /// Let the slot go. Completions still to come for it are ignored, and
+    /// their buffers recycled. Lock held.
+    void detach(uint32_t slot, uring_connection* conn) {
+        slot_entry& s = slots_[slot];
+        s.owner = 0;
+        s.generation = (s.generation + 1) & generation_mask;
+        boost::system::error_code ignored;
+        update_file(slot, -1, ignored);
+        free_slots_.push_back(slot);
+        starved_.erase(std::remove(starved_.begin(), starved_.end(), conn), starved_.end());
+    }
+
+    /// Point a fixed file slot at fd, or at nothing for -1.
+    bool update_file(uint32_t slot, int fd, boost::system::error_code& e) {
+        io_uring_files_update update;
+        std::memset(&update, 0, sizeof(update));
+        update.offset = slot;
+        update.fds = reinterpret_cast<uintptr_t>(&fd);
+        return ring_.register_resource(IORING_REGISTER_FILES_UPDATE, &update, 1, e);
+    }
+
+    /// Identifies an operation in its completion.
+    static uint64_t user_data(uint32_t slot, uint32_t generation, operation_kind kind) {
+        return (uint64_t(slot) << 32) | (uint64_t(generation) << 2) | kind;
+    }
+
+    /// A submission entry to prepare. If the ring is full, what is prepared
+    /// is submitted first. Returns 0 if the kernel will not take more. Lock
+    /// held.
+    io_uring_sqe* get_sqe() {
+        io_uring_sqe* sqe = ring_.get_sqe();
+        if (!sqe) {
+            submit_now();
+            sqe = ring_.get_sqe();
+        }
+        return sqe;
+    }
+
+    /// Have what is prepared submitted once the handlers already queued on
+    /// the io_service have run, and have prepared their own. Lock held.
+    void submit_soon() {
+        if (!submit_scheduled_) {
+            submit_scheduled_ = true;
+            io_service_.post(make_custom_alloc_handler(submit_memory_,
+                             boost::bind(&uring_service::handle_submit, this)));
+        }
+    }
+
+    /// Submit everything prepared since the submit was scheduled.
+    void handle_submit() {
+        boost::mutex::scoped_lock lock(mutex_);
+        submit_scheduled_ = false;
+        submit_now();
+    }
+
+    /// Submit everything prepared. Entries the kernel cannot take yet are
+    /// retried by another submit. Lock held.
+    void submit_now() {
+        unsigned int pending = ring_.pending();
+        if (pending == 0) {
+            return;
+        }
+        boost::system::error_code e;
+        unsigned int count = ring_.submit(e);
+        metrics& m = metrics::instance();
+        m.add(enters_);
+        m.add(submitted_, count);
+        if (count < pending) {
+            submit_soon();
+        }
+    }
+
+    /// Wait for completions to be signalled.
+    void wait() {
+        events_.async_wait(boost::asio::posix::stream_descriptor::wait_read,
+                           make_custom_alloc_handler(wait_memory_,
+                                   boost::bind(&uring_service::handle_events, this,
+                                               boost::asio::placeholders::error)));
+    }
+
+    /// Take every completion, then call the handlers they completed.
+    void handle_events(const boost::system::error_code& e) {
+        if (e) {
+            return;
+        }
+        uint64_t signalled;
+        if (::read(event_fd_, &signalled, sizeof(signalled)) < 0) {
+            // Nothing signalled after all; the completions are read anyway.
+        }
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            io_uring_cqe cqe;
+            uint64_t count = 0;
+            while (ring_.peek(cqe)) {
+                complete(cqe);
+                ++count;
+            }
+            metrics::instance().add(completed_, count);
+
+            // Receives re-armed and sends continued while completing go out now.
+            submit_now();
+        }
+        for (std::size_t i = 0; i < ready_.size(); ++i) {
+            ready_[i].handler(ready_[i].error);
+        }
+        ready_.clear();
+        wait();
+    }
+
+    /// Have handler called with e from the io_service, without the ring.
+    /// Lock held.
+    void defer(uring_handler& handler, const boost::system::error_code& e) {
+        deferred_.push_back(uring_completion());
+        handler.move_to(deferred_.back().handler);
+        deferred_.back().error = e;
+        if (deferred_.size() == 1) {
+            io_service_.post(boost::bind(&uring_service::handle_deferred, this));
+        }
+    }
+
+    /// Call the handlers deferred since the last call.
+    void handle_deferred() {
+        std::vector<uring_completion> deferred;
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            deferred.swap(deferred_);
+        }
+        for (std::size_t i = 0; i < deferred.size(); ++i) {
+            deferred[i].handler(deferred[i].error);
+        }
+    }
+
+    /// Route a completion to the connection it belongs to. Lock held.
+    void complete(const io_uring_cqe& cqe) {
+        uint32_t slot = static_cast<uint32_t>(cqe.user_data >> 32);
+        uint32_t generation = static_cast<uint32_t>(cqe.user_data) >> 2;
+        operation_kind kind = static_cast<operation_kind>(cqe.user_data & 3);
+        if (kind == provide_operation) {
+            // Only failures complete, and only if the group is already full.
+            return;
+        }
+        slot_entry& s = slots_[slot];
+        if (!s.owner || s.generation != generation) {
+            if (cqe.flags & IORING_CQE_F_BUFFER) {
+                recycle(static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+            }
+            return;
+        }
+        complete(*s.owner, kind, cqe.res, cqe.flags);
+    }
+
+    /// Defined after uring_connection.
+    void complete(uring_connection& conn, operation_kind kind, int32_t result, uint32_t flags);
+    void resume_starved();
+
+    /// A provided buffer's memory.
+    char* buffer(uint16_t id) {
+        return buffers_ + std::size_t(id) * buffer_size;
+    }
+
+    /// Hand count buffers, from id on, to the kernel to receive into. Lock
+    /// held.
+    void provide(uint16_t id, unsigned int count) {
+        io_uring_sqe* sqe = get_sqe();
+        if (!sqe) {
+            // The kernel takes no more submissions; the ring is finished.
+            return;
+        }
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = static_cast<int32_t>(count);
+        sqe->addr = reinterpret_cast<uintptr_t>(buffer(id));
+        sqe->len = buffer_size;
+        sqe->off = id;
+        sqe->buf_group = buffer_group;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = provide_operation;
+    }
+
+    /// Give a provided buffer back to the kernel, with the next submit, and
+    /// let connections that ran out of buffers receive again. Lock held.
+    void recycle(uint16_t id) {
+        provide(id, 1);
+        submit_soon();
+        if (!starved_.empty()) {
+            resume_starved();
+        }
+    }
+
+    /// Remember a connection whose receive stopped for want of buffers.
+    /// Lock held.
+    void starve(uring_connection* conn) {
+        starved_.push_back(conn);
+    }
+
+    /// The io_service completions are handled on.
+    boost::asio::io_service& io_service_;
+
+    /// Serialises preparing, submitting and completing, and every
+    /// connection's state.
+    boost::mutex mutex_;
+
+    /// The ring.
+    uring ring_;
+
+    /// Signalled by the kernel for each completion.
+    boost::asio::posix::stream_descriptor events_;
+    int event_fd_;
+
+    /// Fixed file slots, and those free.
+    std::vector<slot_entry> slots_;
+    std::vector<uint32_t> free_slots_;
+
+    /// The provided buffers, buffer_count of buffer_size bytes each.
+    char* buffers_;
+
+    /// Connections waiting for buffers to receive into.
+    std::vector<uring_connection*> starved_;
+
+    /// Handlers completed by the completions being handled, and handlers
+    /// completed without the ring, waiting to be called.
+    std::vector<uring_completion> ready_;
+    std::vector<uring_completion> deferred_;
+
+    /// Whether a submit is posted and has not yet run.
+    bool submit_scheduled_;
+
+    /// Whether the ring is set up, and why not if it is not.
+    bool open_;
+    boost::system::error_code error_;
+
+    /// System calls made to submit, entries submitted, and completions.
+    counter_id enters_;
+    counter_id submitted_;
+    counter_id completed_;
+
+    /// Handler memory for the posted submit and for the eventfd wait.
+    handler_memory submit_memory_;
+    handler_memory wait_memory_;
+};
+
+/// A connection whose socket I/O goes through the io_uring of its
+/// io_service's uring_service, with the interface and framing of connection.
+/**
+ * Connecting and accepting still use the asio socket. The socket is handed
+ * to the ring by the first read or write, and from then on only the ring
+ * touches it: writes are sendmsg submissions gathering every frame queued,
+ * and reads come from a multishot receive into the shared provided buffers,
+ * copied into a frame_reader so that frames can span buffers.
+ *
+ * Closing shuts the socket down, which ends the operations in flight; the
+ * fixed file slot is let go once they have completed.
+ */
+class uring_connection : public base_connection
+{
+public:
+    explicit uring_connection(boost::asio::io_service& io_service)
+        : base_connection(io_service), service_(boost::asio::use_service<uring_service>(io_service)),
+          codec_(binary_codec_type), received_at_(0), last_frame_size_(0), reader_(new frame_reader()),
+          slot_(0), generation_(0), attached_(false), closing_(false), multishot_(true),
+          receiving_(false), starved_(false), sending_(false), send_first_(0), read_target_(0),
+          read_next_(0), pending_head_(0), pending_count_(0), pending_offset_(0) {
+        std::memset(&message_, 0, sizeof(message_));
+        pending_.resize(uring_service::buffer_count);
+    }
+
+    ~uring_connection() {
+        boost::mutex::scoped_lock lock(service_.mutex_);
+        release_buffers();
+        if (attached_) {
+            service_.detach(slot_, this);
+        }
+    }
+
+    /// Select the codec used for outgoing messages.
+    void set_codec(codec_type codec) {
+        codec_ = codec;
+    }
+
+    /// Wall clock time, in nanoseconds, at which the data holding the last
+    /// frame read was received.
+    uint64_t received_at() const {
+        return received_at_;
+    }
+
+    /// Size of the last frame read, header included.
+    std::size_t last_frame_size() const {
+        return last_frame_size_;
+    }
+
+    /// Set the largest frame accepted, header included. Call before the
+    /// first read.
+    void set_max_frame(std::size_t bytes) {
+        boost::mutex::scoped_lock lock(service_.mutex_);
+        reader_.reset(new frame_reader(bytes));
+    }
+
+    /// Make room for gather writes of up to count frames, so that they do not
+    /// allocate.
+    void reserve_frames(std::size_t count) {
+        boost::mutex::scoped_lock lock(service_.mutex_);
+        iovecs_.reserve(std::max<std::size_t>(count, 1));
+    }
+
+    /// Shut down and close the socket. Operations in flight complete with an
+    /// error, or with what they did before the shutdown.
+    void close() {
+        boost::mutex::scoped_lock lock(service_.mutex_);
+        boost::system::error_code e;
+        socket_.shutdown(protocol::socket::shutdown_both, e);
+        socket_.close(e);
+        closing_ = true;
+        if (!read_handler_.empty() && !receiving_) {
+            // Waiting for buffers that will not be needed any more.
+            service_.defer(read_handler_, boost::asio::error::operation_aborted);
+        }
+        finish_close();
+    }
+
+    /// Asynchronously write a data structure to the socket.
+    template <typename T, typename Handler>
+    void async_write(const T& t, Handler handler) {
+        boost::mutex::scoped_lock lock(service_.mutex_);
+        if (!encode_frame(codec_, t, outbound_frame_)) {
+            boost::system::error_code error(boost::asio::error::invalid_argument);
+            io_service_.post(make_custom_alloc_handler(write_memory_, boost::bind(handler, error)));
+            return;
+        }
+        iovecs_.clear();
+        iovec v = { &outbound_frame_[0], outbound_frame_.size() };
+        iovecs_.push_back(v);
+        start_send(handler);
+    }
+
+    /// Asynchronously write several encoded frames with a single sendmsg.
+    /// The caller keeps the frames alive until the handler is called.
+    template <typename Handler>
+    void async_write_frames(const std::vector<shared_frame>& frames, Handler handler) {
+        boost::mutex::scoped_lock lock(service_.mutex_);
+        iovecs_.clear();
+        for (std::size_t i = 0; i < frames.size(); ++i) {
+            iovec v = { const_cast<char*>(&(*frames[i])[0]), frames[i]->size() };
+            iovecs_.push_back(v);
+        }
+        start_send(handler);
+    }
+
+    /// Asynchronously read a data structure from the socket.
+    template <typename T, typename Handler>
+    void async_read(T& t, Handler handler) {
+        boost::mutex::scoped_lock lock(service_.mutex_);
+        boost::system::error_code e;
+        if (read_locked(t, e) || e || !attach(e) || !receive(e)) {
+            io_service_.post(make_custom_alloc_handler(read_memory_, boost::bind(handler, e)));
+            return;
+        }
+        read_target_ = &t;
+        read_next_ = &uring_connection::read_into<T>;
+        read_handler_.set(handler);
+    }
+
+    /// Decode the next complete frame already received, without waiting.
+    /// Returns false if there is none, with e set if the connection has
+    /// failed or what is buffered is not a valid frame.
+    template <typename T>
+    bool read_buffered(T& t, boost::system::error_code& e) {
+        boost::mutex::scoped_lock lock(service_.mutex_);
+        return read_locked(t, e);
+    }
+
+private:
+    friend class uring_service;
+
+    /// A provided buffer received into, not yet copied to the frame reader.
+    struct pending_buffer {
+        uint16_t id;
+        uint32_t length;
+    };
+
+    /// Decode into the target of a pending read.
+    typedef bool (*read_function)(uring_connection*, void*, boost::system::error_code&);
+
+    template <typename T>
+    static bool read_into(uring_connection* conn, void* target, boost::system::error_code& e) {
+        return conn->read_locked(*static_cast<T*>(target), e);
+    }
+
+    /// Hand the socket to the ring, if not done yet. Lock held.
+    bool attach(boost::system::error_code& e) {
+        if (attached_) {
+            return true;
+        }
+        if (closing_ || !socket_.is_open()) {
+            e = boost::asio::error::bad_descriptor;
+            return false;
+        }
+
+        // The ring waits for the socket itself; a non-blocking socket would
+        // have its operations fail with EAGAIN instead.
+        socket_.native_non_blocking(false, e);
+        if (e || !service_.attach(this, socket_.native_handle(), slot_, generation_, e)) {
+            return false;
+        }
+        attached_ = true;
+        return true;
+    }
+
+    /// Take the next complete frame. Lock held.
+    template <typename T>
+    bool read_locked(T& t, boost::system::error_code& e) {
+        e = boost::system::error_code();
+        copy_received();
+        frame_view frame;
+        if (!reader_->peek(frame, e)) {
+            if (!e && pending_count_ == 0 && read_error_) {
+                e = read_error_;
+            }
+            return false;
+        }
+        last_frame_size_ = frame.size();
+        bool decoded = decode_payload(frame.header, frame.payload, t);
+        reader_->consume(frame);
+        if (!decoded) {
+            e = boost::asio::error::invalid_argument;
+            return false;
+        }
+        return true;
+    }
+
+    /// Copy received buffers into the frame reader while it has room,
+    /// recycling each buffer once it is copied. Lock held.
+    void copy_received() {
+        while (pending_count_ > 0) {
+            const pending_buffer& p = pending_[pending_head_];
+            boost::asio::mutable_buffer space = *reader_->prepare().begin();
+            std::size_t n = std::min<std::size_t>(boost::asio::buffer_size(space), p.length - pending_offset_);
+            if (n == 0) {
+                return;
+            }
+            std::memcpy(boost::asio::buffer_cast<char*>(space), service_.buffer(p.id) + pending_offset_, n);
+            reader_->commit(n);
+            pending_offset_ += n;
+            if (pending_offset_ == p.length) {
+                pending_offset_ = 0;
+                pending_head_ = (pending_head_ + 1) % pending_.size();
+                --pending_count_;
+                service_.recycle(p.id);
+            }
+        }
+    }
+
+    /// Recycle every buffer not yet copied. Lock held.
+    void release_buffers() {
+        while (pending_count_ > 0) {
+            service_.recycle(pending_[pending_head_].id);
+            pending_head_ = (pending_head_ + 1) % pending_.size();
+            --pending_count_;
+        }
+        pending_offset_ = 0;
+    }
+
+    /// Arm a receive, unless one is armed, is waiting for buffers, or the
+    /// connection is done receiving. Returns false, with e set, if the ring
+    /// will not take it. Lock held.
+    bool receive(boost::system::error_code& e) {
+        if (receiving_ || starved_ || read_error_ || closing_) {
+            return true;
+        }
+        io_uring_sqe* sqe = service_.get_sqe();
+        if (!sqe) {
+            e = boost::asio::error::no_buffer_space;
+            return false;
+        }
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = static_cast<int32_t>(slot_);
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+        sqe->buf_group = uring_service::buffer_group;
+        sqe->ioprio = multishot_ ? IORING_RECV_MULTISHOT : 0;
+        sqe->user_data = uring_service::user_data(slot_, generation_, uring_service::receive_operation);
+        receiving_ = true;
+        service_.submit_soon();
+        return true;
+    }
+
+    /// Start sending iovecs_. Lock held.
+    template <typename Handler>
+    void start_send(Handler& handler) {
+        boost::system::error_code e;
+        if (!attach(e)) {
+            io_service_.post(make_custom_alloc_handler(write_memory_, boost::bind(handler, e)));
+            return;
+        }
+        write_handler_.set(handler);
+        send_first_ = 0;
+        if (!send(e)) {
+            service_.defer(write_handler_, e);
+        }
+    }
+
+    /// Submit a sendmsg of what is left of iovecs_. Lock held.
+    bool send(boost::system::error_code& e) {
+        io_uring_sqe* sqe = service_.get_sqe();
+        if (!sqe) {
+            e = boost::asio::error::no_buffer_space;
+            return false;
+        }
+        message_.msg_iov = iovecs_.empty() ? 0 : &iovecs_[send_first_];
+        message_.msg_iovlen = iovecs_.size() - send_first_;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = static_cast<int32_t>(slot_);
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->addr = reinterpret_cast<uintptr_t>(&message_);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = uring_service::user_data(slot_, generation_, uring_service::send_operation);
+        sending_ = true;
+        service_.submit_soon();
+        return true;
+    }
+
+    /// Handle a receive completion. Lock held.
+    void complete_receive(int32_t result, uint32_t flags, std::vector<uring_completion>& ready) {
+        if (!(flags & IORING_CQE_F_MORE)) {
+            receiving_ = false;
+        }
+        if (result > 0 && (flags & IORING_CQE_F_BUFFER)) {
+            received_at_ = wall_clock_ns();
+            pending_buffer& p = pending_[(pending_head_ + pending_count_) % pending_.size()];
+            p.id = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+            p.length = static_cast<uint32_t>(result);
+            ++pending_count_;
+        } else if (result == 0) {
+            read_error_ = boost::asio::error::eof;
+        } else if (result == -ENOBUFS) {
+            // Re-armed once a buffer is recycled.
+            starved_ = true;
+            service_.starve(this);
+        } else if (result == -EINVAL && multishot_) {
+            // A kernel without multishot receive; arm one receive at a time.
+            multishot_ = false;
+        } else if (result < 0) {
+            read_error_ = boost::system::error_code(-result, boost::system::system_category());
+        }
+
+        boost::system::error_code e;
+        if (!receive(e)) {
+            read_error_ = e;
+        }
+        if (!read_handler_.empty() && (read_next_(this, read_target_, e) || e)) {
+            ready.push_back(uring_completion());
+            read_handler_.move_to(ready.back().handler);
+            ready.back().error = e;
+        }
+        finish_close();
+    }
+
+    /// Handle a sendmsg completion, continuing after a short write. Lock
+    /// held.
+    void complete_send(int32_t result, std::vector<uring_completion>& ready) {
+        sending_ = false;
+        boost::system::error_code e;
+        if (result < 0) {
+            e = boost::system::error_code(-result, boost::system::system_category());
+        } else {
+            std::size_t sent = static_cast<std::size_t>(result);
+            while (send_first_ < iovecs_.size() && sent >= iovecs_[send_first_].iov_len) {
+                sent -= iovecs_[send_first_].iov_len;
+                ++send_first_;
+            }
+            if (send_first_ < iovecs_.size()) {
+                iovec& v = iovecs_[send_first_];
+                v.iov_base = static_cast<char*>(v.iov_base) + sent;
+                v.iov_len -= sent;
+                if (closing_) {
+                    e = boost::asio::error::operation_aborted;
+                } else if (send(e)) {
+                    return;
+                }
+            }
+        }
+        ready.push_back(uring_completion());
+        write_handler_.move_to(ready.back().handler);
+        ready.back().error = e;
+        finish_close();
+    }
+
+    /// Receive again after running out of buffers. Lock held.
+    void resume() {
+        starved_ = false;
+        boost::system::error_code e;
+        if (!receive(e)) {
+            read_error_ = e;
+        }
+    }
+
+    /// Let the fixed file slot go once closed and nothing is in flight.
+    /// Lock held.
+    void finish_close() {
+        if (closing_ && attached_ && !receiving_ && !sending_) {
+            release_buffers();
+            service_.detach(slot_, this);
+            attached_ = false;
+        }
+    }
+
+    /// The service running the ring.
+    uring_service& service_;
+
+    /// Codec used for outgoing messages.
+    codec_type codec_;
+
+    /// Holds an outbound frame, header followed by payload.
+    std::vector<char> outbound_frame_;
+
+    /// When the last frame read was received, and its size.
+    uint64_t received_at_;
+    std::size_t last_frame_size_;
+
+    /// Frames received and not yet decoded.
+    boost::scoped_ptr<frame_reader> reader_;
+
+    /// The socket's fixed file slot and its generation, if attached.
+    uint32_t slot_;
+    uint32_t generation_;
+    bool attached_;
+
+    /// Whether close() has been called.
+    bool closing_;
+
+    /// Whether receives are multishot, whether one is armed, and whether it
+    /// stopped for want of buffers.
+    bool multishot_;
+    bool receiving_;
+    bool starved_;
+
+    /// Why the connection can receive no more, if it cannot.
+    boost::system::error_code read_error_;
+
+    /// The write in progress: whether a sendmsg is in flight, its message,
+    /// the buffers and the first not yet fully sent.
+    bool sending_;
+    msghdr message_;
+    std::vector<iovec> iovecs_;
+    std::size_t send_first_;
+    uring_handler write_handler_;
+
+    /// The read waiting for a frame: where to decode it, how, and the
+    /// handler to call.
+    void* read_target_;
+    read_function read_next_;
+    uring_handler read_handler_;
+
+    /// Received buffers not yet copied, as a ring, and how much of the
+    /// oldest has been.
+    std::vector<pending_buffer> pending_;
+    std::size_t pending_head_;
+    std::size_t pending_count_;
+    std::size_t pending_offset_;
+
+    /// Handler memory for handlers completed without the ring.
+    handler_memory read_memory_;
+    handler_memory write_memory_;
+};
+
+inline void uring_service::complete(uring_connection& conn, operation_kind kind, int32_t result, uint32_t flags)
+{
+    if (kind == receive_operation) {
+        conn.complete_receive(result, flags, ready_);
+    } else {
+        conn.complete_send(result, ready_);
+    }
+}
+
+inline void uring_service::resume_starved()
+{
+    std::vector<uring_connection*> starved;
+    starved.swap(starved_);
+    for (std::size_t i = 0; i < starved.size(); ++i) {
+        starved[i]->resume();
+    }
+    starved.swap(starved_);
+    starved_.clear();
+}
+
+/// Set up the io_uring backend for io_service. Returns false, with e set, if
+/// the kernel cannot run it.
+inline bool use_uring(boost::asio::io_service& io_service, boost::system::error_code& e)
+{
+    if (!uring_service::supported()) {
+        e = boost::asio::error::operation_not_supported;
+        return false;
+    }
+    e = boost::asio::use_service<uring_service>(io_service).error();
+    return !e;
+}
+
+#else
+
+/// Without io_uring support the backend is never chosen; uring_connection
+/// is the asio connection, so code naming it still builds.
+class uring_service
+{
+public:
+    static bool supported() {
+        return false;
+    }
+};
+
+typedef connection uring_connection;
+
+inline bool use_uring(boost::asio::io_service&, boost::system::error_code& e)
+{
+    e = boost::asio::error::operation_not_supported;
+    return false;
+}
+
+#endif // CODECHALLENGE_HAS_URING
+
+typedef boost::shared_ptr<uring_connection> uring_connection_ptr;
+
+} // namespace codechallenge
+
+#endif // CODECHALLENGE_URING_CONNECTION_HPP
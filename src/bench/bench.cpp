@@ -0,0 +1,623 @@
+//
+// bench.cpp
+// ~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/function.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/program_options.hpp>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../../include/connection.hpp" // Must come before boost/serialization headers.
+#include <boost/serialization/vector.hpp>
+#include "../../include/async_logger.hpp"
+#include "../../include/client_session.hpp"
+#include "../../include/csv_format.hpp"
+#include "../../include/frame_reader.hpp"
+#include "../../include/gaze_analytics.hpp"
+#include "../../include/io_service_pool.hpp"
+#include "../../include/metrics.hpp"
+#include "../../include/publisher.hpp"
+#include "../../include/recording.hpp"
+#include "../../include/sample_generator.hpp"
+
+/// Calls to the global allocator so far, for --check-allocations.
+static std::atomic<uint64_t> allocation_count(0);
+
+// The replacements are kept out of line; once inlined, GCC pairs the malloc
+// and free inside them with new and delete expressions and warns.
+__attribute__((noinline)) void* operator new(std::size_t size)
+{
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+namespace codechallenge
+{
+
+/// Runs microbenchmarks and reports them as JSON.
+/**
+ * Each benchmark is a function performing one operation on items_per_op
+ * samples. It is run in doubling rounds until a round takes at least the
+ * minimum time, and the last round is reported.
+ */
+class bench_runner
+{
+public:
+    bench_runner(uint64_t min_time_ns, const std::string& filter)
+        : min_time_ns_(min_time_ns), filter_(filter), results_(0) {
+    }
+
+    /// Time one benchmark, unless it is filtered out. bytes_per_item, if not
+    /// zero, is reported alongside, for codecs.
+    void run(const char* name, std::size_t items_per_op, boost::function<void()> op,
+             double bytes_per_item = 0) {
+        if (!filter_.empty() && std::string(name).find(filter_) == std::string::npos) {
+            return;
+        }
+        uint64_t iterations = 1;
+        uint64_t elapsed = 0;
+        for (;;) {
+            uint64_t start = steady_clock_ns();
+            for (uint64_t i = 0; i < iterations; ++i) {
+                op();
+            }
+            elapsed = steady_clock_ns() - start;
+            if (elapsed >= min_time_ns_ || iterations >= (uint64_t(1) << 40)) {
+                break;
+            }
+            iterations *= 2;
+        }
+
+        double ns_per_op = double(elapsed) / iterations;
+        out_ += results_ ? ",\n    {" : "\n    {";
+        out_ += "\"name\":\"";
+        out_ += name;
+        out_ += "\"";
+        json::append_field(out_, "iterations", iterations);
+        json::append_field(out_, "items_per_op", uint64_t(items_per_op));
+        json::append_field(out_, "ns_per_op", ns_per_op);
+        json::append_field(out_, "ns_per_item", ns_per_op / items_per_op);
+        json::append_field(out_, "items_per_second", 1e9 * items_per_op / ns_per_op);
+        if (bytes_per_item > 0) {
+            json::append_field(out_, "bytes_per_item", bytes_per_item);
+        }
+        out_ += "}";
+        ++results_;
+    }
+
+    /// The report.
+    std::string report() const {
+        return "{\"benchmarks\":[" + out_ + "\n]}\n";
+    }
+
+private:
+    /// Shortest time the reported round may take.
+    uint64_t min_time_ns_;
+
+    /// Only benchmarks whose name contains this are run.
+    std::string filter_;
+
+    /// Results so far.
+    std::string out_;
+    std::size_t results_;
+};
+
+/// Keeps the optimiser from discarding benchmark results.
+volatile std::size_t sink;
+
+void bench_header_encode()
+{
+    frame_header header;
+    header.payload_length = 1234;
+    header.codec = binary_codec_type;
+    header.version = wire_version;
+    char out[frame_header::length];
+    header.encode(out);
+    sink = out[0];
+}
+
+void bench_header_decode(const char* in)
+{
+    frame_header header;
+    sink = header.decode(in);
+}
+
+void bench_generate(sample_generator& generator, std::vector<eye_message>& samples, int count)
+{
+    generator.generate(samples, count, wall_clock_ns(), 1000000);
+    sink = samples.size();
+}
+
+void bench_encode(codec_type codec, uint8_t precision, const std::vector<eye_message>& samples,
+                  std::vector<char>& frame)
+{
+    encode_frame(codec, samples, frame, precision);
+    sink = frame.size();
+}
+
+void bench_decode(const std::vector<char>& frame, std::vector<eye_message>& samples)
+{
+    frame_header header;
+    header.decode(&frame[0]);
+    decode_payload(header, &frame[frame_header::length], samples);
+    sink = samples.size();
+}
+
+void bench_csv_format(const std::vector<eye_message>& samples, std::string& text)
+{
+    text.clear();
+    for (std::size_t i = 0; i < samples.size(); ++i) {
+        csv::append_row(text, samples[i]);
+    }
+    sink = text.size();
+}
+
+void bench_csv_parse(const std::string& text, std::vector<eye_message>& samples)
+{
+    const char* p = text.data();
+    const char* end = p + text.size();
+    std::size_t n = 0;
+    while (p != end && n < samples.size()) {
+        n += csv::parse_row(p, end, samples[n]);
+    }
+    sink = n;
+}
+
+/// Sum two fields of every sample, as an aggregate over a batch does, from
+/// the samples themselves or from their columns.
+void bench_scan_aos(const std::vector<eye_message>& samples)
+{
+    float confidence = 0;
+    uint64_t pupil = 0;
+    for (std::size_t i = 0; i < samples.size(); ++i) {
+        confidence += samples[i].confidence;
+        pupil += samples[i].pupil_diameter;
+    }
+    sink = std::size_t(confidence) + pupil;
+}
+
+void bench_scan_soa(const soa_batch<eye_message>& samples)
+{
+    typedef message_schema<eye_message> schema;
+    const std::vector<float>& confidence = samples.column<schema::confidence>();
+    const std::vector<uint32_t>& pupil = samples.column<schema::pupil_diameter>();
+    float confidence_sum = 0;
+    uint64_t pupil_sum = 0;
+    for (std::size_t i = 0; i < samples.size(); ++i) {
+        confidence_sum += confidence[i];
+        pupil_sum += pupil[i];
+    }
+    sink = std::size_t(confidence_sum) + pupil_sum;
+}
+
+void bench_soa_append(const std::vector<eye_message>& samples, soa_batch<eye_message>& columns)
+{
+    columns.clear();
+    columns.append(&samples[0], samples.size());
+    sink = columns.size();
+}
+
+void bench_analyze(gaze_analyzer& analyzer, const std::vector<eye_message>& stream, std::size_t& offset,
+                   int count)
+{
+    if (offset + count > stream.size()) {
+        offset = 0;
+    }
+    analyzer.process(&stream[offset], count);
+    offset += count;
+}
+
+void bench_sink(log_sink& s, const std::vector<eye_message>& samples)
+{
+    s.write(&samples[0], samples.size(), 1);
+}
+
+/// Read exactly size bytes from a socket.
+void read_fully(int fd, char* out, std::size_t size)
+{
+    while (size > 0) {
+        ssize_t n = ::read(fd, out, size);
+        if (n <= 0) {
+            throw std::runtime_error("socket read failed");
+        }
+        out += n;
+        size -= n;
+    }
+}
+
+/// Send frames, back to back, through a socket pair and decode them all: with
+/// a frame_reader, which reads everything ready at once, or with a read for
+/// each header and another for each payload, as connections used to.
+void bench_frame_read(int write_fd, int read_fd, const std::vector<char>& frames, std::size_t count,
+                      frame_reader* reader, std::vector<char>& payload, std::vector<eye_message>& samples)
+{
+    if (::write(write_fd, &frames[0], frames.size()) != ssize_t(frames.size())) {
+        throw std::runtime_error("socket write failed");
+    }
+    std::size_t decoded = 0;
+    boost::system::error_code e;
+    while (decoded < count) {
+        frame_view frame;
+        if (reader) {
+            boost::asio::mutable_buffer space = *reader->prepare().begin();
+            ssize_t n = ::read(read_fd, boost::asio::buffer_cast<char*>(space), boost::asio::buffer_size(space));
+            if (n <= 0) {
+                throw std::runtime_error("socket read failed");
+            }
+            reader->commit(n);
+            while (reader->peek(frame, e)) {
+                decode_payload(frame.header, frame.payload, samples);
+                reader->consume(frame);
+                ++decoded;
+            }
+        } else {
+            char header[frame_header::length];
+            read_fully(read_fd, header, sizeof(header));
+            frame.header.decode(header);
+            payload.resize(frame.header.payload_length);
+            read_fully(read_fd, &payload[0], payload.size());
+            decode_payload(frame.header, &payload[0], samples);
+            ++decoded;
+        }
+    }
+    sink = samples.size();
+}
+
+/// Send frames through a seqpacket socket pair, a message each, with one
+/// sendmmsg, and take them back with recvmmsg, a frame per message: neither
+/// side looks for frame boundaries.
+void bench_packet_read(int write_fd, int read_fd, std::vector<mmsghdr>& out_messages,
+                       std::vector<mmsghdr>& in_messages, std::size_t count,
+                       std::vector<eye_message>& samples)
+{
+    if (sendmmsg(write_fd, &out_messages[0], out_messages.size(), 0) != int(out_messages.size())) {
+        throw std::runtime_error("socket sendmmsg failed");
+    }
+    std::size_t decoded = 0;
+    while (decoded < count) {
+        int n = recvmmsg(read_fd, &in_messages[0], in_messages.size(), 0, 0);
+        if (n <= 0) {
+            throw std::runtime_error("socket recvmmsg failed");
+        }
+        for (int i = 0; i < n; ++i) {
+            const char* message = static_cast<const char*>(in_messages[i].msg_hdr.msg_iov->iov_base);
+            frame_header header;
+            header.decode(message);
+            decode_payload(header, message + frame_header::length, samples);
+        }
+        decoded += n;
+    }
+    sink = samples.size();
+}
+
+/// Reads every frame from a socket, as a client would.
+class allocation_check_reader
+{
+public:
+    explicit allocation_check_reader(boost::asio::io_service& io_service)
+        : connection_(io_service), frames_(0) {
+    }
+
+    connection& conn() {
+        return connection_;
+    }
+
+    void start() {
+        connection_.async_read(samples_, boost::bind(&allocation_check_reader::handle_read, this,
+                               boost::asio::placeholders::error));
+    }
+
+    void handle_read(const boost::system::error_code& e) {
+        if (e) {
+            return;
+        }
+        frames_.fetch_add(1, std::memory_order_relaxed);
+        start();
+    }
+
+    uint64_t frames() const {
+        return frames_.load(std::memory_order_relaxed);
+    }
+
+private:
+    connection connection_;
+    std::vector<eye_message> samples_;
+    std::atomic<uint64_t> frames_;
+};
+
+/// Publish to a client session over a socket pair, and count calls to the
+/// global allocator once everything has warmed up. Returns the report; sets
+/// allocations to the count.
+/**
+ * Every tick publishes exactly one batch of the same size, so buffers stop
+ * growing once warmed up, and the publisher's pool is built up front to cover
+ * a full send queue. Retention is on, as in the server, for less time than
+ * the warm up, so the ring is already recycling batches when counting starts.
+ * Anything allocated after warm up is then allocated per tick.
+ */
+std::string check_allocations(double rate, int batch, unsigned int warmup_ms,
+                              unsigned int duration_ms, uint64_t& allocations)
+{
+    pacer_options pacing;
+    pacing.rate = rate;
+    pacing.catch_up = catch_up_burst;
+    pacing.adaptive = false;
+    pacing.max_batch = 1;
+    send_queue_options queue;
+    io_service_pool pool(2);
+    session_metrics ids;
+    publisher pub(binary_codec_type, batch, pacing);
+    pub.reserve_batches(queue.max_depth * 2 + 2);
+    pub.set_retention(warmup_ms / 2000.0, rate);
+    connection_ptr server_side(new connection(pool.get_io_service()));
+    allocation_check_reader reader(pool.get_io_service());
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        throw std::runtime_error("socketpair failed");
+    }
+    connection::protocol unix_stream(AF_UNIX, 0);
+    server_side->socket().assign(unix_stream, fds[0]);
+    reader.conn().socket().assign(unix_stream, fds[1]);
+
+    boost::shared_ptr<client_session> session(new client_session(server_side, pub,
+            queue, ids, 1));
+    pub.subscribe(session);
+    reader.start();
+    pool.run();
+    pub.start();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(warmup_ms));
+    uint64_t frames_before = reader.frames();
+    uint64_t before = allocation_count.load();
+    std::this_thread::sleep_for(std::chrono::milliseconds(duration_ms));
+    allocations = allocation_count.load() - before;
+    uint64_t frames = reader.frames() - frames_before;
+
+    pub.stop();
+    pub.unsubscribe(session);
+    server_side->close();
+    reader.conn().close();
+    pool.stop();
+
+    std::string out = "{\"allocation_check\":{";
+    json::append_field(out, "rate", rate, true);
+    json::append_field(out, "batch", uint64_t(batch));
+    json::append_field(out, "warmup_ms", uint64_t(warmup_ms));
+    json::append_field(out, "duration_ms", uint64_t(duration_ms));
+    json::append_field(out, "frames_read", frames);
+    json::append_field(out, "allocations", allocations);
+    out += "}}\n";
+    return out;
+}
+
+} // namespace codechallenge
+
+int main(int argc, char* argv[])
+{
+    using namespace codechallenge;
+    try {
+
+        // Handle command line arguments.
+        namespace po = boost::program_options;
+        unsigned int min_time_ms;
+        int batch;
+        std::string filter;
+        double check_rate;
+        unsigned int warmup_ms;
+        unsigned int duration_ms;
+        po::options_description desc("Options");
+        desc.add_options()
+        ("help", "show this message")
+        ("min-time", po::value<unsigned int>(&min_time_ms)->default_value(200),
+         "shortest measured run of each benchmark, in milliseconds")
+        ("batch", po::value<int>(&batch)->default_value(64), "samples per batch")
+        ("filter", po::value<std::string>(&filter), "only run benchmarks whose name contains this")
+        ("check-allocations", "instead of benchmarking, publish over a socket pair and fail if the "
+         "send and receive path allocates once warmed up")
+        ("check-rate", po::value<double>(&check_rate)->default_value(2000),
+         "batches per second published by --check-allocations")
+        ("warmup", po::value<unsigned int>(&warmup_ms)->default_value(1000),
+         "milliseconds --check-allocations runs before counting")
+        ("duration", po::value<unsigned int>(&duration_ms)->default_value(2000),
+         "milliseconds --check-allocations counts for");
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+        if (vm.count("help")) {
+            std::cout << desc << std::endl;
+            return 0;
+        }
+        if (batch < 1) {
+            std::cerr << "--batch must be at least 1" << std::endl;
+            return 1;
+        }
+
+        if (vm.count("check-allocations")) {
+            uint64_t allocations = 0;
+            std::string report = check_allocations(check_rate, batch, warmup_ms, duration_ms, allocations);
+            fwrite(report.data(), 1, report.size(), stdout);
+            return allocations == 0 ? 0 : 1;
+        }
+
+        bench_runner runner(uint64_t(min_time_ms) * 1000000, filter);
+
+        std::vector<eye_message> samples;
+        generator_options uniform;
+        uniform.gaze = "uniform";
+        uniform.seed = 1;
+        generator_options saccade;
+        saccade.seed = 1;
+        sample_generator uniform_generator(uniform);
+        sample_generator saccade_generator(saccade);
+        uniform_generator.generate(samples, batch, wall_clock_ns(), 1000000);
+        std::vector<eye_message> decoded;
+        std::vector<char> binary_frame;
+        std::vector<char> text_frame;
+        encode_frame(binary_codec_type, samples, binary_frame);
+        encode_frame(text_codec_type, samples, text_frame);
+
+        // The compact codec depends on how alike consecutive samples are, so
+        // it is measured on realistic gaze.
+        std::vector<eye_message> gaze_samples;
+        saccade_generator.generate(gaze_samples, batch, wall_clock_ns(), 1000000);
+        std::vector<char> compact_frame;
+        std::vector<char> lossless_frame;
+        encode_frame(compact_codec_type, gaze_samples, compact_frame, 16);
+        encode_frame(compact_codec_type, gaze_samples, lossless_frame, compact_codec::lossless);
+        std::vector<char> scratch_frame;
+        std::vector<eye_message> scratch_samples;
+        std::string text;
+
+        runner.run("frame_header_encode", 1, boost::bind(&bench_header_encode));
+        runner.run("frame_header_decode", 1, boost::bind(&bench_header_decode, &binary_frame[0]));
+        runner.run("generate_uniform", batch, boost::bind(&bench_generate, boost::ref(uniform_generator),
+                   boost::ref(scratch_samples), batch));
+        runner.run("generate_saccade", batch, boost::bind(&bench_generate, boost::ref(saccade_generator),
+                   boost::ref(scratch_samples), batch));
+        runner.run("binary_encode", batch, boost::bind(&bench_encode, binary_codec_type, 0,
+                   boost::cref(samples), boost::ref(scratch_frame)),
+                   double(binary_frame.size()) / batch);
+        runner.run("binary_decode", batch, boost::bind(&bench_decode, boost::cref(binary_frame),
+                   boost::ref(decoded)));
+        runner.run("compact_encode", batch, boost::bind(&bench_encode, compact_codec_type, 16,
+                   boost::cref(gaze_samples), boost::ref(scratch_frame)),
+                   double(compact_frame.size()) / batch);
+        runner.run("compact_decode", batch, boost::bind(&bench_decode, boost::cref(compact_frame),
+                   boost::ref(decoded)));
+        runner.run("compact_lossless_encode", batch, boost::bind(&bench_encode, compact_codec_type,
+                   compact_codec::lossless, boost::cref(gaze_samples), boost::ref(scratch_frame)),
+                   double(lossless_frame.size()) / batch);
+        runner.run("compact_lossless_decode", batch, boost::bind(&bench_decode, boost::cref(lossless_frame),
+                   boost::ref(decoded)));
+        runner.run("text_encode", batch, boost::bind(&bench_encode, text_codec_type, 0,
+                   boost::cref(samples), boost::ref(scratch_frame)),
+                   double(text_frame.size()) / batch);
+        runner.run("text_decode", batch, boost::bind(&bench_decode, boost::cref(text_frame),
+                   boost::ref(decoded)));
+        {
+            // A long stream of gaze, analyzed a batch at a time, so that the
+            // analyzer sees fixations, saccades and blinks come and go.
+            std::vector<eye_message> stream;
+            saccade_generator.generate(stream, std::size_t(batch) * 1024, wall_clock_ns(), 1000000);
+            gaze_analyzer analyzer;
+            std::size_t offset = 0;
+            runner.run("gaze_analytics", batch, boost::bind(&bench_analyze, boost::ref(analyzer),
+                       boost::cref(stream), boost::ref(offset), batch));
+        }
+        runner.run("csv_format", batch, boost::bind(&bench_csv_format, boost::cref(samples),
+                   boost::ref(text)));
+        {
+            // What a CSV replay does for every sample.
+            std::string csv_text;
+            bench_csv_format(samples, csv_text);
+            std::vector<eye_message> parsed(samples.size());
+            runner.run("csv_parse", batch, boost::bind(&bench_csv_parse, boost::cref(csv_text),
+                       boost::ref(parsed)));
+        }
+        {
+            // The same batch as samples and as columns.
+            soa_batch<eye_message> columns;
+            columns.append(&samples[0], samples.size());
+            runner.run("soa_append", batch, boost::bind(&bench_soa_append, boost::cref(samples),
+                       boost::ref(columns)));
+            runner.run("scan_aos", batch, boost::bind(&bench_scan_aos, boost::cref(samples)));
+            runner.run("scan_soa", batch, boost::bind(&bench_scan_soa, boost::cref(columns)));
+        }
+        {
+            // A burst of frames arriving faster than they are read, as after a
+            // stall; the socket buffer holds all of them.
+            const std::size_t count = 32;
+            std::vector<char> frames;
+            for (std::size_t i = 0; i < count; ++i) {
+                frames.insert(frames.end(), binary_frame.begin(), binary_frame.end());
+            }
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+                throw std::runtime_error("socketpair failed");
+            }
+            int size = int(frames.size()) * 2;
+            setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+            frame_reader reader;
+            std::vector<char> payload;
+            runner.run("frame_read_batched", count * batch, boost::bind(&bench_frame_read, fds[0], fds[1],
+                       boost::cref(frames), count, &reader, boost::ref(payload), boost::ref(decoded)));
+            runner.run("frame_read_per_frame", count * batch, boost::bind(&bench_frame_read, fds[0], fds[1],
+                       boost::cref(frames), count, static_cast<frame_reader*>(0), boost::ref(payload),
+                       boost::ref(decoded)));
+            ::close(fds[0]);
+            ::close(fds[1]);
+
+            // The same burst as seqpacket messages, a frame in each.
+            if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) != 0) {
+                throw std::runtime_error("socketpair failed");
+            }
+            setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+            std::vector<char> slots(frames.size());
+            std::vector<iovec> out_iovecs(count), in_iovecs(count);
+            std::vector<mmsghdr> out_messages(count), in_messages(count);
+            for (std::size_t i = 0; i < count; ++i) {
+                out_iovecs[i].iov_base = &frames[i * binary_frame.size()];
+                out_iovecs[i].iov_len = binary_frame.size();
+                in_iovecs[i].iov_base = &slots[i * binary_frame.size()];
+                in_iovecs[i].iov_len = binary_frame.size();
+                std::memset(&out_messages[i], 0, sizeof(mmsghdr));
+                out_messages[i].msg_hdr.msg_iov = &out_iovecs[i];
+                out_messages[i].msg_hdr.msg_iovlen = 1;
+                std::memset(&in_messages[i], 0, sizeof(mmsghdr));
+                in_messages[i].msg_hdr.msg_iov = &in_iovecs[i];
+                in_messages[i].msg_hdr.msg_iovlen = 1;
+            }
+            runner.run("frame_read_seqpacket", count * batch, boost::bind(&bench_packet_read, fds[0], fds[1],
+                       boost::ref(out_messages), boost::ref(in_messages), count, boost::ref(decoded)));
+            ::close(fds[0]);
+            ::close(fds[1]);
+        }
+        {
+            // The sinks write to the null device, which measures formatting and
+            // write calls rather than the disk.
+            csv_file_sink csv_sink("/dev/null");
+            runner.run("csv_log", batch, boost::bind(&bench_sink, boost::ref(csv_sink),
+                       boost::cref(samples)));
+            recording_sink rec_sink("/dev/null");
+            runner.run("recording_log", batch, boost::bind(&bench_sink, boost::ref(rec_sink),
+                       boost::cref(samples)));
+        }
+
+        std::string report = runner.report();
+        fwrite(report.data(), 1, report.size(), stdout);
+
+    } catch (std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -13,50 +13,325 @@
 #include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/thread.hpp>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
 #include <iostream>
 #include <vector>
+#include <poll.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
 #include "../../include/connection.hpp" // Must come before boost/serialization headers.
 #include <boost/serialization/vector.hpp>
+#include "../../include/admin_server.hpp"
+#include "../../include/async_logger.hpp"
+#include "../../include/client_pipeline.hpp"
 #include "../../include/eye_message.hpp"
-#include <iostream>
-#include <fstream>
+#include "../../include/gaze_analytics.hpp"
+#include "../../include/metrics.hpp"
+#include "../../include/recording.hpp"
+#include "../../include/segment_recorder.hpp"
+#include "../../include/seqpacket_connection.hpp"
+#include "../../include/sequence_tracker.hpp"
+#include "../../include/shm_connection.hpp"
+#include "../../include/subscription.hpp"
+#include "../../include/uring_connection.hpp"
+#include <boost/lexical_cast.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/program_options.hpp>
 
 namespace codechallenge
 {
 
-/// Downloads stock quote information from a server.
+/// Settings chosen on the command line.
+struct client_options {
+    /// Queue, flushing and overflow settings for the logger, and the
+    /// writer threads its sinks are spread over.
+    async_logger_options logger;
+
+    /// Threads decoding and processing received frames, and the cores the
+    /// client's threads are pinned to.
+    pipeline_options pipeline;
+
+    /// Most samples printed to the console per second, 0 for none.
+    unsigned int print_rate;
+
+    /// Save samples as a native recording (.rec).
+    bool record;
+
+    /// Save samples as CSV.
+    bool csv;
+
+    /// Segment rotation, compression and file writing for the recording and
+    /// CSV files.
+    recorder_options recorder;
+
+    /// Classify gaze into fixations, saccades and blinks, saving the events.
+    bool analytics;
+    gaze_analytics_options analytics_options;
+
+    /// Unix socket answering with metrics snapshots, empty for none.
+    std::string admin_socket;
+
+    /// Seconds between metrics snapshots printed to stderr, 0 for none.
+    unsigned int metrics_interval;
+
+    /// Which samples to ask the server for.
+    subscription filter;
+
+    /// Sequence number to resume from on connecting, 0 for the live stream.
+    uint64_t resume_from;
+
+    /// Ask the server to resend samples missing from the sequence.
+    bool recover;
+
+    /// Largest frame accepted from the server, header included.
+    std::size_t max_frame;
+};
+
+/// Ask the server for only the samples passing the filter. Returns false if
+/// the transport cannot filter, in which case the client filters itself.
+template <typename Handler>
+bool async_subscribe(connection& conn, const subscription& filter, Handler handler)
+{
+    conn.async_write(filter, handler);
+    return true;
+}
+
+template <typename Handler>
+bool async_subscribe(seqpacket_connection& conn, const subscription& filter, Handler handler)
+{
+    conn.async_write(filter, handler);
+    return true;
+}
+
+#ifdef CODECHALLENGE_HAS_URING
+template <typename Handler>
+bool async_subscribe(uring_connection& conn, const subscription& filter, Handler handler)
+{
+    conn.async_write(filter, handler);
+    return true;
+}
+#endif
+
+/// A shared memory ring is the same for every reader; nothing to ask for.
+template <typename Handler>
+bool async_subscribe(shm_connection&, const subscription&, Handler)
+{
+    return false;
+}
+
+/// Decode the next frame the connection has already read, if any, so that
+/// every frame brought in by one read is handled together.
+template <typename T>
+bool read_buffered(connection& conn, T& t, boost::system::error_code& e)
+{
+    return conn.read_buffered(t, e);
+}
+
+template <typename T>
+bool read_buffered(seqpacket_connection& conn, T& t, boost::system::error_code& e)
+{
+    return conn.read_buffered(t, e);
+}
+
+#ifdef CODECHALLENGE_HAS_URING
+template <typename T>
+bool read_buffered(uring_connection& conn, T& t, boost::system::error_code& e)
+{
+    return conn.read_buffered(t, e);
+}
+#endif
+
+/// Each shared memory read already takes everything published.
+template <typename T>
+bool read_buffered(shm_connection&, T&, boost::system::error_code&)
+{
+    return false;
+}
+
+/// Read the next frame without decoding it, for the pipeline to decode.
+template <typename Handler>
+void async_read_frame(connection& conn, encoded_frame& frame, Handler handler)
+{
+    conn.async_read(frame, handler);
+}
+
+template <typename Handler>
+void async_read_frame(seqpacket_connection& conn, encoded_frame& frame, Handler handler)
+{
+    conn.async_read(frame, handler);
+}
+
+#ifdef CODECHALLENGE_HAS_URING
+template <typename Handler>
+void async_read_frame(uring_connection& conn, encoded_frame& frame, Handler handler)
+{
+    conn.async_read(frame, handler);
+}
+#endif
+
+/// Shared memory carries samples, not frames; there is nothing to decode, so
+/// it is never read through the pipeline.
+template <typename Handler>
+void async_read_frame(shm_connection&, encoded_frame&, Handler)
+{
+}
+
+/// Bound the size of frames from the server.
+inline void set_max_frame(connection& conn, std::size_t bytes)
+{
+    conn.set_max_frame(bytes);
+}
+
+inline void set_max_frame(seqpacket_connection& conn, std::size_t bytes)
+{
+    conn.set_max_frame(bytes);
+}
+
+#ifdef CODECHALLENGE_HAS_URING
+inline void set_max_frame(uring_connection& conn, std::size_t bytes)
+{
+    conn.set_max_frame(bytes);
+}
+#endif
+
+/// Shared memory has no frames.
+inline void set_max_frame(shm_connection&, std::size_t)
+{
+}
+
+/// Records how long samples take from being generated to being logged. Added
+/// to the first writer after the file sinks there, so it sees samples once
+/// they have been written.
+class latency_sink
+    : public log_sink
+{
+public:
+    latency_sink() {
+        metrics& m = metrics::instance();
+        log_ns_ = m.add_histogram("publish_to_log_ns");
+        samples_logged_ = m.add_counter("samples_logged");
+    }
+
+    void write(const eye_message* samples, std::size_t n, uint64_t first_count) {
+        metrics& m = metrics::instance();
+        uint64_t now = wall_clock_ns();
+        for (std::size_t i = 0; i < n; ++i) {
+            m.record(log_ns_, now - sample_time_ns(samples[i]));
+        }
+        m.add(samples_logged_, n);
+    }
+
+private:
+    /// Sample timestamp to logged.
+    histogram_id log_ns_;
+
+    /// Samples handed to the file sinks.
+    counter_id samples_logged_;
+};
+
+/// Receives eye messages from a server over any connection type providing
+/// async_read(), close() and an async_connect() overload.
+/**
+ * By default one thread receives, decodes and processes (drops duplicates,
+ * finds gaps, filters) each frame, and the logger's writer threads print
+ * and save the samples. With decode threads, the receiving thread only
+ * reads frames and hands them to a client_pipeline, which decodes them on
+ * those threads and processes them on one more.
+ */
+template <typename Connection>
 class client
+    : public metrics_source
 {
 public:
-    /// Constructor starts the asynchronous connect operation.
-    client(boost::asio::io_service& io_service)
-        : connection_(io_service) {
+    /// Constructor starts the asynchronous connect operation, to whatever
+    /// address the connection type's async_connect() takes.
+    template <typename Address>
+    client(boost::asio::io_service& io_service, Connection& conn, const Address& address,
+           const client_options& options)
+        : connection_(conn), filter_(options.filter), filter_locally_(false), seen_(0),
+          resume_from_(options.resume_from), recover_(options.recover),
+          track_(options.recover || options.resume_from != 0), tracker_(options.recover),
+          subscribing_(false), recovery_first_(0), recovery_last_(0), reported_gap_samples_(0),
+          reported_recovered_(0), reported_duplicates_(0), logger_(options.logger),
+          receive_cores_(options.pipeline.receive_cores) {
         this->io_service = &io_service;
 
-        // Open file for data logging
-        open_file();
+        // Register metrics before any thread records them
+        metrics& m = metrics::instance();
+        read_ns_ = m.add_histogram("publish_to_read_ns");
+        decode_ns_ = m.add_histogram("decode_ns");
+        frames_received_ = m.add_counter("frames_received");
+        samples_received_ = m.add_counter("samples_received");
+        bytes_received_ = m.add_counter("bytes_received");
+        samples_missed_ = m.add_counter("samples_missed");
+        samples_recovered_ = m.add_counter("samples_recovered");
+        samples_duplicate_ = m.add_counter("samples_duplicate");
+        frames_per_read_ = m.add_histogram("frames_per_read");
+        set_max_frame(connection_, options.max_frame);
+        tracker_.resume_from(resume_from_);
+        if (options.pipeline.decode_threads > 0) {
+            client_pipeline::process_function process = boost::bind(&client::process_batch, this, _1);
+            pipeline_ = boost::make_shared<client_pipeline>(options.pipeline, process);
+        }
+
+        // Open files for data logging, and optionally print to the console
+        open_files(options);
+        if (options.print_rate > 0) {
+            logger_.add_sink(boost::make_shared<console_sink>(options.print_rate));
+        }
+        logger_.add_sink(boost::make_shared<latency_sink>(), 0);
+        logger_.start();
+        m.add_source(this);
 
-        // Create end-point, and connect to server
-        boost::asio::local::stream_protocol::endpoint ep("/tmp/code_challenge/streams");
-        connection_.socket().async_connect(ep, boost::bind(&client::handle_connect, this,
-                                               boost::asio::placeholders::error));
+        // Connect to server
+        async_connect(connection_, address, boost::bind(&client::handle_connect, this,
+                      boost::asio::placeholders::error));
     }
 
     /// Deconstructor
     ~client() {
-        // Close data log file
-        close_file();
+        // Process and write out anything still queued and close the data log file
+        metrics::instance().remove_source(this);
+        if (pipeline_) {
+            pipeline_->stop();
+        }
+        logger_.stop();
+    }
+
+    /// Report the logger's progress.
+    void write_metrics(std::string& out) {
+        out += "{\"type\":\"logger\"";
+        json::append_field(out, "samples_written", logger_.written());
+        json::append_field(out, "samples_dropped", logger_.dropped());
+        out.push_back('}');
     }
 
     /// Handle completion of a connect operation.
     void handle_connect(const boost::system::error_code& e) {
         if (!e) {
-            // Successfully established connection. Start operation to read the list
-            // of stocks. The connection::async_read() function will automatically
-            // decode the data that is read from the underlying socket.
-            connection_.async_read(stocks_,
-                                   boost::bind(&client::handle_read, this,
-                                               boost::asio::placeholders::error));
+            // Successfully established connection. Send our subscription, unless
+            // we want everything live as the server encodes it, which is what
+            // the server sends by default.
+            if (!filter_.is_all() || !filter_.is_server_codec() || resume_from_ != 0) {
+                filter_locally_ = !subscribe(resume_from_, 0);
+            }
+
+            // Start operation to read the list of stocks. The
+            // connection::async_read() function will automatically decode the
+            // data that is read from the underlying socket, unless the
+            // pipeline is to decode it.
+            if (pipeline_) {
+                async_read_frame(connection_, frame_,
+                                 boost::bind(&client::handle_frame, this,
+                                             boost::asio::placeholders::error));
+            } else {
+                connection_.async_read(stocks_,
+                                       boost::bind(&client::handle_read, this,
+                                                   boost::asio::placeholders::error));
+            }
         } else {
             // An error occurred. Log it and return. Since we are not starting a new
             // operation the io_service will run out of work to do and the client will
@@ -65,38 +340,190 @@ public:
         }
     }
 
-    /// Handle completion of a read operation.
-    void handle_read(const boost::system::error_code& e) {
-        if (!e) {
+    /// Send our subscription, asking for retained samples from first up to
+    /// last if first is not 0. Returns false if the transport cannot take it.
+    bool subscribe(uint64_t first, uint64_t last) {
+        subscription request = filter_;
+        request.resume_from = first;
+        request.resume_to = last;
+        subscribing_ = async_subscribe(connection_, request,
+                                       boost::bind(&client::handle_subscribe, this,
+                                                   boost::asio::placeholders::error));
+        return subscribing_;
+    }
 
-            // Print out the eye data that was received.
-            for (std::size_t i = 0; i < stocks_.size(); ++i) {
-                message_count++;
-                std::cout<< "\n" << "Count: " << message_count << ", ";
-                std::cout << "Time(Sec): " << stocks_[i].time_seconds << ", ";
-                std::cout << "Time(Nanos): " << stocks_[i].time_nanos << ", ";
-                std::cout << "ID: " << stocks_[i].id << ", ";
-                std::cout << "Confidence: " << stocks_[i].confidence << ", ";
-                std::cout << "NormalizedPosX: "  << stocks_[i].normalized_pos_x << ", ";
-                std::cout << "NormalizedPosY: " << stocks_[i].normalized_pos_y << ", ";
-                std::cout << "PupilDiameter: " << stocks_[i].pupil_diameter << ", ";
-
-                // Write sample data to file
-                write_sample_to_file(stocks_[i]);
+    /// Handle completion of sending the subscription.
+    void handle_subscribe(const boost::system::error_code& e) {
+        subscribing_ = false;
+        if (e) {
+            std::cerr << "Subscribe failed: " << e.message() << std::endl;
+            return;
+        }
+        send_recovery();
+    }
 
-            }
-            // Listen for additional data
-            connection_.async_read(stocks_,
-                                   boost::bind(&client::handle_read, this,
-                                               boost::asio::placeholders::error));
+    /// Ask the server to resend the gaps the tracker found since the last
+    /// call. Called on the thread processing samples.
+    void take_gaps() {
+        uint64_t first = 0;
+        uint64_t last = 0;
+        if (!recover_ || !tracker_.take_gap(first, last)) {
+            return;
+        }
+        if (pipeline_) {
+            io_service->post(boost::bind(&client::request_recovery, this, first, last));
         } else {
+            request_recovery(first, last);
+        }
+    }
+
+    /// Add samples first up to last to those to ask the server for.
+    void request_recovery(uint64_t first, uint64_t last) {
+        recovery_first_ = recovery_last_ == 0 ? first : std::min(recovery_first_, first);
+        recovery_last_ = std::max(recovery_last_, last);
+        send_recovery();
+    }
+
+    /// Ask for the samples wanted, once the last request has been sent.
+    void send_recovery() {
+        if (!subscribing_ && recovery_last_ != 0) {
+            uint64_t first = recovery_first_;
+            uint64_t last = recovery_last_;
+            recovery_first_ = 0;
+            recovery_last_ = 0;
+            subscribe(first, last);
+        }
+    }
+
+    /// Handle completion of a read operation, and of every other frame the
+    /// same read from the socket brought in.
+    void handle_read(const boost::system::error_code& e) {
+        if (e) {
             // An error occurred.
             std::cerr << e.message() << std::endl;
+            return;
+        }
+        boost::system::error_code error;
+        uint64_t frames = 0;
+        do {
+            process(stocks_, connection_.received_at(), connection_.last_frame_size());
+            ++frames;
+        } while (read_buffered(connection_, stocks_, error));
+        metrics::instance().record(frames_per_read_, frames);
+        if (error) {
+            std::cerr << error.message() << std::endl;
+            return;
+        }
+
+        // Listen for additional data
+        connection_.async_read(stocks_,
+                               boost::bind(&client::handle_read, this,
+                                           boost::asio::placeholders::error));
+    }
+
+    /// Handle completion of a read of undecoded frames, handing every frame
+    /// the read brought in to the pipeline.
+    void handle_frame(const boost::system::error_code& e) {
+        if (e) {
+            std::cerr << e.message() << std::endl;
+            return;
+        }
+        boost::system::error_code error;
+        uint64_t frames = 0;
+        do {
+            if (!hand_off()) {
+                return;
+            }
+            ++frames;
+        } while (read_buffered(connection_, frame_, error));
+        metrics::instance().record(frames_per_read_, frames);
+        if (error) {
+            std::cerr << error.message() << std::endl;
+            return;
+        }
+        async_read_frame(connection_, frame_,
+                         boost::bind(&client::handle_frame, this, boost::asio::placeholders::error));
+    }
+
+    /// Give the frame just read to the pipeline. The payload is swapped with
+    /// the batch's, so both keep their capacity. Returns false if the
+    /// pipeline is stopping.
+    bool hand_off() {
+        pipeline_batch* batch = pipeline_->acquire();
+        if (!batch) {
+            return false;
+        }
+        batch->frame.header = frame_.header;
+        batch->frame.payload.swap(frame_.payload);
+        batch->received_at = connection_.received_at();
+        batch->frame_size = connection_.last_frame_size();
+        pipeline_->dispatch(batch);
+        return true;
+    }
+
+    /// Handle a batch decoded by the pipeline, on its processing thread.
+    void process_batch(pipeline_batch& batch) {
+        if (!batch.decoded) {
+            std::cerr << "Invalid frame from the server" << std::endl;
+            io_service->post(boost::bind(&client::close_connection, this));
+            return;
+        }
+        process(batch.samples, batch.received_at, batch.frame_size);
+    }
+
+    /// Close the connection, ending the reads.
+    void close_connection() {
+        connection_.close();
+    }
+
+    /// Handle a batch of samples received at received_at in a frame of
+    /// frame_size bytes.
+    void process(const std::vector<eye_message>& batch, uint64_t received_at, std::size_t frame_size) {
+        record_receive(batch, received_at, frame_size);
+
+        // Drop samples seen before and look for gaps.
+        const std::vector<eye_message>* samples = &batch;
+        if (track_) {
+            tracker_.accept(*samples, sequenced_);
+            samples = &sequenced_;
+            record_sequence();
+            take_gaps();
         }
+
+        // Hand the samples to the logger's writer threads for printing and
+        // saving; this thread goes straight back to its work.
+        if (filter_locally_) {
+            filter_.apply(*samples, filtered_, seen_);
+            samples = &filtered_;
+        }
+        logger_.log(*samples);
     }
 
-    /// Open a file, named with timestamp, for logging eye data
-    void open_file() {
+    /// Record the latency and size of a batch read.
+    void record_receive(const std::vector<eye_message>& batch, uint64_t received_at, std::size_t frame_size) {
+        metrics& m = metrics::instance();
+        m.record(decode_ns_, wall_clock_ns() - received_at);
+        if (!batch.empty()) {
+            m.record(read_ns_, received_at - sample_time_ns(batch.back()));
+        }
+        m.add(frames_received_);
+        m.add(samples_received_, batch.size());
+        m.add(bytes_received_, frame_size);
+    }
+
+    /// Add what the sequence tracker found since the last call to the totals.
+    void record_sequence() {
+        metrics& m = metrics::instance();
+        m.add(samples_missed_, tracker_.gap_samples() - reported_gap_samples_);
+        m.add(samples_recovered_, tracker_.recovered() - reported_recovered_);
+        m.add(samples_duplicate_, tracker_.duplicates() - reported_duplicates_);
+        reported_gap_samples_ = tracker_.gap_samples();
+        reported_recovered_ = tracker_.recovered();
+        reported_duplicates_ = tracker_.duplicates();
+    }
+
+    /// Open the files, named with timestamp, for logging eye data
+    void open_files(const client_options& options) {
         // Get Time for Filename
         time_t rawtime;
         struct tm * timeinfo;
@@ -106,66 +533,121 @@ public:
         // Get Filename
         char filename[1000];
         boost::filesystem::create_directories("./saved_data");
-        strftime(filename, sizeof(filename),"./saved_data/eyedata_%Y%m%d%H%M%S.csv", timeinfo);
-
-        // Open File
-        myfile.open (filename);
+        strftime(filename, sizeof(filename),"./saved_data/eyedata_%Y%m%d%H%M%S", timeinfo);
 
-        // Write Header
-        myfile << "Timestamp(Seconds)" << ",";
-        myfile << "Timestamp(Nanoseconds)" << ",";
-        myfile << "ID" << ",";
-        myfile << "Confidence" << ",";
-        myfile << "NormalizedPosX" << ",";
-        myfile << "NormalizedPosY" << ",";
-        myfile << "PupilDiameter";
-        myfile << "\n";
-    }
-
-    /// Close data log file
-    void close_file() {
-        myfile.close();
-    }
-
-    /// Write an eye message's data to the log file
-    void write_sample_to_file(eye_message s) {
-        myfile << s.time_seconds << ",";
-        myfile << s.time_nanos << ",";
-        myfile << s.id << ",";
-        myfile << s.confidence << ",";
-        myfile << s.normalized_pos_x << ",";
-        myfile << s.normalized_pos_y << ",";
-        myfile << s.pupil_diameter;
-        myfile << "\n";
+        // Open Files, the sinks write their headers
+        boost::shared_ptr<segment_compressor> compressor;
+        if (options.recorder.compress) {
+            compressor = boost::make_shared<segment_compressor>();
+        }
+        if (options.record) {
+            segment_sink_factory factory = boost::bind(&make_segment_sink<recording_sink>, _1,
+                                                       options.recorder.file);
+            logger_.add_sink(boost::make_shared<segmented_sink>(filename, ".rec", factory, options.recorder,
+                                                                compressor));
+        }
+        if (options.csv) {
+            segment_sink_factory factory = boost::bind(&make_segment_sink<csv_file_sink>, _1,
+                                                       options.recorder.file);
+            logger_.add_sink(boost::make_shared<segmented_sink>(filename, ".csv", factory, options.recorder,
+                                                                compressor));
+        }
+        if (options.analytics) {
+            logger_.add_sink(boost::make_shared<analytics_sink>(options.analytics_options,
+                                                                std::string(filename) + ".events.csv"));
+        }
     }
 
-    /// Run the io service on a seperate thread
+    /// Run the io service on a seperate thread, and the pipeline if there
+    /// is one
     void start() {
         should_stop = false;
+        if (pipeline_) {
+            pipeline_->start();
+        }
         client_thread = new boost::thread([this]() {
             io_service->run();
         });
+        if (!receive_cores_.empty()) {
+            pin_thread(*client_thread, receive_cores_[0]);
+        }
     }
 
-    /// Stop the thread running the io service
+    /// Stop the thread running the io service, then the pipeline once it
+    /// has processed what was received
     void stop() {
         should_stop = true;
         io_service->stop();
-        boost::system::error_code e;
-        connection_.socket().shutdown(boost::asio::ip::tcp::socket::shutdown_both, e);
-        connection_.socket().close(e);
+        connection_.close();
         client_thread->join();
+        if (pipeline_) {
+            pipeline_->stop();
+        }
     }
 
 private:
     /// The connection to the server.
-    connection connection_;
+    Connection& connection_;
 
     /// The data received from the server.
     std::vector<eye_message> stocks_;
 
-    /// CSV File For Saved Data
-    std::ofstream myfile;
+    /// Decodes and processes frames on threads of its own, if there are
+    /// decode threads; frame_ is read into for it.
+    boost::shared_ptr<client_pipeline> pipeline_;
+    encoded_frame frame_;
+
+    /// The samples wanted. Applied here, into filtered_, when the transport
+    /// cannot do it for us; seen_ carries decimation across batches.
+    subscription filter_;
+    bool filter_locally_;
+    std::vector<eye_message> filtered_;
+    uint64_t seen_;
+
+    /// Where to resume from on connecting, and whether to ask for gaps to be
+    /// resent.
+    uint64_t resume_from_;
+    bool recover_;
+
+    /// Drops duplicates and finds gaps, into sequenced_, if track_.
+    bool track_;
+    sequence_tracker tracker_;
+    std::vector<eye_message> sequenced_;
+
+    /// Whether a subscription is being sent, and the samples to ask for once
+    /// it has been, from recovery_first_ up to recovery_last_ if that is not 0.
+    bool subscribing_;
+    uint64_t recovery_first_;
+    uint64_t recovery_last_;
+
+    /// Tracker counts already added to the totals.
+    uint64_t reported_gap_samples_;
+    uint64_t reported_recovered_;
+    uint64_t reported_duplicates_;
+
+    /// Prints and saves received samples off the io thread
+    async_logger logger_;
+
+    /// Cores the io thread is pinned to, empty for none
+    std::vector<unsigned int> receive_cores_;
+
+    /// Sample timestamp to received, and received to decoded
+    histogram_id read_ns_;
+    histogram_id decode_ns_;
+
+    /// Receive totals
+    counter_id frames_received_;
+    counter_id samples_received_;
+    counter_id bytes_received_;
+
+    /// Samples found missing from the sequence, received later to fill a
+    /// gap, and received twice
+    counter_id samples_missed_;
+    counter_id samples_recovered_;
+    counter_id samples_duplicate_;
+
+    /// Frames handled for each read from the socket
+    histogram_id frames_per_read_;
 
     /// IO Service
     boost::asio::io_service* io_service;
@@ -176,32 +658,382 @@ private:
     /// Flag for client thread execution
     std::atomic_bool should_stop {false};
 
-    /// Counter for number of received messages
-    int message_count = 0;
-
 };
 
 } // namespace codechallenge
 
+/// Block SIGINT and SIGTERM in this thread and every thread it starts, so
+/// that wait_for_stop() receives them instead of the process being killed.
+void block_stop_signals(sigset_t& signals)
+{
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, 0);
+}
+
+/// Wait for <Enter>, the end of input, or one of the blocked signals.
+void wait_for_stop(const sigset_t& signals)
+{
+    std::cout << "Press <Enter> or Ctrl-C to stop" << std::endl;
+    int fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {fd, POLLIN, 0}};
+    for (;;) {
+        if (poll(fds, fd < 0 ? 1 : 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents) {
+            std::cout << "Stopping on signal" << std::endl;
+            break;
+        }
+        char c;
+        if (fds[0].revents && (read(STDIN_FILENO, &c, 1) <= 0 || c == '\n')) {
+            break;
+        }
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+/// Run a client over the given connection until <Enter> is pressed or it is
+/// interrupted, closing its sinks either way.
+template <typename Connection, typename Address>
+void run_client(boost::asio::io_service& io_service, Connection& conn, const Address& address,
+                const codechallenge::client_options& options)
+{
+    sigset_t signals;
+    block_stop_signals(signals);
+    codechallenge::client<Connection> client(io_service, conn, address, options);
+
+    // Make metrics available on demand and, optionally, periodically
+    codechallenge::admin_server admin(io_service);
+    if (!options.admin_socket.empty()) {
+        boost::filesystem::path path(options.admin_socket);
+        boost::filesystem::create_directories(path.parent_path());
+        admin.listen(options.admin_socket);
+    }
+    if (options.metrics_interval > 0) {
+        admin.report_every(boost::posix_time::seconds(options.metrics_interval));
+    }
+
+    // Run until input or a signal
+    client.start();
+    std::cout << "Running..." << std::endl;
+    wait_for_stop(signals);
+    admin.stop();
+    client.stop();
+    std::cout << "Client Stopped" << std::endl;
+}
+
+/// Run a client over a stream socket, unix or TCP, with its I/O done by
+/// asio or by io_uring.
+template <typename Address>
+void run_stream_client(boost::asio::io_service& io_service, bool uring, const Address& address,
+                       const codechallenge::client_options& options)
+{
+    if (uring) {
+        codechallenge::uring_connection conn(io_service);
+        run_client(io_service, conn, address, options);
+    } else {
+        codechallenge::connection conn(io_service);
+        run_client(io_service, conn, address, options);
+    }
+}
+
+/// Parse a list of cores such as "0,2-3". Returns false if it is not one.
+bool parse_cores(const std::string& text, std::vector<unsigned int>& cores)
+{
+    cores.clear();
+    std::size_t start = 0;
+    while (start < text.size()) {
+        std::size_t end = text.find(',', start);
+        if (end == std::string::npos) {
+            end = text.size();
+        }
+        unsigned int first;
+        unsigned int last;
+        char extra;
+        std::string item = text.substr(start, end - start);
+        if (sscanf(item.c_str(), "%u-%u%c", &first, &last, &extra) == 2) {
+            if (first > last) {
+                return false;
+            }
+        } else if (sscanf(item.c_str(), "%u%c", &first, &extra) == 1) {
+            last = first;
+        } else {
+            return false;
+        }
+        for (unsigned int core = first; core <= last; ++core) {
+            cores.push_back(core);
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
 int main(int argc, char* argv[])
 {
     try {
 
-        // Check command line arguments.
-        if(argc != 1) {
-            std::cout << "Ignoring additional input arguments." << std::endl;
+        // Handle command line arguments.
+        namespace po = boost::program_options;
+        std::string transport;
+        std::string io;
+        std::string host;
+        std::string port;
+        codechallenge::socket_tuning tuning;
+        std::string shm_name;
+        std::string shm_wait;
+        std::string overflow;
+        std::string log_format;
+        std::string topic;
+        std::string roi;
+        std::string codec;
+        unsigned int precision;
+        std::string receive_cores;
+        std::string decode_cores;
+        std::string process_cores;
+        std::string sink_cores;
+        uint64_t segment_mb;
+        std::size_t write_kb;
+        std::string sync;
+        codechallenge::client_options options;
+        po::options_description desc("Options");
+        desc.add_options()
+        ("help", "show this message")
+        ("transport", po::value<std::string>(&transport)->default_value("unix"),
+         "how to reach the server: unix (stream socket), seqpacket (unix socket, a frame per message), "
+         "tcp, or shm (shared memory ring)")
+        ("io", po::value<std::string>(&io)->default_value("asio"),
+         "socket I/O for --transport unix and tcp: asio (epoll) or uring (io_uring with multishot "
+         "receive, falling back to asio where the kernel lacks it)")
+        ("host", po::value<std::string>(&host)->default_value("127.0.0.1"),
+         "server host name or address, for --transport tcp")
+        ("port", po::value<std::string>(&port)->default_value("5555"),
+         "server port (its --tcp-port), for --transport tcp")
+        ("tcp-no-delay", po::value<bool>(&tuning.no_delay)->default_value(true),
+         "send subscription requests at once rather than coalescing small writes (TCP_NODELAY)")
+        ("tcp-receive-buffer", po::value<int>(&tuning.receive_buffer)->default_value(0),
+         "kernel receive buffer in bytes, set before connecting; 0 for the system default")
+        ("tcp-busy-poll", po::value<int>(&tuning.busy_poll_us)->default_value(0),
+         "microseconds to busy-poll the device for data (SO_BUSY_POLL), 0 for none")
+        ("shm-name", po::value<std::string>(&shm_name)->default_value("code_challenge"),
+         "name of the shared memory segment, for --transport shm")
+        ("shm-wait", po::value<std::string>(&shm_wait)->default_value("futex"),
+         "how to wait for shared memory data: futex (block) or spin (busy-poll)")
+        ("print-rate", po::value<unsigned int>(&options.print_rate)->default_value(10),
+         "most samples printed to the console per second, 0 to disable printing")
+        ("log-queue", po::value<std::size_t>(&options.logger.queue_capacity)->default_value(1 << 16),
+         "samples buffered between the receive thread and the log writer")
+        ("flush-ms", po::value<unsigned int>(&options.logger.flush_interval_ms)->default_value(100),
+         "longest time logged samples wait before being written out")
+        ("overflow", po::value<std::string>(&overflow)->default_value("block"),
+         "when the log queue is full: block, drop, or count (drop and report)")
+        ("decode-threads", po::value<std::size_t>(&options.pipeline.decode_threads)->default_value(0),
+         "threads decoding received frames, with one more processing them in order; 0 to decode and "
+         "process on the receiving thread (unix, seqpacket and tcp transports)")
+        ("pipeline-batches", po::value<std::size_t>(&options.pipeline.batches)->default_value(1024),
+         "frames in flight between receiving and processing, with --decode-threads")
+        ("sink-threads", po::value<std::size_t>(&options.logger.writer_threads)->default_value(1),
+         "threads the printing and saving sinks are spread over")
+        ("receive-cores", po::value<std::string>(&receive_cores),
+         "core to pin the receiving thread to")
+        ("decode-cores", po::value<std::string>(&decode_cores),
+         "cores to pin the decode threads to, as a list such as 2,3 or 2-3")
+        ("process-cores", po::value<std::string>(&process_cores),
+         "core to pin the processing thread to, with --decode-threads")
+        ("sink-cores", po::value<std::string>(&sink_cores),
+         "cores to pin the sink threads to")
+        ("log-format", po::value<std::string>(&log_format)->default_value("rec"),
+         "how to save samples: rec (native recording, see the query tool), csv, or both")
+        ("segment-mb", po::value<uint64_t>(&segment_mb)->default_value(0),
+         "start a new numbered file once the current one holds this many MiB, 0 for no limit")
+        ("segment-seconds", po::value<unsigned int>(&options.recorder.segment_seconds)->default_value(0),
+         "start a new numbered file once the current one is this many seconds old, 0 for no limit")
+        ("preallocate", "reserve the disk space of each file when it is created, with --segment-mb")
+        ("direct-io", "write the files with O_DIRECT, bypassing the page cache")
+        ("write-kb", po::value<std::size_t>(&write_kb)->default_value(1024),
+         "KiB gathered before each write to the files")
+        ("sync", po::value<std::string>(&sync)->default_value("segment"),
+         "when to force the files to disk: none, segment (as each file is closed) or flush (every "
+         "--flush-ms too)")
+        ("compress", "gzip each file once it is closed, on a background thread")
+        ("admin-socket", po::value<std::string>(&options.admin_socket)->default_value(
+             "/tmp/code_challenge/client_" + boost::lexical_cast<std::string>(getpid()) + ".admin"),
+         "unix socket that answers every connection with a JSON metrics snapshot, empty to disable")
+        ("metrics-interval", po::value<unsigned int>(&options.metrics_interval)->default_value(0),
+         "seconds between JSON metrics snapshots printed to stderr, 0 to disable")
+        ("topic", po::value<std::string>(&topic)->default_value("all"),
+         "which eye's samples to receive: all, left or right")
+        ("min-confidence", po::value<float>(&options.filter.min_confidence)->default_value(0),
+         "drop samples with a lower confidence")
+        ("decimate", po::value<uint32_t>(&options.filter.decimation)->default_value(1),
+         "receive one in this many of the samples passing the other filters")
+        ("roi", po::value<std::string>(&roi),
+         "region of interest x0,y0,x1,y1 in normalized coordinates; samples outside it are dropped")
+        ("analytics", "classify gaze into fixations, saccades and blinks, saving the events "
+         "as ./saved_data/eyedata_<time>.events.csv")
+        ("saccade-velocity", po::value<float>(&options.analytics_options.saccade_velocity)->default_value(100),
+         "gaze velocity, in degrees per second, above which --analytics counts a saccade")
+        ("codec", po::value<std::string>(&codec)->default_value("server"),
+         "encoding to ask the server for: server (its --codec), binary, compact (delta encoded) or text")
+        ("precision", po::value<unsigned int>(&precision)->default_value(16),
+         "bits per unit --codec compact keeps of confidence and positions, at most 24; 0 for lossless")
+        ("resume-from", po::value<uint64_t>(&options.resume_from)->default_value(0),
+         "sequence number to start from, if the server still has it; 0 for the live stream")
+        ("max-frame", po::value<std::size_t>(&options.max_frame)->default_value(
+             codechallenge::frame_reader::default_max_frame),
+         "largest frame accepted from the server, in bytes; the read buffer holds at least one")
+        ("recover", "ask the server to resend samples missing from the sequence (unfiltered "
+         "subscriptions over unix sockets only)");
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+        if (vm.count("help")) {
+            std::cout << desc << std::endl;
+            return 0;
+        }
+        if (overflow == "block") {
+            options.logger.overflow = codechallenge::overflow_block;
+        } else if (overflow == "drop") {
+            options.logger.overflow = codechallenge::overflow_drop;
+        } else if (overflow == "count") {
+            options.logger.overflow = codechallenge::overflow_count;
+        } else {
+            std::cerr << "Unknown overflow policy: " << overflow << std::endl;
+            return 1;
+        }
+        if (!parse_cores(receive_cores, options.pipeline.receive_cores) ||
+            !parse_cores(decode_cores, options.pipeline.decode_cores) ||
+            !parse_cores(process_cores, options.pipeline.process_cores) ||
+            !parse_cores(sink_cores, options.logger.writer_cores)) {
+            std::cerr << "Cores must be listed as numbers and ranges, such as 0,2-3" << std::endl;
+            return 1;
+        }
+        if (transport == "shm" && options.pipeline.decode_threads > 0) {
+            std::cerr << "Shared memory carries decoded samples; ignoring --decode-threads" << std::endl;
+            options.pipeline.decode_threads = 0;
+        }
+        options.analytics = vm.count("analytics") > 0;
+        options.recover = vm.count("recover") > 0;
+        options.record = log_format == "rec" || log_format == "both";
+        options.csv = log_format == "csv" || log_format == "both";
+        if (!options.record && !options.csv) {
+            std::cerr << "Unknown log format: " << log_format << std::endl;
+            return 1;
+        }
+        options.recorder.segment_bytes = segment_mb << 20;
+        options.recorder.compress = vm.count("compress") > 0;
+        options.recorder.file.direct_io = vm.count("direct-io") > 0;
+        options.recorder.file.write_size = write_kb << 10;
+        if (vm.count("preallocate")) {
+            // Segments run over by up to a chunk of samples before rotating.
+            options.recorder.file.preallocate = options.recorder.segment_bytes + (1 << 20);
+        }
+        if (sync == "none") {
+            options.recorder.file.sync = codechallenge::sync_none;
+        } else if (sync == "segment") {
+            options.recorder.file.sync = codechallenge::sync_segment;
+        } else if (sync == "flush") {
+            options.recorder.file.sync = codechallenge::sync_flush;
+        } else {
+            std::cerr << "Unknown sync policy: " << sync << std::endl;
+            return 1;
+        }
+        if (vm.count("preallocate") && segment_mb == 0) {
+            std::cerr << "--preallocate needs --segment-mb to know how much to reserve" << std::endl;
+            return 1;
         }
 
-        // Setup Client
+        if (topic == "left") {
+            options.filter.eye = 0;
+        } else if (topic == "right") {
+            options.filter.eye = 1;
+        } else if (topic != "all") {
+            std::cerr << "Unknown topic: " << topic << std::endl;
+            return 1;
+        }
+        if (options.filter.decimation < 1) {
+            std::cerr << "Decimation must be at least 1" << std::endl;
+            return 1;
+        }
+        if (codec == "binary") {
+            options.filter.codec = codechallenge::binary_codec_type;
+        } else if (codec == "compact") {
+            options.filter.codec = codechallenge::compact_codec_type;
+        } else if (codec == "text") {
+            options.filter.codec = codechallenge::text_codec_type;
+        } else if (codec != "server") {
+            std::cerr << "Unknown codec: " << codec << std::endl;
+            return 1;
+        }
+        if (precision > codechallenge::compact_codec::max_precision) {
+            std::cerr << "--precision must be at most " << int(codechallenge::compact_codec::max_precision)
+                      << std::endl;
+            return 1;
+        }
+        options.filter.precision = static_cast<uint8_t>(precision);
+        if (!roi.empty()) {
+            codechallenge::subscription& f = options.filter;
+            char extra;
+            if (sscanf(roi.c_str(), "%f,%f,%f,%f%c", &f.min_x, &f.min_y, &f.max_x, &f.max_y, &extra) != 4
+                || !std::isfinite(f.min_x) || !std::isfinite(f.min_y) || !std::isfinite(f.max_x)
+                || !std::isfinite(f.max_y) || f.min_x > f.max_x || f.min_y > f.max_y) {
+                std::cerr << "Region of interest must be finite x0,y0,x1,y1 with x0 <= x1 and y0 <= y1: "
+                          << roi << std::endl;
+                return 1;
+            }
+        }
+        float confidence = options.filter.min_confidence;
+        if (!std::isfinite(confidence) || confidence < 0 || confidence > 1) {
+            std::cerr << "--min-confidence must be between 0 and 1" << std::endl;
+            return 1;
+        }
+        if (options.recover && !options.filter.is_all()) {
+            std::cerr << "--recover needs every sample, it cannot be used with filters" << std::endl;
+            return 1;
+        }
+
+        // Setup Client, with the stop signals blocked before any thread starts
+        sigset_t signals;
+        block_stop_signals(signals);
+        codechallenge::metrics::instance().set_process_name("client");
         boost::asio::io_service io_service;
-        codechallenge::client client(io_service);
-
-        // Run until input
-        client.start();
-        std::cout << "Running..." << std::endl;
-        system("read -p 'Press <Enter> to stop\n' var");
-        client.stop();
-        std::cout << "Client Stopped" << std::endl;
+        bool uring = false;
+        if (io == "uring") {
+            boost::system::error_code e;
+            uring = codechallenge::use_uring(io_service, e);
+            if (!uring) {
+                std::cerr << "io_uring is not available (" << e.message() << "), using asio" << std::endl;
+            }
+        } else if (io != "asio") {
+            std::cerr << "Unknown I/O backend: " << io << std::endl;
+            return 1;
+        }
+        if (transport == "unix") {
+            run_stream_client(io_service, uring, std::string("/tmp/code_challenge/streams"), options);
+        } else if (transport == "seqpacket") {
+            codechallenge::seqpacket_connection conn(io_service);
+            run_client(io_service, conn, "/tmp/code_challenge/packets", options);
+        } else if (transport == "tcp") {
+            boost::asio::ip::tcp::resolver resolver(io_service);
+            codechallenge::tcp_address address;
+            address.endpoint = *resolver.resolve(host, port).begin();
+            address.tuning = tuning;
+            run_stream_client(io_service, uring, address, options);
+        } else if (transport == "shm") {
+            codechallenge::shm_connection conn(io_service, shm_wait == "spin"
+                                               ? codechallenge::shm_spin_wait
+                                               : codechallenge::shm_futex_wait);
+            run_client(io_service, conn, shm_name, options);
+        } else {
+            std::cerr << "Unknown transport: " << transport << std::endl;
+            return 1;
+        }
 
     } catch (std::exception& e) {
         std::cerr << e.what() << std::endl;
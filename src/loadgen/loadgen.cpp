@@ -0,0 +1,673 @@
+//
+// loadgen.cpp
+// ~~~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/function.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/program_options.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "../../include/connection.hpp" // Must come before boost/serialization headers.
+#include <boost/serialization/vector.hpp>
+#include "../../include/eye_message.hpp"
+#include "../../include/io_service_pool.hpp"
+#include "../../include/metrics.hpp"
+#include "../../include/producer_handshake.hpp"
+#include "../../include/sample_generator.hpp"
+#include "../../include/seqpacket_connection.hpp"
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+namespace codechallenge
+{
+
+/// Metrics shared by every simulated client.
+struct load_metrics {
+    load_metrics()
+        : measuring(false) {
+        metrics& m = metrics::instance();
+        latency_ns = m.add_histogram("publish_to_receive_ns");
+        frames = m.add_counter("frames_received");
+        samples = m.add_counter("samples_received");
+        bytes = m.add_counter("bytes_received");
+        connected = m.add_counter("clients_connected");
+        failed = m.add_counter("clients_failed");
+        sourced = m.add_counter("samples_sourced");
+        produced = m.add_counter("samples_produced");
+        producers_accepted = m.add_counter("producers_accepted");
+        producers_rejected = m.add_counter("producers_rejected");
+        producers_failed = m.add_counter("producers_failed");
+    }
+
+    /// Sample timestamp to decoded, for every sample.
+    histogram_id latency_ns;
+
+    /// Traffic received by every client while measuring.
+    counter_id frames;
+    counter_id samples;
+    counter_id bytes;
+
+    /// Clients that connected, and that failed to connect or were dropped.
+    counter_id connected;
+    counter_id failed;
+
+    /// Samples received that carry the source a broker stamped them with.
+    counter_id sourced;
+
+    /// Samples sent by every producer while measuring.
+    counter_id produced;
+
+    /// Producers the broker accepted and turned away, and those that failed
+    /// to connect or were dropped.
+    counter_id producers_accepted;
+    counter_id producers_rejected;
+    counter_id producers_failed;
+
+    /// Only traffic received while this is set is counted.
+    std::atomic_bool measuring;
+};
+
+/// A headless client: reads frames as fast as they arrive and records how
+/// late each sample is.
+template <typename Connection>
+class basic_load_client
+    : public boost::enable_shared_from_this<basic_load_client<Connection> >
+{
+public:
+    basic_load_client(boost::asio::io_service& io_service, load_metrics& ids)
+        : connection_(io_service), ids_(ids), stopping_(false) {
+    }
+
+    /// Connect to the server and start reading.
+    template <typename Address>
+    void start(const Address& address) {
+        async_connect(connection_, address, boost::bind(&basic_load_client::handle_connect, this->shared_from_this(),
+                      boost::asio::placeholders::error));
+    }
+
+    /// Close the connection.
+    void stop() {
+        stopping_ = true;
+        connection_.get_io_service().post(boost::bind(&basic_load_client::close, this->shared_from_this()));
+    }
+
+    /// Handle completion of a connect operation.
+    void handle_connect(const boost::system::error_code& e) {
+        if (e) {
+            metrics::instance().add(ids_.failed);
+            return;
+        }
+        metrics::instance().add(ids_.connected);
+        read();
+    }
+
+    /// Handle completion of a read operation.
+    void handle_read(const boost::system::error_code& e) {
+        if (e) {
+            if (!stopping_) {
+                metrics::instance().add(ids_.failed);
+            }
+            return;
+        }
+        if (ids_.measuring) {
+            metrics& m = metrics::instance();
+            uint64_t now = wall_clock_ns();
+            uint64_t sourced = 0;
+            for (std::size_t i = 0; i < samples_.size(); ++i) {
+                m.record(ids_.latency_ns, now - sample_time_ns(samples_[i]));
+                sourced += samples_[i].source_id != 0 ? 1 : 0;
+            }
+            m.add(ids_.sourced, sourced);
+            m.add(ids_.frames);
+            m.add(ids_.samples, samples_.size());
+            m.add(ids_.bytes, connection_.last_frame_size());
+        }
+        read();
+    }
+
+private:
+    /// Start reading the next frame.
+    void read() {
+        connection_.async_read(samples_, boost::bind(&basic_load_client::handle_read, this->shared_from_this(),
+                               boost::asio::placeholders::error));
+    }
+
+    /// Close the connection from the io_service.
+    void close() {
+        connection_.close();
+    }
+
+    /// The connection to the server.
+    Connection connection_;
+
+    /// The batch being read.
+    std::vector<eye_message> samples_;
+
+    /// Where to record metrics.
+    load_metrics& ids_;
+
+    /// Set once the harness is shutting the client down.
+    std::atomic_bool stopping_;
+};
+
+/// Start count clients on the pool's io_services, connecting to address, and
+/// add a function to stop each to stoppers.
+template <typename Connection, typename Address>
+void start_clients(io_service_pool& pool, load_metrics& ids, std::size_t count, const Address& address,
+                   std::vector<boost::function<void()> >& stoppers)
+{
+    typedef basic_load_client<Connection> load_client;
+    for (std::size_t i = 0; i < count; ++i) {
+        boost::shared_ptr<load_client> client =
+            boost::make_shared<load_client>(boost::ref(pool.get_io_service()), boost::ref(ids));
+        client->start(address);
+        stoppers.push_back(boost::bind(&load_client::stop, client));
+    }
+}
+
+/// A simulated tracker: identifies itself to the broker, then sends a batch
+/// of generated samples at a fixed rate, numbering them itself. A tick that
+/// comes while the last batch is still being written sends nothing.
+class load_producer
+    : public boost::enable_shared_from_this<load_producer>
+{
+public:
+    load_producer(boost::asio::io_service& io_service, load_metrics& ids, uint32_t source_id,
+                  const std::string& token, codec_type codec, double rate, int batch)
+        : connection_(io_service), strand_(io_service), timer_(io_service), ids_(ids),
+          generator_(seeded(source_id)), period_(boost::posix_time::microseconds(int64_t(1e6 / rate))),
+          interval_ns_(uint64_t(1e9 / rate / batch)), batch_(batch), next_seq_(1), writing_(false),
+          stopping_(false) {
+        hello_.source_id = source_id;
+        hello_.name = "loadgen-" + boost::lexical_cast<std::string>(source_id);
+        hello_.token = token;
+        connection_.set_codec(codec);
+    }
+
+    /// Connect to the broker and introduce ourselves.
+    void start(const std::string& path) {
+        async_connect(connection_, path, strand_.wrap(boost::bind(&load_producer::handle_connect,
+                      shared_from_this(), boost::asio::placeholders::error)));
+    }
+
+    /// Stop sending and close the connection.
+    void stop() {
+        stopping_ = true;
+        strand_.post(boost::bind(&load_producer::close, shared_from_this()));
+    }
+
+    /// Handle completion of a connect operation.
+    void handle_connect(const boost::system::error_code& e) {
+        if (e) {
+            metrics::instance().add(ids_.producers_failed);
+            return;
+        }
+        connection_.async_write(hello_, strand_.wrap(boost::bind(&load_producer::handle_hello,
+                                shared_from_this(), boost::asio::placeholders::error)));
+    }
+
+    /// Wait for the broker's reply once the hello is sent.
+    void handle_hello(const boost::system::error_code& e) {
+        if (e) {
+            metrics::instance().add(ids_.producers_failed);
+            return;
+        }
+        connection_.async_read(reply_, strand_.wrap(boost::bind(&load_producer::handle_reply,
+                               shared_from_this(), boost::asio::placeholders::error)));
+    }
+
+    /// Start sending if accepted.
+    void handle_reply(const boost::system::error_code& e) {
+        if (e || reply_.status != producer_accepted) {
+            metrics::instance().add(e ? ids_.producers_failed : ids_.producers_rejected);
+            return;
+        }
+        metrics::instance().add(ids_.producers_accepted);
+        deadline_ = boost::posix_time::microsec_clock::universal_time();
+        schedule();
+    }
+
+    /// Send a batch, unless the last one is still being written.
+    void handle_tick(const boost::system::error_code& e) {
+        if (e || stopping_) {
+            return;
+        }
+        if (!writing_) {
+            send();
+        }
+        schedule();
+    }
+
+    /// Handle completion of a write operation.
+    void handle_write(const boost::system::error_code& e) {
+        writing_ = false;
+        if (e && !stopping_) {
+            metrics::instance().add(ids_.producers_failed);
+            stopping_ = true;
+        }
+    }
+
+private:
+    /// Generator options giving each source samples of its own.
+    static generator_options seeded(uint32_t source_id) {
+        generator_options options;
+        options.seed = source_id;
+        return options;
+    }
+
+    /// Wait for the next tick.
+    void schedule() {
+        deadline_ += period_;
+        timer_.expires_at(deadline_);
+        timer_.async_wait(strand_.wrap(boost::bind(&load_producer::handle_tick, shared_from_this(),
+                                                   boost::asio::placeholders::error)));
+    }
+
+    /// Generate and write a batch.
+    void send() {
+        generator_.generate(samples_, std::size_t(batch_), wall_clock_ns(), interval_ns_);
+        for (std::size_t i = 0; i < samples_.size(); ++i) {
+            samples_[i].seq_number = next_seq_++;
+        }
+        if (ids_.measuring) {
+            metrics::instance().add(ids_.produced, samples_.size());
+        }
+        writing_ = true;
+        connection_.async_write(samples_, strand_.wrap(boost::bind(&load_producer::handle_write,
+                                shared_from_this(), boost::asio::placeholders::error)));
+    }
+
+    /// Close the connection and the timer, on the strand.
+    void close() {
+        boost::system::error_code ignored;
+        timer_.cancel(ignored);
+        connection_.close();
+    }
+
+    /// The connection to the broker, and the strand its handlers and the
+    /// timer's run on.
+    connection connection_;
+    boost::asio::io_service::strand strand_;
+    boost::asio::deadline_timer timer_;
+
+    /// Where to record metrics.
+    load_metrics& ids_;
+
+    /// The handshake, and the broker's reply.
+    producer_hello hello_;
+    producer_reply reply_;
+
+    /// Makes up the samples.
+    sample_generator generator_;
+
+    /// Time between batches, and the next batch's deadline.
+    boost::posix_time::time_duration period_;
+    boost::posix_time::ptime deadline_;
+
+    /// Time between samples, and samples per batch.
+    uint64_t interval_ns_;
+    int batch_;
+
+    /// The batch being written, and the sequence number of the next sample.
+    std::vector<eye_message> samples_;
+    uint64_t next_seq_;
+
+    /// Whether a write is in progress.
+    bool writing_;
+
+    /// Set once the harness is shutting the producer down.
+    std::atomic_bool stopping_;
+};
+
+/// A server process started by the harness, stopped by sending the <Enter>
+/// it waits for.
+class server_process
+{
+public:
+    server_process(const std::string& path, const std::vector<std::string>& args)
+        : pid_(-1), input_(-1) {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            throw std::runtime_error("unable to create pipe");
+        }
+        pid_ = fork();
+        if (pid_ < 0) {
+            throw std::runtime_error("unable to fork");
+        }
+        if (pid_ == 0) {
+            // Child: stdin from the pipe, stdout discarded, then become the server.
+            dup2(fds[0], 0);
+            close(fds[0]);
+            close(fds[1]);
+            int null = open("/dev/null", O_WRONLY);
+            dup2(null, 1);
+            std::vector<char*> argv;
+            argv.push_back(const_cast<char*>(path.c_str()));
+            for (std::size_t i = 0; i < args.size(); ++i) {
+                argv.push_back(const_cast<char*>(args[i].c_str()));
+            }
+            argv.push_back(0);
+            execv(path.c_str(), &argv[0]);
+            _exit(127);
+        }
+        close(fds[0]);
+        input_ = fds[1];
+    }
+
+    ~server_process() {
+        stop();
+    }
+
+    /// Whether the process is still running. Reaps it if it has exited.
+    bool running() {
+        int status;
+        if (pid_ > 0 && waitpid(pid_, &status, WNOHANG) == pid_) {
+            pid_ = -1;
+        }
+        return pid_ > 0;
+    }
+
+    /// CPU time, user plus system, the process has used so far.
+    uint64_t cpu_ns() const {
+        std::ifstream stat(("/proc/" + boost::lexical_cast<std::string>(pid_) + "/stat").c_str());
+        std::string line;
+        std::getline(stat, line);
+        // Fields after the parenthesised command name; utime and stime are the
+        // 12th and 13th of them.
+        std::istringstream fields(line.substr(line.rfind(')') + 2));
+        std::string field;
+        uint64_t utime = 0;
+        uint64_t stime = 0;
+        for (int i = 1; i <= 13 && fields >> field; ++i) {
+            if (i == 12) {
+                utime = boost::lexical_cast<uint64_t>(field);
+            } else if (i == 13) {
+                stime = boost::lexical_cast<uint64_t>(field);
+            }
+        }
+        return (utime + stime) * (1000000000 / sysconf(_SC_CLK_TCK));
+    }
+
+    /// Ask the server to stop and wait for it.
+    void stop() {
+        if (input_ >= 0) {
+            ssize_t ignored = write(input_, "\n", 1);
+            (void)ignored;
+            close(input_);
+            input_ = -1;
+        }
+        if (pid_ > 0) {
+            for (int i = 0; i < 50 && running(); ++i) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+            if (running()) {
+                kill(pid_, SIGKILL);
+                int status;
+                waitpid(pid_, &status, 0);
+                pid_ = -1;
+            }
+        }
+    }
+
+private:
+    /// The server's process id.
+    pid_t pid_;
+
+    /// Write end of the server's stdin.
+    int input_;
+};
+
+/// CPU time, user plus system, this process has used so far.
+uint64_t self_cpu_ns()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (uint64_t(usage.ru_utime.tv_sec) + usage.ru_stime.tv_sec) * 1000000000ULL
+           + (uint64_t(usage.ru_utime.tv_usec) + usage.ru_stime.tv_usec) * 1000;
+}
+
+} // namespace codechallenge
+
+int main(int argc, char* argv[])
+{
+    using namespace codechallenge;
+    try {
+
+        // Handle command line arguments.
+        namespace po = boost::program_options;
+        std::string server_path;
+        std::size_t clients;
+        unsigned int rate;
+        int batch;
+        std::string codec;
+        double warmup;
+        double duration;
+        std::size_t threads;
+        std::size_t server_threads;
+        std::string slow_policy;
+        std::string pacing;
+        std::string io;
+        std::string transport;
+        std::size_t producers;
+        double producer_rate;
+        int producer_batch;
+        unsigned short tcp_port;
+        socket_tuning tuning;
+        po::options_description desc("Options");
+        desc.add_options()
+        ("help", "show this message")
+        ("server", po::value<std::string>(&server_path),
+         "server binary to start, by default the one next to this program")
+        ("clients", po::value<std::size_t>(&clients)->default_value(10), "number of simulated clients")
+        ("rate", po::value<unsigned int>(&rate)->default_value(100), "batches published per second")
+        ("batch", po::value<int>(&batch)->default_value(1), "samples per batch (sample_chunk_length)")
+        ("producers", po::value<std::size_t>(&producers)->default_value(0),
+         "simulated trackers sending samples to the server, which then runs as a broker (--ingest) and "
+         "publishes theirs, --rate times a second, instead of generating any")
+        ("producer-rate", po::value<double>(&producer_rate)->default_value(1000),
+         "batches each producer sends per second")
+        ("producer-batch", po::value<int>(&producer_batch)->default_value(1), "samples per producer batch")
+        ("codec", po::value<std::string>(&codec)->default_value("binary"), "payload encoding: binary, compact or text")
+        ("transport", po::value<std::string>(&transport)->default_value("unix"),
+         "how clients reach the server: unix (stream socket), seqpacket (a frame per message) or tcp "
+         "(over loopback)")
+        ("tcp-port", po::value<unsigned short>(&tcp_port)->default_value(5555), "server port, for --transport tcp")
+        ("tcp-no-delay", po::value<bool>(&tuning.no_delay)->default_value(true),
+         "TCP_NODELAY on both ends, for --transport tcp")
+        ("tcp-busy-poll", po::value<int>(&tuning.busy_poll_us)->default_value(0),
+         "microseconds both ends busy-poll for data (SO_BUSY_POLL), for --transport tcp")
+        ("slow-policy", po::value<std::string>(&slow_policy)->default_value("drop-oldest"),
+         "server's slow consumer policy")
+        ("pacing", po::value<std::string>(&pacing)->default_value("timerfd"),
+         "server's pacing mode: timerfd or hybrid")
+        ("io", po::value<std::string>(&io)->default_value("asio"),
+         "server's socket I/O: asio or uring (io_uring)")
+        ("warmup", po::value<double>(&warmup)->default_value(1), "seconds before measuring starts")
+        ("duration", po::value<double>(&duration)->default_value(10), "seconds to measure for")
+        ("threads", po::value<std::size_t>(&threads)->default_value(0),
+         "io threads shared by the simulated clients, 0 for one per core")
+        ("server-threads", po::value<std::size_t>(&server_threads)->default_value(0),
+         "io threads for the server, 0 for one per core");
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+        if (vm.count("help")) {
+            std::cout << desc << std::endl;
+            return 0;
+        }
+        if (transport != "unix" && transport != "seqpacket" && transport != "tcp") {
+            std::cerr << "Unknown transport: " << transport << std::endl;
+            return 1;
+        }
+        if (producer_rate <= 0 || producer_rate > 1000000 || producer_batch < 1 || batch < 1) {
+            std::cerr << "--producer-rate must be above 0 and at most 1000000, "
+                      "--producer-batch and --batch at least 1" << std::endl;
+            return 1;
+        }
+        if (server_path.empty()) {
+            server_path = (boost::filesystem::path(argv[0]).parent_path() / "server").string();
+        }
+
+        // A server that exits early must not kill us when we tell it to stop
+        signal(SIGPIPE, SIG_IGN);
+
+        // Start the server and wait for its socket to appear
+        const std::string socket_path = transport == "seqpacket" ? "/tmp/code_challenge/packets"
+                                                                 : "/tmp/code_challenge/streams";
+        boost::system::error_code ignored;
+        boost::filesystem::remove(socket_path, ignored);
+        std::vector<std::string> args;
+        args.push_back("--rate=" + boost::lexical_cast<std::string>(rate));
+        args.push_back("--batch=" + boost::lexical_cast<std::string>(batch));
+        args.push_back("--codec=" + codec);
+        if (transport == "tcp") {
+            args.push_back("--tcp-port=" + boost::lexical_cast<std::string>(tcp_port));
+            args.push_back("--tcp-no-delay=" + boost::lexical_cast<std::string>(tuning.no_delay));
+            args.push_back("--tcp-busy-poll=" + boost::lexical_cast<std::string>(tuning.busy_poll_us));
+        } else {
+            args.push_back("--transport=" + transport);
+        }
+        args.push_back("--slow-policy=" + slow_policy);
+        args.push_back("--pacing=" + pacing);
+        args.push_back("--io=" + io);
+        args.push_back("--threads=" + boost::lexical_cast<std::string>(server_threads));
+        args.push_back("--admin-socket");
+        args.push_back("");
+        const std::string producer_path = "/tmp/code_challenge/producers";
+        const std::string token = "loadgen";
+        if (producers > 0) {
+            args.push_back("--ingest");
+            args.push_back("--producer-token=" + token);
+        }
+        server_process server(server_path, args);
+        const std::string& last_path = producers > 0 ? producer_path : socket_path;
+        for (int i = 0; i < 100 && !boost::filesystem::exists(last_path); ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        if (!server.running() || !boost::filesystem::exists(socket_path)
+                || !boost::filesystem::exists(last_path)) {
+            std::cerr << "Server did not start: " << server_path << std::endl;
+            return 1;
+        }
+
+        // Connect the simulated clients
+        metrics::instance().set_process_name("loadgen");
+        load_metrics ids;
+        io_service_pool pool(threads);
+        std::vector<boost::function<void()> > stoppers;
+        if (transport == "seqpacket") {
+            start_clients<seqpacket_connection>(pool, ids, clients, socket_path, stoppers);
+        } else if (transport == "tcp") {
+            tcp_address address;
+            address.endpoint = boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), tcp_port);
+            address.tuning = tuning;
+            start_clients<connection>(pool, ids, clients, address, stoppers);
+        } else {
+            start_clients<connection>(pool, ids, clients, socket_path, stoppers);
+        }
+        codec_type producer_codec = codec == "compact" ? compact_codec_type
+                                    : codec == "text" ? text_codec_type : binary_codec_type;
+        for (std::size_t i = 0; i < producers; ++i) {
+            boost::shared_ptr<load_producer> producer = boost::make_shared<load_producer>(
+                        boost::ref(pool.get_io_service()), boost::ref(ids), uint32_t(i + 1), token,
+                        producer_codec, producer_rate, producer_batch);
+            producer->start(producer_path);
+            stoppers.push_back(boost::bind(&load_producer::stop, producer));
+        }
+        pool.run();
+
+        // Measure
+        std::this_thread::sleep_for(std::chrono::duration<double>(warmup));
+        uint64_t start = steady_clock_ns();
+        uint64_t server_cpu_start = server.cpu_ns();
+        uint64_t client_cpu_start = self_cpu_ns();
+        ids.measuring = true;
+        std::this_thread::sleep_for(std::chrono::duration<double>(duration));
+        ids.measuring = false;
+        double elapsed = (steady_clock_ns() - start) / 1e9;
+        uint64_t server_cpu = server.cpu_ns() - server_cpu_start;
+        uint64_t client_cpu = self_cpu_ns() - client_cpu_start;
+
+        // Shut down
+        for (std::size_t i = 0; i < stoppers.size(); ++i) {
+            stoppers[i]();
+        }
+        server.stop();
+        pool.stop();
+
+        // Report
+        metrics& m = metrics::instance();
+        uint64_t samples = m.total(ids.samples);
+        uint64_t frames = m.total(ids.frames);
+        uint64_t bytes = m.total(ids.bytes);
+        histogram_snapshot latency = m.merged(ids.latency_ns);
+        std::string out = "{\"config\":{";
+        json::append_field(out, "clients", uint64_t(clients), true);
+        json::append_field(out, "rate", uint64_t(rate));
+        json::append_field(out, "batch", uint64_t(batch));
+        out += ",\"codec\":\"" + codec + "\"";
+        out += ",\"transport\":\"" + transport + "\"";
+        out += ",\"io\":\"" + io + "\"";
+        json::append_field(out, "producers", uint64_t(producers));
+        json::append_field(out, "producer_rate", producer_rate);
+        json::append_field(out, "producer_batch", uint64_t(producer_batch));
+        json::append_field(out, "duration_s", elapsed);
+        out += "}";
+        json::append_field(out, "clients_connected", m.total(ids.connected));
+        json::append_field(out, "clients_failed", m.total(ids.failed));
+        json::append_field(out, "producers_accepted", m.total(ids.producers_accepted));
+        json::append_field(out, "producers_rejected", m.total(ids.producers_rejected));
+        json::append_field(out, "producers_failed", m.total(ids.producers_failed));
+        json::append_field(out, "samples_produced", m.total(ids.produced));
+        json::append_field(out, "samples_sourced", m.total(ids.sourced));
+        json::append_field(out, "samples_received", samples);
+        json::append_field(out, "frames_received", frames);
+        json::append_field(out, "bytes_received", bytes);
+        out += ",\"throughput\":{";
+        json::append_field(out, "samples_per_second", samples / elapsed, true);
+        json::append_field(out, "frames_per_second", frames / elapsed);
+        json::append_field(out, "bytes_per_second", bytes / elapsed);
+        out += "},\"latency_ns\":{";
+        json::append_field(out, "count", latency.count(), true);
+        json::append_field(out, "min", latency.min());
+        json::append_field(out, "mean", latency.mean());
+        json::append_field(out, "p50", latency.percentile(0.5));
+        json::append_field(out, "p90", latency.percentile(0.9));
+        json::append_field(out, "p99", latency.percentile(0.99));
+        json::append_field(out, "p999", latency.percentile(0.999));
+        json::append_field(out, "max", latency.max());
+        out += "},\"cpu\":{";
+        json::append_field(out, "server_percent", 100.0 * server_cpu / (elapsed * 1e9), true);
+        json::append_field(out, "clients_percent", 100.0 * client_cpu / (elapsed * 1e9));
+        json::append_field(out, "server_ns_per_sample", samples ? double(server_cpu) / samples : 0.0);
+        json::append_field(out, "clients_ns_per_sample", samples ? double(client_cpu) / samples : 0.0);
+        out += "}}\n";
+        fwrite(out.data(), 1, out.size(), stdout);
+
+    } catch (std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,351 @@
+//
+// query.cpp
+// ~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+#include <boost/algorithm/string.hpp>
+#include <boost/program_options.hpp>
+#include "../../include/csv_format.hpp"
+#include "../../include/recording.hpp"
+
+namespace codechallenge
+{
+
+/// Running aggregates of one column.
+struct column_stats {
+    column_stats()
+        : count(0), sum(0), min(std::numeric_limits<double>::max()),
+          max(std::numeric_limits<double>::lowest()) {
+    }
+
+    uint64_t count;
+    double sum;
+    double min;
+    double max;
+};
+
+/// Samples [begin, end) of one block, all within the queried time range.
+struct sample_range {
+    std::size_t block;
+    uint32_t begin;
+    uint32_t end;
+};
+
+/// Answers queries against one recording, touching only the blocks whose
+/// index entries overlap the requested time range.
+class query
+{
+public:
+    query(const recording_reader& reader, uint64_t from_ns, uint64_t to_ns)
+        : reader_(reader), from_ns_(from_ns), to_ns_(to_ns) {
+    }
+
+    /// Call f with every run of consecutive in-range samples.
+    template <typename Function>
+    void for_each_range(Function f) const {
+        for (std::size_t i = reader_.lower_block(from_ns_); i < reader_.block_count(); ++i) {
+            const recording::index_entry& entry = reader_.block_index(i);
+            if (entry.first_ns > to_ns_) {
+                break;
+            }
+            if (entry.first_ns >= from_ns_ && entry.last_ns <= to_ns_) {
+                sample_range whole = { i, 0, entry.count };
+                f(whole);
+                continue;
+            }
+            sample_range run = { i, 0, 0 };
+            for (uint32_t j = 0; j < entry.count; ++j) {
+                uint64_t ts = reader_.timestamp_ns(i, j);
+                if (ts >= from_ns_ && ts <= to_ns_) {
+                    if (run.end != j) {
+                        run.begin = j;
+                    }
+                    run.end = j + 1;
+                } else if (run.end > run.begin) {
+                    f(run);
+                    run.begin = run.end = 0;
+                }
+            }
+            if (run.end > run.begin) {
+                f(run);
+            }
+        }
+    }
+
+    /// Aggregate the given columns over the time range.
+    std::vector<column_stats> stats(const std::vector<recording::column_id>& columns) const {
+        std::vector<column_stats> result(columns.size());
+        for_each_range([&](const sample_range& r) {
+            for (std::size_t c = 0; c < columns.size(); ++c) {
+                accumulate(r, columns[c], result[c]);
+            }
+        });
+        return result;
+    }
+
+    /// Print the given columns of every sample in the time range as CSV.
+    void print(const std::vector<recording::column_id>& columns, FILE* out) const {
+        std::string line;
+        for (std::size_t c = 0; c < columns.size(); ++c) {
+            line += c ? "," : "";
+            line += recording::column(columns[c]).name;
+        }
+        line += "\n";
+        for_each_range([&](const sample_range& r) {
+            for (uint32_t j = r.begin; j < r.end; ++j) {
+                for (std::size_t c = 0; c < columns.size(); ++c) {
+                    if (c) {
+                        line.push_back(',');
+                    }
+                    append_value(line, r.block, columns[c], j);
+                }
+                line.push_back('\n');
+            }
+            fwrite(line.data(), 1, line.size(), out);
+            line.clear();
+        });
+        fwrite(line.data(), 1, line.size(), out);
+    }
+
+    /// Write every sample in the time range in the client's CSV format.
+    void export_csv(FILE* out) const {
+        std::string text;
+        csv::append_header(text);
+        for_each_range([&](const sample_range& r) {
+            for (uint32_t j = r.begin; j < r.end; ++j) {
+                csv::append_row(text, reader_.sample(r.block, j));
+            }
+            fwrite(text.data(), 1, text.size(), out);
+            text.clear();
+        });
+        fwrite(text.data(), 1, text.size(), out);
+    }
+
+private:
+    /// Fold one run of one column into s, reading the column in place.
+    void accumulate(const sample_range& r, recording::column_id id, column_stats& s) const {
+        switch (recording::column(id).type) {
+        case recording::u8_column:
+            accumulate(reader_.column<uint8_t>(r.block, id), r, s);
+            break;
+        case recording::u32_column:
+            accumulate(reader_.column<uint32_t>(r.block, id), r, s);
+            break;
+        case recording::u64_column:
+            accumulate(reader_.column<uint64_t>(r.block, id), r, s);
+            break;
+        case recording::f32_column:
+            accumulate(reader_.column<float>(r.block, id), r, s);
+            break;
+        }
+    }
+
+    template <typename T>
+    static void accumulate(const T* data, const sample_range& r, column_stats& s) {
+        double sum = 0;
+        T lo = data[r.begin];
+        T hi = data[r.begin];
+        for (uint32_t j = r.begin; j < r.end; ++j) {
+            sum += data[j];
+            lo = std::min(lo, data[j]);
+            hi = std::max(hi, data[j]);
+        }
+        s.count += r.end - r.begin;
+        s.sum += sum;
+        s.min = std::min(s.min, double(lo));
+        s.max = std::max(s.max, double(hi));
+    }
+
+    /// Append one value as text.
+    void append_value(std::string& out, std::size_t block, recording::column_id id, uint32_t j) const {
+        switch (recording::column(id).type) {
+        case recording::u8_column:
+            csv::append_uint(out, reader_.column<uint8_t>(block, id)[j]);
+            break;
+        case recording::u32_column:
+            csv::append_uint(out, reader_.column<uint32_t>(block, id)[j]);
+            break;
+        case recording::u64_column:
+            csv::append_uint(out, reader_.column<uint64_t>(block, id)[j]);
+            break;
+        case recording::f32_column:
+            csv::append_float(out, reader_.column<float>(block, id)[j]);
+            break;
+        }
+    }
+
+    /// The recording.
+    const recording_reader& reader_;
+
+    /// Inclusive time range, in nanoseconds since the epoch.
+    uint64_t from_ns_;
+    uint64_t to_ns_;
+};
+
+/// Parse "seconds[.fraction]" since the epoch into nanoseconds, exactly.
+bool parse_time(const std::string& text, uint64_t& ns)
+{
+    std::string::size_type dot = text.find('.');
+    std::string whole = text.substr(0, dot);
+    std::string fraction = dot == std::string::npos ? "" : text.substr(dot + 1);
+    if (whole.empty() || fraction.size() > 9
+            || whole.find_first_not_of("0123456789") != std::string::npos
+            || fraction.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    fraction.resize(9, '0');
+    ns = std::strtoull(whole.c_str(), 0, 10) * 1000000000ULL + std::strtoull(fraction.c_str(), 0, 10);
+    return true;
+}
+
+/// Print a timestamp in nanoseconds as "seconds.nanoseconds".
+void print_time(uint64_t ns)
+{
+    printf("%llu.%09llu", (unsigned long long)(ns / 1000000000ULL),
+           (unsigned long long)(ns % 1000000000ULL));
+}
+
+} // namespace codechallenge
+
+int main(int argc, char* argv[])
+{
+    using namespace codechallenge;
+    try {
+
+        // Handle command line arguments.
+        namespace po = boost::program_options;
+        std::string command;
+        std::string filename;
+        std::string from;
+        std::string to;
+        std::string fields;
+        std::string output;
+        po::options_description desc("Options");
+        desc.add_options()
+        ("help", "show this message")
+        ("command", po::value<std::string>(&command),
+         "info (summary), scan (print fields), stats (count/min/max/mean of fields), "
+         "or export (CSV in the client's format)")
+        ("file", po::value<std::string>(&filename), "recording (.rec) to query")
+        ("from", po::value<std::string>(&from), "start of the time range, seconds since the epoch")
+        ("to", po::value<std::string>(&to), "end of the time range (inclusive)")
+        ("fields", po::value<std::string>(&fields)->default_value("all"),
+         "comma separated fields for scan and stats, e.g. time_seconds,pupil_diameter")
+        ("output", po::value<std::string>(&output), "file to write to instead of stdout");
+        po::positional_options_description positional;
+        positional.add("command", 1).add("file", 1);
+        po::variables_map vm;
+        po::store(po::command_line_parser(argc, argv).options(desc).positional(positional).run(), vm);
+        po::notify(vm);
+        if (vm.count("help") || command.empty() || filename.empty()) {
+            std::cout << "Usage: query <info|scan|stats|export> <file.rec> [options]\n"
+                      << desc << std::endl;
+            return vm.count("help") ? 0 : 1;
+        }
+
+        uint64_t from_ns = 0;
+        uint64_t to_ns = std::numeric_limits<uint64_t>::max();
+        if ((!from.empty() && !parse_time(from, from_ns)) || (!to.empty() && !parse_time(to, to_ns))) {
+            std::cerr << "Times are seconds since the epoch, e.g. 1539800000.25" << std::endl;
+            return 1;
+        }
+
+        std::vector<recording::column_id> columns;
+        if (fields == "all") {
+            for (int i = 0; i < recording::column_count; ++i) {
+                columns.push_back(recording::column_id(i));
+            }
+        } else {
+            std::vector<std::string> names;
+            boost::split(names, fields, boost::is_any_of(","));
+            for (std::size_t i = 0; i < names.size(); ++i) {
+                recording::column_id id = recording::find_column(names[i]);
+                if (id == recording::column_count) {
+                    std::cerr << "Unknown field: " << names[i] << std::endl;
+                    return 1;
+                }
+                columns.push_back(id);
+            }
+        }
+
+        recording_reader reader(filename);
+        query q(reader, from_ns, to_ns);
+        for (std::size_t i = 0; i < columns.size(); ++i) {
+            if (!reader.has_column(columns[i])) {
+                if (fields != "all") {
+                    std::cerr << filename << " predates field " << recording::column(columns[i]).name
+                              << std::endl;
+                    return 1;
+                }
+                columns.resize(i);
+            }
+        }
+
+        FILE* out = stdout;
+        if (!output.empty()) {
+            out = fopen(output.c_str(), "w");
+            if (!out) {
+                std::cerr << "Unable to open " << output << std::endl;
+                return 1;
+            }
+        }
+
+        if (command == "info") {
+            printf("Samples: %llu\nBlocks: %zu of %u samples\n",
+                   (unsigned long long)reader.sample_count(), reader.block_count(),
+                   reader.block_capacity());
+            printf("Schema version: %u\n", reader.schema_version());
+            if (reader.recovered()) {
+                printf("Index: rebuilt, the recording was not closed\n");
+            }
+            if (reader.block_count() > 0) {
+                printf("First: ");
+                print_time(reader.block_index(0).first_ns);
+                printf("\nLast: ");
+                print_time(reader.block_index(reader.block_count() - 1).last_ns);
+                printf("\n");
+            }
+        } else if (command == "scan") {
+            q.print(columns, out);
+        } else if (command == "stats") {
+            std::vector<column_stats> stats = q.stats(columns);
+            fprintf(out, "field,count,min,max,mean\n");
+            for (std::size_t c = 0; c < columns.size(); ++c) {
+                const column_stats& s = stats[c];
+                fprintf(out, "%s,%llu", recording::column(columns[c]).name, (unsigned long long)s.count);
+                if (s.count > 0) {
+                    fprintf(out, ",%.17g,%.17g,%.17g\n", s.min, s.max, s.sum / s.count);
+                } else {
+                    fprintf(out, ",,,\n");
+                }
+            }
+        } else if (command == "export") {
+            q.export_csv(out);
+        } else {
+            std::cerr << "Unknown command: " << command << std::endl;
+            return 1;
+        }
+
+        if (out != stdout) {
+            fclose(out);
+        }
+
+    } catch (std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -18,133 +18,360 @@
 #include "../../include/connection.hpp" // Must come before boost/serialization headers.
 #include <boost/serialization/vector.hpp>
 #include "../../include/eye_message.hpp"
-#include <stdlib.h>
-#include <time.h>
-#include <chrono>
-#include <ctime>
+#include "../../include/admin_server.hpp"
+#include "../../include/client_session.hpp"
+#include "../../include/ingest_broker.hpp"
+#include "../../include/io_service_pool.hpp"
+#include "../../include/metrics.hpp"
+#include "../../include/producer_session.hpp"
+#include "../../include/publisher.hpp"
+#include "../../include/replay.hpp"
+#include "../../include/send_queue.hpp"
+#include "../../include/seqpacket_connection.hpp"
+#include "../../include/shm_connection.hpp"
+#include "../../include/uring_connection.hpp"
 #include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/make_shared.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+#include <sys/resource.h>
 
 
 namespace codechallenge
 {
 
+/// Writes every published batch into a shared memory ring.
+class shm_session
+    : public subscriber,
+      public boost::enable_shared_from_this<shm_session>
+{
+public:
+    explicit shm_session(boost::shared_ptr<shm_connection> conn)
+        : conn_(conn) {
+    }
+
+    /// Copy the batch's samples into the ring. Batches are delivered one tick
+    /// at a time, so the ring only ever has one producer.
+    void deliver(const published_batch_ptr& batch) {
+        conn_->async_write(batch->samples,
+                           boost::bind(&shm_session::handle_write, shared_from_this(),
+                                       boost::asio::placeholders::error));
+    }
+
+    /// Handle completion of a write operation. Ring writes cannot fail.
+    void handle_write(const boost::system::error_code& e) {
+    }
+
+private:
+    /// The producer side of the ring.
+    boost::shared_ptr<shm_connection> conn_;
+};
+
+/// Settings chosen on the command line.
+struct server_options {
+    /// Codec used to encode batches for socket clients that do not ask for
+    /// one, and the compact codec's precision.
+    codec_type codec;
+    unsigned int precision;
+
+    /// Transport offered to clients: "unix", "seqpacket" or "shm".
+    std::string transport;
+
+    /// TCP port also listened on, alongside the transport, 0 for none; the
+    /// address listened on, and the number of listening sockets sharing the
+    /// port.
+    unsigned short tcp_port;
+    std::string tcp_address;
+    std::size_t tcp_listeners;
+
+    /// Socket options for each TCP connection accepted.
+    socket_tuning tcp_tuning;
+
+    /// Whether stream connections, unix and TCP, do their I/O through
+    /// io_uring rather than asio's reactor.
+    bool uring;
+
+    /// Name of the shared memory segment, for the shm transport.
+    std::string shm_name;
+
+    /// Number of samples the shared memory ring holds.
+    uint32_t shm_capacity;
+
+    /// Num samples to send in each chunk.
+    int sample_chunk_length;
+
+    /// Publishing rate and how it is kept.
+    pacer_options pacing;
+
+    /// How samples are made up.
+    generator_options generation;
+
+    /// Recording to publish instead, if any, and how.
+    replay_options replay;
+
+    /// Producers to publish for instead, if enabled.
+    ingest_options ingest;
+
+    /// Per-client queue depth and slow consumer policy, for socket clients.
+    send_queue_options send_queue;
+
+    /// Seconds of published batches kept for clients resuming from a
+    /// sequence number, 0 for none.
+    double retention;
+};
+
 /// Serves eye messages to any client that connects to it.
 class server
 {
 public:
-    /// Constructor opens the acceptor and starts waiting for the first incoming
-    /// connection.
-    server(boost::asio::io_service& io_service)
-        : acceptor_(io_service,
-                    boost::asio::local::stream_protocol::endpoint("/tmp/code_challenge/streams")) {
-        this->io_service = &io_service;
+    typedef boost::asio::basic_socket_acceptor<connection::protocol> stream_acceptor;
+    typedef boost::asio::basic_socket_acceptor<seqpacket_connection::protocol> packet_acceptor;
+    typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
 
-        // Start an accept operation for a new connection.
-        connection_ptr new_conn(new connection(acceptor_.get_io_service()));
-        acceptor_.async_accept(new_conn->socket(),
-                               boost::bind(&server::handle_accept, this,
-                                           boost::asio::placeholders::error, new_conn));
+    /// Constructor sets up the chosen transport: it either opens the acceptor
+    /// and starts waiting for the first incoming connection, or creates the
+    /// shared memory ring. TCP listeners, if any, are opened as well, and so
+    /// are the producers' when ingesting.
+    server(io_service_pool& pool, const server_options& options)
+        : pool_(pool),
+          options_(options),
+          packet_acceptor_(pool.get_io_service()),
+          client_count_(0),
+          publisher_(options.codec, options.sample_chunk_length, options.pacing, options.generation) {
+        publisher_.set_precision(static_cast<uint8_t>(options.precision));
+        if (options.transport != "shm" || options.tcp_port != 0) {
+            publisher_.set_retention(options.retention, options.pacing.rate);
+        }
+        if (!options.replay.path.empty()) {
+            publisher_.replay(boost::make_shared<replayer>(open_replay_source(options.replay.path),
+                              options.replay));
+        }
+        if (options.ingest.enabled) {
+            broker_ = boost::make_shared<ingest_broker>(options.ingest);
+            publisher_.ingest(broker_);
+        }
 
+        if (options.transport == "shm") {
+            boost::shared_ptr<shm_connection> conn(new shm_connection(pool_.get_io_service()));
+            conn->create(options.shm_name, options.shm_capacity);
+            publisher_.subscribe(boost::make_shared<shm_session>(conn));
+        } else if (options.transport == "seqpacket") {
+            boost::asio::local::stream_protocol::endpoint local("/tmp/code_challenge/packets");
+            seqpacket_connection::protocol::endpoint ep(local);
+            packet_acceptor_.open(ep.protocol());
+            packet_acceptor_.bind(ep);
+            packet_acceptor_.listen();
+            start_accept(packet_acceptor_, 0);
+        } else {
+            boost::asio::local::stream_protocol::endpoint local("/tmp/code_challenge/streams");
+            listen(connection::protocol::endpoint(local), false, 0);
+        }
+
+        // Every TCP listener binds the same port; the kernel spreads incoming
+        // connections across them.
+        if (options.tcp_port != 0) {
+            boost::asio::ip::tcp::endpoint tcp(boost::asio::ip::address::from_string(options.tcp_address),
+                                               options.tcp_port);
+            for (std::size_t i = 0; i < options.tcp_listeners; ++i) {
+                listen(connection::protocol::endpoint(tcp), true, &options_.tcp_tuning);
+            }
+        }
+
+        // Producers have listeners of their own, so that neither kind of peer
+        // can be taken for the other.
+        if (broker_) {
+            boost::asio::local::stream_protocol::endpoint local(options.ingest.path);
+            start_accept_producer(open_acceptor(connection::protocol::endpoint(local), false), 0);
+            if (options.ingest.tcp_port != 0) {
+                boost::asio::ip::tcp::endpoint tcp(boost::asio::ip::address::from_string(options.tcp_address),
+                                                   options.ingest.tcp_port);
+                start_accept_producer(open_acceptor(connection::protocol::endpoint(tcp), false),
+                                      &options_.tcp_tuning);
+            }
+        }
+
+        // A single publisher generates the data for every client.
+        publisher_.start();
+    }
+
+    /// Open a stream acceptor listening on ep and start accepting clients on
+    /// it. Each connection accepted is given tuning, if any.
+    void listen(const connection::protocol::endpoint& ep, bool share_port, const socket_tuning* tuning) {
+        start_accept(open_acceptor(ep, share_port), tuning);
+    }
+
+    /// Open a stream acceptor listening on ep.
+    stream_acceptor& open_acceptor(const connection::protocol::endpoint& ep, bool share_port) {
+        boost::shared_ptr<stream_acceptor> acceptor(new stream_acceptor(pool_.get_io_service()));
+        acceptor->open(ep.protocol());
+        if (share_port) {
+            acceptor->set_option(stream_acceptor::reuse_address(true));
+            acceptor->set_option(reuse_port(true));
+        }
+        acceptor->bind(ep);
+        acceptor->listen();
+        acceptors_.push_back(acceptor);
+        return *acceptor;
+    }
+
+    /// Start an accept operation for a new connection: a connection for a
+    /// stream acceptor, a seqpacket_connection for the packet one.
+    void start_accept(stream_acceptor& acceptor, const socket_tuning* tuning) {
+        if (options_.uring) {
+            start_accept<uring_connection>(acceptor, tuning);
+        } else {
+            start_accept<connection>(acceptor, tuning);
+        }
+    }
+
+    void start_accept(packet_acceptor& acceptor, const socket_tuning* tuning) {
+        start_accept<seqpacket_connection>(acceptor, tuning);
+    }
+
+    template <typename Connection, typename Acceptor>
+    void start_accept(Acceptor& acceptor, const socket_tuning* tuning) {
+        boost::shared_ptr<Connection> new_conn(new Connection(pool_.get_io_service()));
+        void (server::*f)(const boost::system::error_code&, boost::shared_ptr<Connection>, Acceptor&,
+                          const socket_tuning*)
+            = &server::handle_accept<Connection, Acceptor>;
+        acceptor.async_accept(new_conn->socket(),
+                              boost::bind(f, this, boost::asio::placeholders::error, new_conn,
+                                          boost::ref(acceptor), tuning));
     }
 
     /// Handle completion of a accept operation.
-    void handle_accept(const boost::system::error_code& e, connection_ptr conn) {
-        if (!e) {
+    template <typename Connection, typename Acceptor>
+    void handle_accept(const boost::system::error_code& e, boost::shared_ptr<Connection> conn,
+                       Acceptor& acceptor, const socket_tuning* tuning) {
+        // An accept can complete without error yet leave no usable socket
+        // behind; there is no client to serve in that case.
+        if (!e && conn->socket().is_open()) {
+            tune(*conn, tuning);
             std::cout << "Client Connected!" << std::endl;
+            typedef basic_client_session<Connection> session_type;
+            boost::shared_ptr<session_type> session = boost::make_shared<session_type>(conn,
+                    boost::ref(publisher_), options_.send_queue, boost::cref(session_metrics_),
+                    ++client_count_);
+            publisher_.subscribe(session);
+            session->start();
+        }
 
-            // Setup eye-data publishing timer.
-            boost::thread t([this, conn]() {
-                boost::asio::io_service io;
-                boost::asio::deadline_timer t(io, boost::posix_time::milliseconds(10));
-                t.async_wait(boost::bind(&server::send_eye_message, this, boost::asio::placeholders::error, &t, conn));
-                io.run();
-            });
-        }
-
-        // Start an accept operation for a new connection.
-        connection_ptr new_conn(new connection(acceptor_.get_io_service()));
-        acceptor_.async_accept(new_conn->socket(),
-                               boost::bind(&server::handle_accept, this,
-                                           boost::asio::placeholders::error, new_conn));
-    }
-
-    /// Handle completion of a write operation.
-    void handle_write(const boost::system::error_code& e, boost::asio::deadline_timer* t, connection_ptr conn) {
-        // Just assume that a write error is caused by the client socket closing
-        if(e) {
-            // Stop the io service sending messages to the client, allow the connection finish
-            t->get_io_service().stop();
-            std::cout << "Client Disconnected" << std::endl;
-        }
-    }
-
-    /// Send one or more eye_messages to client connection
-    void send_eye_message(const boost::system::error_code& e,
-                          boost::asio::deadline_timer* t, connection_ptr conn) {
-
-        // Create a vector of eye messages
-        std::vector<eye_message> stocks_;
-        for (int i=0; i<server::sample_chunk_length; i++) {
-            eye_message msg;
-            msg.time_seconds = time(0);
-            msg.time_nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
-            msg.id = rand()%2;
-            msg.confidence = rand()%2;
-            msg.normalized_pos_x = (rand()%1000)/1000.0;
-            msg.normalized_pos_y = (rand()%1000)/1000.0;
-            msg.pupil_diameter = rand()%100;
-            stocks_.push_back(msg);
-        }
-
-        // Write messages to the stream
-        conn->async_write(stocks_,
-                          boost::bind(&server::handle_write, this,
-                                      boost::asio::placeholders::error, t, conn));
-
-        // Schedule next message, or finish
-        if(!should_stop && !e) {
-            t->expires_at(t->expires_at() + boost::posix_time::milliseconds(10));
-            t->async_wait(boost::bind(&server::send_eye_message, this, boost::asio::placeholders::error, t, conn));
-        } else {
-            t->get_io_service().stop();
+        if (acceptor.is_open()) {
+            start_accept(acceptor, tuning);
+        }
+    }
+
+    /// Start an accept operation for a new producer connection.
+    void start_accept_producer(stream_acceptor& acceptor, const socket_tuning* tuning) {
+        connection_ptr new_conn(new connection(pool_.get_io_service()));
+        acceptor.async_accept(new_conn->socket(),
+                              boost::bind(&server::handle_accept_producer, this, boost::asio::placeholders::error,
+                                          new_conn, boost::ref(acceptor), tuning));
+    }
+
+    /// Handle completion of a producer accept operation. The producer is
+    /// heard out by its own session, which publishes nothing of it until it
+    /// has identified itself.
+    void handle_accept_producer(const boost::system::error_code& e, connection_ptr conn,
+                                stream_acceptor& acceptor, const socket_tuning* tuning) {
+        if (!e && conn->socket().is_open()) {
+            tune(*conn, tuning);
+            boost::make_shared<producer_session>(conn, boost::ref(*broker_))->start();
+        }
+
+        if (acceptor.is_open()) {
+            start_accept_producer(acceptor, tuning);
+        }
+    }
+
+    /// Apply the socket options of a TCP listener to a connection it accepted.
+    /// Failing only costs latency, so the client is served anyway.
+    void tune(base_connection& conn, const socket_tuning* tuning) {
+        if (!tuning) {
             return;
         }
+        boost::system::error_code e;
+        conn.tune(*tuning, e);
+        if (e) {
+            std::cerr << "Socket tuning failed: " << e.message() << std::endl;
+        }
+    }
 
+    /// Seqpacket sockets are only unix sockets, but each frame must fit in
+    /// the send buffer whole: make room for the largest frame clients read
+    /// by default.
+    void tune(seqpacket_connection& conn, const socket_tuning*) {
+        std::size_t max_send = conn.set_max_send(frame_reader::default_max_frame);
+        if (max_send < frame_reader::default_max_frame) {
+            std::cerr << "Seqpacket frames are limited to " << max_send
+                      << " bytes; raise net.core.wmem_max for more" << std::endl;
+        }
     }
 
-    /// Run the io service on a seperate thread
+    /// Run the io service on the worker pool
     void start() {
-        should_stop = false;
-        server_thread = new boost::thread([this]() {
-            io_service->run();
-        });
+        pool_.run();
     }
 
-    /// Stop the thread running the io service
+    /// Stop publishing and join the worker pool
     void stop() {
-        should_stop = true;
-        io_service->stop();
-        server_thread->join();
+        publisher_.stop();
+        boost::system::error_code e;
+        for (std::size_t i = 0; i < acceptors_.size(); ++i) {
+            acceptors_[i]->close(e);
+        }
+        packet_acceptor_.close(e);
+        pool_.stop();
     }
 
 private:
-    /// The acceptor object used to accept incoming socket connections.
-    boost::asio::local::stream_protocol::acceptor acceptor_;
+    /// Worker threads running every connection and the publisher
+    io_service_pool& pool_;
+
+    /// Settings chosen on the command line
+    server_options options_;
+
+    /// The acceptors used to accept incoming stream connections, unix and
+    /// TCP, clients' and producers', and the one for seqpacket connections.
+    std::vector<boost::shared_ptr<stream_acceptor> > acceptors_;
+    packet_acceptor packet_acceptor_;
 
-    /// IO Service
-    boost::asio::io_service* io_service;
+    /// Metric ids used by every client session
+    session_metrics session_metrics_;
 
-    /// Num samples to send in each chunk
-    const static int sample_chunk_length = 1;
+    /// Clients accepted so far, used to number them
+    uint64_t client_count_;
 
-    /// Run Thread
-    boost::thread* server_thread;
+    /// Admits producers and merges their samples, when ingesting
+    boost::shared_ptr<ingest_broker> broker_;
 
-    /// Flag for service thread execution
-    std::atomic_bool should_stop {false};
+    /// Generates eye messages and broadcasts them to every client
+    publisher publisher_;
 };
 
+/// Parse a list of source ids such as "1,2,7". Returns false if it is not
+/// one; ids must not be 0.
+bool parse_sources(const std::string& text, std::vector<uint32_t>& sources)
+{
+    sources.clear();
+    std::size_t start = 0;
+    while (start < text.size()) {
+        std::size_t end = text.find(',', start);
+        if (end == std::string::npos) {
+            end = text.size();
+        }
+        unsigned int id;
+        char extra;
+        if (sscanf(text.substr(start, end - start).c_str(), "%u%c", &id, &extra) != 1 || id == 0) {
+            return false;
+        }
+        sources.push_back(id);
+        start = end + 1;
+    }
+    return true;
+}
+
 } // namespace codechallenge
 
 int main(int argc, char* argv[])
@@ -152,22 +379,254 @@ int main(int argc, char* argv[])
     try {
 
         // Handle command line arguments.
-        if (argc != 1) {
-            std::cout << "Ignoring additional input arguments." << std::endl;
+        namespace po = boost::program_options;
+        std::string codec_name;
+        std::size_t threads = 0;
+        std::string slow_policy;
+        std::string pacing;
+        std::string catch_up;
+        uint64_t spin_us = 0;
+        std::string admin_socket;
+        unsigned int metrics_interval = 0;
+        std::string io;
+        std::string sources;
+        codechallenge::server_options options;
+        po::options_description desc("Options");
+        desc.add_options()
+        ("help", "show this message")
+        ("threads", po::value<std::size_t>(&threads)->default_value(0),
+         "number of io worker threads, 0 for one per core")
+        ("pin-threads", "bind each io worker thread to its own core")
+        ("rate", po::value<double>(&options.pacing.rate)->default_value(100),
+         "batches published per second")
+        ("pacing", po::value<std::string>(&pacing)->default_value("timerfd"),
+         "how ticks are timed: timerfd (sleep on absolute deadlines) or hybrid (sleep, then spin)")
+        ("spin-us", po::value<uint64_t>(&spin_us)->default_value(50),
+         "microseconds spent spinning before each tick, for --pacing hybrid")
+        ("catch-up", po::value<std::string>(&catch_up)->default_value("coalesce"),
+         "ticks missed by a late wake up: coalesce (into one batch), burst (all sent), or skip")
+        ("max-batch", po::value<unsigned int>(&options.pacing.max_batch)->default_value(64),
+         "most ticks adaptive batching puts in one batch")
+        ("no-adaptive-batching", "never put several ticks in one batch to keep up with --rate")
+        ("batch", po::value<int>(&options.sample_chunk_length)->default_value(1),
+         "samples per published batch")
+        ("gaze", po::value<std::string>(&options.generation.gaze)->default_value("saccade"),
+         "how generated gaze moves: saccade (fixations, saccades and blinks) or uniform (noise)")
+        ("seed", po::value<uint64_t>(&options.generation.seed)->default_value(0),
+         "seed for generated samples, the same seed gives the same samples; 0 for a random seed")
+        ("replay", po::value<std::string>(&options.replay.path),
+         "publish the samples of a recording (.rec, or a client's .csv log) instead of generating them")
+        ("replay-speed", po::value<double>(&options.replay.speed)->default_value(1),
+         "replay speed relative to the recording; 0 for as fast as possible, --batch samples a frame")
+        ("replay-loop", "start the recording again when it ends")
+        ("ingest", "act as a broker: publish the samples producers send instead of generating any")
+        ("producer-socket", po::value<std::string>(&options.ingest.path)->default_value(options.ingest.path),
+         "unix socket producers connect to, for --ingest; only producers running as this user are accepted")
+        ("producer-port", po::value<unsigned short>(&options.ingest.tcp_port)->default_value(0),
+         "also accept producers over TCP on this port at --tcp-address, for --ingest; needs --producer-token")
+        ("producer-token", po::value<std::string>(&options.ingest.token),
+         "secret every producer must present, for --ingest")
+        ("sources", po::value<std::string>(&sources),
+         "comma separated source ids producers may identify as, for --ingest; any by default")
+        ("ingest-queue", po::value<std::size_t>(&options.ingest.queue_capacity)->default_value(1 << 16),
+         "samples held between producers and the publisher, for --ingest")
+        ("ingest-batch", po::value<std::size_t>(&options.ingest.max_batch)->default_value(8192),
+         "most samples published per tick, for --ingest; the rest wait for the next tick")
+        ("codec", po::value<std::string>(&codec_name)->default_value("binary"),
+         "payload encoding for clients that do not choose one: binary, compact (delta encoded), "
+         "or text (boost text archive, for debugging)")
+        ("precision", po::value<unsigned int>(&options.precision)->default_value(16),
+         "bits per unit that --codec compact keeps of confidence and positions, at most 24; "
+         "0 for lossless")
+        ("transport", po::value<std::string>(&options.transport)->default_value("unix"),
+         "how clients connect: unix (stream socket), seqpacket (unix socket, a frame per message) "
+         "or shm (shared memory ring)")
+        ("tcp-port", po::value<unsigned short>(&options.tcp_port)->default_value(0),
+         "also accept clients over TCP on this port, alongside --transport; 0 for no TCP")
+        ("tcp-address", po::value<std::string>(&options.tcp_address)->default_value("127.0.0.1"),
+         "address TCP clients connect to, 0.0.0.0 for every interface")
+        ("tcp-listeners", po::value<std::size_t>(&options.tcp_listeners)->default_value(1),
+         "listening sockets sharing the TCP port through SO_REUSEPORT, 0 for one per io thread")
+        ("tcp-no-delay", po::value<bool>(&options.tcp_tuning.no_delay)->default_value(true),
+         "send each frame to TCP clients at once rather than coalescing small writes (TCP_NODELAY)")
+        ("tcp-send-buffer", po::value<int>(&options.tcp_tuning.send_buffer)->default_value(0),
+         "kernel send buffer of each TCP connection in bytes, 0 for the system default")
+        ("tcp-receive-buffer", po::value<int>(&options.tcp_tuning.receive_buffer)->default_value(0),
+         "kernel receive buffer of each TCP connection in bytes, 0 for the system default")
+        ("tcp-busy-poll", po::value<int>(&options.tcp_tuning.busy_poll_us)->default_value(0),
+         "microseconds each TCP connection busy-polls the device for data (SO_BUSY_POLL), 0 for none")
+        ("io", po::value<std::string>(&io)->default_value("asio"),
+         "socket I/O for unix and TCP clients: asio (epoll) or uring (io_uring, falling back to asio "
+         "where the kernel lacks it)")
+        ("shm-name", po::value<std::string>(&options.shm_name)->default_value("code_challenge"),
+         "name of the shared memory segment under /dev/shm, for --transport shm")
+        ("shm-capacity", po::value<uint32_t>(&options.shm_capacity)->default_value(4096),
+         "number of samples held by the shared memory ring")
+        ("send-queue", po::value<std::size_t>(&options.send_queue.max_depth)->default_value(256),
+         "most frames queued for a client behind the write in progress")
+        ("slow-policy", po::value<std::string>(&slow_policy)->default_value("drop-oldest"),
+         "when a client's queue is full: drop-oldest, conflate (keep only the newest frame), "
+         "or disconnect")
+        ("retention", po::value<double>(&options.retention)->default_value(5),
+         "seconds of published samples kept for clients that resume from a sequence number or "
+         "recover a gap, 0 to disable")
+        ("admin-socket", po::value<std::string>(&admin_socket)->default_value("/tmp/code_challenge/server.admin"),
+         "unix socket that answers every connection with a JSON metrics snapshot, empty to disable")
+        ("metrics-interval", po::value<unsigned int>(&metrics_interval)->default_value(0),
+         "seconds between JSON metrics snapshots printed to stderr, 0 to disable");
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+        if (vm.count("help")) {
+            std::cout << desc << std::endl;
+            return 0;
+        }
+        if (options.pacing.rate <= 0 || options.pacing.rate > 1000000
+                || options.sample_chunk_length < 1 || options.pacing.max_batch < 1) {
+            std::cerr << "--rate must be above 0 and at most 1000000, "
+                      "--batch and --max-batch at least 1" << std::endl;
+            return 1;
+        }
+        options.pacing.spin_ns = spin_us * 1000;
+        options.replay.loop = vm.count("replay-loop") > 0;
+        if (options.replay.speed < 0) {
+            std::cerr << "--replay-speed must not be negative" << std::endl;
+            return 1;
+        }
+        options.pacing.adaptive = vm.count("no-adaptive-batching") == 0;
+        if (pacing == "timerfd") {
+            options.pacing.mode = codechallenge::pacing_timerfd;
+        } else if (pacing == "hybrid") {
+            options.pacing.mode = codechallenge::pacing_hybrid;
+        } else {
+            std::cerr << "Unknown pacing mode: " << pacing << std::endl;
+            return 1;
+        }
+        options.ingest.enabled = vm.count("ingest") > 0;
+        if (options.ingest.enabled && !options.replay.path.empty()) {
+            std::cerr << "--ingest and --replay cannot be combined" << std::endl;
+            return 1;
+        }
+        if (options.ingest.max_batch == 0) {
+            std::cerr << "--ingest-batch must be at least 1" << std::endl;
+            return 1;
+        }
+        if (!codechallenge::parse_sources(sources, options.ingest.sources)) {
+            std::cerr << "--sources must be a comma separated list of ids above 0" << std::endl;
+            return 1;
+        }
+        if (options.ingest.tcp_port != 0 && options.ingest.token.empty()) {
+            std::cerr << "--producer-port needs --producer-token; TCP producers cannot be identified otherwise"
+                      << std::endl;
+            return 1;
+        }
+        if (options.ingest.token.size() > codechallenge::producer_hello::max_text) {
+            std::cerr << "--producer-token must be at most " << int(codechallenge::producer_hello::max_text)
+                      << " bytes" << std::endl;
+            return 1;
+        }
+        if (!options.replay.path.empty() && options.replay.speed == 0) {
+            options.pacing.mode = codechallenge::pacing_unpaced;
+        }
+        if (catch_up == "coalesce") {
+            options.pacing.catch_up = codechallenge::catch_up_coalesce;
+        } else if (catch_up == "burst") {
+            options.pacing.catch_up = codechallenge::catch_up_burst;
+        } else if (catch_up == "skip") {
+            options.pacing.catch_up = codechallenge::catch_up_skip;
+        } else {
+            std::cerr << "Unknown catch-up policy: " << catch_up << std::endl;
+            return 1;
+        }
+        options.codec = codechallenge::binary_codec_type;
+        if (codec_name == "text") {
+            options.codec = codechallenge::text_codec_type;
+        } else if (codec_name == "compact") {
+            options.codec = codechallenge::compact_codec_type;
+        } else if (codec_name != "binary") {
+            std::cerr << "Unknown codec: " << codec_name << std::endl;
+            return 1;
+        }
+        if (options.precision > codechallenge::compact_codec::max_precision) {
+            std::cerr << "--precision must be at most " << int(codechallenge::compact_codec::max_precision)
+                      << std::endl;
+            return 1;
+        }
+        if (slow_policy == "drop-oldest") {
+            options.send_queue.policy = codechallenge::drop_oldest;
+        } else if (slow_policy == "conflate") {
+            options.send_queue.policy = codechallenge::conflate_latest;
+        } else if (slow_policy == "disconnect") {
+            options.send_queue.policy = codechallenge::disconnect_slow;
+        } else {
+            std::cerr << "Unknown slow consumer policy: " << slow_policy << std::endl;
+            return 1;
+        }
+        if (options.generation.gaze != "saccade" && options.generation.gaze != "uniform") {
+            std::cerr << "Unknown gaze model: " << options.generation.gaze << std::endl;
+            return 1;
+        }
+        if (options.transport != "unix" && options.transport != "seqpacket" && options.transport != "shm") {
+            std::cerr << "Unknown transport: " << options.transport << std::endl;
+            return 1;
+        }
+        if (io != "asio" && io != "uring") {
+            std::cerr << "Unknown I/O backend: " << io << std::endl;
+            return 1;
+        }
+        if (options.tcp_listeners == 0) {
+            options.tcp_listeners = threads > 0 ? threads : std::max(1u, boost::thread::hardware_concurrency());
         }
 
-        // Remove and recreate socket directory, just in case
-        boost::filesystem::remove_all("/tmp/code_challenge/");
+        // Remove the server's stale sockets, just in case. The directory also
+        // holds the admin sockets of running clients, which are left alone.
         boost::filesystem::create_directories("/tmp/code_challenge/");
+        std::vector<std::string> stale;
+        stale.push_back("/tmp/code_challenge/streams");
+        stale.push_back("/tmp/code_challenge/packets");
+        if (options.ingest.enabled) {
+            stale.push_back(options.ingest.path);
+        }
+        for (std::size_t i = 0; i < stale.size(); ++i) {
+            if (boost::filesystem::status(stale[i]).type() == boost::filesystem::socket_file) {
+                boost::filesystem::remove(stale[i]);
+            }
+        }
+
+        // Let a single server hold connections to well over a thousand clients
+        struct rlimit files;
+        if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+            files.rlim_cur = files.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &files);
+        }
 
         // Setup Server
-        boost::asio::io_service io_service;
-        codechallenge::server server(io_service);
+        codechallenge::metrics::instance().set_process_name("server");
+        codechallenge::io_service_pool pool(threads, vm.count("pin-threads") > 0);
+        options.uring = false;
+        if (io == "uring") {
+            boost::system::error_code e;
+            options.uring = codechallenge::use_uring(pool.get_io_service(), e);
+            if (!options.uring) {
+                std::cerr << "io_uring is not available (" << e.message() << "), using asio" << std::endl;
+            }
+        }
+        codechallenge::server server(pool, options);
+
+        // Make metrics available on demand and, optionally, periodically
+        codechallenge::admin_server admin(pool.get_io_service());
+        if (!admin_socket.empty()) {
+            admin.listen(admin_socket);
+        }
+        if (metrics_interval > 0) {
+            admin.report_every(boost::posix_time::seconds(metrics_interval));
+        }
 
         // Run until input
         server.start();
         std::cout << "Running..." << std::endl;
         system("read -p 'Press <Enter> to stop\n' var");
+        admin.stop();
         server.stop();
         std::cout << "Server Stopped" << std::endl;
 
@@ -0,0 +1,487 @@
+//
+// tests.cpp
+// ~~~~~~~~~
+//
+// Copyright 2018 Cody Feltch
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#define BOOST_TEST_MODULE codechallenge
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include <boost/test/included/unit_test.hpp>
+#include "../../include/connection.hpp" // Must come before boost/serialization headers.
+#include <boost/serialization/vector.hpp>
+#include "../../include/codec.hpp"
+#include "../../include/producer_handshake.hpp"
+#include "../../include/recording.hpp"
+#include "../../include/subscription.hpp"
+
+using namespace codechallenge;
+
+namespace
+{
+
+/// A batch of n varied samples, with sources if sourced.
+std::vector<eye_message> make_batch(std::size_t n, bool sourced)
+{
+    std::vector<eye_message> batch(n);
+    for (std::size_t i = 0; i < n; ++i) {
+        eye_message& m = batch[i];
+        m.seq_number = 1000 + i + (i % 3 == 2 ? 5 : 0);
+        m.time_seconds = 1539864000 + i / 3;
+        m.time_nanos = static_cast<uint32_t>((i * 333333333u + i * i * 17) % 1000000000u);
+        m.id = (i % 2) != 0;
+        m.confidence = float(i % 11) / 10.0f;
+        m.normalized_pos_x = 0.5f + 0.45f * std::sin(float(i));
+        m.normalized_pos_y = 0.5f - 0.3f * std::cos(float(i) * 0.7f);
+        m.pupil_diameter = static_cast<uint32_t>(40 + (i * 7) % 25);
+        m.source_id = sourced ? static_cast<uint32_t>(1 + i % 2) : 0;
+        m.source_seq = sourced ? 50 + i / 2 : 0;
+    }
+    return batch;
+}
+
+/// Check two samples match, their floats within tolerance.
+void check_sample(const eye_message& expected, const eye_message& actual, float tolerance = 0)
+{
+    BOOST_CHECK_EQUAL(expected.seq_number, actual.seq_number);
+    BOOST_CHECK_EQUAL(expected.time_seconds, actual.time_seconds);
+    BOOST_CHECK_EQUAL(expected.time_nanos, actual.time_nanos);
+    BOOST_CHECK_EQUAL(expected.id, actual.id);
+    BOOST_CHECK_SMALL(expected.confidence - actual.confidence, tolerance + 1e-30f);
+    BOOST_CHECK_SMALL(expected.normalized_pos_x - actual.normalized_pos_x, tolerance + 1e-30f);
+    BOOST_CHECK_SMALL(expected.normalized_pos_y - actual.normalized_pos_y, tolerance + 1e-30f);
+    BOOST_CHECK_EQUAL(expected.pupil_diameter, actual.pupil_diameter);
+    BOOST_CHECK_EQUAL(expected.source_id, actual.source_id);
+    BOOST_CHECK_EQUAL(expected.source_seq, actual.source_seq);
+}
+
+/// Decode a whole frame into out.
+template <typename T>
+bool decode_frame(const std::vector<char>& frame, T& out)
+{
+    frame_header header;
+    return frame.size() >= frame_header::length
+           && header.decode(&frame[0])
+           && header.payload_length == frame.size() - frame_header::length
+           && decode_payload(header, &frame[frame_header::length], out);
+}
+
+/// Encode t as a frame of the given codec and decode it back into out.
+template <typename T>
+bool frame_round_trip(codec_type codec, const T& t, T& out)
+{
+    std::vector<char> frame;
+    return encode_frame(codec, t, frame) && decode_frame(frame, out);
+}
+
+/// Encode a batch as a frame of the given codec and precision and decode it
+/// back into out.
+bool frame_round_trip(codec_type codec, const std::vector<eye_message>& batch, std::vector<eye_message>& out,
+                      uint8_t precision)
+{
+    std::vector<char> frame;
+    return encode_frame(codec, batch, frame, precision) && decode_frame(frame, out);
+}
+
+/// A file in the temporary directory, removed when done with.
+struct temp_file {
+    temp_file()
+        : path((boost::filesystem::temp_directory_path()
+                / boost::filesystem::unique_path("codechallenge-%%%%%%%%.rec")).string()) {
+    }
+
+    ~temp_file() {
+        boost::filesystem::remove(path);
+    }
+
+    std::string path;
+};
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(varints)
+
+BOOST_AUTO_TEST_CASE(round_trip)
+{
+    const uint64_t values[] = { 0, 1, 127, 128, 16383, 16384, uint64_t(1) << 63,
+                                std::numeric_limits<uint64_t>::max() };
+    for (uint64_t value : values) {
+        char buffer[wire::max_varint_length];
+        char* end = wire::put_varint(buffer, value);
+        BOOST_CHECK_LE(end - buffer, int(wire::max_varint_length));
+        const char* p = buffer;
+        uint64_t decoded;
+        BOOST_CHECK(wire::get_varint(p, end, decoded));
+        BOOST_CHECK_EQUAL(decoded, value);
+        BOOST_CHECK(p == end);
+
+        // Truncated
+        p = buffer;
+        BOOST_CHECK(end - buffer == 1 || !wire::get_varint(p, end - 1, decoded));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(zigzag)
+{
+    const int64_t values[] = { 0, -1, 1, -64, 64, std::numeric_limits<int64_t>::min(),
+                               std::numeric_limits<int64_t>::max() };
+    for (int64_t value : values) {
+        BOOST_CHECK_EQUAL(wire::unzigzag(wire::zigzag(value)), value);
+    }
+    BOOST_CHECK_EQUAL(wire::zigzag(-1), 1u);
+    BOOST_CHECK_EQUAL(wire::zigzag(1), 2u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(binary)
+
+BOOST_AUTO_TEST_CASE(unsourced_batches_use_version_1_records)
+{
+    std::vector<eye_message> batch = make_batch(20, false);
+    std::vector<char> payload;
+    BOOST_REQUIRE(binary_codec::encode(batch, payload));
+    BOOST_CHECK_EQUAL(payload.size(), 4 + batch.size() * record_size(binary_codec::schema::fields(), 1));
+
+    std::vector<eye_message> decoded;
+    BOOST_REQUIRE(binary_codec::decode(&payload[0], payload.size(), decoded));
+    BOOST_REQUIRE_EQUAL(decoded.size(), batch.size());
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+        check_sample(batch[i], decoded[i]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sourced_batches_use_version_2_records)
+{
+    std::vector<eye_message> batch = make_batch(20, true);
+    std::vector<char> payload;
+    BOOST_REQUIRE(binary_codec::encode(batch, payload));
+    BOOST_CHECK_EQUAL(payload.size(), 4 + batch.size() * std::size_t(binary_codec::record_size));
+
+    std::vector<eye_message> decoded;
+    BOOST_REQUIRE(binary_codec::decode(&payload[0], payload.size(), decoded));
+    BOOST_REQUIRE_EQUAL(decoded.size(), batch.size());
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+        check_sample(batch[i], decoded[i]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(empty_batch)
+{
+    std::vector<eye_message> batch;
+    std::vector<eye_message> decoded = make_batch(3, true);
+    BOOST_CHECK(frame_round_trip(binary_codec_type, batch, decoded));
+    BOOST_CHECK(decoded.empty());
+}
+
+BOOST_AUTO_TEST_CASE(rejects_truncated_payloads)
+{
+    std::vector<eye_message> batch = make_batch(5, true);
+    std::vector<char> payload;
+    BOOST_REQUIRE(binary_codec::encode(batch, payload));
+    std::vector<eye_message> decoded;
+    BOOST_CHECK(!binary_codec::decode(&payload[0], payload.size() - 1, decoded));
+    BOOST_CHECK(!binary_codec::decode(&payload[0], 3, decoded));
+}
+
+BOOST_AUTO_TEST_CASE(frames)
+{
+    std::vector<eye_message> batch = make_batch(7, true);
+    std::vector<eye_message> decoded;
+    BOOST_REQUIRE(frame_round_trip(binary_codec_type, batch, decoded));
+    BOOST_REQUIRE_EQUAL(decoded.size(), batch.size());
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+        check_sample(batch[i], decoded[i]);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(compact)
+
+BOOST_AUTO_TEST_CASE(lossless)
+{
+    for (bool sourced : { false, true }) {
+        std::vector<eye_message> batch = make_batch(100, sourced);
+        std::vector<eye_message> decoded;
+        BOOST_REQUIRE(frame_round_trip(compact_codec_type, batch, decoded, compact_codec::lossless));
+        BOOST_REQUIRE_EQUAL(decoded.size(), batch.size());
+        for (std::size_t i = 0; i < batch.size(); ++i) {
+            check_sample(batch[i], decoded[i]);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(quantized)
+{
+    for (uint8_t precision : { 1, 8, 16, int(compact_codec::max_precision) }) {
+        float step = float(1.0 / double((uint32_t(1) << precision) - 1));
+        std::vector<eye_message> batch = make_batch(100, precision % 2 == 0);
+        std::vector<eye_message> decoded;
+        BOOST_REQUIRE(frame_round_trip(compact_codec_type, batch, decoded, precision));
+        BOOST_REQUIRE_EQUAL(decoded.size(), batch.size());
+        for (std::size_t i = 0; i < batch.size(); ++i) {
+            check_sample(batch[i], decoded[i], step / 2 + 1e-7f);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(rejects_bad_precision)
+{
+    std::vector<eye_message> batch = make_batch(3, false);
+    std::vector<char> payload;
+    BOOST_CHECK(!compact_codec::encode(batch, payload, compact_codec::max_precision + 1));
+
+    BOOST_REQUIRE(compact_codec::encode(batch, payload));
+    payload[0] = char(compact_codec::max_precision + 1);
+    std::vector<eye_message> decoded;
+    BOOST_CHECK(!compact_codec::decode(&payload[0], payload.size(), decoded));
+}
+
+BOOST_AUTO_TEST_CASE(empty_batch)
+{
+    for (uint8_t precision : { 0, 16 }) {
+        std::vector<eye_message> batch;
+        std::vector<eye_message> decoded = make_batch(3, true);
+        BOOST_CHECK(frame_round_trip(compact_codec_type, batch, decoded, precision));
+        BOOST_CHECK(decoded.empty());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(single_sample_and_large_gaps)
+{
+    std::vector<eye_message> batch = make_batch(3, true);
+    batch[1].seq_number = batch[0].seq_number + (uint64_t(1) << 40);
+    batch[2].seq_number = batch[0].seq_number;
+    batch[2].time_seconds = batch[0].time_seconds;
+    batch[1].pupil_diameter = std::numeric_limits<uint32_t>::max();
+    batch[2].source_seq = 0;
+    std::vector<eye_message> decoded;
+    BOOST_REQUIRE(frame_round_trip(compact_codec_type, batch, decoded));
+    BOOST_REQUIRE_EQUAL(decoded.size(), batch.size());
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+        check_sample(batch[i], decoded[i]);
+    }
+
+    batch.resize(1);
+    BOOST_REQUIRE(frame_round_trip(compact_codec_type, batch, decoded));
+    BOOST_REQUIRE_EQUAL(decoded.size(), 1u);
+    check_sample(batch[0], decoded[0]);
+}
+
+BOOST_AUTO_TEST_CASE(rejects_malformed)
+{
+    std::vector<eye_message> batch = make_batch(10, true);
+    std::vector<char> payload;
+    BOOST_REQUIRE(compact_codec::encode(batch, payload));
+    std::vector<eye_message> decoded;
+    BOOST_CHECK(!compact_codec::decode(&payload[0], payload.size() - 1, decoded));
+    payload.push_back(0);
+    BOOST_CHECK(!compact_codec::decode(&payload[0], payload.size(), decoded));
+
+    batch[4].time_nanos = 1000000000u;
+    payload.clear();
+    BOOST_CHECK(!compact_codec::encode(batch, payload));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(subscriptions)
+
+BOOST_AUTO_TEST_CASE(round_trip)
+{
+    subscription s;
+    s.eye = 1;
+    s.min_confidence = 0.25f;
+    s.decimation = 3;
+    s.min_x = 0.1f;
+    s.min_y = 0.2f;
+    s.max_x = 0.8f;
+    s.max_y = 0.9f;
+    s.codec = compact_codec_type;
+    s.precision = 16;
+    s.resume_from = 100;
+    s.resume_to = 200;
+
+    subscription decoded;
+    BOOST_REQUIRE(frame_round_trip(subscription_codec_type, s, decoded));
+    BOOST_CHECK_EQUAL(int(decoded.eye), 1);
+    BOOST_CHECK_EQUAL(decoded.min_confidence, s.min_confidence);
+    BOOST_CHECK_EQUAL(decoded.decimation, s.decimation);
+    BOOST_CHECK_EQUAL(decoded.min_x, s.min_x);
+    BOOST_CHECK_EQUAL(decoded.min_y, s.min_y);
+    BOOST_CHECK_EQUAL(decoded.max_x, s.max_x);
+    BOOST_CHECK_EQUAL(decoded.max_y, s.max_y);
+    BOOST_CHECK_EQUAL(int(decoded.codec), int(s.codec));
+    BOOST_CHECK_EQUAL(int(decoded.precision), int(s.precision));
+    BOOST_CHECK_EQUAL(decoded.resume_from, s.resume_from);
+    BOOST_CHECK_EQUAL(decoded.resume_to, s.resume_to);
+    BOOST_CHECK(!(s < decoded) && !(decoded < s));
+
+    subscription all;
+    BOOST_REQUIRE(frame_round_trip(subscription_codec_type, subscription(), all));
+    BOOST_CHECK(all.is_all());
+    BOOST_CHECK(all.is_server_codec());
+}
+
+BOOST_AUTO_TEST_CASE(rejects_unusable_thresholds)
+{
+    std::vector<subscription> bad(9);
+    bad[0].min_confidence = std::numeric_limits<float>::quiet_NaN();
+    bad[1].min_x = std::numeric_limits<float>::quiet_NaN();
+    bad[2].max_y = std::numeric_limits<float>::infinity();
+    bad[3].min_confidence = 1.5f;
+    bad[4].min_confidence = -0.5f;
+    bad[5].min_x = 0.9f;
+    bad[5].max_x = 0.1f;
+    bad[6].decimation = 0;
+    bad[7].precision = compact_codec::max_precision + 1;
+    bad[8].resume_from = 10;
+    bad[8].resume_to = 5;
+    for (std::size_t i = 0; i < bad.size(); ++i) {
+        subscription decoded;
+        BOOST_CHECK_MESSAGE(!frame_round_trip(subscription_codec_type, bad[i], decoded),
+                            "subscription " << i << " should be rejected");
+    }
+
+    std::vector<char> payload(subscription::payload_length);
+    subscription().encode(&payload[0]);
+    subscription decoded;
+    BOOST_CHECK(decoded.decode(&payload[0], payload.size()));
+    BOOST_CHECK(!decoded.decode(&payload[0], payload.size() - 1));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(producer_handshake)
+
+BOOST_AUTO_TEST_CASE(hello_round_trip)
+{
+    producer_hello hello;
+    hello.source_id = 7;
+    hello.name = "tracker-left";
+    hello.token = std::string(producer_hello::max_text, 's');
+    producer_hello decoded;
+    BOOST_REQUIRE(frame_round_trip(producer_hello_codec_type, hello, decoded));
+    BOOST_CHECK_EQUAL(decoded.source_id, hello.source_id);
+    BOOST_CHECK_EQUAL(decoded.name, hello.name);
+    BOOST_CHECK_EQUAL(decoded.token, hello.token);
+
+    hello.name.clear();
+    hello.token.clear();
+    BOOST_REQUIRE(frame_round_trip(producer_hello_codec_type, hello, decoded));
+    BOOST_CHECK(decoded.name.empty());
+    BOOST_CHECK(decoded.token.empty());
+}
+
+BOOST_AUTO_TEST_CASE(rejects_bad_hellos)
+{
+    producer_hello hello;
+    std::vector<char> frame;
+    BOOST_CHECK(!encode_frame(producer_hello_codec_type, hello, frame));
+    hello.source_id = 7;
+    hello.name = std::string(producer_hello::max_text + 1, 'n');
+    BOOST_CHECK(!encode_frame(producer_hello_codec_type, hello, frame));
+
+    hello.name = "tracker";
+    std::vector<char> payload(hello.payload_length());
+    hello.encode(&payload[0]);
+    producer_hello decoded;
+    BOOST_CHECK(decoded.decode(&payload[0], payload.size()));
+    BOOST_CHECK(!decoded.decode(&payload[0], payload.size() - 1));
+    payload.push_back(0);
+    BOOST_CHECK(!decoded.decode(&payload[0], payload.size()));
+}
+
+BOOST_AUTO_TEST_CASE(reply_round_trip)
+{
+    for (int status = producer_accepted; status <= producer_foreign_user; ++status) {
+        producer_reply reply;
+        reply.status = producer_status(status);
+        producer_reply decoded;
+        BOOST_REQUIRE(frame_round_trip(producer_reply_codec_type, reply, decoded));
+        BOOST_CHECK_EQUAL(int(decoded.status), status);
+    }
+
+    frame_header header;
+    header.payload_length = producer_reply::payload_length;
+    header.codec = producer_reply_codec_type;
+    header.version = wire_version;
+    const char unknown = char(producer_foreign_user + 1);
+    producer_reply decoded;
+    BOOST_CHECK(!decode_payload(header, &unknown, decoded));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(recordings)
+
+BOOST_AUTO_TEST_CASE(round_trip)
+{
+    temp_file file;
+    std::vector<eye_message> batch = make_batch(10, true);
+    {
+        recording_sink sink(file.path, segment_file_options(), 4);
+        sink.write(&batch[0], batch.size(), 0);
+    }
+
+    recording_reader reader(file.path);
+    BOOST_CHECK(!reader.recovered());
+    BOOST_CHECK_EQUAL(reader.block_capacity(), 4u);
+    BOOST_REQUIRE_EQUAL(reader.block_count(), 3u);
+    BOOST_CHECK_EQUAL(reader.sample_count(), 10u);
+    BOOST_CHECK_EQUAL(reader.block_index(2).count, 2u);
+    std::size_t k = 0;
+    for (std::size_t i = 0; i < reader.block_count(); ++i) {
+        for (uint32_t j = 0; j < reader.block_index(i).count; ++j) {
+            check_sample(batch[k++], reader.sample(i, j));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(empty_recording)
+{
+    temp_file file;
+    {
+        recording_sink sink(file.path);
+    }
+    recording_reader reader(file.path);
+    BOOST_CHECK(!reader.recovered());
+    BOOST_CHECK_EQUAL(reader.block_count(), 0u);
+    BOOST_CHECK_EQUAL(reader.sample_count(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(recovers_whole_blocks_without_a_trailer)
+{
+    temp_file file;
+    std::vector<eye_message> batch = make_batch(10, true);
+    recording_sink sink(file.path, segment_file_options(), 4);
+    sink.write(&batch[0], batch.size(), 0);
+    sink.flush();
+
+    recording_reader reader(file.path);
+    BOOST_CHECK(reader.recovered());
+    BOOST_REQUIRE_EQUAL(reader.block_count(), 2u);
+    BOOST_CHECK_EQUAL(reader.sample_count(), 8u);
+    for (std::size_t i = 0; i < reader.block_count(); ++i) {
+        const recording::index_entry& entry = reader.block_index(i);
+        BOOST_CHECK_EQUAL(entry.count, 4u);
+        for (uint32_t j = 0; j < entry.count; ++j) {
+            const eye_message& expected = batch[i * 4 + j];
+            check_sample(expected, reader.sample(i, j));
+            uint64_t ts = recording::timestamp_ns(expected.time_seconds, expected.time_nanos);
+            BOOST_CHECK_LE(entry.first_ns, ts);
+            BOOST_CHECK_GE(entry.last_ns, ts);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()